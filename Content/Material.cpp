@@ -7,10 +7,12 @@
 
 using namespace std;
 
+atomic<uint32_t> Material::mNextId(0);
+
 Material::Material(const string& name, ::Shader* shader)
-	: mName(name), mShader(shader), mDevice(shader->Device()), mCullMode(VK_CULL_MODE_FLAG_BITS_MAX_ENUM), mBlendMode(BLEND_MODE_MAX_ENUM), mRenderQueue(~0), mPassMask(PASS_MASK_MAX_ENUM) {}
+	: mName(name), mShader(shader), mDevice(shader->Device()), mId(mNextId++), mCullMode(VK_CULL_MODE_FLAG_BITS_MAX_ENUM), mBlendMode(BLEND_MODE_MAX_ENUM), mRenderQueue(~0), mPassMask(PASS_MASK_MAX_ENUM), mRelocationCount(0) {}
 Material::Material(const string& name, shared_ptr<::Shader> shader)
-	: mName(name), mShader(shader), mDevice(shader->Device()), mCullMode(VK_CULL_MODE_FLAG_BITS_MAX_ENUM), mBlendMode(BLEND_MODE_MAX_ENUM), mRenderQueue(~0), mPassMask(PASS_MASK_MAX_ENUM) {}
+	: mName(name), mShader(shader), mDevice(shader->Device()), mId(mNextId++), mCullMode(VK_CULL_MODE_FLAG_BITS_MAX_ENUM), mBlendMode(BLEND_MODE_MAX_ENUM), mRenderQueue(~0), mPassMask(PASS_MASK_MAX_ENUM), mRelocationCount(0) {}
 Material::~Material() {
 	for (auto& kp : mVariantData) {
 		for (uint32_t i = 0; i < mDevice->MaxFramesInFlight(); i++)
@@ -104,6 +106,7 @@ void Material::SetParameter(const string& name, uint32_t index, Texture* param)
 }
 
 Material::VariantData* Material::GetData(PassType pass) {
+	lock_guard<mutex> lock(mDescriptorMutex);
 	if (mVariantData.count(pass) == 0) {
 		GraphicsShader* shader = Shader()->GetGraphics(pass, mShaderKeywords);
 		if (!shader) return nullptr;
@@ -130,83 +133,98 @@ void Material::SetDescriptorParameters(CommandBuffer* commandBuffer, Camera* cam
 	GraphicsShader* shader = data->mShaderVariant;
 	if (shader->mDescriptorSetLayouts.size() > PER_MATERIAL && shader->mDescriptorBindings.size()) {
 		uint32_t frameContextIndex = commandBuffer->Device()->FrameContextIndex();
-		DescriptorSet*& ds = data->mDescriptorSets[frameContextIndex];
-		if (!ds || (ds->Layout() != shader->mDescriptorSetLayouts[PER_MATERIAL])) {
-			safe_delete(ds);
-			ds = new DescriptorSet(mName + " DescriptorSet", commandBuffer->Device(), shader->mDescriptorSetLayouts[PER_MATERIAL]);
-			data->mDirty[frameContextIndex] = true;
-		}
+		VkDescriptorSet descriptorSet;
+		{
+			// draws using this material can be recorded on several threads at once
+			lock_guard<mutex> lock(mDescriptorMutex);
+			if (mRelocationCount != mDevice->RelocationCount()) {
+				// textures or buffers were moved by Device::Defragment(), and the sets might use their old handles
+				for (auto& d : mVariantData)
+					memset(d.second->mDirty, true, sizeof(bool) * mDevice->MaxFramesInFlight());
+				mRelocationCount = mDevice->RelocationCount();
+			}
+			DescriptorSet*& ds = data->mDescriptorSets[frameContextIndex];
+			if (!ds || (ds->Layout() != shader->mDescriptorSetLayouts[PER_MATERIAL])) {
+				safe_delete(ds);
+				// cached, so materials with the same parameters (and the same material in each frame context) share a descriptor set
+				ds = new DescriptorSet(mName + " DescriptorSet", commandBuffer->Device(), shader->mDescriptorSetLayouts[PER_MATERIAL], true);
+				data->mDirty[frameContextIndex] = true;
+			}
 
-		// set descriptor parameters
-		if (data->mDirty[frameContextIndex]) {
-			PROFILER_BEGIN("Write Descriptor Sets");
-			for (auto& m : mParameters) {
-				if (m.second.index() > 4) continue;
-				if (shader->mDescriptorBindings.count(m.first) == 0) continue;
-				auto& bindings = shader->mDescriptorBindings.at(m.first);
-				if (bindings.first != PER_MATERIAL) continue;
+			// set descriptor parameters
+			if (data->mDirty[frameContextIndex]) {
+				PROFILER_BEGIN("Write Descriptor Sets");
+				for (auto& m : mParameters) {
+					if (m.second.index() > 4) continue;
+					if (shader->mDescriptorBindings.count(m.first) == 0) continue;
+					auto& bindings = shader->mDescriptorBindings.at(m.first);
+					if (bindings.first != PER_MATERIAL) continue;
 
-				auto binding = bindings.second;
+					auto binding = bindings.second;
 
-				switch (m.second.index()) {
-				case 0:
-					ds->CreateSampledTextureDescriptor(get<shared_ptr<Texture>>(m.second).get(), binding.binding);
-					break;
-				case 1:
-					ds->CreateSamplerDescriptor(get<shared_ptr<Sampler>>(m.second).get(), binding.binding);
-					break;
-				case 2:
-					ds->CreateSampledTextureDescriptor(get<Texture*>(m.second), binding.binding);
-					break;
-				case 3:
-					ds->CreateSamplerDescriptor(get<Sampler*>(m.second), binding.binding);
-					break;
+					switch (m.second.index()) {
+					case 0:
+						ds->CreateSampledTextureDescriptor(get<shared_ptr<Texture>>(m.second).get(), binding.binding);
+						break;
+					case 1:
+						ds->CreateSamplerDescriptor(get<shared_ptr<Sampler>>(m.second).get(), binding.binding);
+						break;
+					case 2:
+						ds->CreateSampledTextureDescriptor(get<Texture*>(m.second), binding.binding);
+						break;
+					case 3:
+						ds->CreateSamplerDescriptor(get<Sampler*>(m.second), binding.binding);
+						break;
+					}
 				}
-			}
 
-			for (auto& m : mArrayParameters) {
-				if (shader->mDescriptorBindings.count(m.first) == 0) continue;
-				auto& bindings = shader->mDescriptorBindings.at(m.first);
-				if (bindings.first != PER_MATERIAL) continue;
+				for (auto& m : mArrayParameters) {
+					if (shader->mDescriptorBindings.count(m.first) == 0) continue;
+					auto& bindings = shader->mDescriptorBindings.at(m.first);
+					if (bindings.first != PER_MATERIAL) continue;
 
-				for (auto& p : m.second) {
-					if (p.first >= bindings.second.descriptorCount) continue;
-					Texture* t = p.second.index() == 0 ? get<shared_ptr<Texture>>(p.second).get() : get<Texture*>(p.second);
-					ds->CreateSampledTextureDescriptor(t, p.first, bindings.second.binding);
-				}
+					for (auto& p : m.second) {
+						if (p.first >= bindings.second.descriptorCount) continue;
+						Texture* t = p.second.index() == 0 ? get<shared_ptr<Texture>>(p.second).get() : get<Texture*>(p.second);
+						ds->CreateSampledTextureDescriptor(t, p.first, bindings.second.binding);
+					}
 
-			}
+				}
 
-			for (auto& m : mUniformBuffers) {
-				if (shader->mDescriptorBindings.count(m.first) == 0) continue;
-				auto& bindings = shader->mDescriptorBindings.at(m.first);
-				if (bindings.first != PER_MATERIAL) continue;
+				for (auto& m : mUniformBuffers) {
+					if (shader->mDescriptorBindings.count(m.first) == 0) continue;
+					auto& bindings = shader->mDescriptorBindings.at(m.first);
+					if (bindings.first != PER_MATERIAL) continue;
 
-				auto binding = bindings.second;
+					auto binding = bindings.second;
 
-				switch (m.second.mBuffer.index()) {
-				case 0:
-					ds->CreateUniformBufferDescriptor(get<Buffer*>(m.second.mBuffer), m.second.mOffset, m.second.mRange, binding.binding);
-					break;
-				case 1:
-					ds->CreateUniformBufferDescriptor(get<shared_ptr<Buffer>>(m.second.mBuffer).get(), m.second.mOffset, m.second.mRange, binding.binding);
-					break;
+					switch (m.second.mBuffer.index()) {
+					case 0:
+						ds->CreateUniformBufferDescriptor(get<Buffer*>(m.second.mBuffer), m.second.mOffset, m.second.mRange, binding.binding);
+						break;
+					case 1:
+						ds->CreateUniformBufferDescriptor(get<shared_ptr<Buffer>>(m.second.mBuffer).get(), m.second.mOffset, m.second.mRange, binding.binding);
+						break;
+					}
 				}
-			}
 
-			ds->FlushWrites();
-			data->mDirty[frameContextIndex] = false;
-			PROFILER_END;
+				ds->FlushWrites();
+				data->mDirty[frameContextIndex] = false;
+				PROFILER_END;
+			}
+			descriptorSet = *ds;
 		}
 
 		PROFILER_BEGIN("Bind Descriptor Sets");
-		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader->mPipelineLayout, PER_MATERIAL, 1, *ds, 0, nullptr);
+		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader->mPipelineLayout, PER_MATERIAL, 1, &descriptorSet, 0, nullptr);
+		commandBuffer->mDescriptorSetBindCount++;
 		PROFILER_END;
 	}
 
 	if (camera && shader->mDescriptorSetLayouts.size() > PER_CAMERA && shader->mDescriptorBindings.count("Camera")) {
 		auto binding = shader->mDescriptorBindings.at("Camera");
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader->mPipelineLayout, PER_CAMERA, 1, *camera->DescriptorSet(binding.second.stageFlags), 0, nullptr);
+		commandBuffer->mDescriptorSetBindCount++;
 	}
 }
 void Material::SetPushConstantParameters(CommandBuffer* commandBuffer, Camera* camera, VariantData* data) {
@@ -37,6 +37,8 @@ public:
 
 	inline ::Shader* Shader() const { return mShader.index() == 0 ? std::get<::Shader*>(mShader) : std::get<std::shared_ptr<::Shader>>(mShader).get(); };
 	ENGINE_EXPORT GraphicsShader* GetShader(PassType pass);
+	// Unique for each material, used to group draws that use the same material
+	inline uint32_t Id() const { return mId; }
 
 	// Set the pass mask override
 	// Default to PASS_MASK_MAX_ENUM, which uses the shader's pass mask
@@ -104,6 +106,8 @@ private:
 	ENGINE_EXPORT VariantData* GetData(PassType pass);
 
 	Device* mDevice;
+	uint32_t mId;
+	ENGINE_EXPORT static std::atomic<uint32_t> mNextId;
 
 	std::variant<::Shader*, std::shared_ptr<::Shader>> mShader;
 	std::set<std::string> mShaderKeywords;
@@ -124,4 +128,8 @@ private:
 	std::unordered_map<std::string, std::unordered_map<uint32_t, std::variant<std::shared_ptr<Texture>, Texture*>>> mArrayParameters;
 
 	std::unordered_map<PassType, VariantData*> mVariantData;
+	// Device::RelocationCount() when the descriptor sets were last checked
+	uint64_t mRelocationCount;
+	// guards mVariantData and the descriptor sets, which are updated by threads recording draws
+	std::mutex mDescriptorMutex;
 };
\ No newline at end of file
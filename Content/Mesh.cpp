@@ -16,6 +16,8 @@
 
 using namespace std;
 
+atomic<uint32_t> Mesh::mNextId(0);
+
 const ::VertexInput StdVertex::VertexInput {
 	{
 		{
@@ -155,9 +157,9 @@ inline Bone* AddBone(AnimationRig& rig, aiNode* node, const aiScene* scene, aiNo
 	return bone;
 }
 
-Mesh::Mesh(const string& name) : mName(name), mVertexInput(nullptr), mBvh(nullptr), mIndexCount(0), mVertexCount(0), mBaseVertex(0), mVertexSize(0), mBaseIndex(0), mIndexType(VK_INDEX_TYPE_UINT16) {}
+Mesh::Mesh(const string& name) : mName(name), mId(mNextId++), mVertexInput(nullptr), mBvh(nullptr), mIndexCount(0), mVertexCount(0), mBaseVertex(0), mVertexSize(0), mBaseIndex(0), mIndexType(VK_INDEX_TYPE_UINT16) {}
 Mesh::Mesh(const string& name, ::Device* device, const string& filename, float scale)
-	: mName(name), mVertexInput(nullptr), mBvh(nullptr), mBaseVertex(0), mBaseIndex(0), mTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
+	: mName(name), mId(mNextId++), mVertexInput(nullptr), mBvh(nullptr), mBaseVertex(0), mBaseIndex(0), mTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
 
 	const aiScene* scene = aiImportFile(filename.c_str(), aiProcessPreset_TargetRealtime_MaxQuality | aiProcess_FlipUVs | aiProcess_MakeLeftHanded);
 	if (!scene) {
@@ -322,6 +324,7 @@ Mesh::Mesh(const string& name, ::Device* device, const string& filename, float s
 		}
 
 		mWeightBuffer = make_shared<Buffer>(mName + " Weights", device, vertexWeights.size() * sizeof(VertexWeight), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		mWeightBuffer->SetMemoryCategory(MEMORY_CATEGORY_MESH);
 	}
 	
 	if (use32bit) {
@@ -339,11 +342,23 @@ Mesh::Mesh(const string& name, ::Device* device, const string& filename, float s
 	mVertexSize = sizeof(StdVertex);
 	mVertexInput = &StdVertex::VertexInput;
 
+	// Load the bvh from the cache next to the file, or build it and update the cache
 	mBvh = new TriangleBvh2();
-	if (use32bit)
-		mBvh->Build(vertices.data(), 0, vertexCount, sizeof(StdVertex), indices32.data(), indices32.size(), VK_INDEX_TYPE_UINT32);
-	else
-		mBvh->Build(vertices.data(), 0, vertexCount, sizeof(StdVertex), indices16.data(), indices16.size(), VK_INDEX_TYPE_UINT16);
+	string bvhCache = filename + ".bvh";
+	size_t importSettings = 0;
+	hash_combine(importSettings, scale);
+	auto bvhStart = chrono::high_resolution_clock::now();
+	uint64_t bvhKey = TriangleBvh2::HashFile(filename, importSettings);
+	bool bvhCached = TriangleBvh2::ReadCache(bvhCache, bvhKey, &mBvh, 1);
+	if (!bvhCached) {
+		if (use32bit)
+			mBvh->Build(vertices.data(), 0, vertexCount, sizeof(StdVertex), indices32.data(), indices32.size(), VK_INDEX_TYPE_UINT32);
+		else
+			mBvh->Build(vertices.data(), 0, vertexCount, sizeof(StdVertex), indices16.data(), indices16.size(), VK_INDEX_TYPE_UINT16);
+		TriangleBvh2::WriteCache(bvhCache, bvhKey, &mBvh, 1);
+	}
+	float bvhTime = chrono::duration<float, milli>(chrono::high_resolution_clock::now() - bvhStart).count();
+	CopyVertexAttributes(vertices.data(), vertexCount, sizeof(StdVertex));
 
 	if (!uniqueBones.size())
 		mWeightBuffer = nullptr;
@@ -353,11 +368,11 @@ Mesh::Mesh(const string& name, ::Device* device, const string& filename, float s
 	else
 		mIndexBuffer = make_shared<Buffer>(name + " Index Buffer", device, indices16.data(), sizeof(uint16_t) * indices16.size(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
 
-	printf("Loaded %s / %d verts %d tris / %.2fx%.2fx%.2f\n", filename.c_str(), (int)vertices.size(), (int)(use32bit ? indices32.size() : indices16.size()) / 3, mx.x - mn.x, mx.y - mn.y, mx.z - mn.z);
+	printf("Loaded %s / %d verts %d tris / %.2fx%.2fx%.2f / bvh %s in %.2fms\n", filename.c_str(), (int)vertices.size(), (int)(use32bit ? indices32.size() : indices16.size()) / 3, mx.x - mn.x, mx.y - mn.y, mx.z - mn.z, bvhCached ? "read" : "built", bvhTime);
 }
 Mesh::Mesh(const string& name, ::Device* device, const AABB& bounds, TriangleBvh2* bvh, shared_ptr<Buffer> vertexBuffer, shared_ptr<Buffer> indexBuffer,
-	uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology)
-	: mName(name), mVertexInput(vertexInput), mBvh(bvh), mBaseIndex(baseIndex), mIndexCount(indexCount), mIndexType(indexType), mBaseVertex(baseVertex), mVertexCount(vertexCount), mBounds(bounds), mTopology(topology) {
+	uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology, const StdVertex* vertices)
+	: mName(name), mId(mNextId++), mVertexInput(vertexInput), mBvh(bvh), mBaseIndex(baseIndex), mIndexCount(indexCount), mIndexType(indexType), mBaseVertex(baseVertex), mVertexCount(vertexCount), mBounds(bounds), mTopology(topology) {
 	
 	mVertexBuffer = vertexBuffer;
 	mIndexBuffer = indexBuffer;
@@ -365,10 +380,13 @@ Mesh::Mesh(const string& name, ::Device* device, const AABB& bounds, TriangleBvh
 	mVertexSize = 0;
 	for (const auto& a : vertexInput->mAttributes)
 		mVertexSize = max(mVertexSize, a.offset + FormatSize(a.format));
+
+	if (vertices && bvh)
+		CopyVertexAttributes(vertices, vertexCount, sizeof(StdVertex));
 }
 Mesh::Mesh(const string& name, ::Device* device, const AABB& bounds, TriangleBvh2* bvh, shared_ptr<Buffer> vertexBuffer, shared_ptr<Buffer> indexBuffer, shared_ptr<Buffer> weightBuffer,
-	uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology)
-	: mName(name), mVertexInput(vertexInput), mBvh(bvh), mBaseIndex(baseIndex), mIndexCount(indexCount), mIndexType(indexType), mBaseVertex(baseVertex), mVertexCount(vertexCount), mBounds(bounds), mTopology(topology) {
+	uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology, const StdVertex* vertices)
+	: mName(name), mId(mNextId++), mVertexInput(vertexInput), mBvh(bvh), mBaseIndex(baseIndex), mIndexCount(indexCount), mIndexType(indexType), mBaseVertex(baseVertex), mVertexCount(vertexCount), mBounds(bounds), mTopology(topology) {
 
 	mVertexBuffer = vertexBuffer;
 	mIndexBuffer = indexBuffer;
@@ -376,9 +394,12 @@ Mesh::Mesh(const string& name, ::Device* device, const AABB& bounds, TriangleBvh
 	mVertexSize = 0;
 	for (const auto& a : vertexInput->mAttributes)
 		mVertexSize = max(mVertexSize, a.offset + FormatSize(a.format));
+
+	if (vertices && bvh)
+		CopyVertexAttributes(vertices, vertexCount, sizeof(StdVertex));
 }
 Mesh::Mesh(const string& name, ::Device* device, const void* vertices, const void* indices, uint32_t vertexCount, uint32_t vertexSize, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology)
-	: mName(name), mVertexInput(vertexInput), mBvh(nullptr), mIndexCount(indexCount), mIndexType(indexType), mVertexCount(vertexCount), mVertexSize(vertexSize), mBaseVertex(0), mBaseIndex(0), mTopology(topology) {
+	: mName(name), mId(mNextId++), mVertexInput(vertexInput), mBvh(nullptr), mIndexCount(indexCount), mIndexType(indexType), mVertexCount(vertexCount), mVertexSize(vertexSize), mBaseVertex(0), mBaseIndex(0), mTopology(topology) {
 	
 	float3 mn, mx;
 	for (uint32_t i = 0; i < indexCount; i++) {
@@ -402,6 +423,8 @@ Mesh::Mesh(const string& name, ::Device* device, const void* vertices, const voi
 	if (mTopology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
 		mBvh = new TriangleBvh2();
 		mBvh->Build(vertices, 0, vertexCount, vertexSize, indices, indexCount, mIndexType);
+		if (mVertexInput == &StdVertex::VertexInput)
+			CopyVertexAttributes(vertices, vertexCount, vertexSize);
 	}
 
 	mBounds = AABB(mn, mx);
@@ -409,7 +432,7 @@ Mesh::Mesh(const string& name, ::Device* device, const void* vertices, const voi
 	mIndexBuffer  = make_shared<Buffer>(name + " Index Buffer", device, indices, indexSize * indexCount, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 }
 Mesh::Mesh(const string& name, ::Device* device, const void* vertices, const VertexWeight* weights, const vector<pair<string, const void*>>&  shapeKeys, const void* indices, uint32_t vertexCount, uint32_t vertexSize, uint32_t indexCount, const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology)
-	: mName(name), mVertexInput(vertexInput), mBvh(nullptr), mIndexCount(indexCount), mIndexType(indexType), mVertexCount(vertexCount), mVertexSize(vertexSize), mBaseVertex(0), mBaseIndex(0), mTopology(topology) {
+	: mName(name), mId(mNextId++), mVertexInput(vertexInput), mBvh(nullptr), mIndexCount(indexCount), mIndexType(indexType), mVertexCount(vertexCount), mVertexSize(vertexSize), mBaseVertex(0), mBaseIndex(0), mTopology(topology) {
 
 	float3 mn, mx;
 	for (uint32_t i = 0; i < indexCount; i++) {
@@ -433,15 +456,21 @@ Mesh::Mesh(const string& name, ::Device* device, const void* vertices, const Ver
 	if (mTopology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
 		mBvh = new TriangleBvh2();
 		mBvh->Build(vertices, 0, vertexCount, vertexSize, indices, indexCount, mIndexType);
+		if (mVertexInput == &StdVertex::VertexInput)
+			CopyVertexAttributes(vertices, vertexCount, vertexSize);
 	}
 
 	mBounds = AABB(mn, mx);
 	mVertexBuffer = make_shared<Buffer>(name + " Vertex Buffer", device, vertices, vertexSize * vertexCount, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
 	mWeightBuffer = make_shared<Buffer>(name + " Weight Buffer", device, weights, sizeof(VertexWeight) * vertexCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	mWeightBuffer->SetMemoryCategory(MEMORY_CATEGORY_MESH);
 	mIndexBuffer = make_shared<Buffer>(name + " Index Buffer", device, indices, indexSize * indexCount, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
-	for (auto i : shapeKeys)
-		mShapeKeys.emplace(i.first, make_shared<Buffer>(name + i.first, device, i.second, vertexSize * vertexCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT));
+	for (auto i : shapeKeys) {
+		shared_ptr<Buffer> shapeKey = make_shared<Buffer>(name + i.first, device, i.second, vertexSize * vertexCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+		shapeKey->SetMemoryCategory(MEMORY_CATEGORY_MESH);
+		mShapeKeys.emplace(i.first, shapeKey);
+	}
 }
 
 Mesh* Mesh::CreatePlaneX(const string& name, Device* device, float s, float v) {
@@ -537,6 +566,54 @@ bool Mesh::Intersect(const Ray& ray, float* t, bool any) {
 	if (!mBvh) return false;
 	return mBvh->Intersect(ray, t, any);
 }
+bool Mesh::Intersect(const Ray& ray, RaycastHit* hit, bool any) {
+	if (!mBvh) return false;
+	TriangleHit th;
+	if (!mBvh->Intersect(ray, &th, any)) return false;
+	WriteHit(th, hit);
+	return true;
+}
+uint32_t Mesh::IntersectPacket(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any) {
+	if (!mBvh) return 0;
+	TriangleHit th[RAY_PACKET_SIZE];
+	mBvh->IntersectPacket(rays, rayCount, th, any);
+	uint32_t hitMask = 0;
+	for (uint32_t r = 0; r < rayCount; r++) {
+		if (th[r].mTriangle == 0xFFFFFFFF) continue;
+		WriteHit(th[r], &hits[r]);
+		hitMask |= 1 << r;
+	}
+	return hitMask;
+}
+
+void Mesh::WriteHit(const TriangleHit& th, RaycastHit* hit) const {
+	hit->mT = th.mT;
+	hit->mObject = nullptr;
+	hit->mTriangle = th.mTriangle;
+	hit->mBarycentrics = th.mBarycentrics;
+
+	const uint3& v = th.mVertices;
+	float3 w(1.f - th.mBarycentrics.x - th.mBarycentrics.y, th.mBarycentrics.x, th.mBarycentrics.y);
+	if (mNormals.size()) {
+		hit->mNormal = normalize(mNormals[v.x] * w.x + mNormals[v.y] * w.y + mNormals[v.z] * w.z);
+		hit->mTexcoord = mTexcoords[v.x] * w.x + mTexcoords[v.y] * w.y + mTexcoords[v.z] * w.z;
+	} else {
+		// use the triangle's face normal
+		float3 p0 = mBvh->GetVertex(v.x);
+		hit->mNormal = normalize(cross(mBvh->GetVertex(v.y) - p0, mBvh->GetVertex(v.z) - p0));
+		hit->mTexcoord = 0;
+	}
+}
+
+void Mesh::CopyVertexAttributes(const void* vertices, uint32_t vertexCount, uint32_t vertexSize) {
+	mNormals.resize(vertexCount);
+	mTexcoords.resize(vertexCount);
+	for (uint32_t i = 0; i < vertexCount; i++) {
+		const StdVertex& v = *(const StdVertex*)((const uint8_t*)vertices + vertexSize * i);
+		mNormals[i] = v.normal;
+		mTexcoords[i] = v.uv;
+	}
+}
 
 Mesh::~Mesh() {
 	for (auto kp : mAnimations)
@@ -45,14 +45,16 @@ public:
 
 	ENGINE_EXPORT Mesh(const std::string& name);
 	// Construct from existing vertex/index buffer
+	// If vertices is not nullptr, the normals and uvs of its vertexCount vertices are kept to interpolate them at raycast hits
 	ENGINE_EXPORT Mesh(const std::string& name, ::Device* device, const AABB& bounds, TriangleBvh2* bvh,
 		std::shared_ptr<Buffer> vertexBuffer, std::shared_ptr<Buffer> indexBuffer, uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount,
-		const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+		const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, const StdVertex* vertices = nullptr);
 	// Construct from existing vertex/index/weight buffer
+	// If vertices is not nullptr, the normals and uvs of its vertexCount vertices are kept to interpolate them at raycast hits
 	ENGINE_EXPORT Mesh(const std::string& name, ::Device* device, const AABB& bounds, TriangleBvh2* bvh,
 		std::shared_ptr<Buffer> vertexBuffer, std::shared_ptr<Buffer> indexBuffer, std::shared_ptr<Buffer> weightBuffer,
 		uint32_t baseVertex, uint32_t vertexCount, uint32_t baseIndex, uint32_t indexCount,
-		const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+		const ::VertexInput* vertexInput, VkIndexType indexType, VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, const StdVertex* vertices = nullptr);
 	// Construct from vertices/indices. Constructs a triangle bvh if the topology is VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST
 	ENGINE_EXPORT Mesh(const std::string& name, ::Device* device,
 		const void* vertices, const void* indices, uint32_t vertexCount, uint32_t vertexSize, uint32_t indexCount,
@@ -89,18 +91,35 @@ public:
 	// The bvh CAN be nullptr if nullptr was passed into the mesh upon creation
 	inline TriangleBvh2* BVH() const { return mBvh; }
 	ENGINE_EXPORT bool Intersect(const Ray& ray, float* t, bool any);
+	// Fills in hit with the triangle, and the normal and uv in object space. The hit's object is set to nullptr.
+	ENGINE_EXPORT bool Intersect(const Ray& ray, RaycastHit* hit, bool any);
+	// Traces up to RAY_PACKET_SIZE rays together, see TriangleBvh2::IntersectPacket(). Returns a mask with bit r set if rays[r] hit the mesh.
+	ENGINE_EXPORT uint32_t IntersectPacket(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any);
 
 	inline const ::VertexInput* VertexInput() const { return mVertexInput; }
 
 	inline AABB Bounds() const { return mBounds; }
 	inline void Bounds(const AABB& b) { mBounds = b; }
 
+	// Unique for each mesh, used to group draws that use the same mesh
+	inline uint32_t Id() const { return mId; }
+
 private:
 	friend class AssetManager;
 	// Construct from a scene file (and assimp). Constructs a triangle bvh as well
 	ENGINE_EXPORT Mesh(const std::string& name, ::Device* device, const std::string& filename, float scale = 1.f);
 
+	// Keeps the normals and uvs of StdVertex vertices, to interpolate them at raycast hits
+	ENGINE_EXPORT void CopyVertexAttributes(const void* vertices, uint32_t vertexCount, uint32_t vertexSize);
+	// Fills in a hit record from a triangle hit, interpolating the normal and uv
+	ENGINE_EXPORT void WriteHit(const TriangleHit& triangleHit, RaycastHit* hit) const;
+
+	uint32_t mId;
+	ENGINE_EXPORT static std::atomic<uint32_t> mNextId;
+
 	TriangleBvh2* mBvh;
+	std::vector<float3> mNormals;
+	std::vector<float2> mTexcoords;
 
 	const ::VertexInput* mVertexInput;
 	uint32_t mBaseVertex;
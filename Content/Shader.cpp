@@ -5,6 +5,8 @@
 
 using namespace std;
 
+atomic<uint32_t> GraphicsShader::mNextId(0);
+
 bool PipelineInstance::operator==(const PipelineInstance& rhs) const {
 	return rhs.mHash == mHash;
 		// rhs.mRenderPass == mRenderPass &&
@@ -308,6 +310,7 @@ VkPipeline GraphicsShader::GetPipeline(RenderPass* renderPass, const VertexInput
 	VkPolygonMode poly = polyMode == VK_POLYGON_MODE_MAX_ENUM ? mShader->mRasterizationState.polygonMode : polyMode;
 	PipelineInstance instance(*renderPass, vertexInput, topology, cull, blendMode, poly);
 
+	lock_guard<mutex> lock(mPipelineMutex);
 	if (mPipelines.count(instance))
 		return mPipelines.at(instance);
 	else {
@@ -5,6 +5,8 @@
 #include <Core/Sampler.hpp>
 #include <Core/RenderPass.hpp>
 
+#include <atomic>
+
 class Shader;
 
 // Represents a pipeline with various parameters
@@ -73,13 +75,20 @@ public:
 
 	std::unordered_map<PipelineInstance, VkPipeline> mPipelines;
 	Shader* mShader;
+	// Unique for each variant, used to group draws that use the same pipeline
+	uint32_t mId;
 
-	inline GraphicsShader() : ShaderVariant() { mShader = nullptr; mStages[0] = {}; mStages[1] = {}; }
+	inline GraphicsShader() : ShaderVariant() { mShader = nullptr; mStages[0] = {}; mStages[1] = {}; mId = mNextId++; }
 	ENGINE_EXPORT VkPipeline GetPipeline(RenderPass* renderPass, const VertexInput* vertexInput,
 		VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
 		VkCullModeFlags cullMode = VK_CULL_MODE_FLAG_BITS_MAX_ENUM,
 		BlendMode blendMode = BLEND_MODE_MAX_ENUM,
 		VkPolygonMode polyMode = VK_POLYGON_MODE_MAX_ENUM);
+
+private:
+	// guards mPipelines, which is filled in lazily by threads recording draws
+	std::mutex mPipelineMutex;
+	ENGINE_EXPORT static std::atomic<uint32_t> mNextId;
 };
 
 class Shader : public Asset {
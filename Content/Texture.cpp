@@ -52,7 +52,7 @@ uint8_t* load(const string& filename, bool srgb, uint32_t& pixelSize, int32_t& x
 	return pixels;
 }
 
-Texture::Texture(const string& name, Device* device, const string& filename, bool srgb) : mName(name), mDevice(device), mMemory({}) {
+Texture::Texture(const string& name, Device* device, const string& filename, bool srgb) : mName(name), mDevice(device), mMemory({}), mLayout(VK_IMAGE_LAYOUT_UNDEFINED), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	int32_t x, y, channels;
 	uint32_t size;
 	uint8_t* pixels = load(filename, srgb, size, x, y, channels, mFormat);
@@ -70,33 +70,15 @@ Texture::Texture(const string& name, Device* device, const string& filename, boo
 	CreateImage();
 	CreateImageView(VK_IMAGE_ASPECT_COLOR_BIT);
 
-	VkBufferImageCopy copyRegion = {};
-	copyRegion.bufferOffset = 0;
-	copyRegion.bufferRowLength = 0;
-	copyRegion.bufferImageHeight = 0;
-	copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	copyRegion.imageSubresource.mipLevel = 0;
-	copyRegion.imageSubresource.baseArrayLayer = 0;
-	copyRegion.imageSubresource.layerCount = 1;
-	copyRegion.imageOffset = { 0, 0, 0 };
-	copyRegion.imageExtent = { mWidth, mHeight, 1 };
-
 	VkDeviceSize dataSize = mWidth * mHeight * size * channels;
-
-	Buffer uploadBuffer(name + " Copy", mDevice, pixels, dataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-	auto commandBuffer = mDevice->GetCommandBuffer();
-	TransitionImageLayout(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, commandBuffer.get());
-	vkCmdCopyBufferToImage(*commandBuffer, uploadBuffer, mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-	GenerateMipMaps(commandBuffer.get());
-	mDevice->Execute(commandBuffer, false)->Wait();
+	mDevice->UploadManager()->Upload(this, (const void**)&pixels, 1, dataSize);
 
 	stbi_image_free(pixels);
 
 	//printf("Loaded %s: %dx%d %s\n", filename.c_str(), mWidth, mHeight, FormatToString(mFormat));
 }
 Texture::Texture(const string& name, Device* device, const string& px, const string& nx, const string& py, const string& ny, const string& pz, const string& nz, bool srgb)
-	: mName(name), mDevice(device), mMemory({}) {
+	: mName(name), mDevice(device), mMemory({}), mLayout(VK_IMAGE_LAYOUT_UNDEFINED), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	int32_t x, y, channels;
 	uint32_t size;
 	
@@ -122,30 +104,8 @@ Texture::Texture(const string& name, Device* device, const string& px, const str
 	CreateImage();
 	CreateImageView(VK_IMAGE_ASPECT_COLOR_BIT);
 
-	VkBufferImageCopy copyRegion = {};
-	copyRegion.bufferOffset = 0;
-	copyRegion.bufferRowLength = 0;
-	copyRegion.bufferImageHeight = 0;
-	copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	copyRegion.imageSubresource.mipLevel = 0;
-	copyRegion.imageSubresource.baseArrayLayer = 0;
-	copyRegion.imageSubresource.layerCount = mArrayLayers;
-	copyRegion.imageOffset = { 0, 0, 0 };
-	copyRegion.imageExtent = { mWidth, mHeight, 1 };
-
 	VkDeviceSize dataSize = mWidth * mHeight * size * channels;
-
-	auto commandBuffer = mDevice->GetCommandBuffer();
-	TransitionImageLayout(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, commandBuffer.get());
-	
-	Buffer uploadBuffer(name + " Copy", mDevice, dataSize * mArrayLayers, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	for (uint32_t j = 0; j < mArrayLayers; j++)
-		memcpy((uint8_t*)uploadBuffer.MappedData() + j * dataSize, pixels[j], dataSize);
-
-	vkCmdCopyBufferToImage(*commandBuffer, uploadBuffer, mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-	GenerateMipMaps(commandBuffer.get());
-	mDevice->Execute(commandBuffer, false)->Wait();
+	mDevice->UploadManager()->Upload(this, (const void**)pixels, mArrayLayers, dataSize);
 
 	for (uint32_t i = 0; i < 6; i++)
 		stbi_image_free(pixels[i]);
@@ -154,7 +114,7 @@ Texture::Texture(const string& name, Device* device, const string& px, const str
 }
 
 Texture::Texture(const string& name, Device* device, const void* pixels, VkDeviceSize imageSize, uint32_t width, uint32_t height, uint32_t depth, VkFormat format, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mWidth(width), mHeight(height), mDepth(depth), mArrayLayers(1), mMipLevels(mipLevels), mFormat(format), mSampleCount(numSamples), mTiling(tiling), mUsage(usage), mMemoryProperties(properties), mMemory({}) {
+	: mName(name), mDevice(device), mWidth(width), mHeight(height), mDepth(depth), mArrayLayers(1), mMipLevels(mipLevels), mFormat(format), mSampleCount(numSamples), mTiling(tiling), mUsage(usage), mMemoryProperties(properties), mMemory({}), mLayout(VK_IMAGE_LAYOUT_UNDEFINED), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	
 	if (mipLevels == 0) mMipLevels = (uint32_t)std::floor(std::log2(std::max(mWidth, mHeight))) + 1;
 	if (mMipLevels > 1) mUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
@@ -164,28 +124,7 @@ Texture::Texture(const string& name, Device* device, const void* pixels, VkDevic
 		CreateImage();
 		CreateImageView(VK_IMAGE_ASPECT_COLOR_BIT);
 
-		VkBufferImageCopy copyRegion = {};
-		copyRegion.bufferOffset = 0;
-		copyRegion.bufferRowLength = 0;
-		copyRegion.bufferImageHeight = 0;
-		copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		copyRegion.imageSubresource.mipLevel = 0;
-		copyRegion.imageSubresource.baseArrayLayer = 0;
-		copyRegion.imageSubresource.layerCount = 1;
-		copyRegion.imageOffset = { 0, 0, 0 };
-		copyRegion.imageExtent = { mWidth, mHeight, mDepth };
-
-		Buffer uploadBuffer(name + " Copy", mDevice, pixels, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-		auto commandBuffer = mDevice->GetCommandBuffer();
-		TransitionImageLayout(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, commandBuffer.get());
-		vkCmdCopyBufferToImage(*commandBuffer, uploadBuffer, mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-		if (mMipLevels > 1)
-			GenerateMipMaps(commandBuffer.get());
-		else
-			TransitionImageLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, ((mUsage & VK_IMAGE_USAGE_STORAGE_BIT) != 0) ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, commandBuffer.get());
-		mDevice->Execute(commandBuffer, false)->Wait();
+		mDevice->UploadManager()->Upload(this, &pixels, 1, imageSize);
 	} else {
 		CreateImage();
 		CreateImageView(VK_IMAGE_ASPECT_COLOR_BIT);
@@ -193,7 +132,7 @@ Texture::Texture(const string& name, Device* device, const void* pixels, VkDevic
 }
 
 Texture::Texture(const string& name, Device* device, uint32_t width, uint32_t height, uint32_t depth, VkFormat format, VkSampleCountFlagBits numSamples, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mWidth(width), mHeight(height), mDepth(depth), mArrayLayers(1), mMipLevels(1), mFormat(format), mSampleCount(numSamples), mTiling(tiling), mUsage(usage), mMemoryProperties(properties), mMemory({}) {
+	: mName(name), mDevice(device), mWidth(width), mHeight(height), mDepth(depth), mArrayLayers(1), mMipLevels(1), mFormat(format), mSampleCount(numSamples), mTiling(tiling), mUsage(usage), mMemoryProperties(properties), mMemory({}), mLayout(VK_IMAGE_LAYOUT_UNDEFINED), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	
 	mUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	CreateImage();
@@ -295,9 +234,37 @@ void Texture::GenerateMipMaps(CommandBuffer* commandBuffer) {
 		0, nullptr,
 		0, nullptr,
 		1, &barrier);
+	mLayout = barrier.newLayout;
 }
 
 void Texture::CreateImage() {
+	// sampled and storage color textures in device-local memory can be moved by Device::Defragment()
+	bool relocatable = (mMemoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0 && mTiling == VK_IMAGE_TILING_OPTIMAL && mSampleCount == VK_SAMPLE_COUNT_1_BIT &&
+		!HasDepthComponent(mFormat) && mFormat != VK_FORMAT_S8_UINT &&
+		(mUsage & (VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT)) &&
+		(mUsage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)) == 0;
+	if (relocatable) mUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+	CreateImageHandle();
+
+	MemoryCategory category = MEMORY_CATEGORY_TEXTURE;
+	if (mUsage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT))
+		category = MEMORY_CATEGORY_RENDER_TARGET;
+	else if (mDepth > 1)
+		category = MEMORY_CATEGORY_VOLUME;
+
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(*mDevice, mImage, &memRequirements);
+
+	mMemory = mDevice->AllocateMemory(memRequirements, mMemoryProperties, mTiling == VK_IMAGE_TILING_LINEAR, mName, category);
+	vkBindImageMemory(*mDevice, mImage, mMemory.mDeviceMemory, mMemory.mOffset);
+
+	if (relocatable) mDevice->SetRelocatable(mMemory, this);
+}
+void Texture::SetMemoryCategory(MemoryCategory category) {
+	mDevice->SetMemoryCategory(mMemory, category);
+}
+void Texture::CreateImageHandle() {
 	VkImageCreateInfo imageInfo = {};
 	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageInfo.imageType = mDepth > 1 ? VK_IMAGE_TYPE_3D : (mHeight > 1 ? VK_IMAGE_TYPE_2D : VK_IMAGE_TYPE_1D);
@@ -317,12 +284,56 @@ void Texture::CreateImage() {
 
 	ThrowIfFailed(vkCreateImage(*mDevice, &imageInfo, nullptr, &mImage), "vkCreateImage failed for " + mName);
 	mDevice->SetObjectName(mImage, mName, VK_OBJECT_TYPE_IMAGE);
+}
+void Texture::Relocate(const DeviceMemoryAllocation& memory, CommandBuffer* commandBuffer) {
+	VkImage src = mImage;
+	VkImageLayout layout = mLayout;
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(*mDevice, mImage, &memRequirements);
-
-	mMemory = mDevice->AllocateMemory(memRequirements, mMemoryProperties, mName);
+	CreateImageHandle();
+	mMemory = memory;
 	vkBindImageMemory(*mDevice, mImage, mMemory.mDeviceMemory, mMemory.mOffset);
+	CreateImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+	// nothing has been written to the texture yet, so there is nothing to copy and the new image can stay undefined too
+	if (layout == VK_IMAGE_LAYOUT_UNDEFINED) return;
+
+	VkImageMemoryBarrier barriers[2] = {};
+	for (uint32_t i = 0; i < 2; i++) {
+		barriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barriers[i].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barriers[i].subresourceRange.levelCount = mMipLevels;
+		barriers[i].subresourceRange.layerCount = mArrayLayers;
+	}
+	barriers[0].image = src;
+	barriers[0].oldLayout = layout;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[1].image = mImage;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+	vector<VkImageCopy> regions(mMipLevels);
+	for (uint32_t i = 0; i < mMipLevels; i++) {
+		regions[i] = {};
+		regions[i].srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		regions[i].srcSubresource.mipLevel = i;
+		regions[i].srcSubresource.layerCount = mArrayLayers;
+		regions[i].dstSubresource = regions[i].srcSubresource;
+		regions[i].extent = { max(mWidth >> i, 1u), max(mHeight >> i, 1u), max(mDepth >> i, 1u) };
+	}
+	vkCmdCopyImage(*commandBuffer, src, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)regions.size(), regions.data());
+
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].newLayout = layout;
+	barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barriers[1]);
 }
 void Texture::CreateImageView(VkImageAspectFlags aspectFlags) {
 	VkImageViewCreateInfo viewInfo = {};
@@ -434,6 +445,7 @@ void Texture::TransitionImageLayout(VkImageLayout oldLayout, VkImageLayout newLa
 		1, &barrier );
 }
 VkImageMemoryBarrier Texture::TransitionImageLayout(VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags& srcStage, VkPipelineStageFlags& dstStage) {
+	mLayout = newLayout;
 	VkImageMemoryBarrier barrier = {};
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	barrier.oldLayout = oldLayout;
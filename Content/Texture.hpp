@@ -30,7 +30,17 @@ public:
 
 	inline VkImage Image() const { return mImage; }
 	inline VkImageView View() const { return mView; }
+	inline const DeviceMemoryAllocation& Memory() const { return mMemory; }
+	// Unique id from Device::NextResourceId(), which descriptor sets use to tell resources apart when their handles are re-used
+	inline uint64_t ResourceId() const { return mResourceId; }
+	// Token of the last UploadManager upload into this texture, or 0 if it has none
+	inline UploadToken LastUpload() const { return mLastUpload; }
+	// Attachments count towards MEMORY_CATEGORY_RENDER_TARGET, 3d textures towards MEMORY_CATEGORY_VOLUME, and others towards MEMORY_CATEGORY_TEXTURE, unless this is called
+	ENGINE_EXPORT void SetMemoryCategory(MemoryCategory category);
 
+	// The layout set by the last transition recorded with TransitionImageLayout() or GenerateMipMaps(), which Device::Defragment() keeps when it moves the texture.
+	// VK_IMAGE_LAYOUT_UNDEFINED until the first transition
+	inline VkImageLayout Layout() const { return mLayout; }
 	ENGINE_EXPORT void TransitionImageLayout(VkImageLayout oldLayout, VkImageLayout newLayout, CommandBuffer* commandBuffer);
 	// Create the struct used to transition the layout, and return the stage flags associated with each layout
 	ENGINE_EXPORT VkImageMemoryBarrier TransitionImageLayout(VkImageLayout oldLayout, VkImageLayout newLayout, VkPipelineStageFlags& srcStage, VkPipelineStageFlags& dstStage);
@@ -43,6 +53,8 @@ public:
 
 private:
 	friend class AssetManager;
+	friend class Device;
+	friend class UploadManager;
 	ENGINE_EXPORT Texture(const std::string& name, Device* device, const std::string& filename, bool srgb = true);
 	ENGINE_EXPORT Texture(const std::string& name, Device* device, const std::string& px, const std::string& nx, const std::string& py, const std::string& ny, const std::string& pz, const std::string& nz, bool srgb = true);
 
@@ -65,7 +77,13 @@ private:
 
 	VkImage mImage;
 	VkImageView mView;
+	VkImageLayout mLayout;
+	uint64_t mResourceId;
+	UploadToken mLastUpload;
 
 	ENGINE_EXPORT void CreateImage();
+	ENGINE_EXPORT void CreateImageHandle();
+	// Re-creates the image in 'memory' and records a copy of its contents into 'commandBuffer'. Used by Device::Defragment(), which destroys the old image
+	ENGINE_EXPORT void Relocate(const DeviceMemoryAllocation& memory, CommandBuffer* commandBuffer);
 	ENGINE_EXPORT void CreateImageView(VkImageAspectFlags flags);
 };
\ No newline at end of file
@@ -5,31 +5,42 @@
 
 using namespace std;
 
+// buffers count towards MEMORY_CATEGORY_MESH if they can hold vertices or indices
+inline MemoryCategory UsageCategory(VkBufferUsageFlags usage) {
+	return (usage & (VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT)) ? MEMORY_CATEGORY_MESH : MEMORY_CATEGORY_OTHER;
+}
+
 Buffer::Buffer(const std::string& name, ::Device* device, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(VK_FORMAT_UNDEFINED), mMemory({}) {
+	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(VK_FORMAT_UNDEFINED), mMemory({}), mConcurrent(false), mCategory(UsageCategory(usage)), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	Allocate();
 }
 Buffer::Buffer(const std::string& name, ::Device* device, VkDeviceSize size, VkBufferUsageFlags usage, VkFormat viewFormat, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(viewFormat), mMemory({}) {
+	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(viewFormat), mMemory({}), mConcurrent(false), mCategory(UsageCategory(usage)), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	Allocate();
 }
 Buffer::Buffer(const std::string& name, ::Device* device, const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(VK_FORMAT_UNDEFINED), mMemory({}) {
+	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(VK_FORMAT_UNDEFINED), mMemory({}), mConcurrent(false), mCategory(UsageCategory(usage)), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	if ((properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
 		mUsageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	Allocate();
-	Upload(data, size);
+	if (data && (mMemoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
+		mDevice->UploadManager()->Upload(this, data, size, 0, true);
+	else
+		Upload(data, size);
 }
 Buffer::Buffer(const std::string& name, ::Device* device, const void* data, VkDeviceSize size, VkBufferUsageFlags usage, VkFormat viewFormat, VkMemoryPropertyFlags properties)
-	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(viewFormat), mMemory({}) {
+	: mName(name), mDevice(device), mSize(size), mUsageFlags(usage), mMemoryProperties(properties), mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(viewFormat), mMemory({}), mConcurrent(false), mCategory(UsageCategory(usage)), mResourceId(device->NextResourceId()), mLastUpload(0) {
 	if ((properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
 		mUsageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 	Allocate();
-	Upload(data, size);
+	if (data && (mMemoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
+		mDevice->UploadManager()->Upload(this, data, size, 0, true);
+	else
+		Upload(data, size);
 }
 Buffer::Buffer(const Buffer& src)
 	: mName(src.mName), mDevice(src.mDevice), mSize(0), mUsageFlags(src.mUsageFlags | VK_BUFFER_USAGE_TRANSFER_DST_BIT), mMemoryProperties(src.mMemoryProperties),
-	mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(src.mViewFormat), mMemory({}) {
+	mBuffer(VK_NULL_HANDLE), mView(VK_NULL_HANDLE), mViewFormat(src.mViewFormat), mMemory({}), mConcurrent(false), mCategory(src.mCategory), mResourceId(src.mDevice->NextResourceId()), mLastUpload(0) {
 	CopyFrom(src);
 }
 Buffer::~Buffer() {
@@ -44,6 +55,7 @@ void Buffer::Upload(const void* data, VkDeviceSize size) {
 	if (mMemoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
 		memcpy(MappedData(), data, size);
 	} else {
+		bool initial = false;
 		if ((mUsageFlags & VK_BUFFER_USAGE_TRANSFER_DST_BIT) == 0) {
 			mUsageFlags |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 			
@@ -52,13 +64,17 @@ void Buffer::Upload(const void* data, VkDeviceSize size) {
 			mDevice->FreeMemory(mMemory);
 			mSize = size;
 			Allocate();
+			initial = true;
 		}
-		Buffer uploadBuffer(mName + " upload", mDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		memcpy(uploadBuffer.MappedData(), data, size);
-		CopyFrom(uploadBuffer);
+		mDevice->UploadManager()->Upload(this, data, size, 0, initial);
 	}
 }
 
+void Buffer::SetMemoryCategory(MemoryCategory category) {
+	mCategory = category;
+	mDevice->SetMemoryCategory(mMemory, category);
+}
+
 void Buffer::CopyFrom(const Buffer& other) {
 	if (mSize != other.mSize) {
 		if (mView) vkDestroyBufferView(*mDevice, mView, nullptr);
@@ -90,19 +106,64 @@ void Buffer::CopyFrom(const Buffer& other) {
 }
 
 void Buffer::Allocate(){
+	// device-local buffers can be moved by Device::Defragment(), except storage buffers, which the compute queue might be using
+	bool relocatable = (mMemoryProperties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0 && (mUsageFlags & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) == 0;
+	if (relocatable) mUsageFlags |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	CreateBuffer();
+
+	VkMemoryRequirements memRequirements;
+	vkGetBufferMemoryRequirements(*mDevice, mBuffer, &memRequirements);
+	mMemory = mDevice->AllocateMemory(memRequirements, mMemoryProperties, true, mName, mCategory);
+	vkBindBufferMemory(*mDevice, mBuffer, mMemory.mDeviceMemory, mMemory.mOffset);
+	CreateView();
+
+	if (relocatable) mDevice->SetRelocatable(mMemory, this);
+}
+void Buffer::Relocate(const DeviceMemoryAllocation& memory, CommandBuffer* commandBuffer) {
+	VkBuffer src = mBuffer;
+
+	CreateBuffer();
+	mMemory = memory;
+	vkBindBufferMemory(*mDevice, mBuffer, mMemory.mDeviceMemory, mMemory.mOffset);
+	CreateView();
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = src;
+	barrier.size = mSize;
+	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+	VkBufferCopy copyRegion = {};
+	copyRegion.size = mSize;
+	vkCmdCopyBuffer(*commandBuffer, src, mBuffer, 1, &copyRegion);
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	barrier.buffer = mBuffer;
+	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void Buffer::CreateBuffer() {
 	VkBufferCreateInfo bufferInfo = {};
 	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	bufferInfo.size = mSize;
 	bufferInfo.usage = mUsageFlags;
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	mConcurrent = (mUsageFlags & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) && mDevice->QueueFamilyIndices().size() > 1;
+	if (mConcurrent) {
+		bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		bufferInfo.queueFamilyIndexCount = (uint32_t)mDevice->QueueFamilyIndices().size();
+		bufferInfo.pQueueFamilyIndices = mDevice->QueueFamilyIndices().data();
+	}
 	ThrowIfFailed(vkCreateBuffer(*mDevice, &bufferInfo, nullptr, &mBuffer), "vkCreateBuffer failed for " + mName);
 	mDevice->SetObjectName(mBuffer, mName, VK_OBJECT_TYPE_BUFFER);
-
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(*mDevice, mBuffer, &memRequirements);
-	mMemory = mDevice->AllocateMemory(memRequirements, mMemoryProperties, mName);
-	vkBindBufferMemory(*mDevice, mBuffer, mMemory.mDeviceMemory, mMemory.mOffset);
-
+}
+void Buffer::CreateView() {
 	if (mViewFormat != VK_FORMAT_UNDEFINED) {
 		VkBufferViewCreateInfo viewInfo = {};
 		viewInfo.sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO;
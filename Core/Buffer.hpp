@@ -15,7 +15,7 @@ public:
 	ENGINE_EXPORT ~Buffer();
 
 	// Upload data from the host to the device
-	// If this buffer is not host visible, then a staging buffer will be created and the data will be copied with Buffer::CopyFrom()
+	// If this buffer is not host visible, then the data will be copied by the device's UploadManager, without waiting for the copy to finish
 	// If this buffer is not host visible and does not have the VK_BUFFER_USAGE_TRANSFER_DST_BIT flag, then the buffer will be re-created with VK_BUFFER_USAGE_TRANSFER_DST_BIT
 	// If this buffer is host visible, then the data is immediately memcpy'd
 	ENGINE_EXPORT void Upload(const void* data, VkDeviceSize size);
@@ -26,6 +26,10 @@ public:
 	inline VkBufferUsageFlags Usage() const { return mUsageFlags; }
 	inline VkMemoryPropertyFlags MemoryProperties() const { return mMemoryProperties; }
 	inline const DeviceMemoryAllocation& Memory() const { return mMemory; }
+	// Buffers with vertex or index usage count towards MEMORY_CATEGORY_MESH, and others towards MEMORY_CATEGORY_OTHER, unless this is called
+	ENGINE_EXPORT void SetMemoryCategory(MemoryCategory category);
+	// Storage buffers are shared between the device's queue families when it has more than one, so compute and transfer queues can use them without ownership transfers
+	inline bool Concurrent() const { return mConcurrent; }
 
 	ENGINE_EXPORT void CopyFrom(const Buffer& other);
 	Buffer& operator=(const Buffer& other) = delete;
@@ -34,9 +38,15 @@ public:
 	inline const VkBufferView& View() const { return mView; }
 
 	inline ::Device* Device() const { return mDevice; }
+	// Unique id from Device::NextResourceId(), which descriptor sets use to tell resources apart when their handles are re-used
+	inline uint64_t ResourceId() const { return mResourceId; }
+	// Token of the last UploadManager upload into this buffer, or 0 if it has none
+	inline UploadToken LastUpload() const { return mLastUpload; }
 	inline operator VkBuffer() const { return mBuffer; }
 
 private:
+	friend class ::Device;
+	friend class ::UploadManager;
 	::Device* mDevice;
 	VkBuffer mBuffer;
 	DeviceMemoryAllocation mMemory;
@@ -45,9 +55,18 @@ private:
 	VkFormat mViewFormat;
 
 	VkDeviceSize mSize;
+	bool mConcurrent;
+	MemoryCategory mCategory;
 
 	VkBufferUsageFlags mUsageFlags;
 	VkMemoryPropertyFlags mMemoryProperties;
+	uint64_t mResourceId;
+	UploadToken mLastUpload;
 
 	ENGINE_EXPORT void Allocate();
+	ENGINE_EXPORT void CreateBuffer();
+	// Creates the texel buffer view, if the buffer has a view format
+	ENGINE_EXPORT void CreateView();
+	// Re-creates the buffer in 'memory' and records a copy of its contents into 'commandBuffer'. Used by Device::Defragment(), which destroys the old buffer
+	ENGINE_EXPORT void Relocate(const DeviceMemoryAllocation& memory, CommandBuffer* commandBuffer);
 };
\ No newline at end of file
@@ -13,27 +13,12 @@
 
 using namespace std;
 
-Fence::Fence(Device* device) : mDevice(device) {
-	VkFenceCreateInfo fenceInfo = {};
-	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	ThrowIfFailed(vkCreateFence(*mDevice, &fenceInfo, nullptr, &mFence), "vkCreateFence failed");
-}
-Fence::~Fence() {
-	Wait();
-	vkDestroyFence(*mDevice, mFence, nullptr);
-}
+Fence::Fence(Device* device, VkSemaphore timeline, uint64_t value) : mDevice(device), mTimeline(timeline), mValue(value) {}
 void Fence::Wait() {
-	ThrowIfFailed(vkWaitForFences(*mDevice, 1, &mFence, true, numeric_limits<uint64_t>::max()), "vkWaitForFences failed");
+	mDevice->Wait(mTimeline, mValue);
 }
 bool Fence::Signaled() {
-	VkResult status = vkGetFenceStatus(*mDevice, mFence);
-	if (status == VK_NOT_READY) return false;
-	if (status == VK_SUCCESS) return true;
-	ThrowIfFailed(status, "vkGetFenceStatus failed");
-	return false;
-}
-void Fence::Reset(){
-	ThrowIfFailed(vkResetFences(*mDevice, 1, &mFence), "vkResetFences failed");
+	return mDevice->CompletedValue(mTimeline) >= mValue;
 }
 
 Semaphore::Semaphore(Device* device) : mDevice(device) {
@@ -45,18 +30,15 @@ Semaphore::~Semaphore() {
 	vkDestroySemaphore(*mDevice, mSemaphore, nullptr);
 }
 
-CommandBuffer::CommandBuffer(::Device* device, VkCommandPool commandPool, const string& name)
-	: mDevice(device), mCommandPool(commandPool), mCurrentRenderPass(nullptr), mCurrentMaterial(nullptr), mCurrentPipeline(VK_NULL_HANDLE), mTriangleCount(0), mCurrentIndexBuffer(nullptr) {
+CommandBuffer::CommandBuffer(::Device* device, VkCommandPool commandPool, uint32_t queueFamily, const string& name, VkCommandBufferLevel level)
+	: mDevice(device), mCommandPool(commandPool), mQueueFamilyIndex(queueFamily), mCurrentRenderPass(nullptr), mCurrentFramebuffer(VK_NULL_HANDLE), mCurrentMaterial(nullptr), mCurrentPipeline(VK_NULL_HANDLE), mTriangleCount(0), mPipelineBindCount(0), mDescriptorSetBindCount(0), mCurrentIndexBuffer(nullptr) {
 	VkCommandBufferAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	allocInfo.commandPool = mCommandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.level = level;
 	allocInfo.commandBufferCount = 1;
 	ThrowIfFailed(vkAllocateCommandBuffers(*mDevice, &allocInfo, &mCommandBuffer), "vkAllocateCommandBuffers failed");
 	mDevice->SetObjectName(mCommandBuffer, name, VK_OBJECT_TYPE_COMMAND_BUFFER);
-
-	mSignalFence = make_shared<Fence>(device);
-	mDevice->SetObjectName(mSignalFence->operator VkFence(), name, VK_OBJECT_TYPE_FENCE);
 }
 CommandBuffer::~CommandBuffer() {
 	vkFreeCommandBuffers(*mDevice, mCommandPool, 1, &mCommandBuffer);
@@ -77,21 +59,56 @@ void CommandBuffer::EndLabel() {
 
 void CommandBuffer::Reset(const string& name) {
 	vkResetCommandBuffer(mCommandBuffer, 0);
+	Clear(name);
+}
+void CommandBuffer::Clear(const string& name) {
 	mDevice->SetObjectName(mCommandBuffer, name, VK_OBJECT_TYPE_COMMAND_BUFFER);
-	
-	mSignalFence->Reset();
-	mDevice->SetObjectName(*mSignalFence, name + " Fence", VK_OBJECT_TYPE_FENCE);
+	mSignalFence.reset();
+	mWaitFences.clear();
 
 	mCurrentRenderPass = nullptr;
+	mCurrentFramebuffer = VK_NULL_HANDLE;
 	mCurrentCamera = nullptr;
 	mCurrentMaterial = nullptr;
 	mCurrentPipeline = VK_NULL_HANDLE;
 	mTriangleCount = 0;
+	mPipelineBindCount = 0;
+	mDescriptorSetBindCount = 0;
 	mCurrentIndexBuffer = nullptr;
 	mCurrentVertexBuffers.clear();
 }
 
-void CommandBuffer::BeginRenderPass(RenderPass* renderPass, const VkExtent2D& renderArea, VkFramebuffer frameBuffer, VkClearValue* clearValues, uint32_t clearValueCount) {
+void CommandBuffer::AddWait(shared_ptr<Fence> fence) {
+	mWaitFences.push_back(fence);
+}
+void CommandBuffer::TransferOwnership(Buffer* buffer, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, CommandBuffer* dst, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = *buffer;
+	barrier.size = buffer->Size();
+
+	if (mQueueFamilyIndex == dst->mQueueFamilyIndex) {
+		barrier.srcAccessMask = srcAccess;
+		barrier.dstAccessMask = dstAccess;
+		vkCmdPipelineBarrier(*dst, srcStage, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		return;
+	}
+	// the semaphore 'dst' waits on makes the writes visible
+	if (buffer->Concurrent()) return;
+
+	barrier.srcQueueFamilyIndex = mQueueFamilyIndex;
+	barrier.dstQueueFamilyIndex = dst->mQueueFamilyIndex;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = 0;
+	vkCmdPipelineBarrier(mCommandBuffer, srcStage, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccess;
+	vkCmdPipelineBarrier(*dst, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+void CommandBuffer::BeginRenderPass(RenderPass* renderPass, const VkExtent2D& renderArea, VkFramebuffer frameBuffer, VkClearValue* clearValues, uint32_t clearValueCount, VkSubpassContents contents) {
 	VkRenderPassBeginInfo info = {};
 	info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	info.renderPass = *renderPass;
@@ -99,15 +116,17 @@ void CommandBuffer::BeginRenderPass(RenderPass* renderPass, const VkExtent2D& re
 	info.pClearValues = clearValues;
 	info.renderArea = { { 0, 0 }, renderArea };
 	info.framebuffer = frameBuffer;
-	vkCmdBeginRenderPass(*this, &info, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBeginRenderPass(*this, &info, contents);
 
 	mCurrentRenderPass = renderPass;
+	mCurrentFramebuffer = frameBuffer;
 
 	mTriangleCount = 0;
 }
 void CommandBuffer::EndRenderPass() {
 	vkCmdEndRenderPass(*this);
 	mCurrentRenderPass = nullptr;
+	mCurrentFramebuffer = VK_NULL_HANDLE;
 	mCurrentCamera = nullptr;
 	mCurrentMaterial = nullptr;
 	mCurrentIndexBuffer = nullptr;
@@ -115,6 +134,19 @@ void CommandBuffer::EndRenderPass() {
 	mCurrentPipeline = VK_NULL_HANDLE;
 }
 
+void CommandBuffer::Execute(const vector<shared_ptr<CommandBuffer>>& secondaries) {
+	if (secondaries.empty()) return;
+	vector<VkCommandBuffer> commandBuffers(secondaries.size());
+	for (uint32_t i = 0; i < secondaries.size(); i++) {
+		ThrowIfFailed(vkEndCommandBuffer(secondaries[i]->mCommandBuffer), "vkEndCommandBuffer failed");
+		commandBuffers[i] = secondaries[i]->mCommandBuffer;
+		mTriangleCount += secondaries[i]->mTriangleCount;
+		mPipelineBindCount += secondaries[i]->mPipelineBindCount;
+		mDescriptorSetBindCount += secondaries[i]->mDescriptorSetBindCount;
+	}
+	vkCmdExecuteCommands(mCommandBuffer, (uint32_t)commandBuffers.size(), commandBuffers.data());
+}
+
 bool CommandBuffer::PushConstant(ShaderVariant* shader, const std::string& name, const void* value) {
 	if (shader->mPushConstants.count(name) == 0) return false;
 	VkPushConstantRange range = shader->mPushConstants.at(name);
@@ -127,8 +159,10 @@ VkPipelineLayout CommandBuffer::BindShader(GraphicsShader* shader, PassType pass
 	if (mCurrentPipeline == pipeline) {
 		if (mCurrentCamera != camera && camera) {
 			mCurrentCamera = camera;
-			if (mCurrentRenderPass && camera && shader->mDescriptorBindings.count("Camera"))
+			if (mCurrentRenderPass && camera && shader->mDescriptorBindings.count("Camera")) {
 				vkCmdBindDescriptorSets(*this, VK_PIPELINE_BIND_POINT_GRAPHICS, shader->mPipelineLayout, PER_CAMERA, 1, *camera->DescriptorSet(shader->mDescriptorBindings.at("Camera").second.stageFlags), 0, nullptr);
+				mDescriptorSetBindCount++;
+			}
 			
 			uint32_t eye = 0;
 			PushConstant(shader, "StereoEye", &eye);
@@ -137,9 +171,12 @@ VkPipelineLayout CommandBuffer::BindShader(GraphicsShader* shader, PassType pass
 	}
 	mCurrentPipeline = pipeline;
 	vkCmdBindPipeline(*this, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	mPipelineBindCount++;
 	if (camera) {
-		if (mCurrentRenderPass && shader->mDescriptorBindings.count("Camera"))
+		if (mCurrentRenderPass && shader->mDescriptorBindings.count("Camera")) {
 			vkCmdBindDescriptorSets(*this, VK_PIPELINE_BIND_POINT_GRAPHICS, shader->mPipelineLayout, PER_CAMERA, 1, *camera->DescriptorSet(shader->mDescriptorBindings.at("Camera").second.stageFlags), 0, nullptr);
+			mDescriptorSetBindCount++;
+		}
 		mCurrentCamera = camera;
 		uint32_t eye = 0;
 		PushConstant(shader, "StereoEye", &eye);
@@ -163,6 +200,7 @@ VkPipelineLayout CommandBuffer::BindMaterial(Material* material, PassType pass,
 
 	if (pipeline != mCurrentPipeline) {
 		vkCmdBindPipeline(*this, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		mPipelineBindCount++;
 		mCurrentPipeline = pipeline;
 		mCurrentCamera = nullptr;
 		mCurrentMaterial = nullptr;
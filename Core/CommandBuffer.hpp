@@ -19,20 +19,20 @@ class RenderPass;
 class Camera;
 class ShaderVariant;
 
+// A value of a queue's timeline semaphore, which the device signals when the work submitted to the queue before it finishes
 class Fence {
 public:
-	ENGINE_EXPORT Fence(Device* device);
-	ENGINE_EXPORT ~Fence();
-	// Wait for the device to signal this fence
+	ENGINE_EXPORT Fence(Device* device, VkSemaphore timeline, uint64_t value);
+	// Wait for the device to signal this fence, submitting the work before it first if it is still queued
 	ENGINE_EXPORT void Wait();
 	// Has the device signaled this fence?
 	ENGINE_EXPORT bool Signaled();
-	// Reset the state of the fence
-	ENGINE_EXPORT void Reset();
-	inline operator VkFence() const { return mFence; }
+	inline VkSemaphore Timeline() const { return mTimeline; }
+	inline uint64_t Value() const { return mValue; }
 private:
 	Device* mDevice;
-	VkFence mFence;
+	VkSemaphore mTimeline;
+	uint64_t mValue;
 };
 class Semaphore {
 public:
@@ -57,6 +57,12 @@ public:
 
 	ENGINE_EXPORT void Reset(const std::string& name = "Command Buffer");
 
+	// Make this command buffer wait for 'fence' before it starts, when it is executed. Used for fences from other queues; fences from the same queue are ignored
+	ENGINE_EXPORT void AddWait(std::shared_ptr<Fence> fence);
+	// Pass ownership of 'buffer' from this command buffer's queue family to 'dst's, recording the release here and the acquire in 'dst', which must wait on this command buffer.
+	// If both are in the same family, this records one barrier in 'dst' instead. Buffers shared between queue families need no transfer, so nothing is recorded for them
+	ENGINE_EXPORT void TransferOwnership(Buffer* buffer, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, CommandBuffer* dst, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
 	inline RenderPass* CurrentRenderPass() const { return mCurrentRenderPass; }
 
 	// Find the range for a push constant named 'name' and push it
@@ -81,19 +87,33 @@ public:
 	ENGINE_EXPORT void BindVertexBuffer(Buffer* buffer, uint32_t index, VkDeviceSize offset);
 	ENGINE_EXPORT void BindIndexBuffer(Buffer* buffer, VkDeviceSize offset, VkIndexType indexType);
 
-	ENGINE_EXPORT void BeginRenderPass(RenderPass* renderPass, const VkExtent2D& renderArea, VkFramebuffer frameBuffer, VkClearValue* clearValues, uint32_t clearValueCount);
+	// If 'contents' is VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS, the render pass can only be recorded into with secondary command buffers, through Execute()
+	ENGINE_EXPORT void BeginRenderPass(RenderPass* renderPass, const VkExtent2D& renderArea, VkFramebuffer frameBuffer, VkClearValue* clearValues, uint32_t clearValueCount,
+		VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 	ENGINE_EXPORT void EndRenderPass();
+	// Ends each secondary command buffer from Device::GetSecondaryCommandBuffer(this), and executes them in order, adding their counts to this command buffer's
+	ENGINE_EXPORT void Execute(const std::vector<std::shared_ptr<CommandBuffer>>& secondaries);
 
 	inline ::Device* Device() const { return mDevice; }
+	inline uint32_t QueueFamilyIndex() const { return mQueueFamilyIndex; }
 
 	size_t mTriangleCount;
+	// Pipelines and descriptor sets bound through BindShader(), BindMaterial() and instanced MeshRenderers since the command buffer was reset
+	uint32_t mPipelineBindCount;
+	uint32_t mDescriptorSetBindCount;
 
 private:
 	friend class Device;
-	ENGINE_EXPORT CommandBuffer(::Device* device, VkCommandPool commandPool, const std::string& name = "Command Buffer");
+	friend class UploadManager;
+	ENGINE_EXPORT CommandBuffer(::Device* device, VkCommandPool commandPool, uint32_t queueFamily, const std::string& name = "Command Buffer", VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+	// Clears the recording state, for re-use after the command buffer's pool was reset
+	ENGINE_EXPORT void Clear(const std::string& name);
 	::Device* mDevice;
 	VkCommandBuffer mCommandBuffer;
 	VkCommandPool mCommandPool;
+	uint32_t mQueueFamilyIndex;
+	std::vector<std::shared_ptr<Fence>> mWaitFences;
+	// assigned when the command buffer is executed
 	std::shared_ptr<Fence> mSignalFence;
 	std::shared_ptr<Semaphore> mSignalSemaphore;
 
@@ -101,6 +121,8 @@ private:
 	Buffer* mCurrentIndexBuffer;
 
 	RenderPass* mCurrentRenderPass;
+	// inherited by secondary command buffers
+	VkFramebuffer mCurrentFramebuffer;
 	Camera* mCurrentCamera;
 	VkPipeline mCurrentPipeline;
 	Material* mCurrentMaterial;
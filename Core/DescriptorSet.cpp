@@ -5,7 +5,10 @@
 
 using namespace std;
 
-DescriptorSet::DescriptorSet(const string& name, Device* device, VkDescriptorSetLayout layout) : mDevice(device), mLayout(layout) {
+DescriptorSet::DescriptorSet(const string& name, Device* device, VkDescriptorSetLayout layout, bool cached)
+	: mDevice(device), mDescriptorSet(VK_NULL_HANDLE), mLayout(layout), mDescriptorPool(VK_NULL_HANDLE), mCached(cached), mCacheKey(0) {
+	if (mCached) return;
+	mDescriptorPool = device->mDescriptorPool;
 	VkDescriptorSetAllocateInfo allocInfo = {};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocInfo.descriptorPool = mDevice->mDescriptorPool;
@@ -16,6 +19,8 @@ DescriptorSet::DescriptorSet(const string& name, Device* device, VkDescriptorSet
 	mDevice->SetObjectName(mDescriptorSet, name, VK_OBJECT_TYPE_DESCRIPTOR_SET);
 	mDevice->mDescriptorSetCount++;
 }
+DescriptorSet::DescriptorSet(Device* device)
+	: mDevice(device), mDescriptorSet(VK_NULL_HANDLE), mLayout(VK_NULL_HANDLE), mDescriptorPool(VK_NULL_HANDLE), mCached(false), mCacheKey(0) {}
 DescriptorSet::~DescriptorSet() {
 	for (auto c : mCurrent) {
 		safe_delete(c.second.pImageInfo);
@@ -34,19 +39,44 @@ DescriptorSet::~DescriptorSet() {
 		delete mImageInfoPool.front();
 		mImageInfoPool.pop();
 	}
-	lock_guard lock(mDevice->mDescriptorPoolMutex);
-	ThrowIfFailed(vkFreeDescriptorSets(*mDevice, mDevice->mDescriptorPool, 1, &mDescriptorSet), "vkFreeDescriptorSets failed");
-	mDevice->mDescriptorSetCount--;
+	if (mCacheKey) mDevice->ReleaseCachedDescriptorSet(mCacheKey, mDescriptorSet);
+	if (mDescriptorPool != VK_NULL_HANDLE) {
+		lock_guard lock(mDevice->mDescriptorPoolMutex);
+		ThrowIfFailed(vkFreeDescriptorSets(*mDevice, mDescriptorPool, 1, &mDescriptorSet), "vkFreeDescriptorSets failed");
+		mDevice->mDescriptorSetCount--;
+	}
+}
+
+void DescriptorSet::Reset(const string& name, VkDescriptorSetLayout layout, VkDescriptorSet descriptorSet, bool cached) {
+	for (auto c : mCurrent) {
+		safe_delete(c.second.pImageInfo);
+		safe_delete(c.second.pBufferInfo);
+	}
+	mCurrent.clear();
+	mCurrentResources.clear();
+
+	for (VkDescriptorBufferInfo* d : mPendingBuffers) mBufferInfoPool.push(d);
+	for (VkDescriptorImageInfo* d : mPendingImages) mImageInfoPool.push(d);
+	mPending.clear();
+	mPendingResources.clear();
+	mPendingImages.clear();
+	mPendingBuffers.clear();
+
+	mLayout = layout;
+	mDescriptorSet = descriptorSet;
+	mCached = cached;
+	if (mDescriptorSet != VK_NULL_HANDLE) mDevice->SetObjectName(mDescriptorSet, name, VK_OBJECT_TYPE_DESCRIPTOR_SET);
 }
 
 void DescriptorSet::CreateStorageBufferDescriptor(Buffer* buffer, uint32_t index, VkDeviceSize offset, VkDeviceSize range, uint32_t binding) {
-	uint64_t idx = (uint64_t)binding | ((uint64_t)index << 32);
+	uint64_t idx = ((uint64_t)binding << 32) | (uint64_t)index;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER &&
 			c.pBufferInfo->buffer == *buffer &&
 			c.pBufferInfo->offset == offset &&
-			c.pBufferInfo->range == range) return;
+			c.pBufferInfo->range == range &&
+			mCurrentResources.at(idx) == buffer->ResourceId()) return;
 	}
 
 	VkDescriptorBufferInfo* info;
@@ -69,16 +99,18 @@ void DescriptorSet::CreateStorageBufferDescriptor(Buffer* buffer, uint32_t index
 	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(buffer->ResourceId());
 	mPendingBuffers.push_back(info);
 }
 void DescriptorSet::CreateStorageBufferDescriptor(Buffer* buffer, VkDeviceSize offset, VkDeviceSize range, uint32_t binding) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER &&
 			c.pBufferInfo->buffer == *buffer &&
 			c.pBufferInfo->offset == offset &&
-			c.pBufferInfo->range == range) return;
+			c.pBufferInfo->range == range &&
+			mCurrentResources.at(idx) == buffer->ResourceId()) return;
 	}
 
 	VkDescriptorBufferInfo* info;
@@ -101,13 +133,14 @@ void DescriptorSet::CreateStorageBufferDescriptor(Buffer* buffer, VkDeviceSize o
 	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(buffer->ResourceId());
 	mPendingBuffers.push_back(info);
 }
 void DescriptorSet::CreateStorageTexelBufferDescriptor(Buffer* buffer, uint32_t binding) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
-		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER && c.pTexelBufferView == &buffer->View()) return;
+		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER && c.pTexelBufferView == &buffer->View() && mCurrentResources.at(idx) == buffer->ResourceId()) return;
 	}
 
 	VkWriteDescriptorSet write = {};
@@ -119,16 +152,18 @@ void DescriptorSet::CreateStorageTexelBufferDescriptor(Buffer* buffer, uint32_t
 	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(buffer->ResourceId());
 }
 
 void DescriptorSet::CreateUniformBufferDescriptor(Buffer* buffer, VkDeviceSize offset, VkDeviceSize range, uint32_t binding) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER &&
 			c.pBufferInfo->buffer == *buffer &&
 			c.pBufferInfo->offset == offset &&
-			c.pBufferInfo->range == range) return;
+			c.pBufferInfo->range == range &&
+			mCurrentResources.at(idx) == buffer->ResourceId()) return;
 	}
 
 	VkDescriptorBufferInfo* info;
@@ -151,16 +186,18 @@ void DescriptorSet::CreateUniformBufferDescriptor(Buffer* buffer, VkDeviceSize o
 	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(buffer->ResourceId());
 	mPendingBuffers.push_back(info);
 }
 
 void DescriptorSet::CreateStorageTextureDescriptor(Texture* texture, uint32_t binding, VkImageLayout layout) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE &&
 			c.pImageInfo->imageLayout == layout &&
-			c.pImageInfo->imageView == texture->View()) return;
+			c.pImageInfo->imageView == texture->View() &&
+			mCurrentResources.at(idx) == texture->ResourceId()) return;
 	}
 
 	VkDescriptorImageInfo* info;
@@ -183,15 +220,17 @@ void DescriptorSet::CreateStorageTextureDescriptor(Texture* texture, uint32_t bi
 	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(texture->ResourceId());
 	mPendingImages.push_back(info);
 }
 void DescriptorSet::CreateStorageTextureDescriptor(Texture* texture, uint32_t index, uint32_t binding, VkImageLayout layout) {
-	uint64_t idx = (uint64_t)binding | ((uint64_t)index << 32);
+	uint64_t idx = ((uint64_t)binding << 32) | (uint64_t)index;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE &&
 			c.pImageInfo->imageLayout == layout &&
-			c.pImageInfo->imageView == texture->View()) return;
+			c.pImageInfo->imageView == texture->View() &&
+			mCurrentResources.at(idx) == texture->ResourceId()) return;
 	}
 
 	VkDescriptorImageInfo* info;
@@ -214,15 +253,17 @@ void DescriptorSet::CreateStorageTextureDescriptor(Texture* texture, uint32_t in
 	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(texture->ResourceId());
 	mPendingImages.push_back(info);
 }
 void DescriptorSet::CreateSampledTextureDescriptor(Texture* texture, uint32_t binding, VkImageLayout layout) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE &&
 			c.pImageInfo->imageLayout == layout &&
-			c.pImageInfo->imageView == texture->View()) return;
+			c.pImageInfo->imageView == texture->View() &&
+			mCurrentResources.at(idx) == texture->ResourceId()) return;
 	}
 
 	VkDescriptorImageInfo* info;
@@ -245,15 +286,17 @@ void DescriptorSet::CreateSampledTextureDescriptor(Texture* texture, uint32_t bi
 	write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(texture->ResourceId());
 	mPendingImages.push_back(info);
 }
 void DescriptorSet::CreateSampledTextureDescriptor(Texture* texture, uint32_t index, uint32_t binding, VkImageLayout layout) {
-	uint64_t idx = (uint64_t)binding | ((uint64_t)index << 32);
+	uint64_t idx = ((uint64_t)binding << 32) | (uint64_t)index;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
 		if (c.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE &&
 			c.pImageInfo->imageLayout == layout &&
-			c.pImageInfo->imageView == texture->View()) return;
+			c.pImageInfo->imageView == texture->View() &&
+			mCurrentResources.at(idx) == texture->ResourceId()) return;
 	}
 
 	VkDescriptorImageInfo* info;
@@ -276,14 +319,16 @@ void DescriptorSet::CreateSampledTextureDescriptor(Texture* texture, uint32_t in
 	write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(texture->ResourceId());
 	mPendingImages.push_back(info);
 }
 
 void DescriptorSet::CreateSamplerDescriptor(Sampler* sampler, uint32_t binding) {
-	uint64_t idx = (uint64_t)binding;
+	uint64_t idx = (uint64_t)binding << 32;
 	if (mCurrent.count(idx)) {
 		const VkWriteDescriptorSet& c = mCurrent.at(idx);
-		if (c.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER && c.pImageInfo->sampler == *sampler) return;
+		if (c.descriptorType == VK_DESCRIPTOR_TYPE_SAMPLER && c.pImageInfo->sampler == *sampler &&
+			mCurrentResources.at(idx) == sampler->ResourceId()) return;
 	}
 
 	VkDescriptorImageInfo* info;
@@ -306,16 +351,83 @@ void DescriptorSet::CreateSamplerDescriptor(Sampler* sampler, uint32_t binding)
 	write.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
 	write.descriptorCount = 1;
 	mPending.push_back(write);
+	mPendingResources.push_back(sampler->ResourceId());
 	mPendingImages.push_back(info);
 }
 
+VkDescriptorUpdateTemplate DescriptorSet::BuildTemplateData() {
+	mTemplateEntries.clear();
+	mTemplateData.clear();
+	mTemplateResources.clear();
+
+	for (auto& kp : mCurrent) {
+		const VkWriteDescriptorSet& w = kp.second;
+		DescriptorData d;
+		memset(&d, 0, sizeof(DescriptorData));
+		// copy field by field, so the padding stays zeroed for hashing
+		if (w.pImageInfo) {
+			d.mImage.sampler = w.pImageInfo->sampler;
+			d.mImage.imageView = w.pImageInfo->imageView;
+			d.mImage.imageLayout = w.pImageInfo->imageLayout;
+		} else if (w.pBufferInfo) {
+			d.mBuffer.buffer = w.pBufferInfo->buffer;
+			d.mBuffer.offset = w.pBufferInfo->offset;
+			d.mBuffer.range = w.pBufferInfo->range;
+		} else if (w.pTexelBufferView)
+			d.mTexelBufferView = *w.pTexelBufferView;
+
+		// consecutive array elements of the same binding are written by one entry
+		if (mTemplateEntries.size()) {
+			VkDescriptorUpdateTemplateEntry& e = mTemplateEntries.back();
+			if (e.dstBinding == w.dstBinding && e.descriptorType == w.descriptorType && e.dstArrayElement + e.descriptorCount == w.dstArrayElement) {
+				e.descriptorCount++;
+				mTemplateData.push_back(d);
+				mTemplateResources.push_back(mCurrentResources.at(kp.first));
+				continue;
+			}
+		}
+
+		VkDescriptorUpdateTemplateEntry e = {};
+		e.dstBinding = w.dstBinding;
+		e.dstArrayElement = w.dstArrayElement;
+		e.descriptorCount = 1;
+		e.descriptorType = w.descriptorType;
+		e.offset = mTemplateData.size() * sizeof(DescriptorData);
+		e.stride = sizeof(DescriptorData);
+		mTemplateEntries.push_back(e);
+		mTemplateData.push_back(d);
+		mTemplateResources.push_back(mCurrentResources.at(kp.first));
+	}
+
+	size_t key = 0;
+	hash_combine(key, mLayout);
+	for (const VkDescriptorUpdateTemplateEntry& e : mTemplateEntries) {
+		hash_combine(key, e.dstBinding);
+		hash_combine(key, e.dstArrayElement);
+		hash_combine(key, e.descriptorCount);
+		hash_combine(key, e.descriptorType);
+	}
+	return mDevice->GetDescriptorUpdateTemplate(key, mLayout, mTemplateEntries);
+}
+
 void DescriptorSet::FlushWrites() {
 	if (mPending.empty()) return;
 
-	vkUpdateDescriptorSets(*mDevice, (uint32_t)mPending.size(), mPending.data(), 0, nullptr);
+	if (!mCached) {
+		// only the pending descriptors change, the rest of the set keeps what was written before
+		uint32_t count = 0;
+		for (VkWriteDescriptorSet& w : mPending) {
+			w.dstSet = mDescriptorSet;
+			count += w.descriptorCount;
+		}
+		vkUpdateDescriptorSets(*mDevice, (uint32_t)mPending.size(), mPending.data(), 0, nullptr);
+		mDevice->mDescriptorWriteCount += count;
+	}
 
-	for (VkWriteDescriptorSet i : mPending) {
-		uint64_t idx = (uint64_t)i.dstBinding | ((uint64_t)i.dstArrayElement << 32);
+	for (uint32_t j = 0; j < mPending.size(); j++) {
+		const VkWriteDescriptorSet& i = mPending[j];
+		uint64_t idx = ((uint64_t)i.dstBinding << 32) | (uint64_t)i.dstArrayElement;
+		mCurrentResources[idx] = mPendingResources[j];
 		if (mCurrent.count(idx)) {
 			VkWriteDescriptorSet c = mCurrent.at(idx);
 			safe_delete(c.pImageInfo);
@@ -339,6 +451,29 @@ void DescriptorSet::FlushWrites() {
 	for (VkDescriptorImageInfo* d : mPendingImages) mImageInfoPool.push(d);
 	
 	mPending.clear();
+	mPendingResources.clear();
 	mPendingImages.clear();
 	mPendingBuffers.clear();
-}
\ No newline at end of file
+
+	if (mCached) {
+		// cached sets are looked up by all of their descriptors, so templates write every descriptor in mCurrent when a new set is needed
+		VkDescriptorUpdateTemplate updateTemplate = BuildTemplateData();
+
+		// identical descriptors of the same resources in an identical layout hash to the same cache entry
+		size_t key = (size_t)updateTemplate;
+		for (const DescriptorData& d : mTemplateData) {
+			const uint64_t* words = (const uint64_t*)&d;
+			for (uint32_t i = 0; i < sizeof(DescriptorData) / sizeof(uint64_t); i++)
+				hash_combine(key, words[i]);
+		}
+		for (uint64_t r : mTemplateResources)
+			hash_combine(key, r);
+		if (key == 0) key = 1;
+
+		// acquired before the old set is released, so a set that didn't change keeps its entry
+		VkDescriptorSet set = mDevice->AcquireCachedDescriptorSet(key, mLayout, updateTemplate, mTemplateData, mTemplateResources);
+		if (mCacheKey) mDevice->ReleaseCachedDescriptorSet(mCacheKey, mDescriptorSet);
+		mCacheKey = key;
+		mDescriptorSet = set;
+	}
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <map>
+
 #include <Util/Util.hpp>
 
 class Device;
@@ -9,7 +11,9 @@ class Sampler;
 
 class DescriptorSet {
 public:
-	ENGINE_EXPORT DescriptorSet(const std::string& name, Device* device, VkDescriptorSetLayout layout);
+	// If 'cached' is true, no descriptor set is allocated here. Instead, FlushWrites() looks the set's descriptors up in the device's descriptor set cache,
+	// so that sets with the same layout and descriptors share one VkDescriptorSet, which is only written once
+	ENGINE_EXPORT DescriptorSet(const std::string& name, Device* device, VkDescriptorSetLayout layout, bool cached = false);
 	ENGINE_EXPORT ~DescriptorSet();
 
 	ENGINE_EXPORT void CreateStorageBufferDescriptor(Buffer* buffer, uint32_t index, VkDeviceSize offset, VkDeviceSize range, uint32_t binding);
@@ -25,6 +29,8 @@ public:
 	
 	ENGINE_EXPORT void CreateSamplerDescriptor(Sampler* sampler, uint32_t binding);
 
+	// Writes the pending descriptors with one vkUpdateDescriptorSets call. Cached sets look up the set with all of their descriptors instead,
+	// which is written with one vkUpdateDescriptorSetWithTemplate call if it isn't in the cache
 	ENGINE_EXPORT void FlushWrites();
 
 	inline VkDescriptorSetLayout Layout() const { return mLayout; }
@@ -32,9 +38,31 @@ public:
 	inline operator VkDescriptorSet() const { return mDescriptorSet; }
 
 private:
-	std::unordered_map<uint64_t, VkWriteDescriptorSet> mCurrent;
+	friend class Device;
+	// One descriptor in the data passed to vkUpdateDescriptorSetWithTemplate
+	union DescriptorData {
+		VkDescriptorImageInfo mImage;
+		VkDescriptorBufferInfo mBuffer;
+		VkBufferView mTexelBufferView;
+	};
+
+	// Creates an empty set, given a descriptor set from a temporary pool by Device::GetTempDescriptorSet()
+	ENGINE_EXPORT DescriptorSet(Device* device);
+	// Points this set at a newly allocated descriptor set (or the cache, if 'cached' is true), forgetting the writes made to the old one
+	ENGINE_EXPORT void Reset(const std::string& name, VkDescriptorSetLayout layout, VkDescriptorSet descriptorSet, bool cached);
+	// Fills mTemplateEntries and mTemplateData from mCurrent, and returns the update template that writes them
+	ENGINE_EXPORT VkDescriptorUpdateTemplate BuildTemplateData();
+
+	// every descriptor written so far, by binding << 32 | array element, so that they are sorted by binding
+	std::map<uint64_t, VkWriteDescriptorSet> mCurrent;
+	// ResourceId() of the Buffer, Texture or Sampler of each descriptor in mCurrent, since its handles can be re-used by a new resource once it is destroyed
+	std::map<uint64_t, uint64_t> mCurrentResources;
+	std::vector<VkDescriptorUpdateTemplateEntry> mTemplateEntries;
+	std::vector<DescriptorData> mTemplateData;
+	std::vector<uint64_t> mTemplateResources;
 
 	std::vector<VkWriteDescriptorSet> mPending;
+	std::vector<uint64_t> mPendingResources;
 	std::queue<VkDescriptorBufferInfo*> mBufferInfoPool;
 	std::queue<VkDescriptorImageInfo*> mImageInfoPool;
 	std::vector<VkDescriptorBufferInfo*> mPendingBuffers;
@@ -43,4 +71,9 @@ private:
 	Device* mDevice;
 	VkDescriptorSet mDescriptorSet;
 	VkDescriptorSetLayout mLayout;
+	// the pool mDescriptorSet is freed to, or VK_NULL_HANDLE if it belongs to a temporary pool that is reset in bulk
+	VkDescriptorPool mDescriptorPool;
+	bool mCached;
+	// key of the cache entry mDescriptorSet belongs to, or 0
+	size_t mCacheKey;
 };
\ No newline at end of file
@@ -1,21 +1,40 @@
+#include <chrono>
+#include <cstring>
+
+#include <Content/Texture.hpp>
 #include <Core/Buffer.hpp>
 #include <Core/Device.hpp>
 #include <Core/Instance.hpp>
 #include <Core/CommandBuffer.hpp>
 #include <Core/Window.hpp>
+#include <Util/DefragmentationPlanner.hpp>
 #include <Util/Profiler.hpp>
 #include <Util/Util.hpp>
 
 
 //#define PRINT_VK_ALLOCATIONS
 
-// 4kb blocks
-#define MEM_BLOCK_SIZE (4*1024)
 // 4mb min allocation
 #define MEM_MIN_ALLOC (4*1024*1024)
+// Defragment() only empties memory blocks that are less full than this
+#define DEFRAG_MAX_OCCUPANCY .5f
+// fraction of each heap used as its budget, when VK_EXT_memory_budget isn't supported
+#define MEMORY_BUDGET_FALLBACK .8f
+// 1mb initial size of each frame context's buffer for GetTempBufferRange()
+#define FRAME_BUFFER_SIZE (1024*1024)
+#define FRAME_BUFFER_USAGE (VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT)
+// sets in a thread's first temporary descriptor pool, each pool added after it is as large as all the previous ones
+#define TEMP_DESCRIPTOR_POOL_SIZE 256
+// descriptors of each type per set in temporary descriptor pools
+#define TEMP_DESCRIPTORS_PER_SET 4
 
 using namespace std;
 
+thread_local uint64_t Device::mCachedFrameContext = 0;
+thread_local Device::DescriptorPool* Device::mCachedDescriptorPool = nullptr;
+thread_local uint64_t Device::mCachedCommandFrameContext = 0;
+thread_local unordered_map<uint32_t, Device::CommandPool>* Device::mCachedCommandPools = nullptr;
+
 /*static*/ bool Device::FindQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface, uint32_t& graphicsFamily, uint32_t& presentFamily) {
 	uint32_t queueFamilyCount = 0;
 	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
@@ -46,54 +65,196 @@ using namespace std;
 	return g && p;
 }
 
+Device::FrameContext::FrameContext() : mSemaphores({}), mTimelineValue(0), mComputeTimelineValue(0), mTempBuffers({}), mTempBuffersInUse({}), mDescriptorPools({}), mCommandPools({}), mFrameBuffer(nullptr), mOverflowBuffers({}) {
+	static atomic<uint64_t> nextId(1);
+	mId = nextId++;
+}
 void Device::FrameContext::Reset() {
-	if (mFences.size()) {
+	if (mTimelineValue || mComputeTimelineValue) {
 		PROFILER_BEGIN("Wait for GPU");
-		vector<VkFence> fences(mFences.size());
-		for (uint32_t i = 0; i < mFences.size(); i++)
-			fences[i] = *mFences[i];
-		ThrowIfFailed(vkWaitForFences(*mDevice, fences.size(), fences.data(), true, numeric_limits<uint64_t>::max()), "vkWaitForFences failed");
+		// submissions to a queue finish in order, so this covers every command buffer in the frame
+		mDevice->Wait(mDevice->mGraphicsTimeline.mTimeline, mTimelineValue);
+		if (mComputeTimelineValue) mDevice->Wait(mDevice->mComputeTimeline.mTimeline, mComputeTimelineValue);
 		PROFILER_END;
 	}
 
-	mFences.clear();
+	mTimelineValue = 0;
+	mComputeTimelineValue = 0;
 	mSemaphores.clear();
 
+	PROFILER_BEGIN("Reset command pools");
+	// every command buffer from the pools was submitted in this frame, which is done now
+	for (auto& kp : mCommandPools)
+		for (auto& p : kp.second) {
+			CommandPool& pool = p.second;
+			if (!pool.mInUse && !pool.mSecondaryInUse) continue;
+			ThrowIfFailed(vkResetCommandPool(*mDevice, pool.mCommandPool, 0), "vkResetCommandPool failed");
+			mDevice->mCommandBufferHighWaterMark = max(mDevice->mCommandBufferHighWaterMark, pool.mInUse + pool.mSecondaryInUse);
+			mDevice->mCommandBuffersInUse -= pool.mInUse + pool.mSecondaryInUse;
+			pool.mInUse = 0;
+			pool.mSecondaryInUse = 0;
+		}
+	PROFILER_END;
+
+	PROFILER_BEGIN("Destroy retired thread pools");
+	for (auto& pools : mRetiredCommandPools)
+		for (auto& p : pools) {
+			CommandPool& pool = p.second;
+			mDevice->mCommandBuffersInUse -= pool.mInUse + pool.mSecondaryInUse;
+			mDevice->mCommandBufferCount -= (uint32_t)(pool.mCommandBuffers.size() + pool.mSecondaryCommandBuffers.size());
+			pool.mCommandBuffers.clear();
+			pool.mSecondaryCommandBuffers.clear();
+			vkDestroyCommandPool(*mDevice, pool.mCommandPool, nullptr);
+		}
+	mRetiredCommandPools.clear();
+	for (DescriptorPool& p : mRetiredDescriptorPools) {
+		for (auto& key : p.mCacheKeys)
+			mDevice->ReleaseCachedDescriptorSet(key.first, key.second);
+		for (DescriptorSet* ds : p.mSets) {
+			if (!ds->mCached)
+				mDevice->mDescriptorSetCount--;
+			else if (ds->mCacheKey)
+				mDevice->ReleaseCachedDescriptorSet(ds->mCacheKey, ds->mDescriptorSet);
+			delete ds;
+		}
+		for (DescriptorSet* ds : p.mFreeSets)
+			delete ds;
+		for (VkDescriptorPool pool : p.mPools)
+			vkDestroyDescriptorPool(*mDevice, pool, nullptr);
+	}
+	mRetiredDescriptorPools.clear();
+	PROFILER_END;
+
+	PROFILER_BEGIN("Free relocated resources");
+	for (const RetiredResource& r : mRetiredResources) {
+		if (r.mBufferView) vkDestroyBufferView(*mDevice, r.mBufferView, nullptr);
+		if (r.mBuffer) vkDestroyBuffer(*mDevice, r.mBuffer, nullptr);
+		if (r.mImageView) vkDestroyImageView(*mDevice, r.mImageView, nullptr);
+		if (r.mImage) vkDestroyImage(*mDevice, r.mImage, nullptr);
+		mDevice->FreeMemory(r.mMemory);
+	}
+	mRetiredResources.clear();
+	PROFILER_END;
+
+	PROFILER_BEGIN("Free retired descriptor sets");
+	{
+		// cached sets that were released the last time this frame context was used, which the GPU is done with now
+		uint32_t index = (uint32_t)(this - mDevice->mFrameContexts);
+		lock_guard<mutex> lock(mDevice->mDescriptorCacheMutex);
+		vector<VkDescriptorSet> sets;
+		for (auto it = mDevice->mRetiredDescriptorSets.begin(); it != mDevice->mRetiredDescriptorSets.end();) {
+			if (it->first == index) {
+				sets.push_back(it->second);
+				it = mDevice->mRetiredDescriptorSets.erase(it);
+			} else
+				it++;
+		}
+		if (sets.size()) {
+			lock_guard<mutex> poolLock(mDevice->mDescriptorPoolMutex);
+			ThrowIfFailed(vkFreeDescriptorSets(*mDevice, mDevice->mDescriptorPool, (uint32_t)sets.size(), sets.data()), "vkFreeDescriptorSets failed");
+			mDevice->mDescriptorSetCount -= (uint32_t)sets.size();
+		}
+	}
+	PROFILER_END;
+
 	PROFILER_BEGIN("Clear old buffers");
 	for (auto it = mTempBuffers.begin(); it != mTempBuffers.end();) {
 		if (it->second == 1) {
 			safe_delete(it->first);
 			it = mTempBuffers.erase(it);
+			continue;
 		}
 
 		it->second--;
 		it++;
 	}
+
+	// grow the frame buffer to fit everything allocated from it last frame
+	VkDeviceSize capacity = mFrameBufferAllocator.Capacity();
+	if (mFrameBufferAllocator.OverflowCount()) {
+		while (capacity < mFrameBufferAllocator.Required()) capacity *= 2;
+		fprintf_color(COLOR_YELLOW, stderr, "Growing frame buffer to %.3f MiB (%u allocations didn't fit)\n", capacity / (1024.f * 1024.f), mFrameBufferAllocator.OverflowCount());
+		safe_delete(mFrameBuffer);
+	}
+	for (auto& b : mOverflowBuffers)
+		safe_delete(b.first);
+	mOverflowBuffers.clear();
+	mFrameBufferAllocator.Reset(capacity);
 	PROFILER_END;
 
 	for (Buffer* b : mTempBuffersInUse)
 		mTempBuffers.push_back(make_pair(b, 8));
-	for (DescriptorSet* ds : mTempDescriptorSetsInUse)
-		mTempDescriptorSets[ds->Layout()].push_back(make_pair(ds, 8));
-
 	mTempBuffersInUse.clear();
-	mTempDescriptorSetsInUse.clear();
+
+	PROFILER_BEGIN("Reset descriptor pools");
+	for (auto& kp : mDescriptorPools) {
+		DescriptorPool& p = kp.second;
+		for (auto& key : p.mCacheKeys)
+			mDevice->ReleaseCachedDescriptorSet(key.first, key.second);
+		p.mCacheKeys.clear();
+		p.mLastSetCount = 0;
+		for (DescriptorSet* ds : p.mSets) {
+			if (ds->mCached) {
+				if (ds->mCacheKey) p.mCacheKeys.push_back(make_pair(ds->mCacheKey, ds->mDescriptorSet));
+				ds->mCacheKey = 0;
+			} else
+				p.mLastSetCount++;
+		}
+		p.mHighWaterMark = max(p.mHighWaterMark, p.mLastSetCount);
+		mDevice->mDescriptorSetCount -= p.mLastSetCount;
+		p.mFreeSets.insert(p.mFreeSets.end(), p.mSets.begin(), p.mSets.end());
+		p.mSets.clear();
+
+		if (p.mPools.size() > 1) {
+			// ran out last time, replace the pools with one that fits all of them
+			for (VkDescriptorPool pool : p.mPools)
+				vkDestroyDescriptorPool(*mDevice, pool, nullptr);
+			p.mPools = { mDevice->CreateTempDescriptorPool(p.mCapacity) };
+		} else if (p.mPools.size())
+			vkResetDescriptorPool(*mDevice, p.mPools[0], 0);
+		p.mCurrentPool = 0;
+	}
+	PROFILER_END;
 }
 Device::FrameContext::~FrameContext() {
 	Reset();
 	for (auto b : mTempBuffers)
 		safe_delete(b.first);
-	for (auto kp : mTempDescriptorSets)
-		while (kp.second.size()) {
-			auto front = kp.second.begin();
-			safe_delete(front->first);
-			kp.second.erase(front);
+	safe_delete(mFrameBuffer);
+	for (auto& kp : mDescriptorPools) {
+		for (DescriptorSet* ds : kp.second.mFreeSets)
+			delete ds;
+		for (VkDescriptorPool pool : kp.second.mPools)
+			vkDestroyDescriptorPool(*mDevice, pool, nullptr);
+	}
+	for (auto& kp : mCommandPools)
+		for (auto& p : kp.second) {
+			mDevice->mCommandBufferCount -= (uint32_t)(p.second.mCommandBuffers.size() + p.second.mSecondaryCommandBuffers.size());
+			p.second.mCommandBuffers.clear();
+			p.second.mSecondaryCommandBuffers.clear();
+			vkDestroyCommandPool(*mDevice, p.second.mCommandPool, nullptr);
 		}
 }
 
+void Device::QueueTimeline::Init(Device* device, VkQueue queue, const string& name) {
+	mQueue = queue;
+	mLastValue = 0;
+	mSubmittedValue = 0;
+
+	VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+	typeInfo.initialValue = 0;
+	VkSemaphoreCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	info.pNext = &typeInfo;
+	ThrowIfFailed(vkCreateSemaphore(*device, &info, nullptr, &mTimeline), "vkCreateSemaphore failed");
+	device->SetObjectName(mTimeline, name, VK_OBJECT_TYPE_SEMAPHORE);
+}
+
 Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t physicalDeviceIndex, uint32_t graphicsQueueFamily, uint32_t presentQueueFamily, const set<string>& deviceExtensions, vector<const char*> validationLayers)
-	: mInstance(instance), mFrameContexts(nullptr), mGraphicsQueueFamilyIndex(graphicsQueueFamily), mPresentQueueFamilyIndex(presentQueueFamily),
-	mFrameContextIndex(0), mDescriptorSetCount(0), mMemoryAllocationCount(0), mMemoryUsage(0) {
+	: mInstance(instance), mFrameContexts(nullptr), mUploadManager(nullptr), mGraphicsQueueFamilyIndex(graphicsQueueFamily), mPresentQueueFamilyIndex(presentQueueFamily),
+	mFrameContextIndex(0), mDescriptorSetCount(0), mCommandBuffersInUse(0), mCommandBufferCount(0), mCommandBufferHighWaterMark(0), mDescriptorWriteCount(0), mDescriptorCacheHitCount(0), mMemoryAllocationCount(0), mMemoryUsage(0), mRelocationCount(0), mNextBudgetCallbackId(1), mNextRelocationCallbackId(1), mNextResourceId(1) {
 
 	#ifdef ENABLE_DEBUG_LAYERS
 	SetDebugUtilsObjectNameEXT = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr(*instance, "vkSetDebugUtilsObjectNameEXT");
@@ -109,8 +270,61 @@ Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t p
 	for (const string& s : deviceExtensions)
 		deviceExts.push_back(s.c_str());
 
+	// VK_EXT_memory_budget is optional, GetMemoryBudget() estimates the budgets without it
+	uint32_t extensionCount;
+	vkEnumerateDeviceExtensionProperties(mPhysicalDevice, nullptr, &extensionCount, nullptr);
+	vector<VkExtensionProperties> extensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(mPhysicalDevice, nullptr, &extensionCount, extensions.data());
+	mMemoryBudgetSupported = false;
+	for (const VkExtensionProperties& e : extensions)
+		if (strcmp(e.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+			mMemoryBudgetSupported = true;
+			if (!deviceExtensions.count(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) deviceExts.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+			break;
+		}
+
+	// every queue submission and frame context is tracked with timeline semaphores, so there is no fallback without them
+	bool timelineExtension = false;
+	for (const VkExtensionProperties& e : extensions)
+		if (strcmp(e.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) timelineExtension = true;
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR supportedTimelineFeatures = {};
+	supportedTimelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	VkPhysicalDeviceFeatures2 supportedFeatures = {};
+	supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supportedFeatures.pNext = &supportedTimelineFeatures;
+	if (timelineExtension) vkGetPhysicalDeviceFeatures2(mPhysicalDevice, &supportedFeatures);
+	if (!timelineExtension || !supportedTimelineFeatures.timelineSemaphore) {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+		fprintf_color(COLOR_RED, stderr, "Device %u (%s) doesn't support timeline semaphores (VK_KHR_timeline_semaphore), which Stratum requires\n", physicalDeviceIndex, properties.deviceName);
+		throw runtime_error("Timeline semaphores are not supported");
+	}
+
 	#pragma region get queue info
-	set<uint32_t> uniqueQueueFamilies{ mGraphicsQueueFamilyIndex, mPresentQueueFamilyIndex };
+	// prefer a transfer-only queue family for uploads, so that they can run alongside rendering
+	mTransferQueueFamilyIndex = mGraphicsQueueFamilyIndex;
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+	vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+	for (uint32_t i = 0; i < queueFamilyCount; i++)
+		if (queueFamilies[i].queueCount > 0 && (queueFamilies[i].queueFlags & VK_QUEUE_TRANSFER_BIT) && (queueFamilies[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0) {
+			mTransferQueueFamilyIndex = i;
+			break;
+		}
+	// and a compute-only queue family for compute work that can overlap rendering. software implementations usually have one family that does everything
+	mComputeQueueFamilyIndex = mGraphicsQueueFamilyIndex;
+	for (uint32_t i = 0; i < queueFamilyCount; i++)
+		if (queueFamilies[i].queueCount > 0 && (queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) && (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0) {
+			mComputeQueueFamilyIndex = i;
+			break;
+		}
+
+	mQueueFamilyIndices = { mGraphicsQueueFamilyIndex };
+	if (mComputeQueueFamilyIndex != mGraphicsQueueFamilyIndex) mQueueFamilyIndices.push_back(mComputeQueueFamilyIndex);
+	if (mTransferQueueFamilyIndex != mGraphicsQueueFamilyIndex) mQueueFamilyIndices.push_back(mTransferQueueFamilyIndex);
+
+	set<uint32_t> uniqueQueueFamilies{ mGraphicsQueueFamilyIndex, mPresentQueueFamilyIndex, mTransferQueueFamilyIndex, mComputeQueueFamilyIndex };
 	vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 	float queuePriority = 1.0f;
 	for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -134,10 +348,14 @@ Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t p
 
 	VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {};
 	indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
-	indexingFeatures.pNext = nullptr;
 	indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
 	indexingFeatures.runtimeDescriptorArray = VK_TRUE;
 
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	timelineFeatures.timelineSemaphore = VK_TRUE;
+	indexingFeatures.pNext = &timelineFeatures;
+
 	VkDeviceCreateInfo createInfo = {};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	createInfo.queueCreateInfoCount = (uint32_t)queueCreateInfos.size();
@@ -150,6 +368,9 @@ Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t p
 	createInfo.pNext = &indexingFeatures;
 	ThrowIfFailed(vkCreateDevice(mPhysicalDevice, &createInfo, nullptr, &mDevice), "vkCreateDevice failed");
 
+	WaitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(mDevice, "vkWaitSemaphoresKHR");
+	GetSemaphoreCounterValueKHR = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(mDevice, "vkGetSemaphoreCounterValueKHR");
+
 	VkPhysicalDeviceProperties properties = {};
 	vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
 	string name = "Device " + to_string(properties.deviceID) + ": " + properties.deviceName;
@@ -163,6 +384,26 @@ Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t p
 	vkGetDeviceQueue(mDevice, mPresentQueueFamilyIndex, mPresentQueueIndex, &mPresentQueue);
 	SetObjectName(mGraphicsQueue, name + " Graphics Queue", VK_OBJECT_TYPE_QUEUE);
 	SetObjectName(mPresentQueue, name + " Present Queue", VK_OBJECT_TYPE_QUEUE);
+	if (mTransferQueueFamilyIndex == mGraphicsQueueFamilyIndex)
+		mTransferQueue = mGraphicsQueue;
+	else {
+		vkGetDeviceQueue(mDevice, mTransferQueueFamilyIndex, 0, &mTransferQueue);
+		SetObjectName(mTransferQueue, name + " Transfer Queue", VK_OBJECT_TYPE_QUEUE);
+	}
+	if (mComputeQueueFamilyIndex == mGraphicsQueueFamilyIndex)
+		mComputeQueue = mGraphicsQueue;
+	else {
+		vkGetDeviceQueue(mDevice, mComputeQueueFamilyIndex, 0, &mComputeQueue);
+		SetObjectName(mComputeQueue, name + " Compute Queue", VK_OBJECT_TYPE_QUEUE);
+	}
+
+	mGraphicsTimeline.Init(this, mGraphicsQueue, name + " Graphics Timeline");
+	mTransferTimeline.mTimeline = VK_NULL_HANDLE;
+	if (mTransferQueue != mGraphicsQueue)
+		mTransferTimeline.Init(this, mTransferQueue, name + " Transfer Timeline");
+	mComputeTimeline.mTimeline = VK_NULL_HANDLE;
+	if (mComputeQueue != mGraphicsQueue)
+		mComputeTimeline.Init(this, mComputeQueue, name + " Compute Timeline");
 	#pragma endregion
 
 	#pragma region PipelineCache and DesriptorPool
@@ -203,11 +444,24 @@ Device::Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t p
 	#pragma endregion
 
 	vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &mMemoryProperties);
+	memset(mCategoryUsage, 0, sizeof(mCategoryUsage));
+	mHeapAllocated.resize(mMemoryProperties.memoryHeapCount);
+	mHeapExternalUsage.resize(mMemoryProperties.memoryHeapCount);
+	mHeapBudgets.resize(mMemoryProperties.memoryHeapCount);
+	CheckMemoryBudget(true);
+
+	mUploadManager = new ::UploadManager(this);
 }
 Device::~Device() {
 	Flush();
+	safe_delete(mUploadManager);
 	safe_delete_array(mFrameContexts);
+	vkDestroySemaphore(mDevice, mGraphicsTimeline.mTimeline, nullptr);
+	if (mTransferTimeline.mTimeline != VK_NULL_HANDLE) vkDestroySemaphore(mDevice, mTransferTimeline.mTimeline, nullptr);
+	if (mComputeTimeline.mTimeline != VK_NULL_HANDLE) vkDestroySemaphore(mDevice, mComputeTimeline.mTimeline, nullptr);
 	vkDestroyDescriptorPool(mDevice, mDescriptorPool, nullptr);
+	for (auto& kp : mDescriptorUpdateTemplates)
+		vkDestroyDescriptorUpdateTemplate(mDevice, kp.second.mTemplate, nullptr);
 
 	size_t size = 0;
 	vkGetPipelineCacheData(mDevice, mPipelineCache, &size, nullptr);
@@ -218,13 +472,13 @@ Device::~Device() {
 	delete[] cacheData;
 
 	vkDestroyPipelineCache(mDevice, mPipelineCache, nullptr);
-	for (auto& p : mCommandBuffers)
-		vkDestroyCommandPool(mDevice, p.first, nullptr);
+	for (auto& p : mSetupCommandPools)
+		vkDestroyCommandPool(mDevice, p.second, nullptr);
 	
-	for (auto kp : mMemoryAllocations) {
+	for (auto& kp : mMemoryAllocations) {
 		for (uint32_t i = 0; i < kp.second.size(); i++) {
-			for (auto it = kp.second[i].mAllocations.begin(); it != kp.second[i].mAllocations.begin(); it++)
-				fprintf_color(COLOR_RED, stderr, "Device memory leak detected. Tag: %s\n", it->mTag.c_str());
+			for (auto& t : kp.second[i].mTags)
+				fprintf_color(COLOR_RED, stderr, "Device memory leak detected. Tag: %s\n", t.second.c_str());
 			vkFreeMemory(mDevice, kp.second[i].mMemory, nullptr);
 		}
 	}
@@ -249,15 +503,15 @@ VkSampleCountFlagBits Device::GetMaxUsableSampleCount() {
 
 void Device::Flush() {
 	//vkDeviceWaitIdle(mDevice);
+	mUploadManager->Finish();
+	if (mTransferTimeline.mTimeline != VK_NULL_HANDLE) Wait(mTransferTimeline.mTimeline, mTransferTimeline.mLastValue);
+	if (mComputeTimeline.mTimeline != VK_NULL_HANDLE) Wait(mComputeTimeline.mTimeline, mComputeTimeline.mLastValue);
+	Wait(mGraphicsTimeline.mTimeline, mGraphicsTimeline.mLastValue);
 	lock_guard<mutex> lock(mCommandPoolMutex);
-	for (auto& p : mCommandBuffers) {
-		while (p.second.size()) {
-			p.second.front()->mSignalFence->Wait();
-			p.second.pop();
-		}
-	}
-	for (uint32_t i = 0; i < MaxFramesInFlight(); i++)
-		mFrameContexts[i].Reset();
+	mSetupCommandBuffers.clear();
+	if (mFrameContexts)
+		for (uint32_t i = 0; i < MaxFramesInFlight(); i++)
+			mFrameContexts[i].Reset();
 }
 
 void Device::SetObjectName(void* object, const string& name, VkObjectType type) const {
@@ -279,10 +533,10 @@ void Device::PrintAllocations() {
 	for (uint32_t i = 0; i < mMemoryProperties.memoryHeapCount; i++)
 		total += mMemoryProperties.memoryHeaps[i].size;
 
-	for (auto kp : mMemoryAllocations)
-		for (auto a : kp.second) {
+	for (auto& kp : mMemoryAllocations)
+		for (auto& a : kp.second) {
 			used += a.mSize;
-			for (auto av : a.mAvailable) available += av.second;
+			available += a.mAllocator.Available();
 		}
 
 	if (used == 0) {
@@ -302,93 +556,31 @@ void Device::PrintAllocations() {
 }
 
 bool Device::Allocation::SubAllocate(const VkMemoryRequirements& requirements, DeviceMemoryAllocation& allocation, const string& tag) {
-if (mAvailable.empty()) return false;
-
-	VkDeviceSize blockSize = 0;
-	VkDeviceSize memLocation = 0;
-	VkDeviceSize memSize = 0;
-
-	// find smallest block that can fit the allocation
-	auto block = mAvailable.end();
-	for (auto it = mAvailable.begin(); it != mAvailable.end(); it++) {
-		VkDeviceSize offset = it->first ? AlignUp(it->first, requirements.alignment) : 0;
-		VkDeviceSize blockEnd = AlignUp(offset + requirements.size, MEM_BLOCK_SIZE);
-
-		if (blockEnd > it->first + it->second) continue;
-
-		if (block == mAvailable.end() || it->second < block->second) {
-			memLocation = offset;
-			memSize = blockEnd - offset;
-			blockSize = blockEnd - it->first;
-			block = it;
-		}
-	}
-	if (block == mAvailable.end()) return false;
+	VkDeviceSize offset;
+	uint32_t block = mAllocator.Allocate(requirements.size, requirements.alignment, &offset);
+	if (block == TlsfAllocator::INVALID_BLOCK) return false;
 
 	allocation.mDeviceMemory = mMemory;
-	allocation.mOffset = memLocation;
-	allocation.mSize = memSize;
-	allocation.mMapped = ((uint8_t*)mMapped) + memLocation;
+	allocation.mOffset = offset;
+	allocation.mSize = mAllocator.BlockSize(block);
+	allocation.mAlignment = requirements.alignment;
+	allocation.mMapped = ((uint8_t*)mMapped) + offset;
 	allocation.mTag = tag;
+	allocation.mBlock = block;
 
-	if (block->second > blockSize) {
-		// still room left after this allocation, shift this block over
-		block->first += blockSize;
-		block->second -= blockSize;
-	} else
-		mAvailable.erase(block);
-
-	mAllocations.push_back(allocation);
+	mTags[block] = tag;
 
 	return true;
 }
 void Device::Allocation::Deallocate(const DeviceMemoryAllocation& allocation) {
 	if (allocation.mDeviceMemory != mMemory) return;
-
-	for (auto it = mAllocations.begin(); it != mAllocations.end(); it++)
-		if (it->mOffset == allocation.mOffset) {
-			mAllocations.erase(it);
-			break;
-		}
-
-	VkDeviceSize end = allocation.mOffset + allocation.mSize;
-
-	auto firstAfter = mAvailable.end();
-	auto startBlock = mAvailable.end();
-	auto endBlock = mAvailable.end();
-
-	for (auto it = mAvailable.begin(); it != mAvailable.end(); it++) {
-		if (it->first > allocation.mOffset && (firstAfter == mAvailable.end() || it->first < firstAfter->first)) firstAfter = it;
-
-		if (it->first == end)
-			endBlock = it;
-		if (it->first + it->second == allocation.mOffset)
-			startBlock = it;
-	}
-
-	if (startBlock == endBlock && startBlock != mAvailable.end()) throw; // this should NOT happen
-
-	// merge blocks
-
-	if (startBlock == mAvailable.end() && endBlock == mAvailable.end())
-		// block isn't adjacent to any other blocks
-		mAvailable.insert(firstAfter, make_pair(allocation.mOffset, allocation.mSize));
-	else if (startBlock == mAvailable.end()) {
-		//  --------     |---- allocation ----|---- endBlock ----|
-		endBlock->first = allocation.mOffset;
-		endBlock->second += allocation.mSize;
-	} else if (endBlock == mAvailable.end()) {
-		//  |---- startBlock ----|---- allocation ----|     --------
-		startBlock->second += allocation.mSize;
-	} else {
-		//  |---- startBlock ----|---- allocation ----|---- endBlock ----|
-		startBlock->second += allocation.mSize + endBlock->second;
-		mAvailable.erase(endBlock);
-	}
+	mAllocator.Free(allocation.mBlock);
+	mTags.erase(allocation.mBlock);
+	mRelocatable.erase(allocation.mBlock);
 }
 
-DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, const string& tag) {
-	lock_guard<mutex> lock(mMemoryMutex);
+DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear, const string& tag, MemoryCategory category) {
+	unique_lock<mutex> lock(mMemoryMutex);
 
 	int32_t memoryType = -1;
 	for (uint32_t i = 0; i < mMemoryProperties.memoryTypeCount; i++) {
@@ -404,12 +596,18 @@ DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requir
 
 	DeviceMemoryAllocation alloc = {};
 	alloc.mMemoryType = memoryType;
+	alloc.mCategory = category;
 
 	vector<Allocation>& allocations = mMemoryAllocations[memoryType];
 
+	// every block is aligned to TlsfAllocator::MIN_BLOCK_SIZE, so linear and optimal resources can only share a page if the granularity is larger
+	bool separateLinear = mLimits.bufferImageGranularity > TlsfAllocator::MIN_BLOCK_SIZE;
+
 	for (uint32_t i = 0; i < allocations.size(); i++)
-		if (allocations[i].SubAllocate(requirements, alloc, tag))
+		if ((!separateLinear || allocations[i].mLinear == linear) && allocations[i].SubAllocate(requirements, alloc, tag)) {
+			mCategoryUsage[category] += alloc.mSize;
 			return alloc;
+		}
 
 
 	// Failed to sub-allocate, make a new allocation
@@ -420,7 +618,7 @@ DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requir
 	VkMemoryAllocateInfo info = {};
 	info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
 	info.memoryTypeIndex = memoryType;
-	info.allocationSize = max((uint64_t)MEM_MIN_ALLOC, AlignUp(requirements.size, MEM_BLOCK_SIZE));
+	info.allocationSize = max((uint64_t)MEM_MIN_ALLOC, TlsfAllocator::MinimumSize(requirements.size, requirements.alignment));
 	if (VkResult err = vkAllocateMemory(mDevice, &info, nullptr, &allocation.mMemory)) {
 		VkDeviceSize deviceMemSize = 0;
 		for (uint32_t i = 0; i < mMemoryProperties.memoryHeapCount; i++)
@@ -445,8 +643,10 @@ DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requir
 		}
 	}
 	allocation.mSize = info.allocationSize;
-	allocation.mAvailable = { make_pair((VkDeviceSize)0, allocation.mSize) };
+	allocation.mLinear = linear;
+	allocation.mAllocator = TlsfAllocator(allocation.mSize);
 	mMemoryAllocationCount++;
+	mHeapAllocated[mMemoryProperties.memoryTypes[memoryType].heapIndex] += allocation.mSize;
 
 	if (mMemoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
 		mMemoryUsage += allocation.mSize;
@@ -458,6 +658,7 @@ DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requir
 		fprintf_color(COLOR_RED, stderr, "%s", "Failed to allocate memory\n");
 		throw;
 	}
+	mCategoryUsage[category] += alloc.mSize;
 
 	#ifdef PRINT_VK_ALLOCATIONS
 	if (info.allocationSize < 1024)
@@ -472,18 +673,24 @@ DeviceMemoryAllocation Device::AllocateMemory(const VkMemoryRequirements& requir
 	printf_color(COLOR_YELLOW, "\n");
 	#endif
 
+	lock.unlock();
+	CheckMemoryBudget(false);
 	return alloc;
 }
 void Device::FreeMemory(const DeviceMemoryAllocation& allocation) {
-	lock_guard<mutex> lock(mMemoryMutex);
+	unique_lock<mutex> lock(mMemoryMutex);
 
+	bool freed = false;
 	vector<Allocation>& allocations = mMemoryAllocations[allocation.mMemoryType];
 	for (auto it = allocations.begin(); it != allocations.end();){
 		if (it->mMemory == allocation.mDeviceMemory) {
 			it->Deallocate(allocation);
-			if (it->mAvailable.size() == 1 && it->mAvailable.begin()->second == it->mSize) {
+			mCategoryUsage[allocation.mCategory] -= allocation.mSize;
+			if (it->mAllocator.Empty()) {
 				vkFreeMemory(mDevice, it->mMemory, nullptr);
 				mMemoryAllocationCount--;
+				mHeapAllocated[mMemoryProperties.memoryTypes[allocation.mMemoryType].heapIndex] -= it->mSize;
+				freed = true;
 				if (mMemoryProperties.memoryTypes[allocation.mMemoryType].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
 					mMemoryUsage -= it->mSize;
 				#ifdef PRINT_VK_ALLOCATIONS
@@ -504,36 +711,271 @@ void Device::FreeMemory(const DeviceMemoryAllocation& allocation) {
 		}
 		it++;
 	}
+
+	lock.unlock();
+	if (freed) CheckMemoryBudget(false);
+}
+void Device::SetMemoryCategory(DeviceMemoryAllocation& allocation, MemoryCategory category) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	mCategoryUsage[allocation.mCategory] -= allocation.mSize;
+	mCategoryUsage[category] += allocation.mSize;
+	allocation.mCategory = category;
+}
+VkDeviceSize Device::MemoryCategoryUsage(MemoryCategory category) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	return mCategoryUsage[category];
 }
 
-shared_ptr<CommandBuffer> Device::GetCommandBuffer(const std::string& name) {
-	// get a commandpool for the current thread
-	lock_guard<mutex> lock(mCommandPoolMutex);
-	VkCommandPool& commandPool = mCommandPools[this_thread::get_id()];
-	if (!commandPool) {
-		VkCommandPoolCreateInfo poolInfo = {};
-		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-		poolInfo.queueFamilyIndex = mGraphicsQueueFamilyIndex;
-		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-		ThrowIfFailed(vkCreateCommandPool(mDevice, &poolInfo, nullptr, &commandPool), "vkCreateCommandPool failed");
-		SetObjectName(commandPool, name + " Graphics Command Pool", VK_OBJECT_TYPE_COMMAND_POOL);
+vector<MemoryHeapBudget> Device::GetMemoryBudget() {
+	lock_guard<mutex> lock(mMemoryMutex);
+	return mHeapBudgets;
+}
+uint32_t Device::AddMemoryBudgetCallback(float threshold, MemoryBudgetCallback callback) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	BudgetCallback c = {};
+	c.mId = mNextBudgetCallbackId++;
+	c.mThreshold = threshold;
+	c.mCallback = callback;
+	c.mOver = vector<bool>(mHeapBudgets.size(), false);
+	mBudgetCallbacks.push_back(c);
+	return c.mId;
+}
+void Device::RemoveMemoryBudgetCallback(uint32_t id) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	for (auto it = mBudgetCallbacks.begin(); it != mBudgetCallbacks.end(); it++)
+		if (it->mId == id) {
+			mBudgetCallbacks.erase(it);
+			return;
+		}
+}
+void Device::UpdateMemoryBudget() {
+	PROFILER_BEGIN("Update Memory Budget");
+	CheckMemoryBudget(true);
+	PROFILER_END;
+}
+void Device::CheckMemoryBudget(bool query) {
+	vector<function<void()>> calls;
+	{
+		lock_guard<mutex> lock(mMemoryMutex);
+
+		if (query && mMemoryBudgetSupported) {
+			VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+			budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+			VkPhysicalDeviceMemoryProperties2 properties = {};
+			properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+			properties.pNext = &budget;
+			vkGetPhysicalDeviceMemoryProperties2(mPhysicalDevice, &properties);
+			for (uint32_t i = 0; i < mHeapBudgets.size(); i++) {
+				mHeapExternalUsage[i] = budget.heapUsage[i] > mHeapAllocated[i] ? budget.heapUsage[i] - mHeapAllocated[i] : 0;
+				mHeapBudgets[i].mBudget = budget.heapBudget[i];
+			}
+		}
+
+		for (uint32_t i = 0; i < mHeapBudgets.size(); i++) {
+			MemoryHeapBudget& b = mHeapBudgets[i];
+			b.mSize = mMemoryProperties.memoryHeaps[i].size;
+			b.mDeviceLocal = mMemoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+			b.mUsage = mHeapExternalUsage[i] + mHeapAllocated[i];
+			if (!mMemoryBudgetSupported) b.mBudget = (VkDeviceSize)(b.mSize * MEMORY_BUDGET_FALLBACK);
+		}
+
+		for (BudgetCallback& c : mBudgetCallbacks)
+			for (uint32_t i = 0; i < mHeapBudgets.size(); i++) {
+				bool over = mHeapBudgets[i].mUsage > c.mThreshold * mHeapBudgets[i].mBudget;
+				if (over == c.mOver[i]) continue;
+				c.mOver[i] = over;
+				MemoryBudgetCallback callback = c.mCallback;
+				MemoryHeapBudget budget = mHeapBudgets[i];
+				calls.push_back([=]() { callback(i, budget, over); });
+			}
+	}
+	// called after unlocking, so the callbacks can free memory
+	for (const function<void()>& f : calls)
+		f();
+}
+
+void Device::SetRelocatable(const DeviceMemoryAllocation& allocation, Buffer* buffer) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	for (Allocation& a : mMemoryAllocations[allocation.mMemoryType])
+		if (a.mMemory == allocation.mDeviceMemory) {
+			a.mRelocatable[allocation.mBlock] = { buffer, nullptr };
+			return;
+		}
+}
+void Device::SetRelocatable(const DeviceMemoryAllocation& allocation, Texture* texture) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	for (Allocation& a : mMemoryAllocations[allocation.mMemoryType])
+		if (a.mMemory == allocation.mDeviceMemory) {
+			a.mRelocatable[allocation.mBlock] = { nullptr, texture };
+			return;
+		}
+}
+uint32_t Device::AddRelocationCallback(RelocationCallback callback) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	uint32_t id = mNextRelocationCallbackId++;
+	mRelocationCallbacks.push_back(make_pair(id, callback));
+	return id;
+}
+void Device::RemoveRelocationCallback(uint32_t id) {
+	lock_guard<mutex> lock(mMemoryMutex);
+	for (auto it = mRelocationCallbacks.begin(); it != mRelocationCallbacks.end(); it++)
+		if (it->first == id) {
+			mRelocationCallbacks.erase(it);
+			return;
+		}
+}
+void Device::Defragment(VkDeviceSize maxBytes, float maxMilliseconds) {
+	if (!mFrameContexts) return;
+	PROFILER_BEGIN("Defragment");
+	auto start = chrono::high_resolution_clock::now();
+	
+	shared_ptr<CommandBuffer> commandBuffer;
+	vector<function<void()>> calls;
+	{
+		lock_guard<mutex> lock(mMemoryMutex);
+
+		bool separateLinear = mLimits.bufferImageGranularity > TlsfAllocator::MIN_BLOCK_SIZE;
+		VkDeviceSize moved = 0;
+		bool done = false;
+
+		for (auto& kp : mMemoryAllocations) {
+			vector<Allocation>& allocations = kp.second;
+			if (allocations.size() < 2) continue;
+
+			// linear and optimal resources are kept in separate blocks, and are planned separately
+			for (uint32_t linear = 0; linear < (separateLinear ? 2u : 1u) && !done; linear++) {
+				vector<uint32_t> blockIndices;
+				vector<const TlsfAllocator*> blocks;
+				vector<DefragmentationPlanner::Allocation> relocatable;
+				// index in 'allocations' and block in its allocator of each relocatable allocation
+				vector<pair<uint32_t, uint32_t>> sources;
+				for (uint32_t i = 0; i < allocations.size(); i++) {
+					if (separateLinear && allocations[i].mLinear != (linear == 1)) continue;
+					for (auto& r : allocations[i].mRelocatable) {
+						// the upload's copies and ownership transfers may still be running on the transfer queue, and can't be ordered with the copy here
+						if ((r.second.mBuffer ? r.second.mBuffer->LastUpload() : r.second.mTexture->LastUpload()) > mUploadManager->CompletedToken()) continue;
+						const DeviceMemoryAllocation& memory = r.second.mBuffer ? r.second.mBuffer->Memory() : r.second.mTexture->Memory();
+						DefragmentationPlanner::Allocation a = {};
+						a.mBlock = (uint32_t)blocks.size();
+						a.mSize = memory.mSize;
+						a.mAlignment = memory.mAlignment;
+						relocatable.push_back(a);
+						sources.push_back(make_pair(i, r.first));
+					}
+					blockIndices.push_back(i);
+					blocks.push_back(&allocations[i].mAllocator);
+				}
+
+				vector<DefragmentationPlanner::Move> moves = DefragmentationPlanner::Plan(blocks, relocatable, maxBytes - moved, DEFRAG_MAX_OCCUPANCY);
+				for (const DefragmentationPlanner::Move& m : moves) {
+					if (chrono::duration<float, milli>(chrono::high_resolution_clock::now() - start).count() > maxMilliseconds) {
+						done = true;
+						break;
+					}
+
+					Allocation& src = allocations[sources[m.mAllocation].first];
+					Allocation& dst = allocations[blockIndices[m.mDstBlock]];
+					Relocatable resource = src.mRelocatable.at(sources[m.mAllocation].second);
+					DeviceMemoryAllocation old = resource.mBuffer ? resource.mBuffer->Memory() : resource.mTexture->Memory();
+
+					VkMemoryRequirements requirements = {};
+					requirements.size = old.mSize;
+					requirements.alignment = old.mAlignment;
+					requirements.memoryTypeBits = 1u << old.mMemoryType;
+					DeviceMemoryAllocation memory = {};
+					memory.mMemoryType = old.mMemoryType;
+					memory.mCategory = old.mCategory;
+					// the rest of the plan assumed this move succeeded, so it no longer matches the blocks. drop it, the next Defragment() plans again from the real state
+					if (!dst.SubAllocate(requirements, memory, old.mTag)) break;
+					mCategoryUsage[memory.mCategory] += memory.mSize;
+
+					if (!commandBuffer) {
+						commandBuffer = GetCommandBuffer("Defragment");
+						// the copies run on the graphics queue, after anything the compute queue might still be doing with the resources
+						if (mComputeTimeline.mTimeline != VK_NULL_HANDLE) {
+							lock_guard<mutex> computeLock(mComputeTimeline.mMutex);
+							if (mComputeTimeline.mLastValue) commandBuffer->AddWait(make_shared<Fence>(this, mComputeTimeline.mTimeline, mComputeTimeline.mLastValue));
+						}
+					}
+
+					// the old handles stay alive until the frames that might use them are done, and the old memory is freed along with them
+					RetiredResource retired = {};
+					retired.mMemory = old;
+					if (resource.mBuffer) {
+						retired.mBuffer = *resource.mBuffer;
+						retired.mBufferView = resource.mBuffer->View();
+						resource.mBuffer->Relocate(memory, commandBuffer.get());
+					} else {
+						retired.mImage = resource.mTexture->Image();
+						retired.mImageView = resource.mTexture->View();
+						resource.mTexture->Relocate(memory, commandBuffer.get());
+					}
+					CurrentFrameContext()->mRetiredResources.push_back(retired);
+					for (auto& c : mRelocationCallbacks) {
+						RelocationCallback callback = c.second;
+						calls.push_back([=]() { callback(resource.mBuffer, resource.mTexture); });
+					}
+
+					src.mRelocatable.erase(sources[m.mAllocation].second);
+					dst.mRelocatable[memory.mBlock] = resource;
+					moved += old.mSize;
+					mRelocationCount++;
+				}
+			}
+			if (done) break;
+		}
 	}
 
-	auto& commandBufferQueue = mCommandBuffers[commandPool];
+	if (commandBuffer) Execute(commandBuffer, false);
+	// called after unlocking, so the callbacks can create and free resources
+	for (const function<void()>& f : calls)
+		f();
+	PROFILER_END;
+}
 
+shared_ptr<CommandBuffer> Device::ReuseCommandBuffer(vector<shared_ptr<CommandBuffer>>& commandBuffers, uint32_t inUse, const string& name) {
+	for (uint32_t i = inUse; i < commandBuffers.size(); i++) {
+		// command buffers that are still held elsewhere, e.g. for their fence, keep their state until they are released
+		if (commandBuffers[i].use_count() > 1) continue;
+		swap(commandBuffers[i], commandBuffers[inUse]);
+		commandBuffers[inUse]->Clear(name);
+		return commandBuffers[inUse];
+	}
+	return nullptr;
+}
+shared_ptr<CommandBuffer> Device::GetCommandBuffer(const std::string& name) {
+	return GetCommandBuffer(name, mGraphicsQueueFamilyIndex);
+}
+shared_ptr<CommandBuffer> Device::GetComputeCommandBuffer(const std::string& name) {
+	return GetCommandBuffer(name, mComputeQueueFamilyIndex);
+}
+shared_ptr<CommandBuffer> Device::GetCommandBuffer(const std::string& name, uint32_t queueFamily) {
 	shared_ptr<CommandBuffer> commandBuffer;
-	// see if the command buffer at the front of the queue is done
-	if (commandBufferQueue.size()) {
-		commandBuffer = commandBufferQueue.front();
-		if (commandBuffer->mSignalFence->Signaled()) {
-			// reset and reuse the command buffer at the front of the queue
-			commandBufferQueue.pop();
-			commandBuffer->Reset(name);
-		} else
-			commandBuffer.reset();
+	if (mFrameContexts) {
+		CommandPool* pool = ThreadCommandPool(queueFamily);
+		commandBuffer = ReuseCommandBuffer(pool->mCommandBuffers, pool->mInUse, name);
+		if (!commandBuffer) {
+			commandBuffer = shared_ptr<CommandBuffer>(new CommandBuffer(this, pool->mCommandPool, queueFamily, name));
+			pool->mCommandBuffers.push_back(commandBuffer);
+			swap(pool->mCommandBuffers[pool->mInUse], pool->mCommandBuffers.back());
+			mCommandBufferCount++;
+		}
+		pool->mInUse++;
+		mCommandBuffersInUse++;
+	} else {
+		lock_guard<mutex> lock(mCommandPoolMutex);
+		VkCommandPool& commandPool = mSetupCommandPools[queueFamily];
+		if (!commandPool) {
+			VkCommandPoolCreateInfo poolInfo = {};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = queueFamily;
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+			ThrowIfFailed(vkCreateCommandPool(mDevice, &poolInfo, nullptr, &commandPool), "vkCreateCommandPool failed");
+			SetObjectName(commandPool, "Setup Command Pool", VK_OBJECT_TYPE_COMMAND_POOL);
+		}
+		commandBuffer = shared_ptr<CommandBuffer>(new CommandBuffer(this, commandPool, queueFamily, name));
+		mSetupCommandBuffers.push_back(commandBuffer);
 	}
-	
-	if (!commandBuffer) commandBuffer = shared_ptr<CommandBuffer>(new CommandBuffer(this, commandPool, name));
 
 	// begin recording commands
 	VkCommandBufferBeginInfo beginInfo = {};
@@ -543,39 +985,245 @@ shared_ptr<CommandBuffer> Device::GetCommandBuffer(const std::string& name) {
 
 	return commandBuffer;
 }
+shared_ptr<CommandBuffer> Device::GetSecondaryCommandBuffer(CommandBuffer* primary, const std::string& name) {
+	if (!mFrameContexts || !primary->mCurrentRenderPass) {
+		fprintf_color(COLOR_RED, stderr, "%s\n", "Error: Secondary command buffers need a frame context and a primary command buffer inside a render pass");
+		throw;
+	}
+	shared_ptr<CommandBuffer> commandBuffer;
+	CommandPool* pool = ThreadCommandPool(primary->mQueueFamilyIndex);
+	commandBuffer = ReuseCommandBuffer(pool->mSecondaryCommandBuffers, pool->mSecondaryInUse, name);
+	if (!commandBuffer) {
+		commandBuffer = shared_ptr<CommandBuffer>(new CommandBuffer(this, pool->mCommandPool, primary->mQueueFamilyIndex, name, VK_COMMAND_BUFFER_LEVEL_SECONDARY));
+		pool->mSecondaryCommandBuffers.push_back(commandBuffer);
+		swap(pool->mSecondaryCommandBuffers[pool->mSecondaryInUse], pool->mSecondaryCommandBuffers.back());
+		mCommandBufferCount++;
+	}
+	pool->mSecondaryInUse++;
+	mCommandBuffersInUse++;
+
+	VkCommandBufferInheritanceInfo inheritance = {};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.renderPass = *primary->mCurrentRenderPass;
+	inheritance.subpass = 0;
+	inheritance.framebuffer = primary->mCurrentFramebuffer;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.pInheritanceInfo = &inheritance;
+	ThrowIfFailed(vkBeginCommandBuffer(commandBuffer->mCommandBuffer, &beginInfo), "vkBeginCommandBuffer failed");
+	commandBuffer->mCurrentRenderPass = primary->mCurrentRenderPass;
+
+	return commandBuffer;
+}
 shared_ptr<Fence> Device::Execute(shared_ptr<CommandBuffer> commandBuffer, bool frameContext) {
+	mUploadManager->Flush();
 	lock_guard<mutex> lock(mCommandPoolMutex);
 	ThrowIfFailed(vkEndCommandBuffer(commandBuffer->mCommandBuffer), "vkEndCommandBuffer failed");
 
-	VkSemaphore semaphore = VK_NULL_HANDLE;
-	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-	if (frameContext) {		
-		CurrentFrameContext()->mFences.push_back(commandBuffer->mSignalFence);
+	QueueTimeline* queue = FamilyQueueTimeline(commandBuffer->mQueueFamilyIndex);
 
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+	if (frameContext && queue == &mGraphicsTimeline) {
+		// vkQueuePresentKHR can only wait on binary semaphores
 		if (!commandBuffer->mSignalSemaphore) {
 			commandBuffer->mSignalSemaphore = make_shared<Semaphore>(this);
 			SetObjectName(*commandBuffer->mSignalSemaphore, "CommandBuffer Semaphore", VK_OBJECT_TYPE_SEMAPHORE);
 		}
-		
 		semaphore = *commandBuffer->mSignalSemaphore;
-
 		CurrentFrameContext()->mSemaphores.push_back(commandBuffer->mSignalSemaphore);
 	}
 
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pWaitDstStageMask = semaphore ? &waitStage : nullptr;
-	submitInfo.signalSemaphoreCount = semaphore ? 1 : 0;
-	submitInfo.pSignalSemaphores = semaphore ? &semaphore : nullptr;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer->mCommandBuffer;
-	vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, *commandBuffer->mSignalFence);
-
-	// store the command buffer in the queue
-	mCommandBuffers[commandBuffer->mCommandPool].push(commandBuffer);
+	vector<pair<VkSemaphore, uint64_t>> waits;
+	for (const shared_ptr<Fence>& f : commandBuffer->mWaitFences)
+		// submissions to the same queue are already ordered
+		if (f->Timeline() != queue->mTimeline) waits.push_back(make_pair(f->Timeline(), f->Value()));
+
+	uint64_t value = Enqueue(queue, commandBuffer->mCommandBuffer, semaphore, waits);
+	commandBuffer->mSignalFence = make_shared<Fence>(this, queue->mTimeline, value);
+	if (mFrameContexts) {
+		// the frame context's command pools are reset once everything executed in it is done, whether the frame waits on it or not
+		FrameContext* frame = CurrentFrameContext();
+		if (queue == &mGraphicsTimeline)
+			frame->mTimelineValue = max(frame->mTimelineValue, value);
+		else
+			frame->mComputeTimelineValue = max(frame->mComputeTimelineValue, value);
+	}
 	return commandBuffer->mSignalFence;
 }
+shared_ptr<Fence> Device::GraphicsFence() {
+	lock_guard<mutex> lock(mGraphicsTimeline.mMutex);
+	return make_shared<Fence>(this, mGraphicsTimeline.mTimeline, mGraphicsTimeline.mLastValue);
+}
+void Device::SubmitPending() {
+	if (mTransferTimeline.mTimeline != VK_NULL_HANDLE) SubmitQueue(&mTransferTimeline);
+	if (mComputeTimeline.mTimeline != VK_NULL_HANDLE) SubmitQueue(&mComputeTimeline);
+	SubmitQueue(&mGraphicsTimeline);
+}
+
+uint64_t Device::Enqueue(QueueTimeline* queue, VkCommandBuffer commandBuffer, VkSemaphore signalSemaphore, const vector<pair<VkSemaphore, uint64_t>>& waits) {
+	lock_guard<mutex> lock(queue->mMutex);
+	Submission submission = {};
+	submission.mCommandBuffer = commandBuffer;
+	submission.mSignalValue = ++queue->mLastValue;
+	submission.mSignalSemaphore = signalSemaphore;
+	submission.mWaits = waits;
+	queue->mPending.push_back(submission);
+	return submission.mSignalValue;
+}
+void Device::SubmitQueue(QueueTimeline* queue, uint64_t value) {
+	lock_guard<mutex> lock(queue->mMutex);
+	if (queue->mPending.empty() || queue->mSubmittedValue >= value) return;
+
+	PROFILER_BEGIN("Submit");
+	size_t waitCount = 0;
+	for (const Submission& s : queue->mPending)
+		waitCount += s.mWaits.size();
+
+	// reserved up front, so that the pointers in the submit infos stay valid
+	vector<VkCommandBuffer> commandBuffers;
+	vector<VkSemaphore> waitSemaphores;
+	vector<uint64_t> waitValues;
+	vector<VkPipelineStageFlags> waitStages;
+	vector<VkSemaphore> signalSemaphores;
+	vector<uint64_t> signalValues;
+	vector<VkTimelineSemaphoreSubmitInfoKHR> timelineInfos;
+	vector<VkSubmitInfo> submitInfos;
+	commandBuffers.reserve(queue->mPending.size());
+	waitSemaphores.reserve(waitCount);
+	waitValues.reserve(waitCount);
+	waitStages.reserve(waitCount);
+	signalSemaphores.reserve(queue->mPending.size() * 2);
+	signalValues.reserve(queue->mPending.size() * 2);
+	timelineInfos.reserve(queue->mPending.size());
+	submitInfos.reserve(queue->mPending.size());
+
+	for (size_t i = 0; i < queue->mPending.size();) {
+		VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+		submitInfo.waitSemaphoreCount = (uint32_t)queue->mPending[i].mWaits.size();
+		submitInfo.pWaitSemaphores = waitSemaphores.data() + waitSemaphores.size();
+		submitInfo.pWaitDstStageMask = waitStages.data() + waitStages.size();
+		timelineInfo.waitSemaphoreValueCount = submitInfo.waitSemaphoreCount;
+		timelineInfo.pWaitSemaphoreValues = waitValues.data() + waitValues.size();
+		for (const auto& w : queue->mPending[i].mWaits) {
+			waitSemaphores.push_back(w.first);
+			waitValues.push_back(w.second);
+			waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		}
+
+		// consecutive command buffers share one batch until one waits on something, or signals a binary semaphore.
+		// only the last value in the batch is signaled, which is fine since waiting for a value is satisfied by any larger one
+		submitInfo.pCommandBuffers = commandBuffers.data() + commandBuffers.size();
+		do {
+			commandBuffers.push_back(queue->mPending[i].mCommandBuffer);
+			i++;
+		} while (i < queue->mPending.size() && queue->mPending[i].mWaits.empty() && queue->mPending[i - 1].mSignalSemaphore == VK_NULL_HANDLE);
+		submitInfo.commandBufferCount = (uint32_t)(commandBuffers.data() + commandBuffers.size() - submitInfo.pCommandBuffers);
+
+		submitInfo.pSignalSemaphores = signalSemaphores.data() + signalSemaphores.size();
+		timelineInfo.pSignalSemaphoreValues = signalValues.data() + signalValues.size();
+		signalSemaphores.push_back(queue->mTimeline);
+		signalValues.push_back(queue->mPending[i - 1].mSignalValue);
+		if (queue->mPending[i - 1].mSignalSemaphore != VK_NULL_HANDLE) {
+			signalSemaphores.push_back(queue->mPending[i - 1].mSignalSemaphore);
+			signalValues.push_back(0); // ignored for binary semaphores
+		}
+		submitInfo.signalSemaphoreCount = (uint32_t)(signalSemaphores.data() + signalSemaphores.size() - submitInfo.pSignalSemaphores);
+		timelineInfo.signalSemaphoreValueCount = submitInfo.signalSemaphoreCount;
+
+		timelineInfos.push_back(timelineInfo);
+		submitInfo.pNext = &timelineInfos.back();
+		submitInfos.push_back(submitInfo);
+	}
+
+	ThrowIfFailed(vkQueueSubmit(queue->mQueue, (uint32_t)submitInfos.size(), submitInfos.data(), VK_NULL_HANDLE), "vkQueueSubmit failed");
+	queue->mSubmittedValue = queue->mPending.back().mSignalValue;
+	queue->mPending.clear();
+	PROFILER_END;
+}
+Device::QueueTimeline* Device::FindQueueTimeline(VkSemaphore timeline) {
+	if (timeline == mTransferTimeline.mTimeline) return &mTransferTimeline;
+	if (timeline == mComputeTimeline.mTimeline) return &mComputeTimeline;
+	return &mGraphicsTimeline;
+}
+Device::QueueTimeline* Device::FamilyQueueTimeline(uint32_t queueFamily) {
+	if (queueFamily == mGraphicsQueueFamilyIndex) return &mGraphicsTimeline;
+	if (queueFamily == mComputeQueueFamilyIndex) return &mComputeTimeline;
+	return &mTransferTimeline;
+}
+void Device::Wait(VkSemaphore timeline, uint64_t value) {
+	if (value == 0 || CompletedValue(timeline) >= value) return;
+	QueueTimeline* queue = FindQueueTimeline(timeline);
+	bool submitted;
+	{
+		lock_guard<mutex> lock(queue->mMutex);
+		submitted = queue->mSubmittedValue >= value;
+	}
+	// the submissions may wait on other queues, so submit everything
+	if (!submitted) SubmitPending();
+
+	VkSemaphoreWaitInfoKHR waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &timeline;
+	waitInfo.pValues = &value;
+	ThrowIfFailed(WaitSemaphoresKHR(mDevice, &waitInfo, numeric_limits<uint64_t>::max()), "vkWaitSemaphores failed");
+}
+uint64_t Device::CompletedValue(VkSemaphore timeline) const {
+	uint64_t value;
+	ThrowIfFailed(GetSemaphoreCounterValueKHR(mDevice, timeline, &value), "vkGetSemaphoreCounterValue failed");
+	return value;
+}
+
+TempBufferRange Device::GetTempBufferRange(VkDeviceSize size, VkBufferUsageFlags usage) {
+	VkDeviceSize alignment = 16;
+	if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT)
+		alignment = max(alignment, mLimits.minUniformBufferOffsetAlignment);
+	if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+		alignment = max(alignment, mLimits.minStorageBufferOffsetAlignment);
+	if (usage & (VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT))
+		alignment = max(alignment, mLimits.minTexelBufferOffsetAlignment);
+
+	lock_guard<mutex> lock(mTmpBufferMutex);
+	FrameContext* frame = CurrentFrameContext();
+
+	if (!frame->mFrameBuffer) {
+		if (frame->mFrameBufferAllocator.Capacity() == 0) frame->mFrameBufferAllocator.Reset(FRAME_BUFFER_SIZE);
+		frame->mFrameBuffer = new Buffer("Frame Buffer " + to_string(mFrameContextIndex), this, frame->mFrameBufferAllocator.Capacity(), FRAME_BUFFER_USAGE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		frame->mFrameBuffer->SetMemoryCategory(MEMORY_CATEGORY_TEMP);
+	}
+
+	TempBufferRange range = {};
+	range.mSize = size;
+	if (frame->mFrameBufferAllocator.Allocate(size, alignment, &range.mOffset))
+		range.mBuffer = frame->mFrameBuffer;
+	else {
+		// didn't fit, use an overflow buffer for the rest of this frame
+		if (frame->mOverflowBuffers.empty() || !frame->mOverflowBuffers.back().second.Allocate(size, alignment, &range.mOffset)) {
+			VkDeviceSize capacity = max(frame->mFrameBufferAllocator.Capacity(), size);
+			frame->mOverflowBuffers.push_back(make_pair(
+				new Buffer("Frame Overflow Buffer " + to_string(mFrameContextIndex), this, capacity, FRAME_BUFFER_USAGE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT),
+				LinearAllocator(capacity)));
+			frame->mOverflowBuffers.back().first->SetMemoryCategory(MEMORY_CATEGORY_TEMP);
+			frame->mOverflowBuffers.back().second.Allocate(size, alignment, &range.mOffset);
+		}
+		range.mBuffer = frame->mOverflowBuffers.back().first;
+	}
+	range.mMapped = (uint8_t*)range.mBuffer->MappedData() + range.mOffset;
+	return range;
+}
+VkDeviceSize Device::TempBufferHighWaterMark() const {
+	VkDeviceSize h = 0;
+	if (mFrameContexts)
+		for (uint32_t i = 0; i < mInstance->MaxFramesInFlight(); i++)
+			h = max(h, mFrameContexts[i].mFrameBufferAllocator.HighWaterMark());
+	return h;
+}
 
 Buffer* Device::GetTempBuffer(const std::string& name, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties) {
 	lock_guard<mutex> lock(mTmpBufferMutex);
@@ -584,7 +1232,7 @@ Buffer* Device::GetTempBuffer(const std::string& name, VkDeviceSize size, VkBuff
 	auto closest = frame->mTempBuffers.end();
 	for (auto it = frame->mTempBuffers.begin(); it != frame->mTempBuffers.end(); it++) {
 		if (((it->first->Usage() & usage) == usage) && ((it->first->MemoryProperties() & properties) == properties) && it->first->Size() >= size) {
-			if (closest == frame->mTempBuffers.end() || it->first->Size() < it->first->Size())
+			if (closest == frame->mTempBuffers.end() || it->first->Size() < closest->first->Size())
 				closest = it;
 			if (it->first->Size() == size) break;
 		}
@@ -594,25 +1242,222 @@ Buffer* Device::GetTempBuffer(const std::string& name, VkDeviceSize size, VkBuff
 	if (closest != frame->mTempBuffers.end()) {
 		b = closest->first;
 		frame->mTempBuffers.erase(closest);
-	} else
+	} else {
 		b = new Buffer(name, this, size, usage, properties);
+		b->SetMemoryCategory(MEMORY_CATEGORY_TEMP);
+	}
 	frame->mTempBuffersInUse.push_back(b);
 	return b;
 }
-DescriptorSet* Device::GetTempDescriptorSet(const std::string& name, VkDescriptorSetLayout layout) {
-	lock_guard<mutex> lock(mTmpDescriptorSetMutex);
-	FrameContext* frame = CurrentFrameContext();
+VkDescriptorPool Device::CreateTempDescriptorPool(uint32_t maxSets) {
+	uint32_t count = maxSets * TEMP_DESCRIPTORS_PER_SET;
+	VkDescriptorPoolSize sizes[8] {
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,			count },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,			count },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER,		count },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,		count },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,	count },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,				count },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,				count },
+		{ VK_DESCRIPTOR_TYPE_SAMPLER,					count },
+	};
 
-	auto& sets = frame->mTempDescriptorSets[layout];
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 8;
+	poolInfo.pPoolSizes = sizes;
+	poolInfo.maxSets = maxSets;
+
+	VkDescriptorPool pool;
+	ThrowIfFailed(vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &pool), "vkCreateDescriptorPool failed");
+	SetObjectName(pool, "Temp Descriptor Pool", VK_OBJECT_TYPE_DESCRIPTOR_POOL);
+	return pool;
+}
+Device::DescriptorPool* Device::ThreadDescriptorPool() {
+	FrameContext* frame = CurrentFrameContext();
+	if (mCachedFrameContext != frame->mId) {
+		lock_guard<mutex> lock(frame->mDescriptorPoolsMutex);
+		mCachedDescriptorPool = &frame->mDescriptorPools[this_thread::get_id()];
+		mCachedFrameContext = frame->mId;
+	}
+	return mCachedDescriptorPool;
+}
+Device::CommandPool* Device::ThreadCommandPool(uint32_t queueFamily) {
+	FrameContext* frame = CurrentFrameContext();
+	if (mCachedCommandFrameContext != frame->mId) {
+		lock_guard<mutex> lock(frame->mCommandPoolsMutex);
+		mCachedCommandPools = &frame->mCommandPools[this_thread::get_id()];
+		mCachedCommandFrameContext = frame->mId;
+	}
+	CommandPool& pool = (*mCachedCommandPools)[queueFamily];
+	if (!pool.mCommandPool) {
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = queueFamily;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		ThrowIfFailed(vkCreateCommandPool(mDevice, &poolInfo, nullptr, &pool.mCommandPool), "vkCreateCommandPool failed");
+		SetObjectName(pool.mCommandPool, (queueFamily == mGraphicsQueueFamilyIndex ? "Graphics Command Pool " : "Compute Command Pool ") + to_string(mFrameContextIndex), VK_OBJECT_TYPE_COMMAND_POOL);
+	}
+	return &pool;
+}
+DescriptorSet* Device::GetTempDescriptorSet(const std::string& name, VkDescriptorSetLayout layout) {
+	DescriptorPool* pool = ThreadDescriptorPool();
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set;
+	while (true) {
+		bool created = false;
+		if (pool->mCurrentPool == pool->mPools.size()) {
+			// out of pools, add one as large as the others combined
+			uint32_t size = max((uint32_t)TEMP_DESCRIPTOR_POOL_SIZE, pool->mCapacity);
+			pool->mPools.push_back(CreateTempDescriptorPool(size));
+			pool->mCapacity += size;
+			created = true;
+		}
+		allocInfo.descriptorPool = pool->mPools[pool->mCurrentPool];
+		VkResult result = vkAllocateDescriptorSets(mDevice, &allocInfo, &set);
+		if (result == VK_SUCCESS) break;
+		if (created || (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL))
+			ThrowIfFailed(result, "vkAllocateDescriptorSets failed for " + name);
+		pool->mCurrentPool++;
+	}
 
 	DescriptorSet* ds;
-	if (sets.size()) {
-		auto front = sets.begin();
-		ds = front->first;
-		sets.erase(front);
+	if (pool->mFreeSets.size()) {
+		ds = pool->mFreeSets.back();
+		pool->mFreeSets.pop_back();
 	} else
-		ds = new DescriptorSet(name, this, layout);
+		ds = new DescriptorSet(this);
+	ds->Reset(name, layout, set, false);
 
-	frame->mTempDescriptorSetsInUse.push_back(ds);
+	pool->mSets.push_back(ds);
+	mDescriptorSetCount++;
 	return ds;
+}
+DescriptorSet* Device::GetCachedDescriptorSet(const std::string& name, VkDescriptorSetLayout layout) {
+	DescriptorPool* pool = ThreadDescriptorPool();
+	DescriptorSet* ds;
+	if (pool->mFreeSets.size()) {
+		ds = pool->mFreeSets.back();
+		pool->mFreeSets.pop_back();
+	} else
+		ds = new DescriptorSet(this);
+	// the descriptor set is assigned by FlushWrites(), and released when the frame context is reset
+	ds->Reset(name, layout, VK_NULL_HANDLE, true);
+	pool->mSets.push_back(ds);
+	return ds;
+}
+VkDescriptorUpdateTemplate Device::GetDescriptorUpdateTemplate(size_t key, VkDescriptorSetLayout layout, const vector<VkDescriptorUpdateTemplateEntry>& entries) {
+	lock_guard<mutex> lock(mDescriptorTemplateMutex);
+	auto range = mDescriptorUpdateTemplates.equal_range(key);
+	for (auto it = range.first; it != range.second; it++) {
+		const CachedDescriptorUpdateTemplate& t = it->second;
+		if (t.mLayout != layout || t.mEntries.size() != entries.size()) continue;
+		bool match = true;
+		for (uint32_t i = 0; i < entries.size() && match; i++)
+			match = t.mEntries[i].dstBinding == entries[i].dstBinding && t.mEntries[i].dstArrayElement == entries[i].dstArrayElement &&
+				t.mEntries[i].descriptorCount == entries[i].descriptorCount && t.mEntries[i].descriptorType == entries[i].descriptorType &&
+				t.mEntries[i].offset == entries[i].offset && t.mEntries[i].stride == entries[i].stride;
+		if (match) return t.mTemplate;
+	}
+
+	VkDescriptorUpdateTemplateCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+	info.descriptorUpdateEntryCount = (uint32_t)entries.size();
+	info.pDescriptorUpdateEntries = entries.data();
+	info.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+	info.descriptorSetLayout = layout;
+	CachedDescriptorUpdateTemplate t = {};
+	ThrowIfFailed(vkCreateDescriptorUpdateTemplate(mDevice, &info, nullptr, &t.mTemplate), "vkCreateDescriptorUpdateTemplate failed");
+	t.mLayout = layout;
+	t.mEntries = entries;
+	mDescriptorUpdateTemplates.emplace(key, t);
+	return t.mTemplate;
+}
+VkDescriptorSet Device::AcquireCachedDescriptorSet(size_t key, VkDescriptorSetLayout layout, VkDescriptorUpdateTemplate updateTemplate, const vector<DescriptorSet::DescriptorData>& data, const vector<uint64_t>& resources) {
+	lock_guard<mutex> lock(mDescriptorCacheMutex);
+	auto range = mDescriptorSetCache.equal_range(key);
+	for (auto it = range.first; it != range.second; it++) {
+		CachedDescriptorSet& c = it->second;
+		// the data's padding is zeroed by DescriptorSet::BuildTemplateData(), so it can be compared bytewise
+		if (c.mTemplate != updateTemplate || c.mData.size() != data.size() || c.mResources != resources) continue;
+		if (memcmp(c.mData.data(), data.data(), sizeof(DescriptorSet::DescriptorData) * data.size())) continue;
+		c.mReferences++;
+		mDescriptorCacheHitCount++;
+		return c.mDescriptorSet;
+	}
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = mDescriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+	CachedDescriptorSet c = {};
+	c.mReferences = 1;
+	c.mTemplate = updateTemplate;
+	c.mData = data;
+	c.mResources = resources;
+	{
+		lock_guard<mutex> poolLock(mDescriptorPoolMutex);
+		ThrowIfFailed(vkAllocateDescriptorSets(mDevice, &allocInfo, &c.mDescriptorSet), "vkAllocateDescriptorSets failed");
+	}
+	SetObjectName(c.mDescriptorSet, "Cached DescriptorSet", VK_OBJECT_TYPE_DESCRIPTOR_SET);
+	vkUpdateDescriptorSetWithTemplate(mDevice, c.mDescriptorSet, updateTemplate, data.data());
+	mDescriptorSetCount++;
+	mDescriptorWriteCount += (uint32_t)data.size();
+	return mDescriptorSetCache.emplace(key, move(c))->second.mDescriptorSet;
+}
+void Device::ReleaseCachedDescriptorSet(size_t key, VkDescriptorSet set) {
+	lock_guard<mutex> lock(mDescriptorCacheMutex);
+	auto range = mDescriptorSetCache.equal_range(key);
+	auto it = find_if(range.first, range.second, [&](const pair<const size_t, CachedDescriptorSet>& c) { return c.second.mDescriptorSet == set; });
+	if (it == range.second || --it->second.mReferences) return;
+	// frames in flight may still use the set. it is freed when the current frame context comes around again
+	mRetiredDescriptorSets.push_back(make_pair(mFrameContextIndex, it->second.mDescriptorSet));
+	mDescriptorSetCache.erase(it);
+}
+void Device::ReleaseThreadPools(const vector<thread::id>& threads) {
+	if (!mFrameContexts) return;
+	// the pools may still be in use by frames in flight, so they are destroyed when each frame context is reset
+	for (uint32_t i = 0; i < mInstance->MaxFramesInFlight(); i++) {
+		FrameContext& frame = mFrameContexts[i];
+		for (const thread::id& id : threads) {
+			{
+				lock_guard<mutex> lock(frame.mDescriptorPoolsMutex);
+				auto it = frame.mDescriptorPools.find(id);
+				if (it != frame.mDescriptorPools.end()) {
+					frame.mRetiredDescriptorPools.push_back(move(it->second));
+					frame.mDescriptorPools.erase(it);
+				}
+			}
+			{
+				lock_guard<mutex> lock(frame.mCommandPoolsMutex);
+				auto it = frame.mCommandPools.find(id);
+				if (it != frame.mCommandPools.end()) {
+					frame.mRetiredCommandPools.push_back(move(it->second));
+					frame.mCommandPools.erase(it);
+				}
+			}
+		}
+	}
+}
+vector<DescriptorPoolStats> Device::GetDescriptorPoolStats() {
+	vector<DescriptorPoolStats> stats;
+	if (!mFrameContexts) return stats;
+	for (uint32_t i = 0; i < mInstance->MaxFramesInFlight(); i++) {
+		lock_guard<mutex> lock(mFrameContexts[i].mDescriptorPoolsMutex);
+		for (auto& kp : mFrameContexts[i].mDescriptorPools) {
+			DescriptorPoolStats s = {};
+			s.mFrameContext = i;
+			s.mSetCount = kp.second.mLastSetCount;
+			s.mHighWaterMark = kp.second.mHighWaterMark;
+			s.mCapacity = kp.second.mCapacity;
+			stats.push_back(s);
+		}
+	}
+	return stats;
 }
\ No newline at end of file
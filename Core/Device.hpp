@@ -1,25 +1,91 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <list>
 #include <utility>
 
 #include <Core/DescriptorSet.hpp>
 #include <Core/CommandBuffer.hpp>
 #include <Core/Instance.hpp>
+#include <Core/UploadManager.hpp>
+#include <Util/LinearAllocator.hpp>
+#include <Util/TlsfAllocator.hpp>
 #include <Util/Util.hpp>
 
 class CommandBuffer;
 class Fence;
+class Texture;
 class Window;
 
+// What device memory is used for, for per-category accounting
+enum MemoryCategory {
+	MEMORY_CATEGORY_OTHER,
+	MEMORY_CATEGORY_MESH,
+	MEMORY_CATEGORY_TEXTURE,
+	MEMORY_CATEGORY_VOLUME,
+	MEMORY_CATEGORY_RENDER_TARGET,
+	MEMORY_CATEGORY_SHADOW,
+	MEMORY_CATEGORY_TEMP,
+	MEMORY_CATEGORY_GUI,
+	MEMORY_CATEGORY_COUNT
+};
+inline const char* MemoryCategoryToString(MemoryCategory category) {
+	switch (category) {
+	case MEMORY_CATEGORY_OTHER: return "Other";
+	case MEMORY_CATEGORY_MESH: return "Meshes";
+	case MEMORY_CATEGORY_TEXTURE: return "Textures";
+	case MEMORY_CATEGORY_VOLUME: return "Volumes";
+	case MEMORY_CATEGORY_RENDER_TARGET: return "Render Targets";
+	case MEMORY_CATEGORY_SHADOW: return "Shadows";
+	case MEMORY_CATEGORY_TEMP: return "Temporary";
+	case MEMORY_CATEGORY_GUI: return "GUI";
+	default: return "";
+	}
+}
+
+// Usage of one memory heap, against the budget the driver gives this process
+struct MemoryHeapBudget {
+	VkDeviceSize mUsage;
+	VkDeviceSize mBudget;
+	VkDeviceSize mSize;
+	bool mDeviceLocal;
+};
+// Called when a heap's usage goes over or back under a fraction of its budget
+typedef std::function<void(uint32_t heap, const MemoryHeapBudget& budget, bool over)> MemoryBudgetCallback;
+// Called with the buffer or texture that Device::Defragment() moved, the other is nullptr
+typedef std::function<void(Buffer* buffer, Texture* texture)> RelocationCallback;
+
 // Represents a usable region of device memory
 struct DeviceMemoryAllocation {
 	VkDeviceMemory mDeviceMemory;
 	VkDeviceSize mOffset;
 	VkDeviceSize mSize;
 	uint32_t mMemoryType;
+	VkDeviceSize mAlignment;
 	void* mMapped;
 	std::string mTag;
+	MemoryCategory mCategory;
+	// handle of the block in the allocator it was sub-allocated from
+	uint32_t mBlock;
+};
+
+// A range of a host-visible, persistently mapped buffer, valid for the current frame only
+struct TempBufferRange {
+	Buffer* mBuffer;
+	VkDeviceSize mOffset;
+	VkDeviceSize mSize;
+	void* mMapped;
+};
+
+// Usage of one thread's temporary descriptor pools in one frame context
+struct DescriptorPoolStats {
+	uint32_t mFrameContext;
+	// sets allocated the last time the frame context was used
+	uint32_t mSetCount;
+	uint32_t mHighWaterMark;
+	// sets that fit in the pools without growing them
+	uint32_t mCapacity;
 };
 
 class Device {
@@ -29,17 +95,75 @@ public:
 	ENGINE_EXPORT static bool FindQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface, uint32_t& graphicsFamily, uint32_t& presentFamily);
 
 	// Allocate device memory. Will attempt to sub-allocate from larger allocations. If the 'properties' contains VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, the memory will be mapped.
-	ENGINE_EXPORT DeviceMemoryAllocation AllocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, const std::string& tag);
+	// 'linear' should be true for buffers and linear images, and false for optimal images, so they can be kept apart according to bufferImageGranularity
+	ENGINE_EXPORT DeviceMemoryAllocation AllocateMemory(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear, const std::string& tag, MemoryCategory category = MEMORY_CATEGORY_OTHER);
 	ENGINE_EXPORT void FreeMemory(const DeviceMemoryAllocation& allocation);
+	// Counts 'allocation' towards 'category' instead of the category it was allocated with
+	ENGINE_EXPORT void SetMemoryCategory(DeviceMemoryAllocation& allocation, MemoryCategory category);
+	// Bytes sub-allocated for 'category', in all memory types
+	ENGINE_EXPORT VkDeviceSize MemoryCategoryUsage(MemoryCategory category);
+	// Usage and budget of each memory heap. With VK_EXT_memory_budget, these are the driver's figures from the start of the frame, plus what this device allocated since.
+	// Otherwise, the usage is what this device allocated, and the budget is a fixed fraction of the heap
+	ENGINE_EXPORT std::vector<MemoryHeapBudget> GetMemoryBudget();
+	// Calls 'callback' when a heap's usage goes over 'threshold' times its budget, and again when it goes back under. Callbacks are called without any locks held,
+	// so they can free memory. Returns an id for RemoveMemoryBudgetCallback()
+	ENGINE_EXPORT uint32_t AddMemoryBudgetCallback(float threshold, MemoryBudgetCallback callback);
+	ENGINE_EXPORT void RemoveMemoryBudgetCallback(uint32_t id);
+	// Queries the heap budgets from the driver, if VK_EXT_memory_budget is supported, and calls the budget callbacks. Called by the Instance at the start of each frame
+	ENGINE_EXPORT void UpdateMemoryBudget();
+	// Lets Defragment() move a buffer or texture that is bound to 'allocation', until the allocation is freed
+	ENGINE_EXPORT void SetRelocatable(const DeviceMemoryAllocation& allocation, Buffer* buffer);
+	ENGINE_EXPORT void SetRelocatable(const DeviceMemoryAllocation& allocation, Texture* texture);
+	// Calls 'callback' for each buffer or texture that Defragment() moves, once it has new handles. Descriptor sets that are kept across frames
+	// and aren't re-written every time they are used should re-write their descriptors of the resource. Returns an id for RemoveRelocationCallback()
+	ENGINE_EXPORT uint32_t AddRelocationCallback(RelocationCallback callback);
+	ENGINE_EXPORT void RemoveRelocationCallback(uint32_t id);
+	// Moves relocatable buffers and textures out of sparsely used memory blocks with GPU copies, so that the blocks can be freed.
+	// Stops after moving 'maxBytes' or spending 'maxMilliseconds', and continues where it left off the next time. Called by the Instance at the start of each frame.
+	// Resources with UploadManager uploads that haven't finished are left where they are, and the copies wait for the compute queue's last submission.
+	// Relocatable resources shouldn't be uploaded to from other threads while this runs, since those uploads could be ordered before the copy
+	ENGINE_EXPORT void Defragment(VkDeviceSize maxBytes = 64 * 1024 * 1024, float maxMilliseconds = 1.f);
 	
+	// Get a range of a host-visible buffer, valid for the current frame only. The offset is aligned for the given usage.
+	// Ranges are bump-allocated from one buffer per frame context, which grows to fit the largest frame seen.
+	ENGINE_EXPORT TempBufferRange GetTempBufferRange(VkDeviceSize size, VkBufferUsageFlags usage);
 	// Get a one-time-use buffer, valid for the current frame only. These buffers are pooled and possibly re-used in the future.
+	// Prefer GetTempBufferRange() for host-visible data.
 	ENGINE_EXPORT Buffer* GetTempBuffer(const std::string& name, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
-	// Get a one-time-use descriptor set, valid for the current frame only. These descriptor sets are pooled and possibly re-used in the future.
+	// Get a one-time-use descriptor set, valid for the current frame only.
+	// Each thread allocates from its own pools in each frame context, which are reset in bulk when the frame context is reset, so this doesn't lock.
 	ENGINE_EXPORT DescriptorSet* GetTempDescriptorSet(const std::string& name, VkDescriptorSetLayout layout);
+	// Get a one-time-use descriptor set, valid for the current frame only, whose descriptors are looked up in a cache by FlushWrites() instead of being written.
+	// Sets with identical layouts and descriptors share one VkDescriptorSet, which stays alive while any DescriptorSet uses it
+	ENGINE_EXPORT DescriptorSet* GetCachedDescriptorSet(const std::string& name, VkDescriptorSetLayout layout);
+	ENGINE_EXPORT std::vector<DescriptorPoolStats> GetDescriptorPoolStats();
+	// Frees the descriptor and command pools of threads that have exited, once the frames in flight are done with them.
+	// Otherwise a thread's pools are kept until the device is destroyed
+	ENGINE_EXPORT void ReleaseThreadPools(const std::vector<std::thread::id>& threads);
+	// A unique id for a new Buffer, Texture or Sampler. Unlike their Vulkan handles, ids aren't re-used once a resource is destroyed
+	inline uint64_t NextResourceId() { return mNextResourceId++; }
 
+	// Get a command buffer, valid for the current frame only. Its commands are reset with the frame context's pool, but it isn't re-used while a reference to it is held.
+	// Each thread allocates from its own command pools in each frame context, which are reset in bulk once the frame context's work is done, so this doesn't lock.
 	ENGINE_EXPORT std::shared_ptr<CommandBuffer> GetCommandBuffer(const std::string& name = "Command Buffer");
+	// Get a command buffer for the compute queue, which runs alongside the graphics queue if the device has a compute-only queue family.
+	// Otherwise this is a graphics command buffer. Either way, command buffers that use its results should AddWait() on the fence Execute() returns for it
+	ENGINE_EXPORT std::shared_ptr<CommandBuffer> GetComputeCommandBuffer(const std::string& name = "Compute Command Buffer");
+	// Get a secondary command buffer that continues 'primary's current render pass, valid for the current frame only.
+	// Like GetCommandBuffer(), it comes from the calling thread's pool, so threads can record secondaries for the same primary at once. Record it on one thread, and pass it to primary->Execute()
+	ENGINE_EXPORT std::shared_ptr<CommandBuffer> GetSecondaryCommandBuffer(CommandBuffer* primary, const std::string& name = "Secondary Command Buffer");
 	// Execute a command buffer. If 'frameContext' is true, then the current frame will wait on this command buffer to finish before presenting.
+	// Pending uploads are submitted first, so the command buffer can use anything uploaded before it was executed. Compute command buffers go to the compute queue.
+	// The command buffer is queued, and submitted along with everything else queued by SubmitPending(), which is called before presenting, or when waiting on the returned fence
 	ENGINE_EXPORT std::shared_ptr<Fence> Execute(std::shared_ptr<CommandBuffer> commandBuffer, bool frameContext = true);
+	// A fence that signals when every command buffer executed on the graphics queue so far is done
+	ENGINE_EXPORT std::shared_ptr<Fence> GraphicsFence();
+	// Submits the command buffers queued by Execute(), with one vkQueueSubmit per queue
+	ENGINE_EXPORT void SubmitPending();
+	// Waits for a queue's timeline semaphore to reach 'value', submitting the queued work before it first
+	ENGINE_EXPORT void Wait(VkSemaphore timeline, uint64_t value);
+	// The value of a queue's timeline semaphore, which is the value of the last submission to the queue that finished
+	ENGINE_EXPORT uint64_t CompletedValue(VkSemaphore timeline) const;
 	// Finish all work being done on this device
 	ENGINE_EXPORT void Flush();
 
@@ -52,14 +176,43 @@ public:
 	
 	inline VkQueue GraphicsQueue() const { return mGraphicsQueue; };
 	inline VkQueue PresentQueue() const { return mPresentQueue; };
+	// A queue from a transfer-only family if the device has one, otherwise the graphics queue
+	inline VkQueue TransferQueue() const { return mTransferQueue; };
 	inline uint32_t GraphicsQueueIndex() const { return mGraphicsQueueIndex; };
 	inline uint32_t PresentQueueIndex() const { return mPresentQueueIndex; };
 	inline uint32_t GraphicsQueueFamilyIndex() const { return mGraphicsQueueFamilyIndex; };
 	inline uint32_t PresentQueueFamilyIndex() const { return mPresentQueueFamilyIndex; };
+	inline uint32_t TransferQueueFamilyIndex() const { return mTransferQueueFamilyIndex; };
+	// Timeline semaphores that count the submissions to each queue that have finished
+	inline VkSemaphore GraphicsTimeline() const { return mGraphicsTimeline.mTimeline; };
+	inline VkSemaphore TransferTimeline() const { return mTransferTimeline.mTimeline ? mTransferTimeline.mTimeline : mGraphicsTimeline.mTimeline; };
+	inline VkSemaphore ComputeTimeline() const { return mComputeTimeline.mTimeline ? mComputeTimeline.mTimeline : mGraphicsTimeline.mTimeline; };
+	// A queue from a compute-only family if the device has one, otherwise the graphics queue
+	inline VkQueue ComputeQueue() const { return mComputeQueue; };
+	inline uint32_t ComputeQueueFamilyIndex() const { return mComputeQueueFamilyIndex; };
+	// The distinct families of the graphics, compute and transfer queues, which buffers that are shared between the queues are created with
+	inline const std::vector<uint32_t>& QueueFamilyIndices() const { return mQueueFamilyIndices; };
+
+	inline ::UploadManager* UploadManager() const { return mUploadManager; }
 
 	inline uint32_t DescriptorSetCount() const { return mDescriptorSetCount; };
+	// Command buffers handed out by GetCommandBuffer() whose frame contexts haven't been reset yet
+	inline uint32_t CommandBuffersInUse() const { return mCommandBuffersInUse; };
+	// Command buffers allocated from all frame contexts' command pools
+	inline uint32_t CommandBufferCount() const { return mCommandBufferCount; };
+	// Most command buffers used by one thread for one queue family in a single frame
+	inline uint32_t CommandBufferHighWaterMark() const { return mCommandBufferHighWaterMark; };
+	// Descriptors written by DescriptorSet::FlushWrites() since the device was created
+	inline uint64_t DescriptorWriteCount() const { return mDescriptorWriteCount; };
+	// Cached descriptor sets that were found in the cache instead of being written, since the device was created
+	inline uint64_t DescriptorCacheHitCount() const { return mDescriptorCacheHitCount; };
 	inline uint32_t MemoryAllocationCount() const { return mMemoryAllocationCount; };
 	inline VkDeviceSize MemoryUsage() const { return mMemoryUsage; };
+	// Buffers and textures moved by Defragment() since the device was created.
+	// Anything that keeps descriptors of buffers or textures across frames should write them again when this changes
+	inline uint64_t RelocationCount() const { return mRelocationCount; };
+	// Most bytes of GetTempBufferRange() used by a single frame
+	ENGINE_EXPORT VkDeviceSize TempBufferHighWaterMark() const;
 	inline const VkPhysicalDeviceMemoryProperties& MemoryProperties() const { return mMemoryProperties; }
 
 	inline uint32_t MaxFramesInFlight() const { return mInstance->MaxFramesInFlight(); }
@@ -72,19 +225,126 @@ public:
 	inline operator VkDevice() const { return mDevice; }
 
 private:
+	// Allocates one thread's temporary descriptor sets in one frame context
+	struct DescriptorPool {
+		// another pool is added when the last one runs out, then they are replaced with one large pool at the next reset
+		std::vector<VkDescriptorPool> mPools;
+		uint32_t mCurrentPool;
+		uint32_t mCapacity;
+
+		// sets allocated since the last reset
+		std::vector<DescriptorSet*> mSets;
+		// sets to re-use after a reset
+		std::vector<DescriptorSet*> mFreeSets;
+		// cached sets used the last time the frame context was used, released at the next reset instead,
+		// so that sets which are used every time the frame context comes around stay in the cache
+		std::vector<std::pair<size_t, VkDescriptorSet>> mCacheKeys;
+
+		uint32_t mLastSetCount;
+		uint32_t mHighWaterMark;
+
+		inline DescriptorPool() : mPools({}), mCurrentPool(0), mCapacity(0), mSets({}), mFreeSets({}), mCacheKeys({}), mLastSetCount(0), mHighWaterMark(0) {}
+	};
+	// Allocates one thread's command buffers for one queue family in one frame context
+	struct CommandPool {
+		VkCommandPool mCommandPool;
+		// every command buffer allocated from the pool. the first mInUse have been handed out since the last reset, the rest are re-used next,
+		// unless something still holds a reference to them
+		std::vector<std::shared_ptr<CommandBuffer>> mCommandBuffers;
+		uint32_t mInUse;
+		// secondary command buffers, handed out and re-used the same way
+		std::vector<std::shared_ptr<CommandBuffer>> mSecondaryCommandBuffers;
+		uint32_t mSecondaryInUse;
+
+		inline CommandPool() : mCommandPool(VK_NULL_HANDLE), mCommandBuffers({}), mInUse(0), mSecondaryCommandBuffers({}), mSecondaryInUse(0) {}
+	};
+	// A buffer or texture that Defragment() can move
+	struct Relocatable {
+		Buffer* mBuffer;
+		Texture* mTexture;
+	};
+	// The handles and memory of a buffer or texture that Defragment() moved, destroyed when the frame context that copied it is reset
+	struct RetiredResource {
+		VkBuffer mBuffer;
+		VkBufferView mBufferView;
+		VkImage mImage;
+		VkImageView mImageView;
+		DeviceMemoryAllocation mMemory;
+	};
+	struct BudgetCallback {
+		uint32_t mId;
+		float mThreshold;
+		MemoryBudgetCallback mCallback;
+		// whether each heap was over the threshold the last time it was checked
+		std::vector<bool> mOver;
+	};
+	struct CachedDescriptorSet {
+		VkDescriptorSet mDescriptorSet;
+		uint32_t mReferences;
+		// what the set was written with, compared on lookup since different descriptors can hash to the same key
+		VkDescriptorUpdateTemplate mTemplate;
+		std::vector<DescriptorSet::DescriptorData> mData;
+		std::vector<uint64_t> mResources;
+	};
+	struct CachedDescriptorUpdateTemplate {
+		VkDescriptorUpdateTemplate mTemplate;
+		VkDescriptorSetLayout mLayout;
+		std::vector<VkDescriptorUpdateTemplateEntry> mEntries;
+	};
+	// A command buffer waiting to be submitted by SubmitQueue()
+	struct Submission {
+		VkCommandBuffer mCommandBuffer;
+		// value the queue's timeline semaphore is set to when the command buffer finishes
+		uint64_t mSignalValue;
+		// binary semaphore to signal as well, for vkQueuePresentKHR
+		VkSemaphore mSignalSemaphore;
+		// timeline semaphores of other queues, and the values to wait for
+		std::vector<std::pair<VkSemaphore, uint64_t>> mWaits;
+	};
+	// A queue, and a timeline semaphore that is set to the value of each submission to it when the submission finishes
+	struct QueueTimeline {
+		VkQueue mQueue;
+		VkSemaphore mTimeline;
+		// value of the last submission, queued or not
+		uint64_t mLastValue;
+		// value of the last submission passed to vkQueueSubmit
+		uint64_t mSubmittedValue;
+		std::vector<Submission> mPending;
+		// guards the queue itself as well
+		std::mutex mMutex;
+
+		ENGINE_EXPORT void Init(Device* device, VkQueue queue, const std::string& name);
+	};
 	struct FrameContext {
 		std::vector<std::shared_ptr<Semaphore>> mSemaphores; // semaphores that signal when this frame is done
-		std::vector<std::shared_ptr<Fence>> mFences; // fences that signal when this frame is done
+		uint64_t mTimelineValue; // value of the graphics timeline when this frame is done
+		uint64_t mComputeTimelineValue; // value of the compute timeline when this frame is done, if there is a compute queue
 		
 		std::list<std::pair<Buffer*, uint32_t>> mTempBuffers;
-		std::unordered_map<VkDescriptorSetLayout, std::list<std::pair<DescriptorSet*, uint32_t>>> mTempDescriptorSets;
-
 		std::vector<Buffer*> mTempBuffersInUse;
-		std::vector<DescriptorSet*> mTempDescriptorSetsInUse;
+		std::vector<RetiredResource> mRetiredResources;
+
+		// unique id, to tell frame contexts apart in mCachedFrameContext
+		uint64_t mId;
+		std::unordered_map<std::thread::id, DescriptorPool> mDescriptorPools;
+		// only locked to find or add a thread's pool
+		std::mutex mDescriptorPoolsMutex;
+		// each thread's command pool for each queue family
+		std::unordered_map<std::thread::id, std::unordered_map<uint32_t, CommandPool>> mCommandPools;
+		std::mutex mCommandPoolsMutex;
+		// pools of threads passed to ReleaseThreadPools(), destroyed at the next reset
+		std::vector<DescriptorPool> mRetiredDescriptorPools;
+		std::vector<std::unordered_map<uint32_t, CommandPool>> mRetiredCommandPools;
+
+		// persistently mapped buffer that GetTempBufferRange() allocates from
+		Buffer* mFrameBuffer;
+		LinearAllocator mFrameBufferAllocator;
+		// buffers for ranges that didn't fit in mFrameBuffer, deleted when mFrameBuffer grows at the next reset
+		std::vector<std::pair<Buffer*, LinearAllocator>> mOverflowBuffers;
 
 		Device* mDevice;
 
-		inline FrameContext() : mFences({}), mSemaphores({}), mTempBuffers({}), mTempDescriptorSets({}), mTempBuffersInUse({}), mTempDescriptorSetsInUse({}) {};
+		ENGINE_EXPORT FrameContext();
 		ENGINE_EXPORT ~FrameContext();
 		ENGINE_EXPORT void Reset();
 	};
@@ -92,9 +352,13 @@ private:
 		void* mMapped;
 		VkDeviceMemory mMemory;
 		VkDeviceSize mSize;
-		// <offset, size>
-		std::list<std::pair<VkDeviceSize, VkDeviceSize>> mAvailable;
-		std::list<DeviceMemoryAllocation> mAllocations;
+		// whether this holds linear resources, only used when bufferImageGranularity is larger than TlsfAllocator::MIN_BLOCK_SIZE
+		bool mLinear;
+		TlsfAllocator mAllocator;
+		// tags of the live sub-allocations, by block
+		std::unordered_map<uint32_t, std::string> mTags;
+		// sub-allocations that Defragment() can move, by block
+		std::unordered_map<uint32_t, Relocatable> mRelocatable;
 
 		ENGINE_EXPORT bool SubAllocate(const VkMemoryRequirements& requirements, DeviceMemoryAllocation& allocation, const std::string& tag);
 		ENGINE_EXPORT void Deallocate(const DeviceMemoryAllocation& allocation);
@@ -103,18 +367,62 @@ private:
 	friend class DescriptorSet;
 	friend class CommandBuffer;
 	friend class ::Instance;
+	friend class ::UploadManager;
 	ENGINE_EXPORT Device(::Instance* instance, VkPhysicalDevice physicalDevice, uint32_t physicalDeviceIndex, uint32_t graphicsQueue, uint32_t presentQueue, const std::set<std::string>& deviceExtensions, std::vector<const char*> validationLayers);
 	
 	ENGINE_EXPORT void PrintAllocations();
+	// Calls the budget callbacks of the heaps that crossed their thresholds. If 'query' is true, the budgets are queried from the driver first
+	ENGINE_EXPORT void CheckMemoryBudget(bool query);
+	ENGINE_EXPORT VkDescriptorPool CreateTempDescriptorPool(uint32_t maxSets);
+	// The calling thread's descriptor pool in the current frame context
+	ENGINE_EXPORT DescriptorPool* ThreadDescriptorPool();
+	// The calling thread's command pool for 'queueFamily' in the current frame context
+	ENGINE_EXPORT CommandPool* ThreadCommandPool(uint32_t queueFamily);
+	// Finds or creates the template that writes 'entries' to sets with 'layout'. 'key' is a hash of the layout and entries
+	ENGINE_EXPORT VkDescriptorUpdateTemplate GetDescriptorUpdateTemplate(size_t key, VkDescriptorSetLayout layout, const std::vector<VkDescriptorUpdateTemplateEntry>& entries);
+	// Finds the cached set written by 'updateTemplate' with 'data', or allocates and writes one, and adds a reference to it.
+	// 'resources' are the ResourceId() of each descriptor's resource, and 'key' is a hash of the template, data and resources
+	ENGINE_EXPORT VkDescriptorSet AcquireCachedDescriptorSet(size_t key, VkDescriptorSetLayout layout, VkDescriptorUpdateTemplate updateTemplate, const std::vector<DescriptorSet::DescriptorData>& data, const std::vector<uint64_t>& resources);
+	// Removes a reference to the cached set 'set', which was acquired with 'key'. Unreferenced sets are freed once the frames that might use them are done
+	ENGINE_EXPORT void ReleaseCachedDescriptorSet(size_t key, VkDescriptorSet set);
 	inline FrameContext* CurrentFrameContext() { return &mFrameContexts[mFrameContextIndex]; }
+	// Queues a command buffer to be submitted to 'queue', after the ones queued before it. Returns the value the queue's timeline is set to when it finishes
+	ENGINE_EXPORT uint64_t Enqueue(QueueTimeline* queue, VkCommandBuffer commandBuffer, VkSemaphore signalSemaphore = VK_NULL_HANDLE, const std::vector<std::pair<VkSemaphore, uint64_t>>& waits = {});
+	// Submits the command buffers queued on 'queue' in one vkQueueSubmit, unless every submission up to 'value' has been submitted already.
+	// Submissions can wait on values queued on other queues, as long as those are submitted as well, which SubmitPending() and Wait() take care of
+	ENGINE_EXPORT void SubmitQueue(QueueTimeline* queue, uint64_t value = ~0ull);
+	ENGINE_EXPORT QueueTimeline* FindQueueTimeline(VkSemaphore timeline);
+	// The timeline of the queue that command buffers from 'queueFamily' are submitted to
+	ENGINE_EXPORT QueueTimeline* FamilyQueueTimeline(uint32_t queueFamily);
+	ENGINE_EXPORT std::shared_ptr<CommandBuffer> GetCommandBuffer(const std::string& name, uint32_t queueFamily);
+	// Moves the first command buffer after the first 'inUse' that isn't referenced anywhere else to index 'inUse' and clears it, or returns nullptr if there is none
+	ENGINE_EXPORT std::shared_ptr<CommandBuffer> ReuseCommandBuffer(std::vector<std::shared_ptr<CommandBuffer>>& commandBuffers, uint32_t inUse, const std::string& name);
 
 	::Instance* mInstance;
 	uint32_t mFrameContextIndex; // assigned by mInstance
 	FrameContext* mFrameContexts;
 
-	uint32_t mDescriptorSetCount;
+	std::atomic<uint32_t> mDescriptorSetCount;
+	std::atomic<uint32_t> mCommandBuffersInUse;
+	std::atomic<uint32_t> mCommandBufferCount;
+	uint32_t mCommandBufferHighWaterMark;
+	std::atomic<uint64_t> mDescriptorWriteCount;
+	std::atomic<uint64_t> mDescriptorCacheHitCount;
 	uint32_t mMemoryAllocationCount;
 	VkDeviceSize mMemoryUsage;
+	uint64_t mRelocationCount;
+	VkDeviceSize mCategoryUsage[MEMORY_CATEGORY_COUNT];
+	bool mMemoryBudgetSupported;
+	// bytes allocated from each heap by this device
+	std::vector<VkDeviceSize> mHeapAllocated;
+	// usage of each heap by everything but this device (other processes and the driver), when the budgets were last queried
+	std::vector<VkDeviceSize> mHeapExternalUsage;
+	std::vector<MemoryHeapBudget> mHeapBudgets;
+	std::vector<BudgetCallback> mBudgetCallbacks;
+	uint32_t mNextBudgetCallbackId;
+	std::vector<std::pair<uint32_t, RelocationCallback>> mRelocationCallbacks;
+	uint32_t mNextRelocationCallbackId;
+	std::atomic<uint64_t> mNextResourceId;
 	VkPhysicalDeviceMemoryProperties mMemoryProperties;
 
 	std::unordered_map<uint32_t, std::vector<Allocation>> mMemoryAllocations;
@@ -131,23 +439,55 @@ private:
 	uint32_t mPresentQueueIndex;
 	uint32_t mGraphicsQueueFamilyIndex;
 	uint32_t mPresentQueueFamilyIndex;
+	uint32_t mTransferQueueFamilyIndex;
+	uint32_t mComputeQueueFamilyIndex;
+	std::vector<uint32_t> mQueueFamilyIndices;
 
 	VkQueue mGraphicsQueue;
 	VkQueue mPresentQueue;
+	VkQueue mTransferQueue;
+	VkQueue mComputeQueue;
+
+	QueueTimeline mGraphicsTimeline;
+	// only used if the transfer queue isn't the graphics queue
+	QueueTimeline mTransferTimeline;
+	// only used if the compute queue isn't the graphics queue
+	QueueTimeline mComputeTimeline;
+
+	::UploadManager* mUploadManager;
 
 	VkDescriptorPool mDescriptorPool;
 
-	std::mutex mTmpDescriptorSetMutex;
+	// update templates by a hash of their layout and entries
+	std::unordered_multimap<size_t, CachedDescriptorUpdateTemplate> mDescriptorUpdateTemplates;
+	// cached sets by a hash of their update template, descriptors and resources, allocated from mDescriptorPool
+	std::unordered_multimap<size_t, CachedDescriptorSet> mDescriptorSetCache;
+	// unreferenced cached sets, and the frame context they were released in, freed when that frame context is reset
+	std::vector<std::pair<uint32_t, VkDescriptorSet>> mRetiredDescriptorSets;
+
+	// the last descriptor pool each thread used, so the pools only have to be looked up once per thread per frame
+	static thread_local uint64_t mCachedFrameContext;
+	static thread_local DescriptorPool* mCachedDescriptorPool;
+	// the command pools each thread used last, like mCachedDescriptorPool
+	static thread_local uint64_t mCachedCommandFrameContext;
+	static thread_local std::unordered_map<uint32_t, CommandPool>* mCachedCommandPools;
+
 	std::mutex mTmpBufferMutex;
 	std::mutex mDescriptorPoolMutex;
+	std::mutex mDescriptorTemplateMutex;
+	std::mutex mDescriptorCacheMutex;
 	std::mutex mCommandPoolMutex;
 	std::mutex mMemoryMutex;
-	std::unordered_map<std::thread::id, VkCommandPool> mCommandPools;
-	std::unordered_map<VkCommandPool, std::queue<std::shared_ptr<CommandBuffer>>> mCommandBuffers;
+	// command pools for each queue family for command buffers that are used before the frame contexts exist, while the swapchain is created
+	std::unordered_map<uint32_t, VkCommandPool> mSetupCommandPools;
+	// command buffers from mSetupCommandPools, kept until the next Flush()
+	std::vector<std::shared_ptr<CommandBuffer>> mSetupCommandBuffers;
 
 	#ifdef ENABLE_DEBUG_LAYERS
 	PFN_vkSetDebugUtilsObjectNameEXT SetDebugUtilsObjectNameEXT;
 	PFN_vkCmdBeginDebugUtilsLabelEXT CmdBeginDebugUtilsLabelEXT;
 	PFN_vkCmdEndDebugUtilsLabelEXT CmdEndDebugUtilsLabelEXT;
 	#endif
+	PFN_vkWaitSemaphoresKHR WaitSemaphoresKHR;
+	PFN_vkGetSemaphoreCounterValueKHR GetSemaphoreCounterValueKHR;
 };
\ No newline at end of file
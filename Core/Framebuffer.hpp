@@ -37,7 +37,7 @@ public:
 
 	ENGINE_EXPORT void Clear(CommandBuffer* commandBuffer);
 	// Create (or re-create, if modified) the buffers and RenderPass if necessary, then begin the RenderPass
-	ENGINE_EXPORT void BeginRenderPass(CommandBuffer* commandBuffer);
+	ENGINE_EXPORT void BeginRenderPass(CommandBuffer* commandBuffer, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 	
 	inline ::RenderPass* RenderPass() const { return mRenderPass; }
 	inline ::Device* Device() const { return mDevice; }
@@ -127,6 +127,7 @@ Instance::Instance(int argc, char** argv, PluginManager* pluginManager)
 	mDeviceExtensions = {
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 		VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME,
+		VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
 	};
 
 	vector<const char*> validationLayers;
@@ -583,6 +584,8 @@ bool Instance::PollEvents() {
 
 void Instance::AdvanceFrame() {
 	PROFILER_BEGIN("Present");
+	// everything executed this frame goes to the GPU together
+	mDevice->SubmitPending();
 	vector<VkSemaphore> waitSemaphores;
 	for (const shared_ptr<Semaphore>& s : mDevice->CurrentFrameContext()->mSemaphores)
 		waitSemaphores.push_back(*s);
@@ -594,4 +597,7 @@ void Instance::AdvanceFrame() {
 
 	mDevice->mFrameContextIndex = mFrameCount % mMaxFramesInFlight;
 	mDevice->CurrentFrameContext()->Reset();
+	mDevice->UpdateMemoryBudget();
+	// before anything is recorded this frame, so it doesn't see the old handles of the resources that are moved
+	mDevice->Defragment();
 }
\ No newline at end of file
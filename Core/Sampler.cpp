@@ -4,12 +4,12 @@
 using namespace std;
 
 Sampler::Sampler(const string& name, Device* device, const VkSamplerCreateInfo& samplerInfo)
-	: mName(name), mDevice(device) {
+	: mName(name), mDevice(device), mResourceId(device->NextResourceId()) {
 	ThrowIfFailed(vkCreateSampler(*mDevice, &samplerInfo, nullptr, &mSampler), "vkCreateSampler failed");
 	mDevice->SetObjectName(mSampler, mName, VK_OBJECT_TYPE_SAMPLER);
 }
 Sampler::Sampler(const string& name, Device* device, float maxLod, VkFilter filter, VkSamplerAddressMode addressMode, float maxAnisotropy)
-	: mName(name), mDevice(device) {
+	: mName(name), mDevice(device), mResourceId(device->NextResourceId()) {
 	VkSamplerCreateInfo samplerInfo = {};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
 	samplerInfo.magFilter = filter;
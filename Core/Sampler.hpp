@@ -14,8 +14,11 @@ public:
 
 	inline const ::VkSampler& VkSampler() const { return mSampler; }
 	inline operator ::VkSampler() const { return mSampler; }
+	// Unique id from Device::NextResourceId(), which descriptor sets use to tell resources apart when their handles are re-used
+	inline uint64_t ResourceId() const { return mResourceId; }
 
 private:
 	Device* mDevice;
 	::VkSampler mSampler;
+	uint64_t mResourceId;
 };
\ No newline at end of file
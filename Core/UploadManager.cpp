@@ -0,0 +1,295 @@
+#include <Core/UploadManager.hpp>
+#include <Core/Buffer.hpp>
+#include <Core/CommandBuffer.hpp>
+#include <Core/Device.hpp>
+#include <Content/Texture.hpp>
+#include <Util/Profiler.hpp>
+
+using namespace std;
+
+// size of the persistent staging buffer. larger uploads get their own staging buffer
+#define STAGING_RING_SIZE (64 * 1024 * 1024)
+
+UploadManager::UploadManager(Device* device)
+	: mDevice(device), mRing(nullptr), mRingHead(0), mRingTail(0), mCurrentBatch(nullptr), mNextToken(1), mCompletedToken(0) {
+	mDedicatedTransfer = mDevice->TransferQueueFamilyIndex() != mDevice->GraphicsQueueFamilyIndex();
+
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	poolInfo.queueFamilyIndex = mDevice->GraphicsQueueFamilyIndex();
+	ThrowIfFailed(vkCreateCommandPool(*mDevice, &poolInfo, nullptr, &mGraphicsCommandPool), "vkCreateCommandPool failed");
+	mDevice->SetObjectName(mGraphicsCommandPool, "Upload Graphics Command Pool", VK_OBJECT_TYPE_COMMAND_POOL);
+
+	mTransferCommandPool = VK_NULL_HANDLE;
+	if (mDedicatedTransfer) {
+		poolInfo.queueFamilyIndex = mDevice->TransferQueueFamilyIndex();
+		ThrowIfFailed(vkCreateCommandPool(*mDevice, &poolInfo, nullptr, &mTransferCommandPool), "vkCreateCommandPool failed");
+		mDevice->SetObjectName(mTransferCommandPool, "Upload Transfer Command Pool", VK_OBJECT_TYPE_COMMAND_POOL);
+	}
+}
+UploadManager::~UploadManager() {
+	Finish();
+	for (Batch* b : mFreeBatches) {
+		b->mTransferCommands.reset();
+		b->mGraphicsCommands.reset();
+		safe_delete(b);
+	}
+	safe_delete(mRing);
+	if (mTransferCommandPool != VK_NULL_HANDLE) vkDestroyCommandPool(*mDevice, mTransferCommandPool, nullptr);
+	vkDestroyCommandPool(*mDevice, mGraphicsCommandPool, nullptr);
+}
+
+UploadManager::Batch* UploadManager::CurrentBatch() {
+	if (mCurrentBatch) return mCurrentBatch;
+	if (mFreeBatches.size()) {
+		mCurrentBatch = mFreeBatches.back();
+		mFreeBatches.pop_back();
+	} else {
+		mCurrentBatch = new Batch();
+		mCurrentBatch->mGraphicsCommands = shared_ptr<CommandBuffer>(new CommandBuffer(mDevice, mGraphicsCommandPool, mDevice->GraphicsQueueFamilyIndex(), "Upload"));
+		if (mDedicatedTransfer) {
+			mCurrentBatch->mTransferCommands = shared_ptr<CommandBuffer>(new CommandBuffer(mDevice, mTransferCommandPool, mDevice->TransferQueueFamilyIndex(), "Upload Transfer"));
+		}
+	}
+	mCurrentBatch->mToken = mNextToken++;
+	mCurrentBatch->mTransferRecording = false;
+	mCurrentBatch->mGraphicsRecording = false;
+	mCurrentBatch->mRingEnd = mRingHead;
+	return mCurrentBatch;
+}
+CommandBuffer* UploadManager::GraphicsCommands() {
+	Batch* batch = CurrentBatch();
+	if (!batch->mGraphicsRecording) {
+		batch->mGraphicsCommands->Reset("Upload");
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		ThrowIfFailed(vkBeginCommandBuffer(*batch->mGraphicsCommands, &beginInfo), "vkBeginCommandBuffer failed");
+		batch->mGraphicsRecording = true;
+	}
+	return batch->mGraphicsCommands.get();
+}
+CommandBuffer* UploadManager::TransferCommands() {
+	if (!mDedicatedTransfer) return GraphicsCommands();
+	Batch* batch = CurrentBatch();
+	if (!batch->mTransferRecording) {
+		batch->mTransferCommands->Reset("Upload Transfer");
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		ThrowIfFailed(vkBeginCommandBuffer(*batch->mTransferCommands, &beginInfo), "vkBeginCommandBuffer failed");
+		batch->mTransferRecording = true;
+	}
+	return batch->mTransferCommands.get();
+}
+
+Buffer* UploadManager::Reserve(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+	if (size > STAGING_RING_SIZE) {
+		Buffer* staging = new Buffer("Upload Staging", mDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		staging->SetMemoryCategory(MEMORY_CATEGORY_TEMP);
+		CurrentBatch()->mStagingBuffers.push_back(staging);
+		offset = 0;
+		return staging;
+	}
+
+	if (!mRing) {
+		mRing = new Buffer("Upload Staging Ring", mDevice, STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		mRing->SetMemoryCategory(MEMORY_CATEGORY_TEMP);
+	}
+
+	uint64_t start;
+	while (true) {
+		uint64_t lap = mRingHead - mRingHead % STAGING_RING_SIZE;
+		// alignment isn't always a power of two (i.e. 12 byte texels)
+		uint64_t aligned = ((mRingHead % STAGING_RING_SIZE + alignment - 1) / alignment) * alignment;
+		// ranges don't wrap around the end of the ring, they start over at the beginning
+		start = aligned + size > STAGING_RING_SIZE ? lap + STAGING_RING_SIZE : lap + aligned;
+		if (start + size - mRingTail <= STAGING_RING_SIZE) break;
+		if (mRingHead == mRingTail) {
+			// the ring is empty, start over at the beginning
+			mRingHead = mRingTail = lap + STAGING_RING_SIZE;
+			continue;
+		}
+
+		// the ring is full, submit the current batch and wait for the oldest one
+		if (mCurrentBatch) FlushBatch();
+		PROFILER_BEGIN("Wait for uploads");
+		mSubmittedBatches.front()->mGraphicsCommands->mSignalFence->Wait();
+		Retire();
+		PROFILER_END;
+	}
+
+	mRingHead = start + size;
+	CurrentBatch()->mRingEnd = mRingHead;
+	offset = start % STAGING_RING_SIZE;
+	return mRing;
+}
+
+UploadToken UploadManager::Upload(Buffer* buffer, const void* data, VkDeviceSize size, VkDeviceSize offset, bool initial) {
+	lock_guard<mutex> lock(mMutex);
+	Retire();
+	if (!size) return mCurrentBatch ? mCurrentBatch->mToken : mNextToken - 1;
+
+	VkDeviceSize srcOffset;
+	Buffer* staging = Reserve(size, 4, srcOffset);
+	memcpy((uint8_t*)staging->MappedData() + srcOffset, data, size);
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = *buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+
+	VkBufferCopy region = {};
+	region.srcOffset = srcOffset;
+	region.dstOffset = offset;
+	region.size = size;
+
+	if (initial && mDedicatedTransfer) {
+		CommandBuffer* transfer = TransferCommands();
+		vkCmdCopyBuffer(*transfer, *staging, *buffer, 1, &region);
+		buffer->mLastUpload = mCurrentBatch->mToken;
+		// buffers shared between queue families don't change owners, the graphics queue's wait on the transfer timeline is enough
+		if (buffer->Concurrent()) return mCurrentBatch->mToken;
+		// release the buffer to the graphics queue
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		barrier.srcQueueFamilyIndex = mDevice->TransferQueueFamilyIndex();
+		barrier.dstQueueFamilyIndex = mDevice->GraphicsQueueFamilyIndex();
+		vkCmdPipelineBarrier(*transfer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		// acquire it on the graphics queue
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+		vkCmdPipelineBarrier(*GraphicsCommands(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	} else {
+		CommandBuffer* graphics = GraphicsCommands();
+		if (!initial) {
+			// wait for work that reads the buffer to finish before overwriting it
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			vkCmdPipelineBarrier(*graphics, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		}
+		vkCmdCopyBuffer(*graphics, *staging, *buffer, 1, &region);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+		vkCmdPipelineBarrier(*graphics, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+
+	buffer->mLastUpload = mCurrentBatch->mToken;
+	return mCurrentBatch->mToken;
+}
+UploadToken UploadManager::Upload(Texture* texture, const void* const* layers, uint32_t layerCount, VkDeviceSize layerSize) {
+	lock_guard<mutex> lock(mMutex);
+	Retire();
+
+	// buffer offsets must be a multiple of 4 and of the texel size
+	VkDeviceSize texelSize = layerSize / ((VkDeviceSize)texture->Width() * texture->Height() * texture->Depth());
+	VkDeviceSize alignment = 4;
+	if (texelSize) while (alignment % texelSize) alignment += 4;
+
+	VkDeviceSize srcOffset;
+	Buffer* staging = Reserve(layerSize * layerCount, alignment, srcOffset);
+	for (uint32_t i = 0; i < layerCount; i++)
+		memcpy((uint8_t*)staging->MappedData() + srcOffset + i * layerSize, layers[i], layerSize);
+
+	VkBufferImageCopy region = {};
+	region.bufferOffset = srcOffset;
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = layerCount;
+	region.imageOffset = { 0, 0, 0 };
+	region.imageExtent = { texture->Width(), texture->Height(), texture->Depth() };
+
+	CommandBuffer* transfer = TransferCommands();
+	texture->TransitionImageLayout(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, transfer);
+	vkCmdCopyBufferToImage(*transfer, *staging, texture->Image(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	CommandBuffer* graphics = GraphicsCommands();
+	if (mDedicatedTransfer) {
+		// pass ownership of every mip level to the graphics queue, which generates the mip maps
+		VkPipelineStageFlags srcStage, dstStage;
+		VkImageMemoryBarrier barrier = texture->TransitionImageLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, srcStage, dstStage);
+		barrier.srcQueueFamilyIndex = mDevice->TransferQueueFamilyIndex();
+		barrier.dstQueueFamilyIndex = mDevice->GraphicsQueueFamilyIndex();
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		vkCmdPipelineBarrier(*transfer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(*graphics, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+	}
+
+	if (texture->MipLevels() > 1)
+		texture->GenerateMipMaps(graphics);
+	else
+		texture->TransitionImageLayout(VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (texture->Usage() & VK_IMAGE_USAGE_STORAGE_BIT) ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, graphics);
+
+	texture->mLastUpload = mCurrentBatch->mToken;
+	return mCurrentBatch->mToken;
+}
+
+void UploadManager::FlushBatch() {
+	// the graphics commands are always queued, their fence marks the end of the batch
+	GraphicsCommands();
+	Batch* batch = mCurrentBatch;
+	mCurrentBatch = nullptr;
+
+	vector<pair<VkSemaphore, uint64_t>> waits;
+	if (batch->mTransferRecording) {
+		ThrowIfFailed(vkEndCommandBuffer(*batch->mTransferCommands), "vkEndCommandBuffer failed");
+		uint64_t value = mDevice->Enqueue(&mDevice->mTransferTimeline, *batch->mTransferCommands);
+		batch->mTransferCommands->mSignalFence = make_shared<Fence>(mDevice, mDevice->mTransferTimeline.mTimeline, value);
+		// submit right away, so the copies start early and the graphics commands never wait on a value that hasn't been submitted
+		mDevice->SubmitQueue(&mDevice->mTransferTimeline);
+		waits.push_back(make_pair(mDevice->mTransferTimeline.mTimeline, value));
+	}
+
+	// queued behind anything executed before the flush, and submitted with whatever is executed next
+	ThrowIfFailed(vkEndCommandBuffer(*batch->mGraphicsCommands), "vkEndCommandBuffer failed");
+	uint64_t value = mDevice->Enqueue(&mDevice->mGraphicsTimeline, *batch->mGraphicsCommands, VK_NULL_HANDLE, waits);
+	batch->mGraphicsCommands->mSignalFence = make_shared<Fence>(mDevice, mDevice->mGraphicsTimeline.mTimeline, value);
+
+	mSubmittedBatches.push_back(batch);
+}
+void UploadManager::Retire() {
+	while (mSubmittedBatches.size() && mSubmittedBatches.front()->mGraphicsCommands->mSignalFence->Signaled()) {
+		// the graphics commands wait on the transfer commands, so the whole batch is done
+		Batch* batch = mSubmittedBatches.front();
+		mSubmittedBatches.pop_front();
+		mRingTail = max(mRingTail, batch->mRingEnd);
+		for (Buffer* b : batch->mStagingBuffers)
+			safe_delete(b);
+		batch->mStagingBuffers.clear();
+		mCompletedToken = batch->mToken;
+		mFreeBatches.push_back(batch);
+	}
+}
+
+void UploadManager::Flush() {
+	lock_guard<mutex> lock(mMutex);
+	if (mCurrentBatch) FlushBatch();
+}
+bool UploadManager::IsComplete(UploadToken token) {
+	lock_guard<mutex> lock(mMutex);
+	Retire();
+	if (token <= mCompletedToken) return true;
+	// make sure the batches being polled for get submitted, even if nothing is executed after them
+	if (mSubmittedBatches.size()) mDevice->SubmitQueue(&mDevice->mGraphicsTimeline, mSubmittedBatches.back()->mGraphicsCommands->mSignalFence->Value());
+	return false;
+}
+void UploadManager::Wait(UploadToken token) {
+	lock_guard<mutex> lock(mMutex);
+	if (mCurrentBatch && token >= mCurrentBatch->mToken) FlushBatch();
+	Retire();
+	while (token > mCompletedToken && mSubmittedBatches.size()) {
+		mSubmittedBatches.front()->mGraphicsCommands->mSignalFence->Wait();
+		Retire();
+	}
+}
+void UploadManager::Finish() {
+	Wait(mNextToken - 1);
+}
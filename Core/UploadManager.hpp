@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+
+#include <Util/Util.hpp>
+
+class Buffer;
+class CommandBuffer;
+class Device;
+class Texture;
+
+// Identifies a batch of uploads. Uploads with lower tokens finish before uploads with higher tokens
+typedef uint64_t UploadToken;
+
+// Copies data from the host to device-local buffers and textures without stalling the caller.
+// Data is copied into a persistent staging ring, and the copies are batched into one command buffer per queue per Flush().
+// Copies to new resources run on a dedicated transfer queue, if the device has one, and ownership is passed to the graphics queue afterwards,
+// which waits on the transfer queue's timeline semaphore.
+// Device::Execute() flushes pending uploads first, so command buffers executed after an upload is recorded always see its data.
+class UploadManager {
+public:
+	ENGINE_EXPORT UploadManager(Device* device);
+	ENGINE_EXPORT ~UploadManager();
+
+	// Copies 'size' bytes of 'data' into 'buffer' at 'offset'. 'data' can be freed as soon as this returns.
+	// 'initial' should be true if the GPU hasn't used the buffer yet, which lets the copy run on the transfer queue
+	ENGINE_EXPORT UploadToken Upload(Buffer* buffer, const void* data, VkDeviceSize size, VkDeviceSize offset = 0, bool initial = false);
+	// Copies 'layerCount' layers of 'layerSize' bytes each into mip 0 of 'texture', which must not have been used by the GPU yet, then generates its mip maps.
+	// The texture ends up in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, or VK_IMAGE_LAYOUT_GENERAL if it has VK_IMAGE_USAGE_STORAGE_BIT
+	ENGINE_EXPORT UploadToken Upload(Texture* texture, const void* const* layers, uint32_t layerCount, VkDeviceSize layerSize);
+
+	// Submits the uploads recorded since the last flush to the transfer queue, and queues them on the graphics queue with Device::Execute()'s command buffers
+	ENGINE_EXPORT void Flush();
+	// Returns true if the uploads with 'token' have finished, and recycles the staging space of finished uploads
+	ENGINE_EXPORT bool IsComplete(UploadToken token);
+	// Waits for the uploads with 'token' to finish, flushing them first if they haven't been submitted
+	ENGINE_EXPORT void Wait(UploadToken token);
+	// Submits and waits for every upload
+	ENGINE_EXPORT void Finish();
+	// The token of the last batch known to have finished. Unlike IsComplete(), this doesn't lock or poll, so it can be called with the device's memory locked
+	inline UploadToken CompletedToken() const { return mCompletedToken; }
+
+	// Bytes of the staging ring used by uploads that haven't finished
+	inline VkDeviceSize StagingUsage() const { return mRingHead - mRingTail; }
+
+private:
+	struct Batch {
+		UploadToken mToken;
+		// copies to new resources, and ownership releases. Only used when the device has a dedicated transfer queue
+		std::shared_ptr<CommandBuffer> mTransferCommands;
+		// other copies, ownership acquires, mip generation and layout transitions
+		std::shared_ptr<CommandBuffer> mGraphicsCommands;
+		bool mTransferRecording;
+		bool mGraphicsRecording;
+		// position in the staging ring after this batch's data
+		uint64_t mRingEnd;
+		// staging buffers for uploads that don't fit in the ring, deleted when the batch finishes
+		std::vector<Buffer*> mStagingBuffers;
+	};
+
+	// Reserves 'size' bytes of staging memory for the current batch, submitting and waiting for older batches if the ring is full
+	ENGINE_EXPORT Buffer* Reserve(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+	ENGINE_EXPORT Batch* CurrentBatch();
+	ENGINE_EXPORT CommandBuffer* TransferCommands();
+	ENGINE_EXPORT CommandBuffer* GraphicsCommands();
+	// Recycles batches that have finished. Expects mMutex to be locked
+	ENGINE_EXPORT void Retire();
+	ENGINE_EXPORT void FlushBatch();
+
+	Device* mDevice;
+	bool mDedicatedTransfer;
+	VkCommandPool mTransferCommandPool;
+	VkCommandPool mGraphicsCommandPool;
+
+	Buffer* mRing;
+	// positions in the ring, which only increase. the offset in mRing is the position modulo its size
+	uint64_t mRingHead;
+	uint64_t mRingTail;
+
+	Batch* mCurrentBatch;
+	std::deque<Batch*> mSubmittedBatches;
+	std::vector<Batch*> mFreeBatches;
+	UploadToken mNextToken;
+	std::atomic<UploadToken> mCompletedToken;
+
+	std::mutex mMutex;
+};
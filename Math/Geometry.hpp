@@ -22,6 +22,16 @@ struct AABB {
 
 	inline float3 Center() const { return (mMax + mMin) * .5f; }
 	inline float3 Extents() const { return (mMax - mMin) * .5f; }
+	inline float SurfaceArea() const {
+		float3 d = mMax - mMin;
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// Squared distance from the point to the box, 0 if the point is inside
+	inline float DistanceSquared(const float3& point) const {
+		float3 d = max(max(mMin - point, point - mMax), float3(0.f));
+		return dot(d, d);
+	}
 
 	inline bool Intersects(const float3& point) const {
 		float3 e = (mMax - mMin) * .5f;
@@ -32,15 +42,7 @@ struct AABB {
 			(s.z <= e.z && s.z >= -e.z);
 	}
 	inline bool Intersects(const Sphere& sphere) const {
-		float3 e = (mMax - mMin) * .5f;
-		float3 s = sphere.mCenter - (mMax + mMin) * .5f;
-		float3 delta = e - s;
-		float sqDist = 0.0f;
-		for (int i = 0; i < 3; i++) {
-			if (s[i] < -e[i]) sqDist += delta[i];
-			if (s[i] >  e[i]) sqDist += delta[i];
-		}
-		return sqDist <= sphere.mRadius * sphere.mRadius;
+		return DistanceSquared(sphere.mCenter) <= sphere.mRadius * sphere.mRadius;
 	}
 	inline bool Intersects(const AABB& aabb) const {
 		// for each i in (x, y, z) if a_min(i) > b_max(i) or b_min(i) > a_max(i) then return false
@@ -200,7 +200,30 @@ void CameraControl::PreRenderScene(CommandBuffer* commandBuffer, Camera* camera,
 		}
 		#endif
 
-		snprintf(tmpText, 128, "%.2fms\n%d DescriptorSets", mScene->FPS(), commandBuffer->Device()->DescriptorSetCount());
+		snprintf(tmpText, 128, "%.2fms\n%d DescriptorSets | %u/%u CommandBuffers", mScene->FPS(), commandBuffer->Device()->DescriptorSetCount(),
+			commandBuffer->Device()->CommandBuffersInUse(), commandBuffer->Device()->CommandBufferCount());
 		GUI::DrawString(sem16, tmpText, 1.f, float2(5, camera->FramebufferHeight() - 30), 18.f);
+
+		const RenderStats& stats = mScene->LastRenderStats();
+		snprintf(tmpText, 128, "Sort %.3fms | %u Draws | %u Pipeline binds | %u Descriptor binds",
+			stats.mSortTime, stats.mDrawCount, stats.mPipelineBindCount, stats.mDescriptorSetBindCount);
+		GUI::DrawString(reg14, tmpText, 1.f, float2(5, camera->FramebufferHeight() - 70), 14.f);
+
+		// device memory by category, and usage against the budget of each heap
+		Device* device = commandBuffer->Device();
+		string memoryText;
+		for (uint32_t i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+			VkDeviceSize usage = device->MemoryCategoryUsage((MemoryCategory)i);
+			if (usage == 0) continue;
+			snprintf(tmpText, 128, "%s: %.1f MiB\n", MemoryCategoryToString((MemoryCategory)i), usage / (1024.f * 1024.f));
+			memoryText += tmpText;
+		}
+		vector<MemoryHeapBudget> budgets = device->GetMemoryBudget();
+		for (uint32_t i = 0; i < budgets.size(); i++) {
+			snprintf(tmpText, 128, "Heap %u%s: %.1f/%.1f MiB\n", i, budgets[i].mDeviceLocal ? " (device)" : "",
+				budgets[i].mUsage / (1024.f * 1024.f), budgets[i].mBudget / (1024.f * 1024.f));
+			memoryText += tmpText;
+		}
+		GUI::DrawString(reg14, memoryText, 1.f, float2(s.x - 5, s.y - 30), 14.f, TEXT_ANCHOR_MAX);
 	}
 }
\ No newline at end of file
@@ -731,11 +731,11 @@ public:
 			ds = commandBuffer->Device()->GetTempDescriptorSet("BakeTransferFunctionRGB", shader->mDescriptorSetLayouts[0]);
 			ds->CreateStorageTextureDescriptor(mTransferLUT, shader->mDescriptorBindings.at("TransferLUT").second.binding, VK_IMAGE_LAYOUT_GENERAL);
 
-			Buffer* gradients = commandBuffer->Device()->GetTempBuffer("GradientRGB", mTransferFunction.GetGradients().size() * sizeof(TransferGradient), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(gradients->MappedData(), mTransferFunction.GetGradients().data(), mTransferFunction.GetGradients().size() * sizeof(TransferGradient));
+			TempBufferRange gradients = commandBuffer->Device()->GetTempBufferRange(mTransferFunction.GetGradients().size() * sizeof(TransferGradient), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(gradients.mMapped, mTransferFunction.GetGradients().data(), mTransferFunction.GetGradients().size() * sizeof(TransferGradient));
 
 			//DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("GradientRGB", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(gradients, 0, mTransferFunction.GetGradients().size() * sizeof(TransferGradient), shader->mDescriptorBindings.at("GradientRGB").second.binding);
+			ds->CreateStorageBufferDescriptor(gradients.mBuffer, gradients.mOffset, mTransferFunction.GetGradients().size() * sizeof(TransferGradient), shader->mDescriptorBindings.at("GradientRGB").second.binding);
 			ds->FlushWrites();
 
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, shader->mPipelineLayout, 0, 1, *ds, 0, nullptr);
@@ -752,11 +752,11 @@ public:
 			ds = commandBuffer->Device()->GetTempDescriptorSet("BakeTransferFunctionA", shader->mDescriptorSetLayouts[0]);
 			ds->CreateStorageTextureDescriptor(mTransferLUT, shader->mDescriptorBindings.at("TransferLUT").second.binding, VK_IMAGE_LAYOUT_GENERAL);
 
-			Buffer* triangles = commandBuffer->Device()->GetTempBuffer("GradientA", mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(triangles->MappedData(), mTransferFunction.GetTriangles().data(), mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle));
+			TempBufferRange triangles = commandBuffer->Device()->GetTempBufferRange(mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(triangles.mMapped, mTransferFunction.GetTriangles().data(), mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle));
 
 			//DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("GradientRGB", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(triangles, 0, mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle), shader->mDescriptorBindings.at("GradientA").second.binding);
+			ds->CreateStorageBufferDescriptor(triangles.mBuffer, triangles.mOffset, mTransferFunction.GetTriangles().size() * sizeof(TransferTriangle), shader->mDescriptorBindings.at("GradientA").second.binding);
 			ds->FlushWrites();
 
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, shader->mPipelineLayout, 0, 1, *ds, 0, nullptr);
@@ -787,10 +787,10 @@ public:
 			if (mRawMask) ds->CreateStorageTextureDescriptor(mRawMask, shader->mDescriptorBindings.at("RawMask").second.binding, VK_IMAGE_LAYOUT_GENERAL);
 			ds->CreateStorageTextureDescriptor(mBakedVolume, shader->mDescriptorBindings.at("Output").second.binding, VK_IMAGE_LAYOUT_GENERAL);
 			if (mRawMask) {
-				Buffer* colbuffer = commandBuffer->Device()->GetTempBuffer("MaskCols", sizeof(mMaskColors), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-				memcpy(colbuffer->MappedData(), &mMaskColors, sizeof(mMaskColors));
+				TempBufferRange colbuffer = commandBuffer->Device()->GetTempBufferRange(sizeof(mMaskColors), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+				memcpy(colbuffer.mMapped, &mMaskColors, sizeof(mMaskColors));
 
-				ds->CreateUniformBufferDescriptor(colbuffer, 0, sizeof(mMaskColors), shader->mDescriptorBindings.at("MaskCols").second.binding);
+				ds->CreateUniformBufferDescriptor(colbuffer.mBuffer, colbuffer.mOffset, sizeof(mMaskColors), shader->mDescriptorBindings.at("MaskCols").second.binding);
 			}
 			if (mTransferLUT) {
 				ds->CreateSampledTextureDescriptor(mTransferLUT, shader->mDescriptorBindings.at("TransferLUTTex").second.binding, VK_IMAGE_LAYOUT_GENERAL);
@@ -862,10 +862,10 @@ public:
 				if (mRawMask) {
 					ds->CreateSampledTextureDescriptor(mRawMask, shader->mDescriptorBindings.at("RawMask").second.binding, VK_IMAGE_LAYOUT_GENERAL);
 
-					Buffer* colbuffer = commandBuffer->Device()->GetTempBuffer("MaskCols", sizeof(mMaskColors), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-					memcpy(colbuffer->MappedData(), &mMaskColors, sizeof(mMaskColors));
+					TempBufferRange colbuffer = commandBuffer->Device()->GetTempBufferRange(sizeof(mMaskColors), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+					memcpy(colbuffer.mMapped, &mMaskColors, sizeof(mMaskColors));
 
-					ds->CreateUniformBufferDescriptor(colbuffer, 0, sizeof(mMaskColors), shader->mDescriptorBindings.at("MaskCols").second.binding);
+					ds->CreateUniformBufferDescriptor(colbuffer.mBuffer, colbuffer.mOffset, sizeof(mMaskColors), shader->mDescriptorBindings.at("MaskCols").second.binding);
 				}
 			}
 			if (mLighting && mGradient)
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <Util/Util.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define BVH4_SSE
+#include <emmintrin.h>
+#endif
+
+// Number of rays traced together by packet queries, at most 32 since each ray is a bit in the packet's masks
+#define RAY_PACKET_SIZE 8
+// Rays are only traced as a packet if their directions are within this cosine of each other
+#define PACKET_COHERENCE .98f
+// Smaller packets are traced one ray at a time, since the shared node tests cost more than they save
+#define MIN_PACKET_RAYS 8
+
+// A node of a four-wide bvh. The children's bounds are stored in structure-of-arrays layout, so all four can be tested at once.
+struct alignas(16) Bvh4Node {
+	float mMinX[4];
+	float mMinY[4];
+	float mMinZ[4];
+	float mMaxX[4];
+	float mMaxY[4];
+	float mMaxZ[4];
+	// index of the child node, or index of the first primitive if the child is a leaf. Empty slots are 0xFFFFFFFF.
+	uint32_t mChild[4];
+	// number of primitives inside each child, 0 if the child is a node
+	uint32_t mCount[4];
+
+	inline void SetChild(uint32_t slot, const AABB& bounds, uint32_t child, uint32_t count) {
+		SetBounds(slot, bounds);
+		mChild[slot] = child;
+		mCount[slot] = count;
+	}
+	inline void SetBounds(uint32_t slot, const AABB& bounds) {
+		mMinX[slot] = bounds.mMin.x;
+		mMinY[slot] = bounds.mMin.y;
+		mMinZ[slot] = bounds.mMin.z;
+		mMaxX[slot] = bounds.mMax.x;
+		mMaxY[slot] = bounds.mMax.y;
+		mMaxZ[slot] = bounds.mMax.z;
+	}
+	inline void Clear() {
+		for (uint32_t i = 0; i < 4; i++)
+			SetChild(i, AABB(float3(1e30f), float3(-1e30f)), 0xFFFFFFFF, 0);
+	}
+};
+
+// Inverts a ray direction for the slab tests. Zero components are nudged away from 0 so the inverse stays finite,
+// since 0 * inf is NaN (and fast-math reciprocals turn 1 / 0 into NaN)
+inline float3 InverseDirection(const float3& direction) {
+	float3 d;
+	for (uint32_t i = 0; i < 3; i++)
+		d[i] = fabsf(direction[i]) < 1e-20f ? (direction[i] < 0 ? -1e-20f : 1e-20f) : direction[i];
+	return 1.f / d;
+}
+
+// Packets only pay off when their rays take similar paths through the tree
+inline bool CoherentPacket(const Ray* rays, uint32_t rayCount) {
+	if (rayCount < MIN_PACKET_RAYS) return false;
+	float3 d0 = normalize(rays[0].mDirection);
+	for (uint32_t r = 1; r < rayCount; r++)
+		if (dot(normalize(rays[r].mDirection), d0) < PACKET_COHERENCE) return false;
+	return true;
+}
+
+// Returns a bitmask of the children that the ray enters no later than tmax, and writes each child's entry distance to t
+// invDirection should come from InverseDirection()
+inline uint32_t IntersectBvh4(const Bvh4Node& node, const float3& origin, const float3& invDirection, float tmax, float t[4]) {
+#ifdef BVH4_SSE
+	__m128 ox = _mm_set1_ps(origin.x);
+	__m128 oy = _mm_set1_ps(origin.y);
+	__m128 oz = _mm_set1_ps(origin.z);
+	__m128 idx = _mm_set1_ps(invDirection.x);
+	__m128 idy = _mm_set1_ps(invDirection.y);
+	__m128 idz = _mm_set1_ps(invDirection.z);
+
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinX), ox), idx);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxX), ox), idx);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinY), oy), idy);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxY), oy), idy);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinZ), oz), idz);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxZ), oz), idz);
+
+	__m128 tnear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_min_ps(t0z, t1z));
+	__m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z));
+	_mm_storeu_ps(t, tnear);
+
+	__m128 hit = _mm_and_ps(_mm_cmpgt_ps(tfar, tnear), _mm_cmple_ps(tnear, _mm_set1_ps(tmax)));
+	__m128 empty = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)node.mChild), _mm_set1_epi32(-1)));
+	return (uint32_t)_mm_movemask_ps(_mm_andnot_ps(empty, hit));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (node.mChild[i] == 0xFFFFFFFF) continue;
+		float2 ct;
+		if (Ray(origin, 1.f / invDirection).Intersect(AABB(float3(node.mMinX[i], node.mMinY[i], node.mMinZ[i]), float3(node.mMaxX[i], node.mMaxY[i], node.mMaxZ[i])), ct) && ct.x <= tmax)
+			mask |= 1 << i;
+		t[i] = ct.x;
+	}
+	return mask;
+#endif
+}
+
+// Bounds of the origins and inverse directions of a packet of rays, to test nodes against every ray at once
+struct RayPacketBounds {
+	float3 mOriginMin;
+	float3 mOriginMax;
+	float3 mInvDirectionMin;
+	float3 mInvDirectionMax;
+
+	inline RayPacketBounds(const Ray* rays, const float3* invDirections, uint32_t rayMask) : mOriginMin(1e30f), mOriginMax(-1e30f), mInvDirectionMin(1e30f), mInvDirectionMax(-1e30f) {
+		for (uint32_t r = 0; r < RAY_PACKET_SIZE; r++) {
+			if ((rayMask & (1 << r)) == 0) continue;
+			// plain comparisons, since fminf and fmaxf aren't always inlined
+			for (uint32_t a = 0; a < 3; a++) {
+				if (rays[r].mOrigin[a] < mOriginMin[a]) mOriginMin[a] = rays[r].mOrigin[a];
+				if (rays[r].mOrigin[a] > mOriginMax[a]) mOriginMax[a] = rays[r].mOrigin[a];
+				if (invDirections[r][a] < mInvDirectionMin[a]) mInvDirectionMin[a] = invDirections[r][a];
+				if (invDirections[r][a] > mInvDirectionMax[a]) mInvDirectionMax[a] = invDirections[r][a];
+			}
+		}
+	}
+};
+
+// Returns a conservative bitmask of the children that any ray of the packet may enter no later than tmax, using interval arithmetic on the slab tests
+// Children that aren't in the mask are missed by every ray. Axes that the rays cross in both directions can't be bounded, and don't cull anything.
+inline uint32_t IntersectBvh4(const Bvh4Node& node, const RayPacketBounds& packet, float tmax) {
+#ifdef BVH4_SSE
+	__m128 tnear = _mm_set1_ps(-1e30f);
+	__m128 tfar = _mm_set1_ps(1e30f);
+	const float* minBounds[3] = { node.mMinX, node.mMinY, node.mMinZ };
+	const float* maxBounds[3] = { node.mMaxX, node.mMaxY, node.mMaxZ };
+	for (uint32_t a = 0; a < 3; a++) {
+		float idMin = packet.mInvDirectionMin[a];
+		float idMax = packet.mInvDirectionMax[a];
+		if (idMin < 0 && idMax > 0) continue;
+		// The rays' directions along this axis share a sign, so each plane's distance is monotonic in the origin,
+		// and its bounds come from the origin farthest from (or closest to) the plane
+		bool positive = idMin >= 0;
+		__m128 n = _mm_sub_ps(_mm_load_ps(positive ? minBounds[a] : maxBounds[a]), _mm_set1_ps(positive ? packet.mOriginMax[a] : packet.mOriginMin[a]));
+		__m128 f = _mm_sub_ps(_mm_load_ps(positive ? maxBounds[a] : minBounds[a]), _mm_set1_ps(positive ? packet.mOriginMin[a] : packet.mOriginMax[a]));
+		__m128 id0 = _mm_set1_ps(idMin);
+		__m128 id1 = _mm_set1_ps(idMax);
+		tnear = _mm_max_ps(tnear, _mm_min_ps(_mm_mul_ps(n, id0), _mm_mul_ps(n, id1)));
+		tfar = _mm_min_ps(tfar, _mm_max_ps(_mm_mul_ps(f, id0), _mm_mul_ps(f, id1)));
+	}
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tfar, tnear), _mm_cmple_ps(tnear, _mm_set1_ps(tmax)));
+	__m128 empty = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)node.mChild), _mm_set1_epi32(-1)));
+	return (uint32_t)_mm_movemask_ps(_mm_andnot_ps(empty, hit));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		if (node.mChild[i] == 0xFFFFFFFF) continue;
+		float3 bmin(node.mMinX[i], node.mMinY[i], node.mMinZ[i]);
+		float3 bmax(node.mMaxX[i], node.mMaxY[i], node.mMaxZ[i]);
+		float tnear = -1e30f;
+		float tfar = 1e30f;
+		for (uint32_t a = 0; a < 3; a++) {
+			float idMin = packet.mInvDirectionMin[a];
+			float idMax = packet.mInvDirectionMax[a];
+			if (idMin < 0 && idMax > 0) continue;
+			bool positive = idMin >= 0;
+			float n = (positive ? bmin[a] : bmax[a]) - (positive ? packet.mOriginMax[a] : packet.mOriginMin[a]);
+			float f = (positive ? bmax[a] : bmin[a]) - (positive ? packet.mOriginMin[a] : packet.mOriginMax[a]);
+			float lo = n * idMin < n * idMax ? n * idMin : n * idMax;
+			float hi = f * idMin > f * idMax ? f * idMin : f * idMax;
+			if (lo > tnear) tnear = lo;
+			if (hi < tfar) tfar = hi;
+		}
+		if (tfar >= tnear && tnear <= tmax)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Returns a bitmask of the children that intersect the frustum
+inline uint32_t IntersectBvh4(const Bvh4Node& node, const float4 frustum[6]) {
+#ifdef BVH4_SSE
+	__m128 half = _mm_set1_ps(.5f);
+	__m128 minx = _mm_load_ps(node.mMinX), maxx = _mm_load_ps(node.mMaxX);
+	__m128 miny = _mm_load_ps(node.mMinY), maxy = _mm_load_ps(node.mMaxY);
+	__m128 minz = _mm_load_ps(node.mMinZ), maxz = _mm_load_ps(node.mMaxZ);
+	__m128 cx = _mm_mul_ps(_mm_add_ps(maxx, minx), half);
+	__m128 cy = _mm_mul_ps(_mm_add_ps(maxy, miny), half);
+	__m128 cz = _mm_mul_ps(_mm_add_ps(maxz, minz), half);
+	__m128 ex = _mm_mul_ps(_mm_sub_ps(maxx, minx), half);
+	__m128 ey = _mm_mul_ps(_mm_sub_ps(maxy, miny), half);
+	__m128 ez = _mm_mul_ps(_mm_sub_ps(maxz, minz), half);
+
+	__m128 inside = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)node.mChild), _mm_set1_epi32(-1)));
+	inside = _mm_xor_ps(inside, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+	for (uint32_t i = 0; i < 6; i++) {
+		float3 a = abs(frustum[i].xyz);
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(a.x)), _mm_mul_ps(ey, _mm_set1_ps(a.y))), _mm_mul_ps(ez, _mm_set1_ps(a.z)));
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(frustum[i].x)), _mm_mul_ps(cy, _mm_set1_ps(frustum[i].y))), _mm_mul_ps(cz, _mm_set1_ps(frustum[i].z)));
+		d = _mm_sub_ps(d, _mm_set1_ps(frustum[i].w));
+		inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, _mm_sub_ps(_mm_setzero_ps(), r)));
+	}
+	return (uint32_t)_mm_movemask_ps(inside);
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; i++)
+		if (node.mChild[i] != 0xFFFFFFFF && AABB(float3(node.mMinX[i], node.mMinY[i], node.mMinZ[i]), float3(node.mMaxX[i], node.mMaxY[i], node.mMaxZ[i])).Intersects(frustum))
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+// Returns a bitmask of the children that overlap the box
+inline uint32_t IntersectBvh4(const Bvh4Node& node, const AABB& box) {
+#ifdef BVH4_SSE
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.mMinX), _mm_set1_ps(box.mMax.x)), _mm_cmpge_ps(_mm_load_ps(node.mMaxX), _mm_set1_ps(box.mMin.x)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.mMinY), _mm_set1_ps(box.mMax.y)), _mm_cmpge_ps(_mm_load_ps(node.mMaxY), _mm_set1_ps(box.mMin.y))));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.mMinZ), _mm_set1_ps(box.mMax.z)), _mm_cmpge_ps(_mm_load_ps(node.mMaxZ), _mm_set1_ps(box.mMin.z))));
+	__m128 empty = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)node.mChild), _mm_set1_epi32(-1)));
+	return (uint32_t)_mm_movemask_ps(_mm_andnot_ps(empty, hit));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; i++)
+		if (node.mChild[i] != 0xFFFFFFFF && AABB(float3(node.mMinX[i], node.mMinY[i], node.mMinZ[i]), float3(node.mMaxX[i], node.mMaxY[i], node.mMaxZ[i])).Intersects(box))
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+// Returns a bitmask of the children within sqrt(maxDistance2) of the point, and writes each child's squared distance from the point to d2
+inline uint32_t DistanceBvh4(const Bvh4Node& node, const float3& point, float maxDistance2, float d2[4]) {
+#ifdef BVH4_SSE
+	__m128 zero = _mm_setzero_ps();
+	__m128 px = _mm_set1_ps(point.x);
+	__m128 py = _mm_set1_ps(point.y);
+	__m128 pz = _mm_set1_ps(point.z);
+	__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(node.mMinX), px), _mm_sub_ps(px, _mm_load_ps(node.mMaxX))), zero);
+	__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(node.mMinY), py), _mm_sub_ps(py, _mm_load_ps(node.mMaxY))), zero);
+	__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_load_ps(node.mMinZ), pz), _mm_sub_ps(pz, _mm_load_ps(node.mMaxZ))), zero);
+	__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+	_mm_storeu_ps(d2, d);
+	__m128 empty = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)node.mChild), _mm_set1_epi32(-1)));
+	return (uint32_t)_mm_movemask_ps(_mm_andnot_ps(empty, _mm_cmple_ps(d, _mm_set1_ps(maxDistance2))));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		d2[i] = AABB(float3(node.mMinX[i], node.mMinY[i], node.mMinZ[i]), float3(node.mMaxX[i], node.mMaxY[i], node.mMaxZ[i])).DistanceSquared(point);
+		if (node.mChild[i] != 0xFFFFFFFF && d2[i] <= maxDistance2)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+// Collapses a binary bvh into a four-wide bvh, by repeatedly opening the largest interior child until a node has four children.
+// children(node, left, right) returns false if the binary node is a leaf. Binary nodes need mBounds, mStartIndex and mCount.
+// If slots is not null, it receives node * 4 + slot for every binary node that is stored as a child of a four-wide node, and 0xFFFFFFFF for the rest.
+template<typename Node, typename Children>
+inline void CollapseBvh4(const std::vector<Node>& binary, uint32_t root, Children children, std::vector<Bvh4Node>& nodes, std::vector<uint32_t>* slots) {
+	nodes.clear();
+	if (slots) slots->assign(binary.size(), 0xFFFFFFFF);
+	if (root >= binary.size()) return;
+
+	struct CollapseTask {
+		uint32_t mBinaryNode;
+		uint32_t mNode;
+	};
+	std::vector<CollapseTask> todo;
+	nodes.push_back({});
+	todo.push_back({ root, 0 });
+
+	while (todo.size()) {
+		CollapseTask task = todo.back();
+		todo.pop_back();
+
+		uint32_t open[4];
+		uint32_t count = 0;
+		uint32_t l, r;
+		if (children(task.mBinaryNode, l, r)) {
+			open[count++] = l;
+			open[count++] = r;
+		} else
+			open[count++] = task.mBinaryNode;
+
+		while (count < 4) {
+			// Open the interior child with the largest surface area
+			int32_t best = -1;
+			float bestArea = -1;
+			for (uint32_t i = 0; i < count; i++) {
+				if (!children(open[i], l, r)) continue;
+				float area = binary[open[i]].mBounds.SurfaceArea();
+				if (area > bestArea) {
+					bestArea = area;
+					best = i;
+				}
+			}
+			if (best < 0) break;
+			children(open[best], l, r);
+			open[best] = l;
+			open[count++] = r;
+		}
+
+		Bvh4Node node;
+		node.Clear();
+		for (uint32_t i = 0; i < count; i++) {
+			const Node& b = binary[open[i]];
+			if (children(open[i], l, r)) {
+				node.SetChild(i, b.mBounds, (uint32_t)nodes.size(), 0);
+				todo.push_back({ open[i], (uint32_t)nodes.size() });
+				nodes.push_back({});
+			} else
+				node.SetChild(i, b.mBounds, b.mStartIndex, b.mCount);
+			if (slots) (*slots)[open[i]] = task.mNode * 4 + i;
+		}
+		nodes[task.mNode] = node;
+	}
+}
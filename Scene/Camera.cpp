@@ -244,6 +244,9 @@ void Camera::SetUniforms() {
 }
 void Camera::Set(CommandBuffer* commandBuffer) {
 	SetUniforms();
+	SetViewport(commandBuffer);
+}
+void Camera::SetViewport(CommandBuffer* commandBuffer) {
 	VkRect2D scissor{ { 0, 0 }, { FramebufferWidth(), FramebufferHeight() } };
 	vkCmdSetScissor(*commandBuffer, 0, 1, &scissor);
 	vkCmdSetViewport(*commandBuffer, 0, 1, &mViewport);
@@ -40,6 +40,8 @@ public:
 	ENGINE_EXPORT virtual void SetUniforms();
 	// Updates the uniform buffer and sets the non-stereo viewport
 	ENGINE_EXPORT virtual void Set(CommandBuffer* commandBuffer);
+	// Sets the non-stereo viewport and scissor, without touching the uniform buffer, for secondary command buffers recorded on other threads
+	ENGINE_EXPORT virtual void SetViewport(CommandBuffer* commandBuffer);
 	// Sets the viewport and StereoEye push constant
 	ENGINE_EXPORT virtual void SetStereoViewport(CommandBuffer* commandBuffer, ShaderVariant* shader, StereoEye eye);
 
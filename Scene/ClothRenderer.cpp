@@ -63,10 +63,14 @@ bool ClothRenderer::UpdateTransform() {
 	return true;
 }
 
-void ClothRenderer::FixedUpdate(CommandBuffer* commandBuffer) {
+void ClothRenderer::FixedUpdate(CommandBuffer* frameCommandBuffer) {
 	if (!mVertexBuffer) return;
 	::Mesh* m = MeshRenderer::Mesh();
 
+	// simulate on the compute queue, after the graphics queue is done drawing the last step
+	shared_ptr<CommandBuffer> commandBuffer = frameCommandBuffer->Device()->GetComputeCommandBuffer(mName + " Cloth");
+	commandBuffer->AddWait(frameCommandBuffer->Device()->GraphicsFence());
+
 	VkBufferMemoryBarrier b = {};
 	b.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
 	b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
@@ -107,13 +111,13 @@ void ClothRenderer::FixedUpdate(CommandBuffer* commandBuffer) {
 
 	Shader* shader = Scene()->AssetManager()->LoadShader("Shaders/cloth.stm");
 
-	Buffer* sphereBuffer = commandBuffer->Device()->GetTempBuffer("Cloth Spheres", sizeof(float4) * max(1u, mSphereColliders.size()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	TempBufferRange sphereBuffer = commandBuffer->Device()->GetTempBufferRange(sizeof(float4) * max(1u, mSphereColliders.size()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	for (uint32_t i = 0; i < mSphereColliders.size(); i++)
-		((float4*)sphereBuffer->MappedData())[i] = float4(mSphereColliders[i].first->WorldPosition(), mSphereColliders[i].second);
+		((float4*)sphereBuffer.mMapped)[i] = float4(mSphereColliders[i].first->WorldPosition(), mSphereColliders[i].second);
 	
-	Buffer* objBuffer = commandBuffer->Device()->GetTempBuffer("Cloth Obj", sizeof(float4x4) * 2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-	((float4x4*)objBuffer->MappedData())[0] = ObjectToWorld();
-	((float4x4*)objBuffer->MappedData())[1] = WorldToObject();
+	TempBufferRange objBuffer = commandBuffer->Device()->GetTempBufferRange(sizeof(float4x4) * 2, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
+	((float4x4*)objBuffer.mMapped)[0] = ObjectToWorld();
+	((float4x4*)objBuffer.mMapped)[1] = WorldToObject();
 
 	uint32_t vc = m->VertexCount();
 	uint32_t tc = m->IndexCount()/3;
@@ -131,7 +135,7 @@ void ClothRenderer::FixedUpdate(CommandBuffer* commandBuffer) {
 
 	ComputeShader* add = m->IndexType() == VK_INDEX_TYPE_UINT16 ? shader->GetCompute("AddForces", {}) : shader->GetCompute("AddForces", {"INDEX_UINT32"});
 	DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("AddForces", add->mDescriptorSetLayouts[0]);
-	ds->CreateUniformBufferDescriptor(objBuffer, 0, objBuffer->Size(), add->mDescriptorBindings.at("ObjectBuffer").second.binding);
+	ds->CreateUniformBufferDescriptor(objBuffer.mBuffer, objBuffer.mOffset, objBuffer.mSize, add->mDescriptorBindings.at("ObjectBuffer").second.binding);
 	ds->CreateStorageBufferDescriptor(m->VertexBuffer().get(), baseVertex, m->VertexBuffer()->Size() - baseVertex, add->mDescriptorBindings.at("SourceVertices").second.binding);
 	ds->CreateStorageBufferDescriptor(m->IndexBuffer().get(), baseIndex, m->IndexBuffer()->Size() - baseIndex, add->mDescriptorBindings.at("Triangles").second.binding);
 	ds->CreateStorageBufferDescriptor(mVertexBuffer, 0, mVertexBuffer->Size(), add->mDescriptorBindings.at("Vertices").second.binding);
@@ -171,11 +175,11 @@ void ClothRenderer::FixedUpdate(CommandBuffer* commandBuffer) {
 	ComputeShader* integrate = mPin ? shader->GetCompute("Integrate", { "PIN" }) : shader->GetCompute("Integrate", {});
 	ds = commandBuffer->Device()->GetTempDescriptorSet("Integrate0", integrate->mDescriptorSetLayouts[0]);
 	if (mPin) ds->CreateStorageBufferDescriptor(m->VertexBuffer().get(), baseVertex, m->VertexBuffer()->Size() - baseVertex, integrate->mDescriptorBindings.at("SourceVertices").second.binding);
-	ds->CreateUniformBufferDescriptor(objBuffer, 0, objBuffer->Size(), integrate->mDescriptorBindings.at("ObjectBuffer").second.binding);
+	ds->CreateUniformBufferDescriptor(objBuffer.mBuffer, objBuffer.mOffset, objBuffer.mSize, integrate->mDescriptorBindings.at("ObjectBuffer").second.binding);
 	ds->CreateStorageBufferDescriptor(mVertexBuffer, 0, mVertexBuffer->Size(), integrate->mDescriptorBindings.at("Vertices").second.binding);
 	ds->CreateStorageBufferDescriptor(mVelocityBuffer, 0, mVelocityBuffer->Size(), integrate->mDescriptorBindings.at("Velocities").second.binding);
 	ds->CreateStorageBufferDescriptor(mForceBuffer, 0, mForceBuffer->Size(), integrate->mDescriptorBindings.at("Forces").second.binding);
-	ds->CreateStorageBufferDescriptor(sphereBuffer, 0, sphereBuffer->Size(), integrate->mDescriptorBindings.at("Spheres").second.binding);
+	ds->CreateStorageBufferDescriptor(sphereBuffer.mBuffer, sphereBuffer.mOffset, sphereBuffer.mSize, integrate->mDescriptorBindings.at("Spheres").second.binding);
 	ds->FlushWrites();
 	vkCmdBindPipeline(*commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, integrate->mPipeline);
 	vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, integrate->mPipelineLayout, 0, 1, *ds, 0, nullptr);
@@ -214,25 +218,11 @@ void ClothRenderer::FixedUpdate(CommandBuffer* commandBuffer) {
 	vkCmdDispatch(*commandBuffer, (vc + 63) / 64, 1, 1);
 
 
-	b.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
-	b.buffer = *mVertexBuffer;
-	b.size = mVertexBuffer->Size();
-	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, nullptr, 1, &b, 0, nullptr);
+	commandBuffer->TransferOwnership(mVertexBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		frameCommandBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+	frameCommandBuffer->AddWait(frameCommandBuffer->Device()->Execute(commandBuffer));
 }
 
-void ClothRenderer::PreRender(CommandBuffer* commandBuffer, Camera* camera, PassType pass) {
-	if (!mVertexBuffer) return;
-
-	VkBufferMemoryBarrier b = {};
-	b.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	b.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
-	b.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
-	b.buffer = *mVertexBuffer;
-	b.size = mVertexBuffer->Size();
-	vkCmdPipelineBarrier(*commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, nullptr, 1, &b, 0, nullptr);
-}
 void ClothRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* camera, uint32_t instanceCount, VkDescriptorSet instanceDS, PassType pass) {
 	::Mesh* mesh = MeshRenderer::Mesh();
 
@@ -248,8 +238,10 @@ void ClothRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* camera,
 	commandBuffer->PushConstant(shader, "LightCount", &lc);
 	commandBuffer->PushConstant(shader, "ShadowTexelSize", &s);
 
-	if (instanceDS != VK_NULL_HANDLE)
+	if (instanceDS != VK_NULL_HANDLE) {
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, &instanceDS, 0, nullptr);
+		commandBuffer->mDescriptorSetBindCount++;
+	}
 
 	commandBuffer->BindVertexBuffer(mVertexBuffer, 0, 0);
 	commandBuffer->BindIndexBuffer(mesh->IndexBuffer().get(), 0, mesh->IndexType());
@@ -266,4 +258,7 @@ void ClothRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* camera,
 
 bool ClothRenderer::Intersect(const Ray& ray, float* t, bool any) {
 	return false;
+}
+bool ClothRenderer::Intersect(const Ray& ray, RaycastHit* hit, bool any) {
+	return false;
 }
\ No newline at end of file
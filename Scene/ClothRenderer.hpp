@@ -32,9 +32,11 @@ public:
 	inline virtual void AddSphereCollider(Object* obj, float radius) { mSphereColliders.push_back(std::make_pair(obj, radius)); }
 	
 	ENGINE_EXPORT virtual void FixedUpdate(CommandBuffer* commandBuffer) override;
-	ENGINE_EXPORT virtual void PreRender(CommandBuffer* commandBuffer, Camera* camera, PassType pass) override;
 
 	ENGINE_EXPORT bool Intersect(const Ray& ray, float* t, bool any) override;
+	ENGINE_EXPORT bool Intersect(const Ray& ray, RaycastHit* hit, bool any) override;
+	// The mesh's bvh doesn't match the deformed vertices, so rays are traced one at a time
+	inline uint32_t IntersectPacket(const Ray* rays, uint32_t rayMask, RaycastHit* hits, bool any) override { return Object::IntersectPacket(rays, rayMask, hits, any); }
 
 protected:
 	Buffer* mVertexBuffer;
@@ -60,11 +60,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 		VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr, camera);
 		if (!layout) return;
 
-		Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("WorldRects", mWorldRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-		memcpy(screenRects->MappedData(), mWorldRects.data(), mWorldRects.size() * sizeof(GuiRect));
+		TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(mWorldRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		memcpy(screenRects.mMapped, mWorldRects.data(), mWorldRects.size() * sizeof(GuiRect));
 
 		DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("WorldRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-		ds->CreateStorageBufferDescriptor(screenRects, 0, mWorldRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+		ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, mWorldRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 		ds->FlushWrites();
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *ds, 0, nullptr);
 
@@ -82,11 +82,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 		VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr, camera);
 		if (!layout) return;
 
-		Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("WorldRects", mWorldTextureRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-		memcpy(screenRects->MappedData(), mWorldTextureRects.data(), mWorldTextureRects.size() * sizeof(GuiRect));
+		TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(mWorldTextureRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		memcpy(screenRects.mMapped, mWorldTextureRects.data(), mWorldTextureRects.size() * sizeof(GuiRect));
 
 		DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("WorldRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-		ds->CreateStorageBufferDescriptor(screenRects, 0, mWorldTextureRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+		ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, mWorldTextureRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 		for (uint32_t i = 0; i < mTextureArray.size(); i++)
 			ds->CreateSampledTextureDescriptor(mTextureArray[i], i, shader->mDescriptorBindings.at("Textures").second.binding);
 		ds->FlushWrites();
@@ -108,11 +108,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 			VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr, camera);
 			if (!layout) return;
 
-			Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("WorldRects", info.rects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(screenRects->MappedData(), info.rects.data(), info.rects.size() * sizeof(GuiRect));
+			TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(info.rects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(screenRects.mMapped, info.rects.data(), info.rects.size() * sizeof(GuiRect));
 
 			DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("WorldRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(screenRects, 0, info.rects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+			ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, info.rects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 			ds->FlushWrites();
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *ds, 0, nullptr);
 
@@ -131,8 +131,8 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 		VkPipelineLayout layout = commandBuffer->BindShader(shader, PASS_MAIN, nullptr, camera);
 		if (!layout) return;
 
-		Buffer* transforms = commandBuffer->Device()->GetTempBuffer("Transforms", sizeof(float4x4) * mWorldStrings.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		float4x4* m = (float4x4*)transforms->MappedData();
+		TempBufferRange transforms = commandBuffer->Device()->GetTempBufferRange(sizeof(float4x4) * mWorldStrings.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		float4x4* m = (float4x4*)transforms.mMapped;
 		for (const GuiString& s : mWorldStrings) {
 			*m = s.mTransform;
 			m++;
@@ -163,8 +163,10 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 					}
 					it++;
 				}
-				if (!glyphBuffer)
+				if (!glyphBuffer) {
 					glyphBuffer = new Buffer("Glyph Buffer", commandBuffer->Device(), glyphCount * sizeof(TextGlyph), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+					glyphBuffer->SetMemoryCategory(MEMORY_CATEGORY_GUI);
+				}
 				
 				glyphBuffer->Upload(glyphs.data(), glyphCount * sizeof(TextGlyph));
 				
@@ -173,7 +175,7 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 
 			DescriptorSet* descriptorSet = commandBuffer->Device()->GetTempDescriptorSet(s.mFont->mName + " DescriptorSet", shader->mDescriptorSetLayouts[PER_OBJECT]);
 			descriptorSet->CreateSampledTextureDescriptor(s.mFont->Texture(), BINDING_START + 0);
-			descriptorSet->CreateStorageBufferDescriptor(transforms, 0, transforms->Size(), BINDING_START + 1);
+			descriptorSet->CreateStorageBufferDescriptor(transforms.mBuffer, transforms.mOffset, transforms.mSize, BINDING_START + 1);
 			descriptorSet->CreateStorageBufferDescriptor(glyphBuffer, 0, glyphBuffer->Size(), BINDING_START + 2);
 			descriptorSet->FlushWrites();
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *descriptorSet, 0, nullptr);
@@ -202,11 +204,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 			VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr);
 			if (!layout) return;
 
-			Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("ScreenRects", mScreenRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(screenRects->MappedData(), mScreenRects.data(), mScreenRects.size() * sizeof(GuiRect));
+			TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(mScreenRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(screenRects.mMapped, mScreenRects.data(), mScreenRects.size() * sizeof(GuiRect));
 
 			DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("ScreenRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(screenRects, 0, mScreenRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+			ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, mScreenRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 			ds->FlushWrites();
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *ds, 0, nullptr);
 
@@ -221,11 +223,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 			VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr);
 			if (!layout) return;
 
-			Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("ScreenRects", mScreenTextureRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(screenRects->MappedData(), mScreenTextureRects.data(), mScreenTextureRects.size() * sizeof(GuiRect));
+			TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(mScreenTextureRects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(screenRects.mMapped, mScreenTextureRects.data(), mScreenTextureRects.size() * sizeof(GuiRect));
 
 			DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("ScreenRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(screenRects, 0, mScreenTextureRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+			ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, mScreenTextureRects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 			for (uint32_t i = 0; i < mTextureArray.size(); i++)
 				ds->CreateSampledTextureDescriptor(mTextureArray[i], i, shader->mDescriptorBindings.at("Textures").second.binding);
 			ds->FlushWrites();
@@ -245,11 +247,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 				VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr, camera);
 				if (!layout) return;
 
-				Buffer* screenRects = commandBuffer->Device()->GetTempBuffer("ScreenRects", info.rects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-				memcpy(screenRects->MappedData(), info.rects.data(), info.rects.size() * sizeof(GuiRect));
+				TempBufferRange screenRects = commandBuffer->Device()->GetTempBufferRange(info.rects.size() * sizeof(GuiRect), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+				memcpy(screenRects.mMapped, info.rects.data(), info.rects.size() * sizeof(GuiRect));
 
 				DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("ScreenRects", shader->mDescriptorSetLayouts[PER_OBJECT]);
-				ds->CreateStorageBufferDescriptor(screenRects, 0, info.rects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
+				ds->CreateStorageBufferDescriptor(screenRects.mBuffer, screenRects.mOffset, info.rects.size() * sizeof(GuiRect), shader->mDescriptorBindings.at("Rects").second.binding);
 				ds->FlushWrites();
 				vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *ds, 0, nullptr);
 
@@ -291,8 +293,10 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 						}
 						it++;
 					}
-					if (!glyphBuffer)
+					if (!glyphBuffer) {
 						glyphBuffer = new Buffer("Glyph Buffer", commandBuffer->Device(), glyphCount * sizeof(TextGlyph), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+						glyphBuffer->SetMemoryCategory(MEMORY_CATEGORY_GUI);
+					}
 					
 					glyphBuffer->Upload(glyphs.data(), glyphCount * sizeof(TextGlyph));
 					bc.mGlyphCache.emplace(key, make_pair(glyphBuffer, 8u));
@@ -318,11 +322,11 @@ void GUI::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 			VkPipelineLayout layout = commandBuffer->BindShader(shader, pass, nullptr, nullptr, VK_PRIMITIVE_TOPOLOGY_LINE_STRIP);
 			if (!layout) return;
 
-			Buffer* b = commandBuffer->Device()->GetTempBuffer("Perf Graph Pts", sizeof(float2) * mLinePoints.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-			memcpy(b->MappedData(), mLinePoints.data(), sizeof(float2) * mLinePoints.size());
+			TempBufferRange b = commandBuffer->Device()->GetTempBufferRange(sizeof(float2) * mLinePoints.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+			memcpy(b.mMapped, mLinePoints.data(), sizeof(float2) * mLinePoints.size());
 			
 			DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("Perf Graph DS", shader->mDescriptorSetLayouts[PER_OBJECT]);
-			ds->CreateStorageBufferDescriptor(b, 0, sizeof(float2) * mLinePoints.size(), INSTANCE_BUFFER_BINDING);
+			ds->CreateStorageBufferDescriptor(b.mBuffer, b.mOffset, sizeof(float2) * mLinePoints.size(), INSTANCE_BUFFER_BINDING);
 			ds->FlushWrites();
 
 			vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, *ds, 0, nullptr);
@@ -300,6 +300,7 @@ void Gizmos::Draw(CommandBuffer* commandBuffer, PassType pass, Camera* camera) {
 		gizmoBuffer = b;
 	}
 
+	// the textures are written every frame, so textures moved by Device::Defragment() are re-written here. the host-visible instance buffers are never moved
 	VkDescriptorSetLayoutBinding b = shader->mDescriptorBindings.at("MainTexture").second;
 	for (uint32_t i = 0; i < mTextures.size(); i++)
 		gizmoDS->CreateSampledTextureDescriptor(mTextures[i], i, b.binding);
@@ -22,6 +22,12 @@ bool MeshRenderer::UpdateTransform() {
 	return true;
 }
 
+uint64_t MeshRenderer::DrawKey(PassType pass) {
+	if (!mMaterial || !Mesh()) return Renderer::DrawKey(pass);
+	GraphicsShader* shader = mMaterial->GetShader(pass);
+	return PackDrawKey(RenderQueue(), shader ? shader->mId : 0, mMaterial->Id(), Mesh()->Id());
+}
+
 void MeshRenderer::PreRender(CommandBuffer* commandBuffer, Camera* camera, PassType pass) {
 	if (pass == PASS_MAIN) Scene()->Environment()->SetEnvironment(camera, mMaterial.get());
 }
@@ -41,8 +47,10 @@ void MeshRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* camera, u
 	commandBuffer->PushConstant(shader, "LightCount", &lc);
 	commandBuffer->PushConstant(shader, "ShadowTexelSize", &s);
 	
-	if (instanceDS != VK_NULL_HANDLE)
+	if (instanceDS != VK_NULL_HANDLE) {
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, &instanceDS, 0, nullptr);
+		commandBuffer->mDescriptorSetBindCount++;
+	}
 
 	commandBuffer->BindVertexBuffer(mesh->VertexBuffer().get(), 0, 0);
 	commandBuffer->BindIndexBuffer(mesh->IndexBuffer().get(), 0, mesh->IndexType());
@@ -69,6 +77,48 @@ bool MeshRenderer::Intersect(const Ray& ray, float* t, bool any) {
 	r.mDirection = (WorldToObject() * float4(ray.mDirection, 0)).xyz;
 	return m->Intersect(r, t, any);
 }
+bool MeshRenderer::Intersect(const Ray& ray, RaycastHit* hit, bool any) {
+	::Mesh* m = Mesh();
+	if (!m) return false;
+	Ray r;
+	r.mOrigin = (WorldToObject() * float4(ray.mOrigin, 1)).xyz;
+	r.mDirection = (WorldToObject() * float4(ray.mDirection, 0)).xyz;
+	// the direction isn't normalized, so t is the same in object and world space
+	if (!m->Intersect(r, hit, any)) return false;
+	hit->mObject = this;
+	hit->mNormal = normalize((transpose(WorldToObject()) * float4(hit->mNormal, 0)).xyz);
+	return true;
+}
+uint32_t MeshRenderer::IntersectPacket(const Ray* rays, uint32_t rayMask, RaycastHit* hits, bool any) {
+	::Mesh* m = Mesh();
+	if (!m) return 0;
+	float4x4 worldToObject = WorldToObject();
+	float4x4 normalMatrix = transpose(worldToObject);
+
+	// Gather the active rays into a packet of their own
+	Ray packet[RAY_PACKET_SIZE];
+	RaycastHit packetHits[RAY_PACKET_SIZE];
+	uint32_t index[RAY_PACKET_SIZE];
+	uint32_t count = 0;
+	for (uint32_t r = 0; r < RAY_PACKET_SIZE; r++) {
+		if ((rayMask & (1 << r)) == 0) continue;
+		packet[count].mOrigin = (worldToObject * float4(rays[r].mOrigin, 1)).xyz;
+		packet[count].mDirection = (worldToObject * float4(rays[r].mDirection, 0)).xyz;
+		index[count++] = r;
+	}
+
+	uint32_t packetMask = m->IntersectPacket(packet, count, packetHits, any);
+	uint32_t hitMask = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if ((packetMask & (1 << i)) == 0) continue;
+		RaycastHit& hit = hits[index[i]];
+		hit = packetHits[i];
+		hit.mObject = this;
+		hit.mNormal = normalize((normalMatrix * float4(hit.mNormal, 0)).xyz);
+		hitMask |= 1 << index[i];
+	}
+	return hitMask;
+}
 
 void MeshRenderer::DrawGizmos(CommandBuffer* commandBuffer, Camera* camera) {
 	if (!Mesh()) return;
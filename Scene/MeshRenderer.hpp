@@ -27,11 +27,15 @@ public:
 	inline virtual PassType PassMask() override { return mMaterial ? mMaterial->PassMask() : Renderer::PassMask(); }
 	inline virtual bool Visible() override { return mVisible && Mesh() && mMaterial && EnabledHierarchy(); }
 	inline virtual uint32_t RenderQueue() override { return mMaterial ? mMaterial->RenderQueue() : Renderer::RenderQueue(); }
+	ENGINE_EXPORT virtual uint64_t DrawKey(PassType pass) override;
 
 	ENGINE_EXPORT virtual void PreRender(CommandBuffer* commandBuffer, Camera* camera, PassType pass) override;
 	ENGINE_EXPORT virtual void Draw(CommandBuffer* commandBuffer, Camera* camera, PassType pass) override;
 
 	ENGINE_EXPORT virtual bool Intersect(const Ray& ray, float* t, bool any) override;
+	ENGINE_EXPORT virtual bool Intersect(const Ray& ray, RaycastHit* hit, bool any) override;
+	// Transforms the rays into object space once and traces them through the mesh's bvh together
+	ENGINE_EXPORT virtual uint32_t IntersectPacket(const Ray* rays, uint32_t rayMask, RaycastHit* hits, bool any) override;
 	inline virtual AABB Bounds() override { UpdateTransform(); return mAABB; }
 
 	ENGINE_EXPORT virtual void DrawGizmos(CommandBuffer* commandBuffer, Camera* camera) override;
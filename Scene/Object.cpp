@@ -5,27 +5,37 @@
 using namespace std;
 
 Object::Object(const string& name)
-	: mName(name), mParent(nullptr), mScene(nullptr), mLayerMask(0),
+	: mName(name), mParent(nullptr), mScene(nullptr), mSceneHandle(INVALID_SLOT_HANDLE), mBvhLeaf(0xFFFFFFFF), mLayerMask(0), mHierarchy(nullptr), mTransform(0), mTransformVersion(0),
 	mLocalPosition(float3()), mLocalRotation(quaternion(0, 0, 0, 1)), mLocalScale(float3(1)),
 	mWorldPosition(float3()), mWorldRotation(quaternion(0, 0, 0, 1)),
-	mObjectToWorld(float4x4(1)), mWorldToObject(float4x4(1)), mTransformDirty(true), mEnabled(true) {
+	mObjectToWorld(float4x4(1)), mWorldToObject(float4x4(1)), mTransformDirty(true), mEnabled(true), mEnabledHierarchy(0) {
 	Dirty();
 }
 Object::~Object() {
 	while (mChildren.size())
 		RemoveChild(mChildren[0]);
 	if (mParent) mParent->RemoveChild(this);
+	if (mHierarchy) mHierarchy->Remove(this);
 }
 
 bool Object::UpdateTransform() {
+	if (mHierarchy) {
+		uint32_t version = mHierarchy->UpdateTransform(mTransform);
+		if (version == mTransformVersion) return false;
+		mTransformVersion = version;
+		float3 p = mHierarchy->mObjectToWorld[mTransform][3].xyz;
+		mBounds = AABB(p, p);
+		return true;
+	}
+
 	if (!mTransformDirty) return false;
 
 	mObjectToParent = float4x4::TRS(mLocalPosition, mLocalRotation, mLocalScale);
 
 	if (mParent) {
 		mObjectToWorld = mParent->ObjectToWorld() * mObjectToParent;
-		mWorldPosition = (mParent->mObjectToWorld * float4(mLocalPosition, 1.f)).xyz;
-		mWorldRotation = mParent->mWorldRotation * mLocalRotation;
+		mWorldPosition = mObjectToWorld[3].xyz;
+		mWorldRotation = mParent->WorldRotation() * mLocalRotation;
 	} else {
 		mObjectToWorld = mObjectToParent;
 		mWorldPosition = mLocalPosition;
@@ -54,6 +64,9 @@ void Object::AddChild(Object* c) {
 
 	mChildren.push_back(c);
 	c->mParent = this;
+	c->InvalidateEnabledHierarchy();
+	if (c->mHierarchy) c->mHierarchy->Reparent(c);
+	if (mHierarchy && mHierarchy != c->mHierarchy) mHierarchy->Reparent(c);
 	c->Dirty();
 }
 void Object::RemoveChild(Object* c) {
@@ -66,26 +79,23 @@ void Object::RemoveChild(Object* c) {
 			it++;
 
 	c->mParent = nullptr;
+	c->InvalidateEnabledHierarchy();
+	if (c->mHierarchy) c->mHierarchy->Reparent(c);
 	c->Dirty();
 }
 
 void Object::Dirty() {
-	if (mScene && LayerMask()) mScene->BvhDirty(this);
+	if (mHierarchy) {
+		mHierarchy->Dirty(this);
+		return;
+	}
 
+	// the descendants of a dirty object are already dirty
+	if (mTransformDirty) return;
 	mTransformDirty = true;
-	queue<Object*> objs;
 	for (Object* c : mChildren) {
 		if (c == this) fprintf_color(COLOR_RED, stderr, "Loop in heirarchy! %s -> %s\n", c->mName.c_str(), mName.c_str());
-		else objs.push(c);
-	}
-	while (!objs.empty()) {
-		Object* c = objs.front();
-		objs.pop();
-		c->mTransformDirty = true;
-		if (mScene && c->LayerMask()) mScene->BvhDirty(this);
-		for (Object* o : c->mChildren)
-			if (o == this) fprintf_color(COLOR_RED, stderr, "Loop in heirarchy! %s -> %s\n", c->mName.c_str(), mName.c_str());
-			else objs.push(o);
+		else c->Dirty();
 	}
 }
 
@@ -94,11 +104,38 @@ AABB Object::Bounds() {
 	return mBounds;
 }
 
+void Object::Enabled(bool e) {
+	if (mEnabled == e) return;
+	mEnabled = e;
+	InvalidateEnabledHierarchy();
+}
+
+void Object::InvalidateEnabledHierarchy() {
+	// the ancestors of a valid object are valid, so the descendants of an invalid object are already invalid
+	if (!(mEnabledHierarchy.load(memory_order_relaxed) & ENABLED_HIERARCHY_VALID)) return;
+	mEnabledHierarchy.store(0, memory_order_relaxed);
+	for (Object* c : mChildren) c->InvalidateEnabledHierarchy();
+}
+
 bool Object::EnabledHierarchy() {
-	Object* o = this;
-	while (o) {
-		if (!o->mEnabled) return false;
-		o = o->mParent;
+	uint32_t cached = mEnabledHierarchy.load(memory_order_relaxed);
+	if (cached & ENABLED_HIERARCHY_VALID) return cached & ENABLED_HIERARCHY_ENABLED;
+
+	// walk up to the first ancestor that is cached, then fill in the objects below it
+	static thread_local vector<Object*> uncached;
+	uncached.clear();
+	bool enabled = true;
+	for (Object* o = this; o; o = o->mParent) {
+		cached = o->mEnabledHierarchy.load(memory_order_relaxed);
+		if (cached & ENABLED_HIERARCHY_VALID) {
+			enabled = cached & ENABLED_HIERARCHY_ENABLED;
+			break;
+		}
+		uncached.push_back(o);
 	}
-	return true;
+	for (auto it = uncached.rbegin(); it != uncached.rend(); it++) {
+		enabled = enabled && (*it)->mEnabled;
+		(*it)->mEnabledHierarchy.store(ENABLED_HIERARCHY_VALID | (enabled ? ENABLED_HIERARCHY_ENABLED : 0), memory_order_relaxed);
+	}
+	return enabled;
 }
\ No newline at end of file
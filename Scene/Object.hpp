@@ -1,21 +1,50 @@
 #pragma once
 
 #include <Core/CommandBuffer.hpp>
+#include <Scene/Bvh4.hpp>
+#include <Scene/TransformHierarchy.hpp>
+#include <Util/SlotMap.hpp>
 #include <Util/Util.hpp>
 
+#include <atomic>
+
+// Bits of Object::mEnabledHierarchy
+#define ENABLED_HIERARCHY_ENABLED 1u // the cached value of EnabledHierarchy()
+#define ENABLED_HIERARCHY_VALID 2u // cleared for an object's subtree when it is enabled, disabled or reparented
+
 class Camera;
+class Object;
 class Scene;
 
-// A hierarchical object in a Scene. Keeps track of a transform internally that is updated on-demand during getter functions
+// A ray's closest (or any) intersection with an object
+struct RaycastHit {
+	float mT;
+	Object* mObject;
+	// index of the triangle that was hit, 0xFFFFFFFF if the object is not made of triangles
+	uint32_t mTriangle;
+	// weights of the triangle's second and third vertex, the first vertex has weight 1 - x - y
+	float2 mBarycentrics;
+	// world-space surface normal, interpolated from the vertices if the mesh has normals. 0 if the object is not made of triangles.
+	float3 mNormal;
+	// uv interpolated from the vertices, 0 if the mesh has no uvs
+	float2 mTexcoord;
+};
+
+// A hierarchical object in a Scene. Its transform is updated on-demand during getter functions, or by the scene's TransformHierarchy once per frame.
+// Objects that aren't in a TransformHierarchy keep track of their transform internally.
 class Object {
 public:
 	const std::string mName;
-	bool mEnabled;
 
 	ENGINE_EXPORT Object(const std::string& name);
 	ENGINE_EXPORT ~Object();
 
 	inline ::Scene* Scene() const { return mScene; }
+	// Handle to this object in its scene, see Scene::FindObject()
+	inline SlotHandle SceneHandle() const { return mSceneHandle; }
+
+	inline bool Enabled() const { return mEnabled; }
+	ENGINE_EXPORT void Enabled(bool e);
 
 	inline Object* Parent() const { return mParent; }
 	ENGINE_EXPORT void AddChild(Object* obj);
@@ -24,25 +53,25 @@ public:
 	inline uint32_t ChildCount() const { return (uint32_t)mChildren.size(); }
 	inline Object* Child(uint32_t index) const { return mChildren[index]; }
 
-	inline float3 WorldPosition() { UpdateTransform(); return mWorldPosition; }
-	inline quaternion WorldRotation() { UpdateTransform(); return mWorldRotation; }
+	inline float3 WorldPosition() { UpdateTransform(); return mHierarchy ? mHierarchy->mObjectToWorld[mTransform][3].xyz : mWorldPosition; }
+	inline quaternion WorldRotation() { UpdateTransform(); return mHierarchy ? mHierarchy->mWorldRotation[mTransform] : mWorldRotation; }
 
-	inline float3 LocalPosition() { UpdateTransform(); return mLocalPosition; }
-	inline quaternion LocalRotation() { UpdateTransform(); return mLocalRotation; }
-	inline float3 LocalScale() { UpdateTransform(); return mLocalScale; }
-	inline float3 WorldScale() { UpdateTransform(); return mWorldScale; }
+	inline float3 LocalPosition() { UpdateTransform(); return LocalPositionData(); }
+	inline quaternion LocalRotation() { UpdateTransform(); return LocalRotationData(); }
+	inline float3 LocalScale() { UpdateTransform(); return LocalScaleData(); }
+	inline float3 WorldScale() { UpdateTransform(); return mHierarchy ? mHierarchy->mWorldScale[mTransform] : mWorldScale; }
 
-	inline float4x4 ObjectToParent() { UpdateTransform(); return mObjectToParent; }
-	inline float4x4 ObjectToWorld() { UpdateTransform(); return mObjectToWorld; }
-	inline float4x4 WorldToObject() { UpdateTransform(); return mWorldToObject; }
+	inline float4x4 ObjectToParent() { UpdateTransform(); return mHierarchy ? mHierarchy->mObjectToParent[mTransform] : mObjectToParent; }
+	inline float4x4 ObjectToWorld() { UpdateTransform(); return mHierarchy ? mHierarchy->mObjectToWorld[mTransform] : mObjectToWorld; }
+	inline float4x4 WorldToObject() { UpdateTransform(); return mHierarchy ? mHierarchy->mWorldToObject[mTransform] : mWorldToObject; }
 
-	inline virtual void LocalPosition(const float3& p) { mLocalPosition = p; Dirty(); }
-	inline virtual void LocalRotation(const quaternion& r) { mLocalRotation = r; Dirty(); }
-	inline virtual void LocalScale(const float3& s) { mLocalScale = s; Dirty(); }
+	inline virtual void LocalPosition(const float3& p) { LocalPositionData() = p; Dirty(); }
+	inline virtual void LocalRotation(const quaternion& r) { LocalRotationData() = r; Dirty(); }
+	inline virtual void LocalScale(const float3& s) { LocalScaleData() = s; Dirty(); }
 
-	inline virtual void LocalPosition(float x, float y, float z) { mLocalPosition.x = x; mLocalPosition.y = y; mLocalPosition.z = z; Dirty(); }
-	inline virtual void LocalScale(float x, float y, float z) { mLocalScale.x = x; mLocalScale.y = y; mLocalScale.z = z; Dirty(); }
-	inline virtual void LocalScale(float x) { mLocalScale.x = x; mLocalScale.y = x; mLocalScale.z = x; Dirty(); }
+	inline virtual void LocalPosition(float x, float y, float z) { LocalPositionData() = float3(x, y, z); Dirty(); }
+	inline virtual void LocalScale(float x, float y, float z) { LocalScaleData() = float3(x, y, z); Dirty(); }
+	inline virtual void LocalScale(float x) { LocalScaleData() = float3(x); Dirty(); }
 
 	ENGINE_EXPORT virtual AABB Bounds();
 
@@ -50,19 +79,58 @@ public:
 	inline virtual void DrawGizmos(CommandBuffer* commandBuffer, Camera* camera) {};
 	
 	// Returns true only if this object and all its ancestors are enabled
+	// The result is cached until this object or one of its ancestors is enabled, disabled or reparented, so this is O(1) in between
 	ENGINE_EXPORT bool EnabledHierarchy();
 
 	// Returns true when an intersection occurs, assigns t to the intersection time if t is not null
 	// If any is true, will return the first hit, otherwise will return the closest hit
 	inline virtual bool Intersect(const Ray& ray, float* t, bool any) { return false; }
-	// If LayerMask != 0 then the object will be included in the scene's BVH and moving the object will trigger BVH builds
+	// Fills in a hit record for the intersection. Objects that aren't made of triangles only need to implement the version above.
+	inline virtual bool Intersect(const Ray& ray, RaycastHit* hit, bool any) {
+		if (!Intersect(ray, &hit->mT, any)) return false;
+		hit->mObject = this;
+		hit->mTriangle = 0xFFFFFFFF;
+		hit->mBarycentrics = 0;
+		hit->mNormal = 0;
+		hit->mTexcoord = 0;
+		return true;
+	}
+	// Intersects the rays of a packet whose bits are set in rayMask, and returns a mask of the rays that hit the object
+	// hits[r] is only written for rays that hit. Objects that can trace rays together should override this, the default traces them one at a time.
+	inline virtual uint32_t IntersectPacket(const Ray* rays, uint32_t rayMask, RaycastHit* hits, bool any) {
+		uint32_t hitMask = 0;
+		for (uint32_t r = 0; r < RAY_PACKET_SIZE; r++)
+			if ((rayMask & (1 << r)) && Intersect(rays[r], &hits[r], any))
+				hitMask |= 1 << r;
+		return hitMask;
+	}
+	// If LayerMask != 0 then the object will be included in the scene's BVH and moving the object will trigger BVH updates
 	// Note Renderers should OR this with their PassMask()
 	inline virtual void LayerMask(uint32_t m) { mLayerMask = m; };
 	inline virtual uint32_t LayerMask() { return mLayerMask; };
 
 private:
 	friend class ::Scene;
+	friend class ObjectBvh2;
+	friend class TransformHierarchy;
 	::Scene* mScene;
+	SlotHandle mSceneHandle;
+	bool mEnabled;
+	// The cached EnabledHierarchy(), in ENABLED_HIERARCHY_* bits
+	std::atomic<uint32_t> mEnabledHierarchy;
+	ENGINE_EXPORT void InvalidateEnabledHierarchy();
+	// Index of this object's leaf in the scene's bvh, which stays valid until the object is removed or the bvh is rebuilt
+	uint32_t mBvhLeaf;
+
+	// The hierarchy that holds this object's transform, and the index of it. The members below are only used when this is nullptr.
+	TransformHierarchy* mHierarchy;
+	uint32_t mTransform;
+	// mHierarchy's version of the transform that UpdateTransform() last saw
+	uint32_t mTransformVersion;
+
+	inline float3& LocalPositionData() { return mHierarchy ? mHierarchy->mLocalPosition[mTransform] : mLocalPosition; }
+	inline quaternion& LocalRotationData() { return mHierarchy ? mHierarchy->mLocalRotation[mTransform] : mLocalRotation; }
+	inline float3& LocalScaleData() { return mHierarchy ? mHierarchy->mLocalScale[mTransform] : mLocalScale; }
 
 	bool mTransformDirty;
 	float3 mLocalPosition;
@@ -3,11 +3,221 @@
 #include <Scene/Scene.hpp>
 #include <Scene/Renderer.hpp>
 
+#include <atomic>
+
+// Smallest number of objects handed to a worker thread as an independent subtree
+#define MIN_SUBTREE_SIZE 2048
+// Smallest number of rays in a batch for each worker thread
+#define MIN_THREAD_RAYS 256
+// Number of rays a thread takes from a batch at a time, so that neighboring rays are traced by the same thread. A multiple of RAY_PACKET_SIZE.
+#define RAYS_PER_TASK 64
+// Bits of each axis in the Morton codes of the LBVH builder
+#define MORTON_BITS 10
+// Bits sorted by each pass of the LBVH builder's radix sort
+#define RADIX_BITS 10
+// Traversal stacks up to this size live on the call stack, deeper trees use a vector
+#define TRAVERSAL_STACK_SIZE 256
+
 using namespace std;
 
-void ObjectBvh2::Build(Object** objects, uint32_t objectCount) {
+uint32_t ObjectBvh2::Split(uint32_t start, uint32_t end, AABB& bounds) {
+	// Calculate the bounding box for this node
+	AABB bb(mPrimitives[start].mBounds);
+	AABB bc(mPrimitives[start].mBounds.Center(), mPrimitives[start].mBounds.Center());
+	for (uint32_t p = start + 1; p < end; ++p) {
+		bb.Encapsulate(mPrimitives[p].mBounds);
+		bc.Encapsulate(mPrimitives[p].mBounds.Center());
+	}
+	bounds = bb;
+
+	// If the number of primitives at this point is less than the leaf
+	// size, then this will become a leaf.
+	if (end - start <= 1) return end;
+
+	// Set the split dimensions
+	uint32_t split_dim = 0;
+	float3 ext = bc.Extents();
+	if (ext.y > ext.x) {
+		split_dim = 1;
+		if (ext.z > ext.y) split_dim = 2;
+	} else
+		if (ext.z > ext.x) split_dim = 2;
+
+	// Split on the center of the longest axis
+	float split_coord = .5f * (bc.mMin[split_dim] + bc.mMax[split_dim]);
+
+	// Partition the list of objects on this split
+	uint32_t mid = start;
+	for (uint32_t i = start; i < end; ++i)
+		if (mPrimitives[i].mBounds.Center()[split_dim] < split_coord) {
+			swap(mPrimitives[i], mPrimitives[mid]);
+			mid++;
+		}
+
+	// If we get a bad split, just choose the center...
+	if (mid == start || mid == end)
+		mid = start + (end - start) / 2;
+
+	return mid;
+}
+
+void ObjectBvh2::BuildSubtree(vector<Node>& nodes, uint32_t start, uint32_t end) {
+	struct BuildTask {
+		uint32_t mParentOffset;
+		uint32_t mStart;
+		uint32_t mEnd;
+	};
+
+	// Nodes are written depth-first, so the left child always directly follows its parent.
+	// Right children patch their parent's mRight offset once they are written.
+	const uint32_t noParent = 0xFFFFFFFF;
+	vector<BuildTask> todo;
+	todo.push_back({ noParent, start, end });
+
+	while (todo.size()) {
+		// Pop the next item off of the stack
+		BuildTask bnode = todo.back();
+		todo.pop_back();
+
+		uint32_t nodeIndex = (uint32_t)nodes.size();
+		if (bnode.mParentOffset != noParent)
+			nodes[bnode.mParentOffset].mRight = nodeIndex - bnode.mParentOffset;
+
+		Node node;
+		node.mStartIndex = bnode.mStart;
+		node.mCount = bnode.mEnd - bnode.mStart;
+		node.mLeft = INVALID_NODE;
+		node.mRight = 0; // leaf until its right child is written
+		node.mParent = INVALID_NODE;
+		uint32_t mid = Split(bnode.mStart, bnode.mEnd, node.mBounds);
+		nodes.push_back(node);
+
+		if (mid == bnode.mEnd) continue;
+
+		todo.push_back({ nodeIndex, mid, bnode.mEnd });
+		todo.push_back({ noParent, bnode.mStart, mid });
+	}
+}
+
+// Spreads the lower 10 bits of v out to every third bit
+static inline uint32_t ExpandBits(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+void ObjectBvh2::BuildLbvh() {
+	uint32_t count = (uint32_t)mPrimitives.size();
+
+	AABB bc(mPrimitives[0].mBounds.Center(), mPrimitives[0].mBounds.Center());
+	for (uint32_t i = 1; i < count; i++)
+		bc.Encapsulate(mPrimitives[i].mBounds.Center());
+	float3 extent = bc.mMax - bc.mMin;
+	float3 scale;
+	for (uint32_t i = 0; i < 3; i++)
+		scale[i] = extent[i] > 0 ? ((1 << MORTON_BITS) - 1) / extent[i] : 0;
+
+	// Sort (code, primitive) pairs with an LSD radix sort, which keeps equal codes in their original order
+	vector<uint2> keys(count);
+	vector<uint2> sorted(count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint3 q = (uint3)min((mPrimitives[i].mBounds.Center() - bc.mMin) * scale, float3((1 << MORTON_BITS) - 1));
+		keys[i] = uint2((ExpandBits(q.x) << 2) | (ExpandBits(q.y) << 1) | ExpandBits(q.z), i);
+	}
+	const uint32_t bucketCount = 1 << RADIX_BITS;
+	vector<uint32_t> offsets(bucketCount);
+	for (uint32_t shift = 0; shift < MORTON_BITS * 3; shift += RADIX_BITS) {
+		memset(offsets.data(), 0, sizeof(uint32_t) * bucketCount);
+		for (uint32_t i = 0; i < count; i++)
+			offsets[(keys[i].x >> shift) & (bucketCount - 1)]++;
+		uint32_t sum = 0;
+		for (uint32_t b = 0; b < bucketCount; b++) {
+			uint32_t c = offsets[b];
+			offsets[b] = sum;
+			sum += c;
+		}
+		for (uint32_t i = 0; i < count; i++)
+			sorted[offsets[(keys[i].x >> shift) & (bucketCount - 1)]++] = keys[i];
+		keys.swap(sorted);
+	}
+
+	vector<Primitive> primitives(count);
+	vector<uint32_t> codes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		primitives[i] = mPrimitives[keys[i].y];
+		codes[i] = keys[i].x;
+	}
+	mPrimitives.swap(primitives);
+
+	// Emit the nodes depth-first, like BuildSubtree(). Bounds are filled in bottom-up afterwards.
+	struct BuildTask {
+		uint32_t mParentOffset;
+		uint32_t mStart;
+		uint32_t mEnd;
+	};
+	const uint32_t noParent = 0xFFFFFFFF;
+	mNodes.reserve(count * 2 - 1);
+	vector<BuildTask> todo;
+	todo.push_back({ noParent, 0, count });
+	while (todo.size()) {
+		BuildTask bnode = todo.back();
+		todo.pop_back();
+
+		uint32_t nodeIndex = (uint32_t)mNodes.size();
+		if (bnode.mParentOffset != noParent)
+			mNodes[bnode.mParentOffset].mRight = nodeIndex - bnode.mParentOffset;
+
+		Node node;
+		node.mBounds = mPrimitives[bnode.mStart].mBounds;
+		node.mStartIndex = bnode.mStart;
+		node.mCount = bnode.mEnd - bnode.mStart;
+		node.mLeft = INVALID_NODE;
+		node.mRight = 0;
+		node.mParent = INVALID_NODE;
+		mNodes.push_back(node);
+
+		if (bnode.mEnd - bnode.mStart <= 1) continue;
+
+		uint32_t first = codes[bnode.mStart];
+		uint32_t last = codes[bnode.mEnd - 1];
+		uint32_t mid;
+		if (first == last)
+			mid = bnode.mStart + (bnode.mEnd - bnode.mStart) / 2;
+		else {
+			// Codes in the node share every bit above the highest differing bit, so the codes with that bit set come last
+			uint32_t bit = first ^ last;
+			bit |= bit >> 1;
+			bit |= bit >> 2;
+			bit |= bit >> 4;
+			bit |= bit >> 8;
+			bit |= bit >> 16;
+			bit ^= bit >> 1;
+			uint32_t splitCode = (first & ~(bit | (bit - 1))) | bit;
+			mid = (uint32_t)(lower_bound(codes.begin() + bnode.mStart, codes.begin() + bnode.mEnd, splitCode) - codes.begin());
+		}
+
+		todo.push_back({ nodeIndex, mid, bnode.mEnd });
+		todo.push_back({ noParent, bnode.mStart, mid });
+	}
+
+	// Children are always stored after their parent
+	for (uint32_t ni = (uint32_t)mNodes.size(); ni-- > 0;) {
+		Node& node = mNodes[ni];
+		if (node.mRight == 0) continue;
+		node.mBounds = mNodes[ni + 1].mBounds;
+		node.mBounds.Encapsulate(mNodes[ni + node.mRight].mBounds);
+	}
+}
+
+void ObjectBvh2::Build(Object** objects, uint32_t objectCount, uint32_t threadCount) {
 	mPrimitives.clear();
 	mNodes.clear();
+	mFreeNodes.clear();
+	mFreePrimitives.clear();
+	mDirtyPrimitives.clear();
+	mRendererBoundsDirty = false;
 
 	mRendererBounds.mMin = 1e10f;
 	mRendererBounds.mMax = -1e10f;
@@ -16,208 +226,836 @@ void ObjectBvh2::Build(Object** objects, uint32_t objectCount) {
 		AABB aabb(objects[i]->Bounds());
 		aabb.mMin -= 1e-2f;
 		aabb.mMax += 1e-2f;
-		mPrimitives.push_back({ aabb, objects[i] });
+		bool renderer = dynamic_cast<Renderer*>(objects[i]) != nullptr;
+		mPrimitives.push_back({ aabb, objects[i], renderer, false });
 
-		if (dynamic_cast<Renderer*>(objects[i]))
-			mRendererBounds.Encapsulate(aabb);
+		if (renderer) mRendererBounds.Encapsulate(aabb);
+	}
+	if (mPrimitives.empty()) {
+		FinishBuild();
+		return;
 	}
 
-	struct BuildTask {
-		uint32_t mParentOffset;
+	if (mBuilder == BVH_BUILDER_LBVH) {
+		BuildLbvh();
+		FinishBuild();
+		return;
+	}
+
+	if (threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+	threadCount = min(threadCount, objectCount / MIN_SUBTREE_SIZE);
+
+	if (threadCount <= 1) {
+		BuildSubtree(mNodes, 0, objectCount);
+		FinishBuild();
+		return;
+	}
+
+	// Split the top of the tree serially until the remaining ranges are small enough to be built
+	// as independent subtrees. Since every split only depends on the objects in a node,
+	// the resulting tree is the same for any thread count.
+	struct TopNode {
+		Node mNode;
+		uint32_t mLeft;
+		uint32_t mRight;
+		uint32_t mSubtree;
+	};
+	struct TopTask {
+		uint32_t mTopNode;
 		uint32_t mStart;
 		uint32_t mEnd;
 	};
+	const uint32_t noSubtree = 0xFFFFFFFF;
+	uint32_t subtreeSize = max((uint32_t)MIN_SUBTREE_SIZE, objectCount / (threadCount * 8));
 
-	BuildTask todo[1024];
-	uint32_t stackptr = 0;
-	const uint32_t untouched = 0xffffffff;
-	const uint32_t touchedTwice = 0xfffffffd;
+	vector<TopNode> top;
+	vector<uint2> subtrees;
+	vector<TopTask> todo;
 
-	uint32_t nNodes = 0;
-	uint32_t nLeafs = 0;
+	top.push_back({});
+	todo.push_back({ 0, 0, objectCount });
+	while (todo.size()) {
+		TopTask task = todo.back();
+		todo.pop_back();
 
-	Node node;
+		AABB bb;
+		uint32_t mid = task.mEnd;
+		if (task.mEnd - task.mStart > subtreeSize)
+			mid = Split(task.mStart, task.mEnd, bb);
 
-	todo[stackptr].mStart = 0;
-	todo[stackptr].mEnd = mPrimitives.size();
-	todo[stackptr].mParentOffset = 0xfffffffc;
-	stackptr++;
+		if (mid == task.mEnd) {
+			top[task.mTopNode].mSubtree = (uint32_t)subtrees.size();
+			subtrees.push_back(uint2(task.mStart, task.mEnd));
+			continue;
+		}
 
-	while (stackptr > 0) {
-		// Pop the next item off of the stack
-		BuildTask& bnode(todo[--stackptr]);
-		uint32_t start = bnode.mStart;
-		uint32_t end = bnode.mEnd;
-		uint32_t nPrims = end - start;
+		TopNode& node = top[task.mTopNode];
+		node.mNode.mBounds = bb;
+		node.mNode.mStartIndex = task.mStart;
+		node.mNode.mCount = task.mEnd - task.mStart;
+		node.mNode.mLeft = INVALID_NODE;
+		node.mNode.mRight = 0;
+		node.mNode.mParent = INVALID_NODE;
+		node.mSubtree = noSubtree;
+		node.mLeft = (uint32_t)top.size();
+		node.mRight = node.mLeft + 1;
+		todo.push_back({ node.mRight, mid, task.mEnd });
+		todo.push_back({ node.mLeft, task.mStart, mid });
+		top.push_back({});
+		top.push_back({});
+	}
 
-		nNodes++;
-		node.mStartIndex = start;
-		node.mCount = nPrims;
-		node.mRightOffset = untouched;
+	// Build the subtrees on worker threads
+	vector<vector<Node>> subtreeNodes(subtrees.size());
+	atomic<uint32_t> nextSubtree(0);
+	auto worker = [&]() {
+		uint32_t i;
+		while ((i = nextSubtree++) < subtrees.size())
+			BuildSubtree(subtreeNodes[i], subtrees[i].x, subtrees[i].y);
+	};
+	vector<thread> threads;
+	for (uint32_t j = 1; j < threadCount; j++)
+		threads.push_back(thread(worker));
+	worker();
+	for (thread& t : threads) t.join();
 
-		// Calculate the bounding box for this node
-		AABB bb(mPrimitives[start].mBounds);
-		AABB bc(mPrimitives[start].mBounds.Center(), mPrimitives[start].mBounds.Center());
-		for (uint32_t p = start + 1; p < end; ++p) {
-			bb.Encapsulate(mPrimitives[p].mBounds);
-			bc.Encapsulate(mPrimitives[p].mBounds.Center());
+	// Stitch the top nodes and subtrees together, depth-first
+	struct StitchTask {
+		uint32_t mParentOffset;
+		uint32_t mTopNode;
+	};
+	const uint32_t noParent = 0xFFFFFFFF;
+	vector<StitchTask> stitch;
+	stitch.push_back({ noParent, 0 });
+	while (stitch.size()) {
+		StitchTask task = stitch.back();
+		stitch.pop_back();
+
+		uint32_t nodeIndex = (uint32_t)mNodes.size();
+		if (task.mParentOffset != noParent)
+			mNodes[task.mParentOffset].mRight = nodeIndex - task.mParentOffset;
+
+		const TopNode& node = top[task.mTopNode];
+		if (node.mSubtree != noSubtree) {
+			mNodes.insert(mNodes.end(), subtreeNodes[node.mSubtree].begin(), subtreeNodes[node.mSubtree].end());
+			continue;
 		}
-		node.mBounds = bb;
+		mNodes.push_back(node.mNode);
+		stitch.push_back({ nodeIndex, node.mRight });
+		stitch.push_back({ noParent, node.mLeft });
+	}
+
+	FinishBuild();
+}
 
-		// If the number of primitives at this point is less than the leaf
-		// size, then this will become a leaf. (Signified by rightOffset == 0)
-		if (nPrims <= 1) {
-			node.mRightOffset = 0;
-			nLeafs++;
+void ObjectBvh2::FinishBuild() {
+	mAreaSum = 0;
+	mSahCost = 0;
+	mBuildSahCost = 0;
+	if (mNodes.empty()) {
+		mRoot = INVALID_NODE;
+		mWideDirty = true;
+		return;
+	}
+
+	mRoot = 0;
+	mNodes[0].mParent = INVALID_NODE;
+	for (uint32_t ni = 0; ni < mNodes.size(); ni++) {
+		Node& node = mNodes[ni];
+		mAreaSum += node.mBounds.SurfaceArea();
+		if (node.mRight == 0) {
+			node.mLeft = INVALID_NODE;
+			node.mRight = INVALID_NODE;
+			mPrimitives[node.mStartIndex].mObject->mBvhLeaf = ni;
+		} else {
+			node.mCount = 0;
+			node.mLeft = ni + 1;
+			node.mRight += ni;
+			mNodes[node.mLeft].mParent = ni;
+			mNodes[node.mRight].mParent = ni;
 		}
+	}
 
-		mNodes.push_back(node);
+	UpdateSahCost();
+	mBuildSahCost = mSahCost;
 
-		// Child touches parent...
-		// Special case: Don't do this for the root.
-		if (bnode.mParentOffset != 0xfffffffc) {
-			mNodes[bnode.mParentOffset].mRightOffset--;
+	mWideDirty = true;
+	UpdateWideNodes();
+}
 
-			// When this is the second touch, this is the right child.
-			// The right child sets up the offset for the flat tree.
-			if (mNodes[bnode.mParentOffset].mRightOffset == touchedTwice) {
-				mNodes[bnode.mParentOffset].mRightOffset = nNodes - 1 - bnode.mParentOffset;
+void ObjectBvh2::UpdateSahCost() {
+	mSahCost = mRoot == INVALID_NODE ? 0 : (float)(mAreaSum / fmaxf(mNodes[mRoot].mBounds.SurfaceArea(), 1e-10f));
+}
+
+bool ObjectBvh2::Contains(Object* object) const {
+	uint32_t leaf = object->mBvhLeaf;
+	return leaf < mNodes.size() && mNodes[leaf].mCount && mPrimitives[mNodes[leaf].mStartIndex].mObject == object;
+}
+
+uint32_t ObjectBvh2::AllocateNode() {
+	mWideDirty = true;
+	uint32_t node;
+	if (mFreeNodes.size()) {
+		node = mFreeNodes.back();
+		mFreeNodes.pop_back();
+	} else {
+		node = (uint32_t)mNodes.size();
+		mNodes.push_back({});
+	}
+	mNodes[node] = { AABB(), 0, 0, INVALID_NODE, INVALID_NODE, INVALID_NODE };
+	return node;
+}
+void ObjectBvh2::FreeNode(uint32_t node) {
+	mWideDirty = true;
+	SetBounds(node, AABB());
+	mNodes[node].mCount = 0;
+	mNodes[node].mLeft = INVALID_NODE;
+	mNodes[node].mRight = INVALID_NODE;
+	mNodes[node].mParent = INVALID_NODE;
+	mFreeNodes.push_back(node);
+}
+void ObjectBvh2::SetBounds(uint32_t node, const AABB& bounds) {
+	mAreaSum += bounds.SurfaceArea() - mNodes[node].mBounds.SurfaceArea();
+	mNodes[node].mBounds = bounds;
+	// Refit the four-wide node that stores this node, if the topology has not changed since it was collapsed
+	if (!mWideDirty && node < mWideSlots.size() && mWideSlots[node] != INVALID_NODE)
+		mWideNodes[mWideSlots[node] / 4].SetBounds(mWideSlots[node] % 4, bounds);
+}
+
+void ObjectBvh2::Rotate(uint32_t ni) {
+	const Node& node = mNodes[ni];
+
+	// Look for the swap between a child and the child of its sibling that shrinks the sibling the most
+	float bestArea = 0;
+	uint32_t bestChild = INVALID_NODE;
+	uint32_t bestGrandchild = INVALID_NODE;
+	AABB bestBounds;
+	for (uint32_t c : { node.mLeft, node.mRight }) {
+		uint32_t sibling = c == node.mLeft ? node.mRight : node.mLeft;
+		const Node& s = mNodes[sibling];
+		if (s.mCount) continue;
+		float area = s.mBounds.SurfaceArea();
+		for (uint32_t g : { s.mLeft, s.mRight }) {
+			// After the swap, the sibling holds c and g's sibling
+			AABB bounds(mNodes[g == s.mLeft ? s.mRight : s.mLeft].mBounds);
+			bounds.Encapsulate(mNodes[c].mBounds);
+			float gain = area - bounds.SurfaceArea();
+			if (gain > bestArea) {
+				bestArea = gain;
+				bestChild = c;
+				bestGrandchild = g;
+				bestBounds = bounds;
 			}
 		}
+	}
+	if (bestChild == INVALID_NODE) return;
+
+	uint32_t sibling = mNodes[bestGrandchild].mParent;
+	Node& n = mNodes[ni];
+	Node& s = mNodes[sibling];
+	if (n.mLeft == bestChild) n.mLeft = bestGrandchild;
+	else n.mRight = bestGrandchild;
+	if (s.mLeft == bestGrandchild) s.mLeft = bestChild;
+	else s.mRight = bestChild;
+	mNodes[bestChild].mParent = sibling;
+	mNodes[bestGrandchild].mParent = ni;
+	mWideDirty = true;
+	SetBounds(sibling, bestBounds);
+}
 
-		// If this is a leaf, no need to subdivide.
-		if (node.mRightOffset == 0) continue;
+void ObjectBvh2::RefitAncestors(uint32_t node, bool rebalance) {
+	while (node != INVALID_NODE) {
+		const Node& n = mNodes[node];
+		AABB bounds(mNodes[n.mLeft].mBounds);
+		bounds.Encapsulate(mNodes[n.mRight].mBounds);
+		bool changed =
+			bounds.mMin.x != n.mBounds.mMin.x || bounds.mMin.y != n.mBounds.mMin.y || bounds.mMin.z != n.mBounds.mMin.z ||
+			bounds.mMax.x != n.mBounds.mMax.x || bounds.mMax.y != n.mBounds.mMax.y || bounds.mMax.z != n.mBounds.mMax.z;
+		SetBounds(node, bounds);
+		if (mDynamic) Rotate(node);
+		if (!changed && !rebalance) break;
+		node = mNodes[node].mParent;
+	}
+}
 
-		// Set the split dimensions
-		uint32_t split_dim = 0;
-		float3 ext = bc.Extents();
-		if (ext.y > ext.x) {
-			split_dim = 1;
-			if (ext.z > ext.y) split_dim = 2;
-		} else
-			if (ext.z > ext.x) split_dim = 2;
+void ObjectBvh2::Insert(Object* object) {
+	if (Contains(object)) return;
 
-		// Split on the center of the longest axis
-		float split_coord = .5f * (bc.mMin[split_dim] + bc.mMax[split_dim]);
+	AABB aabb(object->Bounds());
+	aabb.mMin -= 1e-2f;
+	aabb.mMax += 1e-2f;
+	bool renderer = dynamic_cast<Renderer*>(object) != nullptr;
 
-		// Partition the list of objects on this split
-		uint32_t mid = start;
-		for (uint32_t i = start; i < end; ++i)
-			if (mPrimitives[i].mBounds.Center()[split_dim] < split_coord) {
-				swap(mPrimitives[i], mPrimitives[mid]);
-				mid++;
-			}
+	uint32_t pi;
+	if (mFreePrimitives.size()) {
+		pi = mFreePrimitives.back();
+		mFreePrimitives.pop_back();
+	} else {
+		pi = (uint32_t)mPrimitives.size();
+		mPrimitives.push_back({});
+	}
+	mPrimitives[pi] = { aabb, object, renderer, false };
+	if (renderer) mRendererBounds.Encapsulate(aabb);
+
+	uint32_t leaf = AllocateNode();
+	mNodes[leaf].mStartIndex = pi;
+	mNodes[leaf].mCount = 1;
+	SetBounds(leaf, aabb);
+	object->mBvhLeaf = leaf;
+
+	if (mRoot == INVALID_NODE) {
+		mRoot = leaf;
+		UpdateSahCost();
+		return;
+	}
+
+	// Walk down the tree towards the sibling that adds the least surface area
+	uint32_t sibling = mRoot;
+	while (mNodes[sibling].mCount == 0) {
+		const Node& node = mNodes[sibling];
+		AABB combined(node.mBounds);
+		combined.Encapsulate(aabb);
+		float combinedArea = combined.SurfaceArea();
+
+		// Cost of creating a new parent for this node and the leaf
+		float cost = 2.f * combinedArea;
+		// Cost of pushing the leaf further down, which grows this node
+		float inheritedCost = 2.f * (combinedArea - node.mBounds.SurfaceArea());
+
+		float childCost[2];
+		uint32_t children[2] { node.mLeft, node.mRight };
+		for (uint32_t i = 0; i < 2; i++) {
+			const Node& child = mNodes[children[i]];
+			AABB c(child.mBounds);
+			c.Encapsulate(aabb);
+			childCost[i] = c.SurfaceArea() + inheritedCost;
+			if (child.mCount == 0) childCost[i] -= child.mBounds.SurfaceArea();
+		}
+
+		if (cost < childCost[0] && cost < childCost[1]) break;
+		sibling = childCost[0] < childCost[1] ? children[0] : children[1];
+	}
 
-		// If we get a bad split, just choose the center...
-		if (mid == start || mid == end)
-			mid = start + (end - start) / 2;
+	uint32_t oldParent = mNodes[sibling].mParent;
+	uint32_t parent = AllocateNode();
+	AABB bounds(mNodes[sibling].mBounds);
+	bounds.Encapsulate(aabb);
+	mNodes[parent].mLeft = sibling;
+	mNodes[parent].mRight = leaf;
+	mNodes[parent].mParent = oldParent;
+	SetBounds(parent, bounds);
+	mNodes[sibling].mParent = parent;
+	mNodes[leaf].mParent = parent;
 
-		todo[stackptr].mStart = mid;
-		todo[stackptr].mEnd = end;
-		todo[stackptr].mParentOffset = nNodes - 1;
-		stackptr++;
-		todo[stackptr].mStart = start;
-		todo[stackptr].mEnd = mid;
-		todo[stackptr].mParentOffset = nNodes - 1;
-		stackptr++;
+	if (oldParent == INVALID_NODE)
+		mRoot = parent;
+	else if (mNodes[oldParent].mLeft == sibling)
+		mNodes[oldParent].mLeft = parent;
+	else
+		mNodes[oldParent].mRight = parent;
+
+	RefitAncestors(parent, true);
+	UpdateSahCost();
+}
+
+void ObjectBvh2::Remove(Object* object) {
+	if (!Contains(object)) return;
+
+	uint32_t leaf = object->mBvhLeaf;
+	uint32_t pi = mNodes[leaf].mStartIndex;
+	Primitive& p = mPrimitives[pi];
+	// Clearing mDirty makes Refit() skip the primitive if it is still in mDirtyPrimitives
+	if (p.mRenderer) mRendererBoundsDirty = true;
+	p = { AABB(), nullptr, false, false };
+	mFreePrimitives.push_back(pi);
+	object->mBvhLeaf = INVALID_NODE;
+
+	uint32_t parent = mNodes[leaf].mParent;
+	FreeNode(leaf);
+	if (parent == INVALID_NODE) {
+		mRoot = INVALID_NODE;
+		UpdateSahCost();
+		return;
+	}
+
+	// Replace the parent with the leaf's sibling
+	uint32_t sibling = mNodes[parent].mLeft == leaf ? mNodes[parent].mRight : mNodes[parent].mLeft;
+	uint32_t grandparent = mNodes[parent].mParent;
+	FreeNode(parent);
+	mNodes[sibling].mParent = grandparent;
+	if (grandparent == INVALID_NODE)
+		mRoot = sibling;
+	else {
+		if (mNodes[grandparent].mLeft == parent) mNodes[grandparent].mLeft = sibling;
+		else mNodes[grandparent].mRight = sibling;
+		RefitAncestors(grandparent, true);
 	}
+	UpdateSahCost();
+}
+
+void ObjectBvh2::Dirty(Object* object) {
+	if (!Contains(object)) return;
+	uint32_t pi = mNodes[object->mBvhLeaf].mStartIndex;
+	Primitive& p = mPrimitives[pi];
+	if (p.mDirty) return;
+	p.mDirty = true;
+	mDirtyPrimitives.push_back(pi);
+}
+
+void ObjectBvh2::Refit() {
+	for (uint32_t pi : mDirtyPrimitives) {
+		Primitive& p = mPrimitives[pi];
+		// Primitives that were removed (and maybe reused) since they were dirtied are no longer marked
+		if (!p.mDirty) continue;
+		p.mDirty = false;
+		uint32_t leaf = p.mObject->mBvhLeaf;
+
+		AABB aabb(p.mObject->Bounds());
+		aabb.mMin -= 1e-2f;
+		aabb.mMax += 1e-2f;
+		p.mBounds = aabb;
+		if (p.mRenderer) mRendererBoundsDirty = true;
+
+		SetBounds(leaf, aabb);
+		RefitAncestors(mNodes[leaf].mParent, false);
+	}
+	mDirtyPrimitives.clear();
+	UpdateSahCost();
+}
+
+AABB ObjectBvh2::RendererBounds() {
+	// Renderers may have shrunk or moved apart since the last build, so the bounds are recomputed instead of grown
+	if (mRendererBoundsDirty) {
+		mRendererBounds.mMin = 1e10f;
+		mRendererBounds.mMax = -1e10f;
+		for (const Primitive& p : mPrimitives)
+			if (p.mRenderer) mRendererBounds.Encapsulate(p.mBounds);
+		mRendererBoundsDirty = false;
+	}
+	return mRendererBounds;
+}
+
+void ObjectBvh2::UpdateWideNodes() {
+	if (!mWideDirty) return;
+	CollapseBvh4(mNodes, mRoot, [&](uint32_t n, uint32_t& l, uint32_t& r) {
+		l = mNodes[n].mLeft;
+		r = mNodes[n].mRight;
+		return mNodes[n].mCount == 0;
+	}, mWideNodes, &mWideSlots);
+
+	// dynamic trees have no depth bound, so the depth is measured for the traversal stacks
+	mMaxDepth = 0;
+	vector<pair<uint32_t, uint32_t>> todo;
+	if (mWideNodes.size()) todo.push_back(make_pair(0u, 1u));
+	while (todo.size()) {
+		pair<uint32_t, uint32_t> task = todo.back();
+		todo.pop_back();
+		mMaxDepth = max(mMaxDepth, task.second);
+		const Bvh4Node& node = mWideNodes[task.first];
+		for (uint32_t i = 0; i < 4; i++)
+			if (node.mCount[i] == 0 && node.mChild[i] != INVALID_NODE) todo.push_back(make_pair(node.mChild[i], task.second + 1));
+	}
+	mWideDirty = false;
 }
 
 void ObjectBvh2::FrustumCheck(const float4 frustum[6], vector<Object*>& objects, uint32_t mask) {
-	if (mNodes.size() == 0) return;
+	if (mRoot == INVALID_NODE) return;
+	UpdateWideNodes();
 
-	uint32_t todo[1024];
+	uint32_t todoArray[TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
 	int32_t stackptr = 0;
 
 	todo[stackptr] = 0;
 
 	while (stackptr >= 0) {
-		int ni = todo[stackptr];
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
 		stackptr--;
-		const Node& node(mNodes[ni]);
 
-		if (node.mRightOffset == 0) { // leaf node
-			const Primitive& p = mPrimitives[node.mStartIndex];
-			if (p.mObject->EnabledHierarchy() && (p.mObject->LayerMask() & mask) && p.mBounds.Intersects(frustum))
-				objects.push_back(p.mObject);
-		} else {
-			uint32_t n0 = ni + 1;
-			uint32_t n1 = ni + node.mRightOffset;
-			if (mNodes[n0].mBounds.Intersects(frustum)) todo[++stackptr] = n0;
-			if (mNodes[n1].mBounds.Intersects(frustum)) todo[++stackptr] = n1;
+		uint32_t hit = IntersectBvh4(node, frustum);
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((hit & (1 << i)) == 0) continue;
+			if (node.mCount[i]) { // leaf
+				Object* object = mPrimitives[node.mChild[i]].mObject;
+				if (object->EnabledHierarchy() && (object->LayerMask() & mask))
+					objects.push_back(object);
+			} else
+				todo[++stackptr] = node.mChild[i];
+		}
+	}
+}
+uint32_t ObjectBvh2::Overlap(const AABB& box, Object** objects, uint32_t capacity, uint32_t mask) {
+	if (mRoot == INVALID_NODE) return 0;
+	UpdateWideNodes();
+
+	uint32_t count = 0;
+	uint32_t todoArray[TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
+	int32_t stackptr = 0;
+
+	todo[stackptr] = 0;
+
+	while (stackptr >= 0) {
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
+		stackptr--;
+
+		uint32_t hit = IntersectBvh4(node, box);
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((hit & (1 << i)) == 0) continue;
+			if (node.mCount[i]) { // leaf
+				Object* object = mPrimitives[node.mChild[i]].mObject;
+				if (!object->EnabledHierarchy() || (object->LayerMask() & mask) == 0 || !object->Bounds().Intersects(box)) continue;
+				if (count < capacity) objects[count] = object;
+				count++;
+			} else
+				todo[++stackptr] = node.mChild[i];
+		}
+	}
+	return count;
+}
+uint32_t ObjectBvh2::Overlap(const Sphere& sphere, Object** objects, uint32_t capacity, uint32_t mask) {
+	if (mRoot == INVALID_NODE) return 0;
+	UpdateWideNodes();
+
+	float r2 = sphere.mRadius * sphere.mRadius;
+	uint32_t count = 0;
+	uint32_t todoArray[TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
+	int32_t stackptr = 0;
+
+	todo[stackptr] = 0;
+
+	while (stackptr >= 0) {
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
+		stackptr--;
+
+		float d2[4];
+		uint32_t hit = DistanceBvh4(node, sphere.mCenter, r2, d2);
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((hit & (1 << i)) == 0) continue;
+			if (node.mCount[i]) { // leaf
+				Object* object = mPrimitives[node.mChild[i]].mObject;
+				if (!object->EnabledHierarchy() || (object->LayerMask() & mask) == 0 || !object->Bounds().Intersects(sphere)) continue;
+				if (count < capacity) objects[count] = object;
+				count++;
+			} else
+				todo[++stackptr] = node.mChild[i];
+		}
+	}
+	return count;
+}
+uint32_t ObjectBvh2::Nearest(const float3& point, uint32_t k, Object** objects, float* distances, uint32_t mask, float maxDistance) {
+	if (mRoot == INVALID_NODE || k == 0) return 0;
+	UpdateWideNodes();
+
+	// Nodes farther than the k-th nearest object found so far are skipped. distances holds squared distances until the end.
+	float worst = maxDistance < 1e18f ? maxDistance * maxDistance : 1e36f;
+	uint32_t count = 0;
+
+	struct NearestTask {
+		uint32_t mNode;
+		float mDistance2;
+	};
+	NearestTask todoArray[TRAVERSAL_STACK_SIZE];
+	vector<NearestTask> todoVector;
+	NearestTask* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
+	int32_t stackptr = 0;
+
+	todo[stackptr] = { 0, 0.f };
+
+	while (stackptr >= 0) {
+		NearestTask task = todo[stackptr];
+		stackptr--;
+		if (task.mDistance2 > worst) continue;
+		const Bvh4Node& node = mWideNodes[task.mNode];
+
+		float d2[4];
+		uint32_t hit = DistanceBvh4(node, point, worst, d2);
+
+		// Test leaves right away, and push the nodes so that the nearest one is visited first
+		uint32_t order[4];
+		uint32_t n = 0;
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((hit & (1 << i)) == 0) continue;
+			if (node.mCount[i]) { // leaf
+				Object* object = mPrimitives[node.mChild[i]].mObject;
+				if (!object->EnabledHierarchy() || (object->LayerMask() & mask) == 0) continue;
+				float od2 = object->Bounds().DistanceSquared(point);
+				if (count == k ? od2 >= worst : od2 > worst) continue;
+
+				// Insert into the sorted results, dropping the farthest one if they are full
+				uint32_t j = count < k ? count++ : k - 1;
+				for (; j > 0 && distances[j - 1] > od2; j--) {
+					distances[j] = distances[j - 1];
+					objects[j] = objects[j - 1];
+				}
+				distances[j] = od2;
+				objects[j] = object;
+				if (count == k) worst = distances[k - 1];
+			} else {
+				uint32_t j = n++;
+				for (; j > 0 && d2[order[j - 1]] < d2[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+			}
 		}
+		for (uint32_t i = 0; i < n; i++)
+			if (d2[order[i]] <= worst) todo[++stackptr] = { node.mChild[order[i]], d2[order[i]] };
 	}
+
+	for (uint32_t i = 0; i < count; i++)
+		distances[i] = sqrtf(distances[i]);
+	return count;
 }
+
 Object* ObjectBvh2::Intersect(const Ray& ray, float* t, bool any, uint32_t mask) {
-	if (mNodes.size() == 0) return nullptr;
+	RaycastHit hit;
+	Object* object = Intersect(ray, &hit, any, mask);
+	if (t) *t = hit.mT;
+	return object;
+}
+Object* ObjectBvh2::Intersect(const Ray& ray, RaycastHit* result, bool any, uint32_t mask) {
+	result->mT = 1e20f;
+	result->mObject = nullptr;
+	result->mTriangle = 0xFFFFFFFF;
+	result->mBarycentrics = 0;
+	result->mNormal = 0;
+	result->mTexcoord = 0;
+	if (mRoot == INVALID_NODE) return nullptr;
+	UpdateWideNodes();
 
 	float ht = 1e20f;
-	Object* hitObject = nullptr;
+	float3 invDirection = InverseDirection(ray.mDirection);
 
-	uint32_t todo[128];
+	uint32_t todoArray[TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
 	int stackptr = 0;
 
 	todo[stackptr] = 0;
 
 	while (stackptr >= 0) {
-		uint32_t ni = todo[stackptr];
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
 		stackptr--;
-		const Node& node = mNodes[ni];
 
-		if (node.mRightOffset == 0) {
-			const Primitive& p = mPrimitives[node.mStartIndex];
-			if (!p.mObject->EnabledHierarchy() || (p.mObject->LayerMask() & mask) == 0) continue;
+		float ct[4];
+		uint32_t hit = IntersectBvh4(node, ray.mOrigin, invDirection, ht, ct);
 
-			float ct;
-			if (!p.mObject->Intersect(ray, &ct, any)) continue;
+		// Test leaves right away, and push the hit nodes so that the closest one is visited first
+		uint32_t order[4];
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((hit & (1 << i)) == 0) continue;
+			if (node.mCount[i]) {
+				if (ct[i] >= ht) continue;
+				Object* object = mPrimitives[node.mChild[i]].mObject;
+				if (!object->EnabledHierarchy() || (object->LayerMask() & mask) == 0) continue;
 
-			if (ct < ht) {
-				ht = ct;
-				hitObject = p.mObject;
-				if (any) {
-					if (t) *t = ct;
-					return p.mObject;
+				RaycastHit oh;
+				if (!object->Intersect(ray, &oh, any)) continue;
+				if (oh.mT < ht) {
+					ht = oh.mT;
+					*result = oh;
+					result->mObject = object;
+					if (any) return object;
 				}
+			} else {
+				uint32_t j = count++;
+				for (; j > 0 && ct[order[j - 1]] < ct[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
 			}
-		} else {
-			uint32_t n0 = ni + 1;
-			uint32_t n1 = ni + node.mRightOffset;
-
-			float2 t0;
-			float2 t1;
-			bool h0 = ray.Intersect(mNodes[n0].mBounds, t0);
-			bool h1 = ray.Intersect(mNodes[n1].mBounds, t1);
-
-			if (h0 && t0.y < ht) todo[++stackptr] = n0;
-			if (h1 && t1.y < ht) todo[++stackptr] = n1;
 		}
+		for (uint32_t i = 0; i < count; i++)
+			if (ct[order[i]] < ht) todo[++stackptr] = node.mChild[order[i]];
 	}
 
-	if (t) *t = ht;
-	return hitObject;
+	return result->mObject;
 }
+void ObjectBvh2::IntersectPacket(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any, uint32_t mask) {
+	// Single rays stop at their first hit, which beats waiting for the whole packet in any-hit queries
+	if (mRoot == INVALID_NODE || any || !CoherentPacket(rays, rayCount)) {
+		for (uint32_t r = 0; r < rayCount; r++)
+			Intersect(rays[r], &hits[r], any, mask);
+		return;
+	}
 
-void ObjectBvh2::DrawGizmos(CommandBuffer* commandBuffer, Camera* camera, Scene* scene) {
-	if (mNodes.size() == 0) return;
+	float3 invDirection[RAY_PACKET_SIZE];
+	float ht[RAY_PACKET_SIZE];
 
-	uint32_t todo[1024];
-	int32_t stackptr = 0;
+	uint32_t active = 0;
+	for (uint32_t r = 0; r < rayCount; r++) {
+		hits[r].mT = 1e20f;
+		hits[r].mObject = nullptr;
+		hits[r].mTriangle = 0xFFFFFFFF;
+		hits[r].mBarycentrics = 0;
+		hits[r].mNormal = 0;
+		hits[r].mTexcoord = 0;
+		invDirection[r] = InverseDirection(rays[r].mDirection);
+		ht[r] = 1e20f;
+		active |= 1 << r;
+	}
+
+	// Bounds of the whole packet. They stay valid for any subset of its rays, so they're only computed once.
+	RayPacketBounds packet(rays, invDirection, active);
+
+	// Each node on the stack keeps the mask of the rays that entered it, in the second half of the stack
+	uint32_t stackSize = max(StackSize(), (uint32_t)TRAVERSAL_STACK_SIZE);
+	uint32_t todoArray[2 * TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (stackSize > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(2 * stackSize);
+		todo = todoVector.data();
+	}
+	uint32_t* todoMask = todo + stackSize;
+	int stackptr = 0;
 
 	todo[stackptr] = 0;
+	todoMask[stackptr] = active;
 
+	// The whole packet walks the tree together. Each node is first tested against the whole packet at once,
+	// then against single rays only until every child that survived is known to be entered by one of them.
+	// Rays that entered a node aren't always tested against its children, so they are tested again further down.
 	while (stackptr >= 0) {
-		int ni = todo[stackptr];
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
+		uint32_t nodeMask = todoMask[stackptr];
 		stackptr--;
+		if (nodeMask == 0) continue;
+
+		float tmax = 0;
+		for (uint32_t r = 0; r < rayCount; r++)
+			if ((nodeMask & (1 << r)) && ht[r] > tmax) tmax = ht[r];
+		uint32_t children = IntersectBvh4(node, packet, tmax);
+		if (children == 0) continue;
+
+		uint32_t leaves = 0;
+		for (uint32_t i = 0; i < 4; i++)
+			if (node.mCount[i]) leaves |= 1 << i;
+
+		// Leaves need exact results for every ray, since each ray is only handed to the objects it reaches
+		uint32_t rayMask[4] = { 0, 0, 0, 0 };
+		float ct[RAY_PACKET_SIZE][4];
+		float tnear[4] = { 1e30f, 1e30f, 1e30f, 1e30f };
+		uint32_t entered = 0;
+		for (uint32_t r = 0; r < rayCount; r++) {
+			if ((nodeMask & (1 << r)) == 0) continue;
+			if ((children & leaves) == 0 && entered == children) {
+				for (uint32_t i = 0; i < 4; i++)
+					if (children & (1 << i)) rayMask[i] |= nodeMask & ~((1 << r) - 1);
+				break;
+			}
+			uint32_t hit = IntersectBvh4(node, rays[r].mOrigin, invDirection[r], ht[r], ct[r]) & children;
+			entered |= hit;
+			for (uint32_t i = 0; i < 4; i++)
+				if (hit & (1 << i)) {
+					rayMask[i] |= 1 << r;
+					if (ct[r][i] < tnear[i]) tnear[i] = ct[r][i];
+				}
+		}
+
+		// Test leaves right away, and push the hit nodes so that the closest one is visited first
+		uint32_t order[4];
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < 4; i++) {
+			if (rayMask[i] == 0) continue;
+			if (node.mCount[i] == 0) {
+				uint32_t j = count++;
+				for (; j > 0 && tnear[order[j - 1]] < tnear[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+				continue;
+			}
+
+			// Rays may have found closer hits in the leaves before this one
+			uint32_t leafMask = 0;
+			for (uint32_t r = 0; r < rayCount; r++)
+				if ((rayMask[i] & (1 << r)) && ct[r][i] < ht[r])
+					leafMask |= 1 << r;
+			if (leafMask == 0) continue;
+
+			Object* object = mPrimitives[node.mChild[i]].mObject;
+			if (!object->EnabledHierarchy() || (object->LayerMask() & mask) == 0) continue;
+
+			RaycastHit oh[RAY_PACKET_SIZE];
+			uint32_t hitMask = object->IntersectPacket(rays, leafMask, oh, false);
+			for (uint32_t r = 0; r < rayCount; r++) {
+				if ((hitMask & (1 << r)) == 0 || oh[r].mT >= ht[r]) continue;
+				ht[r] = oh[r].mT;
+				hits[r] = oh[r];
+				hits[r].mObject = object;
+			}
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			todo[++stackptr] = node.mChild[order[i]];
+			todoMask[stackptr] = rayMask[order[i]];
+		}
+	}
+}
+void ObjectBvh2::Intersect(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any, uint32_t mask, uint32_t threadCount) {
+	// Collapse the tree before the threads start reading it
+	UpdateWideNodes();
+
+	if (threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+	threadCount = max(min(threadCount, rayCount / MIN_THREAD_RAYS), 1u);
+
+	atomic<uint32_t> nextRay(0);
+	auto worker = [&]() {
+		uint32_t r;
+		while ((r = nextRay.fetch_add(RAYS_PER_TASK)) < rayCount)
+			for (uint32_t i = r; i < min(r + RAYS_PER_TASK, rayCount); i += RAY_PACKET_SIZE)
+				IntersectPacket(rays + i, min(rayCount - i, (uint32_t)RAY_PACKET_SIZE), hits + i, any, mask);
+	};
+	vector<thread> threads;
+	for (uint32_t j = 1; j < threadCount; j++)
+		threads.push_back(thread(worker));
+	worker();
+	for (thread& t : threads) t.join();
+}
+
+void ObjectBvh2::DrawGizmos(CommandBuffer* commandBuffer, Camera* camera, Scene* scene) {
+	if (mRoot == INVALID_NODE) return;
+
+	// walks the binary tree, which can be deeper than the four-wide one, so the stack grows as needed
+	vector<uint32_t> todo;
+	todo.push_back(mRoot);
+
+	while (todo.size()) {
+		uint32_t ni = todo.back();
+		todo.pop_back();
 		const Node& node(mNodes[ni]);
 
-		if (node.mRightOffset == 0) { // leaf node
+		if (node.mCount) { // leaf node
 			AABB box = mPrimitives[node.mStartIndex].mBounds;
 			Gizmos::DrawWireCube(box.Center(), box.Extents(), quaternion(0, 0, 0, 1), float4(.2f, 1, .2f, .5f));
 		} else {
-			uint32_t n0 = ni + 1;
-			uint32_t n1 = ni + node.mRightOffset;
-			todo[++stackptr] = n0;
-			todo[++stackptr] = n1;
+			uint32_t n0 = node.mLeft;
+			uint32_t n1 = node.mRight;
+			todo.push_back(n0);
+			todo.push_back(n1);
 		}
 	}
 }
\ No newline at end of file
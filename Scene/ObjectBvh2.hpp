@@ -1,43 +1,150 @@
 #pragma once
 
+#include <Scene/Bvh4.hpp>
 #include <Scene/Object.hpp>
 
 #ifdef GetObject
 #undef GetObject
 #endif
 
-// Stores a binary bvh of Objects, based off each object's Object::Bounds() 
+enum BvhBuilder {
+	// Splits nodes on the middle of their longest axis. Slower to build, but makes faster trees.
+	BVH_BUILDER_MEDIAN_SPLIT,
+	// Sorts objects along a Morton curve and splits nodes where the codes differ. Much faster to build, for scenes that rebuild often.
+	BVH_BUILDER_LBVH,
+};
+
+// Stores a binary bvh of Objects, based off each object's Object::Bounds()
+// Dynamic trees insert and remove objects in place, using tree rotations to keep their quality up
+// Queries traverse a four-wide copy of the tree, which is refit along with it and collapsed again after its topology changes
 class ObjectBvh2 {
 public:
 	struct Node {
 		AABB mBounds;
-		// index of the first primitive inside this node
+		// index of the primitive inside this node
 		uint32_t mStartIndex;
-		// number of primitives inside this node
-		uint32_t mRightOffset; // 1st child is at node[index + 1], 2nd child is at node[index + mRightOffset]
+		// number of primitives inside this node, 0 if this node has children
 		uint32_t mCount;
+		uint32_t mLeft;
+		uint32_t mRight;
+		uint32_t mParent;
 	};
 
-	inline ObjectBvh2() {};
+	// The tree is rebuilt once refitting makes its SAH cost exceed rebuildThreshold times the cost of the last build
+	inline ObjectBvh2(bool dynamic = false, float rebuildThreshold = 1.5f)
+		: mDynamic(dynamic), mBuilder(BVH_BUILDER_MEDIAN_SPLIT), mRebuildThreshold(rebuildThreshold), mRoot(INVALID_NODE), mWideDirty(true), mMaxDepth(0), mAreaSum(0), mSahCost(0), mBuildSahCost(0), mRendererBoundsDirty(false) {};
 	inline ~ObjectBvh2() {}
 
 	const std::vector<Node>& Nodes() const { return mNodes; }
+	inline const std::vector<Bvh4Node>& WideNodes() { UpdateWideNodes(); return mWideNodes; }
+	inline uint32_t Root() const { return mRoot; }
 	Object* GetObject(uint32_t index) const { return mPrimitives[index].mObject; }
 
-	inline AABB RendererBounds() { return mRendererBounds; }
+	ENGINE_EXPORT AABB RendererBounds();
+
+	inline bool Dynamic() const { return mDynamic; }
+	inline void Dynamic(bool d) { mDynamic = d; }
+	// The builder used by Build(). Insert() and Remove() work the same on trees from either builder.
+	inline BvhBuilder Builder() const { return mBuilder; }
+	inline void Builder(BvhBuilder b) { mBuilder = b; }
 
-	ENGINE_EXPORT void Build(Object** objects, uint32_t objectCount);
+	// Expected cost of a ray query, relative to the surface area of the root node
+	inline float SahCost() const { return mSahCost; }
+	// SahCost() right after the last build
+	inline float BuildSahCost() const { return mBuildSahCost; }
+	// Dynamic trees are kept in shape by rotations, so they never need rebuilding
+	inline bool NeedsRebuild() const { return !mDynamic && mSahCost > mBuildSahCost * mRebuildThreshold; }
+	// Includes objects that were removed after being dirtied, until the next Refit()
+	inline uint32_t DirtyCount() const { return (uint32_t)mDirtyPrimitives.size(); }
+
+	// Builds the bvh using threadCount threads, or one per hardware thread if threadCount is 0. The tree is the same for any thread count.
+	// The LBVH builder always runs on the calling thread.
+	ENGINE_EXPORT void Build(Object** objects, uint32_t objectCount, uint32_t threadCount = 0);
+	// Inserts an object into the tree in O(log n), without rebuilding it
+	ENGINE_EXPORT void Insert(Object* object);
+	// Removes an object from the tree in O(log n), without rebuilding it. Objects that are not in the tree are ignored.
+	ENGINE_EXPORT void Remove(Object* object);
+	// Marks an object's bounds as changed. Objects that are not in the tree are ignored.
+	ENGINE_EXPORT void Dirty(Object* object);
+	// Updates the bounds of dirty objects and their ancestors. Only dynamic trees change their topology while refitting.
+	ENGINE_EXPORT void Refit();
 	ENGINE_EXPORT void FrustumCheck(const float4 frustum[6], std::vector<Object*>& objects, uint32_t mask);
+	// Writes up to capacity enabled objects whose bounds overlap the box or sphere to objects, in no particular order
+	// Returns the number of overlapping objects, which is more than capacity if some didn't fit
+	ENGINE_EXPORT uint32_t Overlap(const AABB& box, Object** objects, uint32_t capacity, uint32_t mask);
+	ENGINE_EXPORT uint32_t Overlap(const Sphere& sphere, Object** objects, uint32_t capacity, uint32_t mask);
+	// Finds the k enabled objects whose bounds are closest to the point and no farther than maxDistance, sorted from nearest to farthest
+	// objects and distances must hold k elements. Returns the number of objects found.
+	ENGINE_EXPORT uint32_t Nearest(const float3& point, uint32_t k, Object** objects, float* distances, uint32_t mask, float maxDistance = 1e20f);
 	ENGINE_EXPORT Object* Intersect(const Ray& ray, float* t, bool any, uint32_t mask);
+	// Returns the object that was hit and fills in hit, whose mObject is nullptr if the ray missed
+	ENGINE_EXPORT Object* Intersect(const Ray& ray, RaycastHit* hit, bool any, uint32_t mask);
+	// Intersects a batch of rays, tracing them in packets of neighboring rays and spreading large batches across threadCount threads (one per hardware thread if 0)
+	// Closest hits match the single ray queries, unless several objects are hit at exactly the same distance. hits must hold rayCount elements.
+	// Objects must not be modified until this returns, since their transforms are read from several threads
+	ENGINE_EXPORT void Intersect(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any, uint32_t mask, uint32_t threadCount = 0);
 
 	ENGINE_EXPORT void DrawGizmos(CommandBuffer* commandBuffer, Camera* camera, Scene* scene);
 
 private:
+	static const uint32_t INVALID_NODE = 0xFFFFFFFF;
+
 	struct Primitive {
 		AABB mBounds;
 		Object* mObject;
+		bool mRenderer;
+		bool mDirty;
 	};
 	AABB mRendererBounds;
 	std::vector<Node> mNodes;
 	std::vector<Primitive> mPrimitives;
+	std::vector<uint32_t> mFreeNodes;
+	std::vector<uint32_t> mFreePrimitives;
+	// Primitives dirtied since the last Refit(). Entries whose mDirty flag was cleared by Remove() are skipped.
+	std::vector<uint32_t> mDirtyPrimitives;
+	uint32_t mRoot;
+	bool mDynamic;
+	BvhBuilder mBuilder;
+
+	std::vector<Bvh4Node> mWideNodes;
+	// The four-wide node and slot that stores each binary node, as node * 4 + slot
+	std::vector<uint32_t> mWideSlots;
+	bool mWideDirty;
+	// Levels of the four-wide tree, measured when it is collapsed
+	uint32_t mMaxDepth;
+
+	float mRebuildThreshold;
+	// Sum of the surface areas of every node in the tree, which is kept up to date while refitting
+	double mAreaSum;
+	float mSahCost;
+	float mBuildSahCost;
+	bool mRendererBoundsDirty;
+
+	// Computes the bounds of primitives [start, end) and partitions them around the middle of their longest axis
+	// Returns the index of the first primitive in the right child, or end if the node should become a leaf
+	ENGINE_EXPORT uint32_t Split(uint32_t start, uint32_t end, AABB& bounds);
+	// Builds the subtree over primitives [start, end) into nodes, depth-first. Right children are stored as an offset in mRight until FinishBuild().
+	ENGINE_EXPORT void BuildSubtree(std::vector<Node>& nodes, uint32_t start, uint32_t end);
+	// Sorts the primitives by the Morton codes of their centers and splits each node at the highest bit where its codes differ
+	ENGINE_EXPORT void BuildLbvh();
+	// Links children and parents, assigns leaf handles and computes the SAH cost after a build
+	ENGINE_EXPORT void FinishBuild();
+	ENGINE_EXPORT void UpdateWideNodes();
+	// Entries needed by a depth-first traversal of the four-wide tree, which holds at most three siblings of each node on the path to the current node
+	inline uint32_t StackSize() const { return 3 * mMaxDepth + 1; }
+	ENGINE_EXPORT void UpdateSahCost();
+	// Returns true if the object's leaf handle points into this tree
+	ENGINE_EXPORT bool Contains(Object* object) const;
+	// Traces up to RAY_PACKET_SIZE closest-hit rays through the tree together, or one at a time for any-hit queries, small packets, or directions that differ too much
+	// Objects in the leaves are handed every ray of the packet that reaches them, see Object::IntersectPacket()
+	ENGINE_EXPORT void IntersectPacket(const Ray* rays, uint32_t rayCount, RaycastHit* hits, bool any, uint32_t mask);
+
+	ENGINE_EXPORT uint32_t AllocateNode();
+	ENGINE_EXPORT void FreeNode(uint32_t node);
+	ENGINE_EXPORT void SetBounds(uint32_t node, const AABB& bounds);
+	// Swaps a child of the node with a grandchild on the other side when that reduces the surface area of the tree
+	ENGINE_EXPORT void Rotate(uint32_t node);
+	// Recomputes the bounds of node and its ancestors, rotating each of them if the tree is dynamic
+	// Stops early once a node's bounds stop changing, unless the whole path needs to be rebalanced
+	ENGINE_EXPORT void RefitAncestors(uint32_t node, bool rebalance);
 };
\ No newline at end of file
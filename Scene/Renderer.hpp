@@ -4,10 +4,29 @@
 #include <Scene/Scene.hpp>
 #include <Util/Util.hpp>
 
+// Bits of a draw key used by each sort criteria, from the most significant. The scene sorts draws by their keys.
+#define DRAW_KEY_QUEUE_BITS 13
+#define DRAW_KEY_SHADER_BITS 10
+#define DRAW_KEY_MATERIAL_BITS 13
+#define DRAW_KEY_MESH_BITS 16
+#define DRAW_KEY_DEPTH_BITS 12
+
+// Packs the render state of a draw into a key, leaving the depth bits for the scene to fill in for each view.
+// Ids are truncated, since they only need to keep equal states together: draws that collide are still drawn correctly, but might not be batched.
+inline uint64_t PackDrawKey(uint32_t renderQueue, uint32_t shader, uint32_t material, uint32_t mesh) {
+	uint64_t key = std::min(renderQueue, (1u << DRAW_KEY_QUEUE_BITS) - 1);
+	key = (key << DRAW_KEY_SHADER_BITS) | (shader & ((1u << DRAW_KEY_SHADER_BITS) - 1));
+	key = (key << DRAW_KEY_MATERIAL_BITS) | (material & ((1u << DRAW_KEY_MATERIAL_BITS) - 1));
+	key = (key << DRAW_KEY_MESH_BITS) | (mesh & ((1u << DRAW_KEY_MESH_BITS) - 1));
+	return key << DRAW_KEY_DEPTH_BITS;
+}
+
 class Renderer : public virtual Object {
 public:
 	// Renderers are drawn by the scene in order of increasing RenderQueue
 	inline virtual uint32_t RenderQueue() { return 1000; }
+	// Key that the scene sorts draws by, so that draws with the same state are drawn together. See PackDrawKey().
+	inline virtual uint64_t DrawKey(PassType pass) { return PackDrawKey(RenderQueue(), 0, 0, 0); }
 	// Since passes correspond to LayerMasks as well, renderers are only drawn for passes that match PassMask()
 	virtual PassType PassMask() { return PASS_MAIN; };
 	inline virtual bool Visible() { return EnabledHierarchy(); };
@@ -5,15 +5,24 @@
 #include <Scene/GUI.hpp>
 #include <Core/Instance.hpp>
 #include <Util/Profiler.hpp>
+#include <Util/RadixSort.hpp>
 
 #include <assimp/scene.h>
 #include <assimp/cimport.h>
 #include <assimp/postprocess.h>
 #include <assimp/material.h>
 
+#include <atomic>
+
 using namespace std;
 
 #define INSTANCE_BATCH_SIZE 1024
+// Smallest number of renderers for each thread that records draws
+#define MIN_THREAD_DRAWS 512
+// Number of renderers a record thread draws into each secondary command buffer
+#define DRAWS_PER_CHUNK 128
+// Meshes with at least this many triangles build their bvh using every thread
+#define PARALLEL_BVH_TRIANGLE_COUNT 65536
 #define MAX_GPU_LIGHTS 64
 
 #define SHADOW_ATLAS_RESOLUTION 8192
@@ -119,28 +128,13 @@ inline Bone* AddBone(AnimationRig& rig, aiNode* node, const aiScene* scene, aiNo
 	return bone;
 }
 
-bool RendererCompare(Object* oa, Object* ob) {
-	Renderer* a = dynamic_cast<Renderer*>(oa);
-	Renderer* b = dynamic_cast<Renderer*>(ob);
-	uint32_t qa = a->Visible() ? a->RenderQueue() : 0xFFFFFFFF;
-	uint32_t qb = b->Visible() ? b->RenderQueue() : 0xFFFFFFFF;
-	if (qa == qb && qa != 0xFFFFFFFF) {
-		MeshRenderer* ma = dynamic_cast<MeshRenderer*>(a);
-		MeshRenderer* mb = dynamic_cast<MeshRenderer*>(b);
-		if (ma && mb)
-			if (ma->Material() == mb->Material())
-				return ma->Mesh() < mb->Mesh();
-			else
-				return ma->Material() < mb->Material();
-	}
-	return qa < qb;
-};
-
 Scene::Scene(::Instance* instance, ::AssetManager* assetManager, ::InputManager* inputManager, ::PluginManager* pluginManager)
 	: mInstance(instance), mAssetManager(assetManager), mInputManager(inputManager), mPluginManager(pluginManager), mLastBvhBuild(0), mDrawGizmos(false), mBvhDirty(true), mDrawSkybox(true),
-	mFixedTimeStep(.0025f), mPhysicsTimeLimitPerFrame(.2f) , mFixedAccumulator(0), mDeltaTime(0), mTotalTime(0), mFps(0), mFrameTimeAccum(0), mFrameCount(0){
+	mFixedTimeStep(.0025f), mPhysicsTimeLimitPerFrame(.2f) , mFixedAccumulator(0), mDeltaTime(0), mTotalTime(0), mFps(0), mFrameTimeAccum(0), mFrameCount(0), mRenderStats({}), mLastRenderStats({}),
+	mRecordThreadCount(0), mRecordGeneration(0), mRecordSlots(0), mRecordBusy(0), mStopRecordThreads(false) {
 
 	mBvh = new ObjectBvh2();
+	mTransforms = new TransformHierarchy(this);
 	mShadowTexelSize = float2(1.f / SHADOW_ATLAS_RESOLUTION, 1.f / SHADOW_ATLAS_RESOLUTION) * .75f;
 	mEnvironment = new ::Environment(this);
 
@@ -156,6 +150,8 @@ Scene::Scene(::Instance* instance, ::AssetManager* assetManager, ::InputManager*
 		mLightBuffers[i] = new Buffer("Light Buffer", mInstance->Device(), MAX_GPU_LIGHTS * sizeof(GPULight), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
 		mShadowBuffers[i] = new Buffer("Shadow Buffer", mInstance->Device(), MAX_GPU_LIGHTS * sizeof(ShadowData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
 		mShadowAtlases[i] = new Texture("ShadowAtlas", mInstance->Device(), SHADOW_ATLAS_RESOLUTION, SHADOW_ATLAS_RESOLUTION, 1, VK_FORMAT_D32_SFLOAT, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+		mShadowBuffers[i]->SetMemoryCategory(MEMORY_CATEGORY_SHADOW);
+		mShadowAtlases[i]->SetMemoryCategory(MEMORY_CATEGORY_SHADOW);
 		
 		mShadowAtlases[i]->TransitionImageLayout(VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, commandBuffer.get());
 	}
@@ -186,11 +182,12 @@ Scene::Scene(::Instance* instance, ::AssetManager* assetManager, ::InputManager*
 	mLastFrame = mClock.now();
 }
 Scene::~Scene(){
+	StopRecordThreads();
 	safe_delete(mSkyboxCube);
 	safe_delete(mBvh);
 
-	while (mObjects.size())
-		RemoveObject(mObjects[0].get());
+	while (!mObjects.Empty())
+		RemoveObject(mObjects[mObjects.Size() - 1].mObject.get());
 
 	safe_delete(mEnvironment);
 
@@ -205,10 +202,11 @@ Scene::~Scene(){
 	safe_delete(mShadowAtlasFramebuffer);
 	for (Camera* c : mShadowCameras) safe_delete(c);
 
-	mCameras.clear();
-	mRenderers.clear();
-	mLights.clear();
-	mObjects.clear();
+	mCameras.Clear();
+	mRenderers.Clear();
+	mLights.Clear();
+	mObjects.Clear();
+	safe_delete(mTransforms);
 }
 
 Object* Scene::LoadModelScene(const string& filename,
@@ -238,6 +236,15 @@ Object* Scene::LoadModelScene(const string& filename,
 
 	bool hasBones = false;
 
+	struct BvhBuild {
+		TriangleBvh2* mBvh;
+		uint32_t mBaseVertex;
+		uint32_t mVertexCount;
+		uint32_t mBaseIndex;
+		uint32_t mIndexCount;
+	};
+	vector<BvhBuild> bvhBuilds;
+
 	for (uint32_t m = 0; m < scene->mNumMeshes; m++) {
 		const aiMesh* mesh = scene->mMeshes[m];
 		totalVertices += mesh->mNumVertices;
@@ -250,7 +257,10 @@ Object* Scene::LoadModelScene(const string& filename,
 	shared_ptr<Buffer> vertexBuffer = make_shared<Buffer>(filename + " Vertices", mInstance->Device(), sizeof(StdVertex) * totalVertices, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	shared_ptr<Buffer> indexBuffer  = make_shared<Buffer>(filename + " Indices" , mInstance->Device(), sizeof(uint32_t) * totalIndices  , VK_BUFFER_USAGE_INDEX_BUFFER_BIT  | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 	shared_ptr<Buffer> weightBuffer = nullptr;
-	if (hasBones) weightBuffer = make_shared<Buffer>(filename + " Weights", mInstance->Device(), sizeof(VertexWeight) * totalVertices, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	if (hasBones) {
+		weightBuffer = make_shared<Buffer>(filename + " Weights", mInstance->Device(), sizeof(VertexWeight) * totalVertices, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		weightBuffer->SetMemoryCategory(MEMORY_CATEGORY_MESH);
+	}
 
 	for (uint32_t m = 0; m < scene->mNumMaterials; m++)
 		materials.push_back(materialSetupFunc(this, scene->mMaterials[m]));
@@ -314,7 +324,7 @@ Object* Scene::LoadModelScene(const string& filename,
 		TriangleBvh2* bvh = nullptr;
 		if (topo == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST) {
 			bvh = new TriangleBvh2();
-			bvh->Build(vertices.data() + baseVertex, 0, vertexCount, sizeof(StdVertex), indices.data() + baseIndex, indexCount, VK_INDEX_TYPE_UINT32);
+			bvhBuilds.push_back({ bvh, baseVertex, vertexCount, baseIndex, indexCount });
 		}
 
 		if (mesh->HasBones()) {
@@ -330,14 +340,49 @@ Object* Scene::LoadModelScene(const string& filename,
 
 			meshes.push_back(make_shared<Mesh>(mesh->mName.C_Str(), mInstance->Device(),
 				AABB(mn, mx), bvh, vertexBuffer, indexBuffer, weightBuffer, baseVertex, vertexCount, baseIndex, indexCount,
-				&StdVertex::VertexInput, VK_INDEX_TYPE_UINT32, topo));
+				&StdVertex::VertexInput, VK_INDEX_TYPE_UINT32, topo, vertices.data() + baseVertex));
 		} else {
 			meshes.push_back(make_shared<Mesh>(mesh->mName.C_Str(), mInstance->Device(),
 				AABB(mn, mx), bvh, vertexBuffer, indexBuffer, baseVertex, vertexCount, baseIndex, indexCount,
-				&StdVertex::VertexInput, VK_INDEX_TYPE_UINT32, topo));
+				&StdVertex::VertexInput, VK_INDEX_TYPE_UINT32, topo, vertices.data() + baseVertex));
 		}
 	}
 
+	// Load the triangle bvhs from the cache next to the file, or build them and update the cache
+	vector<TriangleBvh2*> bvhs;
+	for (const BvhBuild& b : bvhBuilds) bvhs.push_back(b.mBvh);
+	string bvhCache = filename + ".scene.bvh";
+	size_t importSettings = 0;
+	hash_combine(importSettings, scale);
+	auto bvhStart = chrono::high_resolution_clock::now();
+	uint64_t bvhKey = TriangleBvh2::HashFile(filename, importSettings);
+	bool bvhCached = bvhs.size() && TriangleBvh2::ReadCache(bvhCache, bvhKey, bvhs.data(), (uint32_t)bvhs.size());
+	if (!bvhCached && bvhs.size()) {
+		// Build the triangle bvhs. Large meshes are built one at a time using every thread,
+		// then the remaining meshes are built concurrently with one thread each.
+		sort(bvhBuilds.begin(), bvhBuilds.end(), [](const BvhBuild& a, const BvhBuild& b) { return a.mIndexCount > b.mIndexCount; });
+		uint32_t bvhThreadCount = max(thread::hardware_concurrency(), 1u);
+		atomic<uint32_t> nextBvh(0);
+		while (nextBvh < bvhBuilds.size() && bvhBuilds[nextBvh].mIndexCount / 3 >= PARALLEL_BVH_TRIANGLE_COUNT) {
+			const BvhBuild& b = bvhBuilds[nextBvh++];
+			b.mBvh->Build(vertices.data() + b.mBaseVertex, 0, b.mVertexCount, sizeof(StdVertex), indices.data() + b.mBaseIndex, b.mIndexCount, VK_INDEX_TYPE_UINT32, bvhThreadCount);
+		}
+		auto bvhWorker = [&]() {
+			uint32_t i;
+			while ((i = nextBvh++) < bvhBuilds.size()) {
+				const BvhBuild& b = bvhBuilds[i];
+				b.mBvh->Build(vertices.data() + b.mBaseVertex, 0, b.mVertexCount, sizeof(StdVertex), indices.data() + b.mBaseIndex, b.mIndexCount, VK_INDEX_TYPE_UINT32, 1);
+			}
+		};
+		vector<thread> bvhThreads;
+		for (uint32_t j = 1; j < min(bvhThreadCount, (uint32_t)bvhBuilds.size()); j++)
+			bvhThreads.push_back(thread(bvhWorker));
+		bvhWorker();
+		for (thread& t : bvhThreads) t.join();
+		TriangleBvh2::WriteCache(bvhCache, bvhKey, bvhs.data(), (uint32_t)bvhs.size());
+	}
+	float bvhTime = chrono::duration<float, milli>(chrono::high_resolution_clock::now() - bvhStart).count();
+
 	AnimationRig rig;
 
 	if (uniqueBones.size()) {
@@ -554,7 +599,7 @@ Object* Scene::LoadModelScene(const string& filename,
 		}
 	}
 
-	printf("Loaded %s\n", filename.c_str());
+	printf("Loaded %s / %s %u bvhs in %.2fms\n", filename.c_str(), bvhCached ? "read" : "built", (uint32_t)bvhs.size(), bvhTime);
 	return root;
 }
 
@@ -578,9 +623,9 @@ void Scene::Update(CommandBuffer* commandBuffer) {
 	mFixedAccumulator += mDeltaTime;
 	t1 = mClock.now();
 	while (mFixedAccumulator > mFixedTimeStep && physicsTime < mPhysicsTimeLimitPerFrame) {
-		for (auto o : mObjects)
-			if (o->EnabledHierarchy())
-				o->FixedUpdate(commandBuffer);
+		for (const ObjectEntry& o : mObjects)
+			if (o.mObject->EnabledHierarchy())
+				o.mObject->FixedUpdate(commandBuffer);
 		for (const auto& p : mPluginManager->Plugins())
 			if (p->mEnabled)
 				p->FixedUpdate(commandBuffer);
@@ -604,63 +649,76 @@ void Scene::Update(CommandBuffer* commandBuffer) {
 			p->PostUpdate(commandBuffer);
 	PROFILER_END;
 
+	PROFILER_BEGIN("Update Transforms");
+	mTransforms->Update();
+	PROFILER_END;
 }
 
-void Scene::AddObject(shared_ptr<Object> object) {
-	mObjects.push_back(object);
-	object->mScene = this;
+// p + offset, where offset was measured on another object of the same class
+template<typename T>
+inline T* OffsetPointer(Object* p, ptrdiff_t offset) { return reinterpret_cast<T*>(reinterpret_cast<char*>(p) + offset); }
 
-	if (auto l = dynamic_cast<Light*>(object.get()))
-		mLights.push_back(l);
-	if (auto c = dynamic_cast<Camera*>(object.get()))
-		mCameras.push_back(c);
-	if (auto r = dynamic_cast<Renderer*>(object.get()))
-		mRenderers.push_back(r);
+SlotHandle Scene::AddObject(shared_ptr<Object> object) {
+	Object* o = object.get();
 
-	mBvhDirty = true;
-}
-void Scene::RemoveObject(Object* object) {
-	if (!object) return;
-
-	if (auto l = dynamic_cast<Light*>(object))
-		for (auto it = mLights.begin(); it != mLights.end();) {
-			if (*it == l) {
-				it = mLights.erase(it);
-				break;
-			} else
-				it++;
+	// the bases are virtual, so their offsets depend on the most derived class, which is the same for every object of that class
+	auto type = mObjectTypes.find(typeid(*o));
+	if (type == mObjectTypes.end()) {
+		ObjectType t = {};
+		if (Light* l = dynamic_cast<Light*>(o)) {
+			t.mLight = true;
+			t.mLightOffset = reinterpret_cast<char*>(l) - reinterpret_cast<char*>(o);
 		}
-
-	if (auto c = dynamic_cast<Camera*>(object))
-		for (auto it = mCameras.begin(); it != mCameras.end();) {
-			if (*it == c) {
-				it = mCameras.erase(it);
-				break;
-			} else
-				it++;
+		if (Camera* c = dynamic_cast<Camera*>(o)) {
+			t.mCamera = true;
+			t.mCameraOffset = reinterpret_cast<char*>(c) - reinterpret_cast<char*>(o);
 		}
-
-	if (auto r = dynamic_cast<Renderer*>(object))
-		for (auto it = mRenderers.begin(); it != mRenderers.end();) {
-			if (*it == r) {
-				it = mRenderers.erase(it);
-				break;
-			} else
-				it++;
+		if (Renderer* r = dynamic_cast<Renderer*>(o)) {
+			t.mRenderer = true;
+			t.mRendererOffset = reinterpret_cast<char*>(r) - reinterpret_cast<char*>(o);
 		}
+		type = mObjectTypes.emplace(typeid(*o), t).first;
+	}
 
-	for (auto it = mObjects.begin(); it != mObjects.end();)
-		if (it->get() == object) {
-			mBvhDirty = true;
-			while (object->mChildren.size())
-				object->RemoveChild(object->mChildren[0]);
-			if (object->mParent) object->mParent->RemoveChild(object);
-			object->mParent = nullptr;
-			object->mScene = nullptr;
-			it = mObjects.erase(it);
-			break;
-		} else
-			it++;
+	ObjectEntry entry;
+	entry.mObject = object;
+	entry.mLight = type->second.mLight ? mLights.Insert(OffsetPointer<Light>(o, type->second.mLightOffset)) : INVALID_SLOT_HANDLE;
+	entry.mCamera = type->second.mCamera ? mCameras.Insert(OffsetPointer<Camera>(o, type->second.mCameraOffset)) : INVALID_SLOT_HANDLE;
+	entry.mRenderer = type->second.mRenderer ? mRenderers.Insert(OffsetPointer<Renderer>(o, type->second.mRendererOffset)) : INVALID_SLOT_HANDLE;
+	o->mSceneHandle = mObjects.Insert(move(entry));
+	o->mScene = this;
+	mTransforms->Add(o);
+
+	if (mBvh->Dynamic() && !mBvhDirty)
+		mBvh->Insert(o);
+	else
+		mBvhDirty = true;
+	return o->mSceneHandle;
+}
+void Scene::RemoveObject(Object* object) {
+	if (!object || object->mScene != this) return;
+	ObjectEntry* entry = mObjects.Get(object->mSceneHandle);
+	if (!entry) return;
+
+	mLights.Erase(entry->mLight);
+	mCameras.Erase(entry->mCamera);
+	mRenderers.Erase(entry->mRenderer);
+
+	if (mBvh && mBvh->Dynamic() && !mBvhDirty)
+		mBvh->Remove(object);
+	else
+		mBvhDirty = true;
+	while (object->mChildren.size())
+		object->RemoveChild(object->mChildren[0]);
+	if (object->mParent) object->mParent->RemoveChild(object);
+	object->mParent = nullptr;
+	mTransforms->Remove(object);
+	object->mScene = nullptr;
+
+	// erasing the entry releases the scene's reference, which might destroy the object
+	SlotHandle handle = object->mSceneHandle;
+	object->mSceneHandle = INVALID_SLOT_HANDLE;
+	mObjects.Erase(handle);
 }
 
 void Scene::AddShadowCamera(uint32_t si, ShadowData* sd, bool ortho, float size, const float3& pos, const quaternion& rot, float near, float far) {
@@ -689,6 +747,8 @@ void Scene::AddShadowCamera(uint32_t si, ShadowData* sd, bool ortho, float size,
 
 void Scene::PreFrame(CommandBuffer* commandBuffer) {
 	vkCmdSetLineWidth(*commandBuffer, 1.0f);
+	mLastRenderStats = mRenderStats;
+	mRenderStats = {};
 	
 	PROFILER_BEGIN("Renderer PreFrame");
 	for (Renderer* r : mRenderers)
@@ -697,7 +757,7 @@ void Scene::PreFrame(CommandBuffer* commandBuffer) {
 	PROFILER_END;
 
 	Camera* mainCamera = nullptr;
-	sort(mCameras.begin(), mCameras.end(), [](const auto& a, const auto& b) {
+	mCameras.Sort([](const auto& a, const auto& b) {
 		return a->RenderPriority() > b->RenderPriority();
 	});
 	for (Camera* c : mCameras)
@@ -711,7 +771,9 @@ void Scene::PreFrame(CommandBuffer* commandBuffer) {
 
 	if (!mBvh) {
 		PROFILER_BEGIN("Sort Renderers");
-		sort(mRenderers.begin(), mRenderers.end(), RendererCompare);
+		mRenderers.Sort([](Renderer* a, Renderer* b) {
+			return a->DrawKey(PASS_MAIN) < b->DrawKey(PASS_MAIN);
+		});
 		PROFILER_END;
 	}
 
@@ -720,7 +782,7 @@ void Scene::PreFrame(CommandBuffer* commandBuffer) {
 	uint32_t si = 0;
 	mShadowCount = 0;
 	mActiveLights.clear();
-	if (mainCamera && mLights.size()) {
+	if (mainCamera && !mLights.Empty()) {
 		AABB sceneBounds;
 		if (mBvh)
 			sceneBounds = BVH()->RendererBounds();
@@ -877,12 +939,12 @@ void Scene::PreFrame(CommandBuffer* commandBuffer) {
 		bool g = mDrawGizmos;
 		mDrawGizmos = false;
 		for (uint32_t i = 0; i < si; i++) {
-			mShadowCameras[i]->mEnabled = true;
+			mShadowCameras[i]->Enabled(true);
 			Render(commandBuffer, mShadowCameras[i], mShadowAtlasFramebuffer, PASS_DEPTH, i == 0);
 			mShadowCount++;
 		}
 		for (uint32_t i = si; i < mShadowCameras.size(); i++)
-			mShadowCameras[i]->mEnabled = false;
+			mShadowCameras[i]->Enabled(false);
 		mDrawGizmos = g;
 
 		uint32_t fc = commandBuffer->Device()->FrameContextIndex();
@@ -902,17 +964,46 @@ void Scene::Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* fr
 	BVH()->FrustumCheck(camera->Frustum(), mRenderList, pass);
 	PROFILER_END;
 	PROFILER_BEGIN("Sort Renderers");
-	sort(mRenderList.begin(), mRenderList.end(), RendererCompare);
+	auto t0 = mClock.now();
+	SortRenderList(camera, pass);
+	mRenderStats.mSortTime += (mClock.now() - t0).count() * 1e-6f;
 	PROFILER_END;
 
 	Render(commandBuffer, camera, framebuffer, pass, clear, mRenderList);
 }
 
+void Scene::SortRenderList(Camera* camera, PassType pass) {
+	uint32_t count = (uint32_t)mRenderList.size();
+	mDrawKeys.resize(count);
+
+	// the state goes in the high bits, and the distance to the camera in the low bits, so draws with the same state are drawn front to back
+	float3 cameraPosition = camera->WorldPosition();
+	float depthScale = ((1 << DRAW_KEY_DEPTH_BITS) - 1) / camera->Far();
+	for (uint32_t i = 0; i < count; i++) {
+		Renderer* r = dynamic_cast<Renderer*>(mRenderList[i]);
+		uint64_t key = 0xFFFFFFFFFFFFFFFFull;
+		if (r->Visible()) {
+			float depth = length(r->Bounds().Center() - cameraPosition) * depthScale;
+			key = r->DrawKey(pass) | (uint64_t)min(depth, (float)((1 << DRAW_KEY_DEPTH_BITS) - 1));
+		}
+		mDrawKeys[i] = make_pair(key, mRenderList[i]);
+	}
+
+	// most of the render queue and depth bits are usually the same for every draw, so the radix sort skips them
+	RadixSort(mDrawKeys, mSortedDrawKeys);
+
+	for (uint32_t i = 0; i < count; i++)
+		mRenderList[i] = mDrawKeys[i].second;
+}
+
 void Scene::Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* framebuffer, PassType pass, bool clear, vector<Object*>& renderList) {
 	camera->PreRender();
 	if (camera->FramebufferWidth() == 0 || camera->FramebufferHeight() == 0)
 		return;
 
+	uint32_t pipelineBindCount = commandBuffer->mPipelineBindCount;
+	uint32_t descriptorSetBindCount = commandBuffer->mDescriptorSetBindCount;
+
 	PROFILER_BEGIN("Plugin PreRender");
 	BEGIN_CMD_REGION(commandBuffer, "Plugin PreRender");
 	for (const auto& p : mPluginManager->Plugins())
@@ -932,110 +1023,150 @@ void Scene::Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* fr
 	PROFILER_BEGIN("Render");
 	BEGIN_CMD_REGION(commandBuffer, "Render");
 
+	uint32_t count = (uint32_t)renderList.size();
+	uint32_t threadCount = mRecordThreadCount ? mRecordThreadCount : max(thread::hardware_concurrency(), 1u);
+	threadCount = min(threadCount, count / MIN_THREAD_DRAWS);
+	bool threaded = threadCount > 1;
+	Device* device = commandBuffer->Device();
+
+	// when threaded, the render pass can only hold secondary command buffers, so the commands recorded on this thread go in secondaries as well
+	auto GetSecondary = [&](const string& name) {
+		shared_ptr<CommandBuffer> secondary = device->GetSecondaryCommandBuffer(commandBuffer, name);
+		// secondary command buffers don't inherit dynamic state
+		vkCmdSetLineWidth(*secondary, 1.0f);
+		camera->SetViewport(secondary.get());
+		return secondary;
+	};
+
 	PROFILER_BEGIN("Begin RenderPass");
 	// begin renderpass
 	if (!framebuffer) framebuffer = camera->Framebuffer();
-	framebuffer->BeginRenderPass(commandBuffer);
-	if (clear) framebuffer->Clear(commandBuffer);
-	camera->Set(commandBuffer);
+	framebuffer->BeginRenderPass(commandBuffer, threaded ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
+	shared_ptr<CommandBuffer> sceneSecondary;
+	if (threaded) sceneSecondary = GetSecondary("Scene");
+	CommandBuffer* sceneCommandBuffer = threaded ? sceneSecondary.get() : commandBuffer;
+	if (clear) framebuffer->Clear(sceneCommandBuffer);
+	camera->Set(sceneCommandBuffer);
 	PROFILER_END;
 
 	PROFILER_BEGIN("Plugin PreRenderScene");
 	for (const auto& p : mPluginManager->Plugins())
-		if (p->mEnabled) p->PreRenderScene(commandBuffer, camera, pass);
+		if (p->mEnabled) p->PreRenderScene(sceneCommandBuffer, camera, pass);
 	PROFILER_END;
 
 	// skybox
 	if (mDrawSkybox && mEnvironment->mSkyboxMaterial && pass == PASS_MAIN) {
 		PROFILER_BEGIN("Draw skybox");
-		mEnvironment->PreRender(commandBuffer, camera);
+		mEnvironment->PreRender(sceneCommandBuffer, camera);
 		ShaderVariant* shader = mEnvironment->mSkyboxMaterial->GetShader(PASS_MAIN);
-		VkPipelineLayout layout = commandBuffer->BindMaterial(mEnvironment->mSkyboxMaterial.get(), pass, mSkyboxCube->VertexInput(), camera, mSkyboxCube->Topology());
-		commandBuffer->BindVertexBuffer(mSkyboxCube->VertexBuffer().get(), 0, 0);
-		commandBuffer->BindIndexBuffer(mSkyboxCube->IndexBuffer().get(), 0, mSkyboxCube->IndexType());
-		camera->SetStereoViewport(commandBuffer, shader, EYE_LEFT);
-		vkCmdDrawIndexed(*commandBuffer, mSkyboxCube->IndexCount(), 1, mSkyboxCube->BaseIndex(), mSkyboxCube->BaseVertex(), 0);
-		commandBuffer->mTriangleCount += mSkyboxCube->IndexCount() / 3;
+		VkPipelineLayout layout = sceneCommandBuffer->BindMaterial(mEnvironment->mSkyboxMaterial.get(), pass, mSkyboxCube->VertexInput(), camera, mSkyboxCube->Topology());
+		sceneCommandBuffer->BindVertexBuffer(mSkyboxCube->VertexBuffer().get(), 0, 0);
+		sceneCommandBuffer->BindIndexBuffer(mSkyboxCube->IndexBuffer().get(), 0, mSkyboxCube->IndexType());
+		camera->SetStereoViewport(sceneCommandBuffer, shader, EYE_LEFT);
+		vkCmdDrawIndexed(*sceneCommandBuffer, mSkyboxCube->IndexCount(), 1, mSkyboxCube->BaseIndex(), mSkyboxCube->BaseVertex(), 0);
+		sceneCommandBuffer->mTriangleCount += mSkyboxCube->IndexCount() / 3;
 		if (camera->StereoMode() != STEREO_NONE) {
-			camera->SetStereoViewport(commandBuffer, shader, EYE_RIGHT);
-			vkCmdDrawIndexed(*commandBuffer, mSkyboxCube->IndexCount(), 1, mSkyboxCube->BaseIndex(), mSkyboxCube->BaseVertex(), 0);
-			commandBuffer->mTriangleCount += mSkyboxCube->IndexCount() / 3;
+			camera->SetStereoViewport(sceneCommandBuffer, shader, EYE_RIGHT);
+			vkCmdDrawIndexed(*sceneCommandBuffer, mSkyboxCube->IndexCount(), 1, mSkyboxCube->BaseIndex(), mSkyboxCube->BaseVertex(), 0);
+			sceneCommandBuffer->mTriangleCount += mSkyboxCube->IndexCount() / 3;
 		}
 		PROFILER_END;
 	}
 
 	#pragma region Render renderers
+	// the GUI is drawn between the renderers before and after its render queue
+	uint32_t guiIndex = 0;
+	while (guiIndex < count && dynamic_cast<Renderer*>(renderList[guiIndex])->RenderQueue() <= GUI::mRenderQueue) guiIndex++;
+
+	auto recordStart = mClock.now();
+	if (!threaded) {
+		mRenderStats.mDrawCount += DrawRenderers(commandBuffer, camera, pass, renderList, 0, guiIndex);
+		DrawGUI(commandBuffer, camera, pass);
+		mRenderStats.mDrawCount += DrawRenderers(commandBuffer, camera, pass, renderList, guiIndex, count);
+
+		camera->Set(commandBuffer);
+		PROFILER_BEGIN("Plugin PostRenderScene");
+		for (const auto& p : mPluginManager->Plugins())
+			if (p->mEnabled) p->PostRenderScene(commandBuffer, camera, pass);
+		PROFILER_END;
+	} else {
+		// GUI, gizmos and plugins aren't thread safe, so their secondaries are recorded here before the threads start
+		shared_ptr<CommandBuffer> guiSecondary = GetSecondary("GUI");
+		DrawGUI(guiSecondary.get(), camera, pass);
+
+		shared_ptr<CommandBuffer> postSecondary = GetSecondary("PostRenderScene");
+		camera->Set(postSecondary.get());
+		PROFILER_BEGIN("Plugin PostRenderScene");
+		for (const auto& p : mPluginManager->Plugins())
+			if (p->mEnabled) p->PostRenderScene(postSecondary.get(), camera, pass);
+		PROFILER_END;
+
+		// chunks don't span the GUI, and instanced batches are split at chunk boundaries
+		PROFILER_BEGIN("Record Renderers");
+		uint32_t preChunks = (guiIndex + DRAWS_PER_CHUNK - 1) / DRAWS_PER_CHUNK;
+		uint32_t chunkCount = preChunks + (count - guiIndex + DRAWS_PER_CHUNK - 1) / DRAWS_PER_CHUNK;
+		vector<shared_ptr<CommandBuffer>> chunks(chunkCount);
+		vector<uint32_t> chunkDraws(chunkCount);
+		atomic<uint32_t> nextChunk(0);
+		// renderers read their transforms on the record threads, so anything moved since Update() is computed here instead of racing there
+		mTransforms->Update();
+		RunRecordThreads(threadCount, [&]() {
+			uint32_t c;
+			while ((c = nextChunk++) < chunkCount) {
+				uint32_t start = c < preChunks ? c * DRAWS_PER_CHUNK : guiIndex + (c - preChunks) * DRAWS_PER_CHUNK;
+				uint32_t end = min(start + DRAWS_PER_CHUNK, c < preChunks ? guiIndex : count);
+				chunks[c] = GetSecondary("Renderers");
+				chunkDraws[c] = DrawRenderers(chunks[c].get(), camera, pass, renderList, start, end);
+			}
+		});
+		PROFILER_END;
+
+		PROFILER_BEGIN("Execute Secondaries");
+		vector<shared_ptr<CommandBuffer>> secondaries;
+		secondaries.reserve(chunkCount + 3);
+		secondaries.push_back(sceneSecondary);
+		secondaries.insert(secondaries.end(), chunks.begin(), chunks.begin() + preChunks);
+		secondaries.push_back(guiSecondary);
+		secondaries.insert(secondaries.end(), chunks.begin() + preChunks, chunks.end());
+		secondaries.push_back(postSecondary);
+		commandBuffer->Execute(secondaries);
+		for (uint32_t d : chunkDraws) mRenderStats.mDrawCount += d;
+		PROFILER_END;
+	}
+	mRenderStats.mRecordTime += (mClock.now() - recordStart).count() * 1e-6f;
+	#pragma endregion
+
+	PROFILER_BEGIN("End RenderPass");
+	vkCmdEndRenderPass(*commandBuffer);
+	PROFILER_END;
+
+	mRenderStats.mPipelineBindCount += commandBuffer->mPipelineBindCount - pipelineBindCount;
+	mRenderStats.mDescriptorSetBindCount += commandBuffer->mDescriptorSetBindCount - descriptorSetBindCount;
+
+	END_CMD_REGION(commandBuffer);
+	PROFILER_END;
+}
+
+uint32_t Scene::DrawRenderers(CommandBuffer* commandBuffer, Camera* camera, PassType pass, const vector<Object*>& renderList, uint32_t start, uint32_t end) {
 	uint32_t frameContextIndex = commandBuffer->Device()->FrameContextIndex();
 	DescriptorSet* batchDS = nullptr;
-	Buffer* batchBuffer = nullptr;
+	TempBufferRange batchBuffer = {};
 	InstanceBuffer* curBatch = nullptr;
 	MeshRenderer* batchStart = nullptr;
 	uint32_t batchSize = 0;
-	bool guiDrawn = false;
-
-	auto DrawGUI = [&]() {
-		guiDrawn = true;
-		if (pass == PASS_MAIN) {
-			if (mDrawGizmos) {
-				PROFILER_BEGIN("Draw Gizmos");
-				BEGIN_CMD_REGION(commandBuffer, "Draw Gizmos");
-				/*
-				for (Camera* c : mShadowCameras)
-					if (camera != c) {
-						float3 f0 = c->ClipToWorld(float3(-1, -1, 0));
-						float3 f1 = c->ClipToWorld(float3(-1, 1, 0));
-						float3 f2 = c->ClipToWorld(float3(1, -1, 0));
-						float3 f3 = c->ClipToWorld(float3(1, 1, 0));
-						float3 f4 = c->ClipToWorld(float3(-1, -1, 1));
-						float3 f5 = c->ClipToWorld(float3(-1, 1, 1));
-						float3 f6 = c->ClipToWorld(float3(1, -1, 1));
-						float3 f7 = c->ClipToWorld(float3(1, 1, 1));
-						Gizmos::DrawLine(f0, f1, 1);
-						Gizmos::DrawLine(f0, f2, 1);
-						Gizmos::DrawLine(f3, f1, 1);
-						Gizmos::DrawLine(f3, f2, 1);
-						Gizmos::DrawLine(f4, f5, 1);
-						Gizmos::DrawLine(f4, f6, 1);
-						Gizmos::DrawLine(f7, f5, 1);
-						Gizmos::DrawLine(f7, f6, 1);
-						Gizmos::DrawLine(f0, f4, 1);
-						Gizmos::DrawLine(f1, f5, 1);
-						Gizmos::DrawLine(f2, f6, 1);
-						Gizmos::DrawLine(f3, f7, 1);
-					}
-				*/
-
-				if (mBvh) mBvh->DrawGizmos(commandBuffer, camera, this);
-
-				for (const auto& r : mObjects)
-					if (r->EnabledHierarchy())
-						r->DrawGizmos(commandBuffer, camera);
+	uint32_t drawCount = 0;
 
-				for (const auto& p : mPluginManager->Plugins())
-					if (p->mEnabled)
-						p->DrawGizmos(commandBuffer, camera);
-				Gizmos::Draw(commandBuffer, pass, camera);
-				END_CMD_REGION(commandBuffer);
-				PROFILER_END;
-			}
-			PROFILER_BEGIN("Draw GUI");
-			GUI::Draw(commandBuffer, pass, camera);
-			PROFILER_END;
-		}
-	};
 	auto DrawLastBatch = [&]() {
 		if (batchStart) {
 			PROFILER_BEGIN("Draw Batch");
 			batchStart->DrawInstanced(commandBuffer, camera, batchSize, *batchDS, pass);
 			batchStart = nullptr;
+			drawCount++;
 			PROFILER_END;
 		}
 	};
-	for (Object* o : renderList) {
-		Renderer* r = dynamic_cast<Renderer*>(o);
-
-		if (!guiDrawn && r->RenderQueue() > GUI::mRenderQueue) DrawGUI();
-
+	for (uint32_t i = start; i < end; i++) {
+		Renderer* r = dynamic_cast<Renderer*>(renderList[i]);
 		if (!r || !r->Visible()) continue;
 		bool batched = false;
 		if (MeshRenderer* cur = dynamic_cast<MeshRenderer*>(r)) {
@@ -1050,11 +1181,11 @@ void Scene::Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* fr
 					batchSize = 0;
 					batchStart = cur;
 
-					batchBuffer = commandBuffer->Device()->GetTempBuffer("Instance Batch", sizeof(InstanceBuffer) * INSTANCE_BATCH_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-					curBatch = (InstanceBuffer*)batchBuffer->MappedData();
+					batchBuffer = commandBuffer->Device()->GetTempBufferRange(sizeof(InstanceBuffer) * INSTANCE_BATCH_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+					curBatch = (InstanceBuffer*)batchBuffer.mMapped;
 
-					batchDS = commandBuffer->Device()->GetTempDescriptorSet("Instance Batch", curShader->mDescriptorSetLayouts[PER_OBJECT]);
-					batchDS->CreateStorageBufferDescriptor(batchBuffer, 0, batchBuffer->Size(), INSTANCE_BUFFER_BINDING);
+					batchDS = commandBuffer->Device()->GetCachedDescriptorSet("Instance Batch", curShader->mDescriptorSetLayouts[PER_OBJECT]);
+					batchDS->CreateStorageBufferDescriptor(batchBuffer.mBuffer, batchBuffer.mOffset, batchBuffer.mSize, INSTANCE_BUFFER_BINDING);
 					if (pass == PASS_MAIN) {
 						if (curShader->mDescriptorBindings.count("Lights"))
 							batchDS->CreateStorageBufferDescriptor(mLightBuffers[frameContextIndex], 0, mLightBuffers[frameContextIndex]->Size(), LIGHT_BUFFER_BINDING);
@@ -1083,37 +1214,140 @@ void Scene::Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* fr
 			DrawLastBatch();
 			PROFILER_BEGIN("Draw Unbatched");
 			r->Draw(commandBuffer, camera, pass);
+			drawCount++;
 			PROFILER_END;
 		}
 	}
 	// render last batch
 	DrawLastBatch();
-	DrawGUI();
-	#pragma endregion
+	return drawCount;
+}
 
-	camera->Set(commandBuffer);
-	PROFILER_BEGIN("Plugin PostRenderScene");
-	for (const auto& p : mPluginManager->Plugins())
-		if (p->mEnabled) p->PostRenderScene(commandBuffer, camera, pass);
-	PROFILER_END;
+void Scene::DrawGUI(CommandBuffer* commandBuffer, Camera* camera, PassType pass) {
+	if (pass != PASS_MAIN) return;
+	if (mDrawGizmos) {
+		PROFILER_BEGIN("Draw Gizmos");
+		BEGIN_CMD_REGION(commandBuffer, "Draw Gizmos");
+		/*
+		for (Camera* c : mShadowCameras)
+			if (camera != c) {
+				float3 f0 = c->ClipToWorld(float3(-1, -1, 0));
+				float3 f1 = c->ClipToWorld(float3(-1, 1, 0));
+				float3 f2 = c->ClipToWorld(float3(1, -1, 0));
+				float3 f3 = c->ClipToWorld(float3(1, 1, 0));
+				float3 f4 = c->ClipToWorld(float3(-1, -1, 1));
+				float3 f5 = c->ClipToWorld(float3(-1, 1, 1));
+				float3 f6 = c->ClipToWorld(float3(1, -1, 1));
+				float3 f7 = c->ClipToWorld(float3(1, 1, 1));
+				Gizmos::DrawLine(f0, f1, 1);
+				Gizmos::DrawLine(f0, f2, 1);
+				Gizmos::DrawLine(f3, f1, 1);
+				Gizmos::DrawLine(f3, f2, 1);
+				Gizmos::DrawLine(f4, f5, 1);
+				Gizmos::DrawLine(f4, f6, 1);
+				Gizmos::DrawLine(f7, f5, 1);
+				Gizmos::DrawLine(f7, f6, 1);
+				Gizmos::DrawLine(f0, f4, 1);
+				Gizmos::DrawLine(f1, f5, 1);
+				Gizmos::DrawLine(f2, f6, 1);
+				Gizmos::DrawLine(f3, f7, 1);
+			}
+		*/
 
+		if (mBvh) mBvh->DrawGizmos(commandBuffer, camera, this);
 
-	PROFILER_BEGIN("End RenderPass");
-	vkCmdEndRenderPass(*commandBuffer);
-	PROFILER_END;
+		for (const ObjectEntry& o : mObjects)
+			if (o.mObject->EnabledHierarchy())
+				o.mObject->DrawGizmos(commandBuffer, camera);
 
-	END_CMD_REGION(commandBuffer);
+		for (const auto& p : mPluginManager->Plugins())
+			if (p->mEnabled)
+				p->DrawGizmos(commandBuffer, camera);
+		Gizmos::Draw(commandBuffer, pass, camera);
+		END_CMD_REGION(commandBuffer);
+		PROFILER_END;
+	}
+	PROFILER_BEGIN("Draw GUI");
+	GUI::Draw(commandBuffer, pass, camera);
 	PROFILER_END;
 }
 
+void Scene::RecordThreadCount(uint32_t c) {
+	if (c == mRecordThreadCount) return;
+	mRecordThreadCount = c;
+	// the threads are started again by the next render that needs them
+	StopRecordThreads();
+}
+
+void Scene::RunRecordThreads(uint32_t threadCount, const function<void()>& task) {
+	// every thread is started, even if this task uses fewer, so their pools are re-used by the next task
+	uint32_t maxThreads = mRecordThreadCount ? mRecordThreadCount : max(thread::hardware_concurrency(), 1u);
+	if (mRecordThreads.size() != maxThreads - 1) {
+		StopRecordThreads();
+		for (uint32_t i = 1; i < maxThreads; i++)
+			mRecordThreads.push_back(thread(&Scene::RecordThread, this, mRecordGeneration));
+	}
+
+	unique_lock<mutex> lock(mRecordMutex);
+	mRecordTask = task;
+	mRecordSlots = threadCount - 1;
+	mRecordBusy = (uint32_t)mRecordThreads.size();
+	mRecordGeneration++;
+	lock.unlock();
+	mRecordStart.notify_all();
+
+	task();
+
+	lock.lock();
+	mRecordDone.wait(lock, [&]() { return mRecordBusy == 0; });
+	mRecordTask = nullptr;
+}
+void Scene::RecordThread(uint64_t generation) {
+	unique_lock<mutex> lock(mRecordMutex);
+	while (true) {
+		mRecordStart.wait(lock, [&]() { return mStopRecordThreads || mRecordGeneration != generation; });
+		if (mStopRecordThreads) return;
+		generation = mRecordGeneration;
+		bool run = mRecordSlots > 0;
+		if (run) mRecordSlots--;
+		lock.unlock();
+		if (run) mRecordTask();
+		lock.lock();
+		if (--mRecordBusy == 0) mRecordDone.notify_one();
+	}
+}
+void Scene::StopRecordThreads() {
+	if (mRecordThreads.empty()) return;
+	unique_lock<mutex> lock(mRecordMutex);
+	mStopRecordThreads = true;
+	lock.unlock();
+	mRecordStart.notify_all();
+	vector<thread::id> ids;
+	for (thread& t : mRecordThreads) {
+		ids.push_back(t.get_id());
+		t.join();
+	}
+	mRecordThreads.clear();
+	mStopRecordThreads = false;
+	// the threads' ids may be re-used by new threads, which must not pick up the old pools
+	mInstance->Device()->ReleaseThreadPools(ids);
+}
+
 vector<Object*> Scene::Objects() const {
-	vector<Object*> objs(mObjects.size());
-	for (uint32_t i = 0; i < mObjects.size(); i++)
-		objs[i] = mObjects[i].get();
+	vector<Object*> objs(mObjects.Size());
+	for (uint32_t i = 0; i < mObjects.Size(); i++)
+		objs[i] = mObjects[i].mObject.get();
 	return objs;
 }
 
 ObjectBvh2* Scene::BVH() {
+	if (mBvh && !mBvhDirty && mBvh->DirtyCount()) {
+		PROFILER_BEGIN("Refit BVH");
+		mBvh->Refit();
+		// Refitting keeps the tree's topology, so rebuild once its quality has degraded too far
+		mBvhDirty = mBvh->NeedsRebuild();
+		PROFILER_END;
+	}
 	if (mBvh && mBvhDirty) {
 		PROFILER_BEGIN("Build BVH");
 		vector<Object*> objs = Objects();
@@ -12,12 +12,27 @@
 #include <Scene/Environment.hpp>
 #include <Scene/Light.hpp>
 #include <Scene/Object.hpp>
+#include <Util/SlotMap.hpp>
 #include <Util/Util.hpp>
 
+#include <condition_variable>
 #include <functional>
+#include <typeindex>
 
 class Renderer;
 
+// Work done by the scene to render a frame
+struct RenderStats {
+	// Time spent sorting render lists, in milliseconds
+	float mSortTime;
+	// Time spent recording renderers and the GUI inside render passes, including waiting for the record threads, in milliseconds
+	float mRecordTime;
+	uint32_t mDrawCount;
+	// See CommandBuffer::mPipelineBindCount and CommandBuffer::mDescriptorSetBindCount
+	uint32_t mPipelineBindCount;
+	uint32_t mDescriptorSetBindCount;
+};
+
 // Holds scene Objects. In general, plugins will add objects during their lifetime,
 // and remove objects during or at the end of their lifetime.
 // This makes the shared_ptr destroy when the plugin removes the object, allowing the plugin's module
@@ -26,8 +41,15 @@ class Scene {
 public:
 	ENGINE_EXPORT ~Scene();
 
-	ENGINE_EXPORT void AddObject(std::shared_ptr<Object> object);
+	// Adds an object in O(1), returning a handle that can be looked up with FindObject() until the object is removed
+	ENGINE_EXPORT SlotHandle AddObject(std::shared_ptr<Object> object);
+	// Removes an object in O(1)
 	ENGINE_EXPORT void RemoveObject(Object* object);
+	// Returns nullptr if the object has been removed
+	inline Object* FindObject(SlotHandle handle) const {
+		const ObjectEntry* e = mObjects.Get(handle);
+		return e ? e->mObject.get() : nullptr;
+	}
 	
 	// Loads a 3d scene from a file, separating all meshes with different topologies/materials into separate MeshRenderers and 
 	// replicating the heirarchy stored in the file, and creating new materials using the specified shader.
@@ -50,8 +72,17 @@ public:
 	// Draw all renderers and GUI/Gizmos in order of RenderQueue
 	// for each plugin: Plugin::PostRenderScene()
 	// End RenderPass
+	// Large render lists are split into chunks that are recorded into secondary command buffers on RecordThreadCount() threads.
+	// Renderer::Draw() may then be called on any of them, but the plugin callbacks, GUI and gizmos are always recorded on the calling thread
 	ENGINE_EXPORT void Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* framebuffer = nullptr, PassType pass = PASS_MAIN, bool clear = true);
 	inline Object* Raycast(const Ray& worldRay, float* t = nullptr, bool any = false, uint32_t mask = 0xFFFFFFFF) { return BVH()->Intersect(worldRay, t, any, mask); }
+	inline Object* Raycast(const Ray& worldRay, RaycastHit* hit, bool any = false, uint32_t mask = 0xFFFFFFFF) { return BVH()->Intersect(worldRay, hit, any, mask); }
+	// Traces a batch of rays in packets on threadCount threads (one per hardware thread if 0). hits must hold rayCount elements. See ObjectBvh2::Intersect().
+	inline void Raycast(const Ray* worldRays, uint32_t rayCount, RaycastHit* hits, bool any = false, uint32_t mask = 0xFFFFFFFF, uint32_t threadCount = 0) { BVH()->Intersect(worldRays, rayCount, hits, any, mask, threadCount); }
+	// See ObjectBvh2::Overlap() and ObjectBvh2::Nearest()
+	inline uint32_t Overlap(const AABB& box, Object** objects, uint32_t capacity, uint32_t mask = 0xFFFFFFFF) { return BVH()->Overlap(box, objects, capacity, mask); }
+	inline uint32_t Overlap(const Sphere& sphere, Object** objects, uint32_t capacity, uint32_t mask = 0xFFFFFFFF) { return BVH()->Overlap(sphere, objects, capacity, mask); }
+	inline uint32_t Nearest(const float3& point, uint32_t k, Object** objects, float* distances, uint32_t mask = 0xFFFFFFFF, float maxDistance = 1e20f) { return BVH()->Nearest(point, k, objects, distances, mask, maxDistance); }
 
 	// Setters
 
@@ -59,6 +90,8 @@ public:
 	inline void PhysicsTimeLimitPerFrame(float t) { mPhysicsTimeLimitPerFrame = t; }
 	inline void DrawSkybox(bool v) { mDrawSkybox = v; }
 	inline void DrawGizmos(bool g) { mDrawGizmos = g; }
+	// Number of threads that record draws, including the rendering thread, or 0 for one per hardware thread. 1 records every draw on the rendering thread
+	ENGINE_EXPORT void RecordThreadCount(uint32_t c);
 
 	// Getters
 
@@ -69,8 +102,12 @@ public:
 	inline float PhysicsTimeLimitPerFrame() const { return mPhysicsTimeLimitPerFrame; }
 	inline bool DrawSkybox() const { return mDrawSkybox; }
 	inline bool DrawGizmos() const { return mDrawGizmos; }
+	inline uint32_t RecordThreadCount() const { return mRecordThreadCount; }
 	inline const std::vector<Light*>& ActiveLights() const { return mActiveLights; }
-	inline const std::vector<Camera*>& Cameras() const { return mCameras; }
+	// Stats of the last frame that was rendered, summed over every camera and shadow
+	inline const RenderStats& LastRenderStats() const { return mLastRenderStats; }
+	// Cameras in the scene, sorted by RenderPriority() at the start of each frame
+	inline const std::vector<Camera*>& Cameras() const { return mCameras.Values(); }
 	// Buffer of GPULight structs (defined in shadercompat.h)
 	inline Buffer* LightBuffer() const { return mLightBuffers[mInstance->Device()->FrameContextIndex()]; }
 	// Buffer of ShadowData structs (defined in shadercompat.h)
@@ -85,16 +122,45 @@ public:
 	inline ::Environment* Environment() const { return mEnvironment; }
 	inline ::Instance* Instance() const { return mInstance; }
 
-	// All objects, in order of insertion
+	// All objects, in no particular order
 	ENGINE_EXPORT std::vector<Object*> Objects() const;
 
 	ENGINE_EXPORT ObjectBvh2* BVH();
+	// When true, objects are inserted into and removed from the bvh directly, instead of rebuilding it
+	inline bool DynamicBvh() const { return mBvh->Dynamic(); }
+	inline void DynamicBvh(bool d) { mBvh->Dynamic(d); mBvhDirty = true; }
+	// The builder used when the bvh is rebuilt. BVH_BUILDER_LBVH suits scenes where most objects move every frame.
+	inline ::BvhBuilder BvhBuilder() const { return mBvh->Builder(); }
+	inline void BvhBuilder(::BvhBuilder b) { mBvh->Builder(b); mBvhDirty = true; }
 	// Frame id of the last bvh build
 	inline uint64_t LastBvhBuild() { return mLastBvhBuild; }
+	// Transforms of the objects in the scene, which are all computed at the end of Update()
+	inline TransformHierarchy* Transforms() const { return mTransforms; }
 
-	inline void BvhDirty(/* unused */ Object* reason) { mBvhDirty = true; }
+	// Refits the bvh around reason before its next use, or rebuilds it entirely if reason is nullptr
+	inline void BvhDirty(Object* reason) {
+		if (reason && mBvh) mBvh->Dirty(reason);
+		else mBvhDirty = true;
+	}
 
 private:
+	// An object in the scene, and its handles in the slot maps of the types it derives from
+	struct ObjectEntry {
+		std::shared_ptr<Object> mObject;
+		SlotHandle mLight;
+		SlotHandle mCamera;
+		SlotHandle mRenderer;
+	};
+	// Offsets from the Object base of a class to its Light, Camera and Renderer bases, which are found with dynamic_cast once per class
+	struct ObjectType {
+		bool mLight;
+		bool mCamera;
+		bool mRenderer;
+		ptrdiff_t mLightOffset;
+		ptrdiff_t mCameraOffset;
+		ptrdiff_t mRendererOffset;
+	};
+
 	friend class Stratum;
 	ENGINE_EXPORT void Update(CommandBuffer* commandBuffer);
 	ENGINE_EXPORT void PreFrame(CommandBuffer* commandBuffer);
@@ -104,6 +170,17 @@ private:
 	ENGINE_EXPORT void AddShadowCamera(uint32_t si, ShadowData* sd, bool ortho, float size, const float3& pos, const quaternion& rot, float near, float far);
 
 	ENGINE_EXPORT void Render(CommandBuffer* commandBuffer, Camera* camera, Framebuffer* framebuffer, PassType pass, bool clear, std::vector<Object*>& renderList);
+	// Sorts mRenderList by the renderers' draw keys, see Renderer::DrawKey()
+	ENGINE_EXPORT void SortRenderList(Camera* camera, PassType pass);
+	// Draws the visible renderers in [start, end) of renderList, batching instanced MeshRenderers, and returns the number of draws. Safe to call on record threads
+	ENGINE_EXPORT uint32_t DrawRenderers(CommandBuffer* commandBuffer, Camera* camera, PassType pass, const std::vector<Object*>& renderList, uint32_t start, uint32_t end);
+	// Draws the gizmos and GUI in the main pass
+	ENGINE_EXPORT void DrawGUI(CommandBuffer* commandBuffer, Camera* camera, PassType pass);
+
+	// Runs task on threadCount - 1 record threads and the calling thread, and returns once they're all done. Starts the record threads if needed
+	ENGINE_EXPORT void RunRecordThreads(uint32_t threadCount, const std::function<void()>& task);
+	ENGINE_EXPORT void RecordThread(uint64_t generation);
+	ENGINE_EXPORT void StopRecordThreads();
 
 	float mFixedAccumulator;
 	float mFixedTimeStep;
@@ -123,6 +200,7 @@ private:
 
 	ObjectBvh2* mBvh;
 	uint64_t mLastBvhBuild;
+	TransformHierarchy* mTransforms;
 	bool mBvhDirty;
 
 	float2 mShadowTexelSize;
@@ -143,10 +221,33 @@ private:
 	::InputManager* mInputManager;
 	::PluginManager* mPluginManager;
 	::Environment* mEnvironment;
-	std::vector<std::shared_ptr<Object>> mObjects;
-	std::vector<Light*> mLights;
-	std::vector<Camera*> mCameras;
-	std::vector<Renderer*> mRenderers;
+	SlotMap<ObjectEntry> mObjects;
+	SlotMap<Light*> mLights;
+	SlotMap<Camera*> mCameras;
+	SlotMap<Renderer*> mRenderers;
+	std::unordered_map<std::type_index, ObjectType> mObjectTypes;
 	std::vector<Object*> mRenderList;
+	// (key, renderer) pairs sorted by SortRenderList(), and the radix sort's scratch buffer
+	std::vector<std::pair<uint64_t, Object*>> mDrawKeys;
+	std::vector<std::pair<uint64_t, Object*>> mSortedDrawKeys;
+	RenderStats mRenderStats;
+	RenderStats mLastRenderStats;
 	bool mDrawGizmos;
+
+	// The record threads persist between frames, since Device keeps command and descriptor pools for each thread
+	uint32_t mRecordThreadCount;
+	std::vector<std::thread> mRecordThreads;
+	std::mutex mRecordMutex;
+	// signaled when a task is posted, or the threads should stop
+	std::condition_variable mRecordStart;
+	// signaled when the last thread finishes the task
+	std::condition_variable mRecordDone;
+	std::function<void()> mRecordTask;
+	// incremented for each task
+	uint64_t mRecordGeneration;
+	// threads that can still take the task
+	uint32_t mRecordSlots;
+	// threads still running the task
+	uint32_t mRecordBusy;
+	bool mStopRecordThreads;
 };
\ No newline at end of file
@@ -17,7 +17,10 @@ Bone* SkinnedMeshRenderer::GetBone(const string& boneName) const {
 	return mBoneMap.count(boneName) ? mBoneMap.at(boneName) : nullptr;
 }
 
-void SkinnedMeshRenderer::PreFrame(CommandBuffer* commandBuffer) {
+void SkinnedMeshRenderer::PreFrame(CommandBuffer* frameCommandBuffer) {
+	// skin on the compute queue, so that it can overlap rendering
+	shared_ptr<CommandBuffer> commandBuffer = frameCommandBuffer->Device()->GetComputeCommandBuffer(mName + " Skinning");
+
 	Shader* skinner = Scene()->AssetManager()->LoadShader("Shaders/skinner.stm");
 	::Mesh* m = MeshRenderer::Mesh();
 
@@ -96,8 +99,8 @@ void SkinnedMeshRenderer::PreFrame(CommandBuffer* commandBuffer) {
 	// Skeleton
 	if (mRig.size()) {
 		// bind space -> object space
-		Buffer* poseBuffer = commandBuffer->Device()->GetTempBuffer(mName + " Pose", mRig.size() * sizeof(float4x4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
-		float4x4* skin = (float4x4*)poseBuffer->MappedData();
+		TempBufferRange poseBuffer = commandBuffer->Device()->GetTempBufferRange(mRig.size() * sizeof(float4x4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+		float4x4* skin = (float4x4*)poseBuffer.mMapped;
 		for (uint32_t i = 0; i < mRig.size(); i++)
 			skin[i] = (WorldToObject() * mRig[i]->ObjectToWorld()) * mRig[i]->mInverseBind; // * vertex;
 
@@ -107,7 +110,7 @@ void SkinnedMeshRenderer::PreFrame(CommandBuffer* commandBuffer) {
 		DescriptorSet* ds = commandBuffer->Device()->GetTempDescriptorSet("Skinning", s->mDescriptorSetLayouts[0]);
 		ds->CreateStorageBufferDescriptor(mVertexBuffer,		   0, mVertexBuffer->Size(),     s->mDescriptorBindings.at("Vertices").second.binding);
 		ds->CreateStorageBufferDescriptor(m->WeightBuffer().get(), 0, m->WeightBuffer()->Size(), s->mDescriptorBindings.at("Weights").second.binding);
-		ds->CreateStorageBufferDescriptor(poseBuffer, 0, poseBuffer->Size(), s->mDescriptorBindings.at("Pose").second.binding);
+		ds->CreateStorageBufferDescriptor(poseBuffer.mBuffer, poseBuffer.mOffset, poseBuffer.mSize, s->mDescriptorBindings.at("Pose").second.binding);
 		ds->FlushWrites();
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, s->mPipelineLayout, 0, 1, *ds, 0, nullptr);
 
@@ -119,11 +122,9 @@ void SkinnedMeshRenderer::PreFrame(CommandBuffer* commandBuffer) {
 		vkCmdDispatch(*commandBuffer, (vc + 63) / 64, 1, 1);
 	}
 
-	barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
-	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
-	vkCmdPipelineBarrier(*commandBuffer,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
-		0, 0, nullptr, 1, &barrier, 0, nullptr);
+	commandBuffer->TransferOwnership(mVertexBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		frameCommandBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+	frameCommandBuffer->AddWait(frameCommandBuffer->Device()->Execute(commandBuffer));
 }
 
 void SkinnedMeshRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* camera, uint32_t instanceCount, VkDescriptorSet instanceDS, PassType pass) {
@@ -141,8 +142,10 @@ void SkinnedMeshRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* ca
 	commandBuffer->PushConstant(shader, "LightCount", &lc);
 	commandBuffer->PushConstant(shader, "ShadowTexelSize", &s);
 	
-	if (instanceDS != VK_NULL_HANDLE)
+	if (instanceDS != VK_NULL_HANDLE) {
 		vkCmdBindDescriptorSets(*commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, PER_OBJECT, 1, &instanceDS, 0, nullptr);
+		commandBuffer->mDescriptorSetBindCount++;
+	}
 
 	commandBuffer->BindVertexBuffer(mVertexBuffer, 0, 0);
 	commandBuffer->BindIndexBuffer(mesh->IndexBuffer().get(), 0, mesh->IndexType());
@@ -160,6 +163,9 @@ void SkinnedMeshRenderer::DrawInstanced(CommandBuffer* commandBuffer, Camera* ca
 bool SkinnedMeshRenderer::Intersect(const Ray& ray, float* t, bool any) {
 	return false;
 }
+bool SkinnedMeshRenderer::Intersect(const Ray& ray, RaycastHit* hit, bool any) {
+	return false;
+}
 
 void SkinnedMeshRenderer::DrawGizmos(CommandBuffer* commandBuffer, Camera* camera) {
 	if (mRig.size()){
@@ -18,6 +18,9 @@ public:
 	ENGINE_EXPORT virtual void PreFrame(CommandBuffer* commandBuffer) override;
 
 	ENGINE_EXPORT bool Intersect(const Ray& ray, float* t, bool any) override;
+	ENGINE_EXPORT bool Intersect(const Ray& ray, RaycastHit* hit, bool any) override;
+	// The mesh's bvh doesn't match the deformed vertices, so rays are traced one at a time
+	inline uint32_t IntersectPacket(const Ray* rays, uint32_t rayMask, RaycastHit* hits, bool any) override { return Object::IntersectPacket(rays, rayMask, hits, any); }
 	ENGINE_EXPORT virtual void DrawGizmos(CommandBuffer* commandBuffer, Camera* camera) override;
 
 protected:
@@ -0,0 +1,379 @@
+#include <Scene/TransformHierarchy.hpp>
+#include <Scene/Object.hpp>
+#include <Scene/Scene.hpp>
+#include <Util/Profiler.hpp>
+
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define TRANSFORM_SSE
+#include <emmintrin.h>
+#endif
+
+// Smallest number of transforms in a level for each worker thread
+#define MIN_THREAD_TRANSFORMS 4096
+// Number of transforms a thread takes from a level at a time
+#define TRANSFORMS_PER_TASK 512
+
+using namespace std;
+
+const uint32_t TransformHierarchy::INVALID_INDEX;
+
+// r = a * b
+inline void MultiplyTransforms(const float4x4& a, const float4x4& b, float4x4& r) {
+#ifdef TRANSFORM_SSE
+	__m128 a0 = _mm_loadu_ps(a.v[0].v);
+	__m128 a1 = _mm_loadu_ps(a.v[1].v);
+	__m128 a2 = _mm_loadu_ps(a.v[2].v);
+	__m128 a3 = _mm_loadu_ps(a.v[3].v);
+	for (uint32_t i = 0; i < 4; i++) {
+		__m128 c = _mm_loadu_ps(b.v[i].v);
+		__m128 x = _mm_mul_ps(a0, _mm_shuffle_ps(c, c, _MM_SHUFFLE(0, 0, 0, 0)));
+		__m128 y = _mm_mul_ps(a1, _mm_shuffle_ps(c, c, _MM_SHUFFLE(1, 1, 1, 1)));
+		__m128 z = _mm_mul_ps(a2, _mm_shuffle_ps(c, c, _MM_SHUFFLE(2, 2, 2, 2)));
+		__m128 w = _mm_mul_ps(a3, _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)));
+		_mm_storeu_ps(r.v[i].v, _mm_add_ps(_mm_add_ps(x, y), _mm_add_ps(z, w)));
+	}
+#else
+	r = a * b;
+#endif
+}
+
+// Inverts a matrix whose last row is (0, 0, 0, 1), which is true of any product of TRS matrices
+inline void InvertTransform(const float4x4& m, float4x4& r) {
+#ifdef TRANSFORM_SSE
+	__m128 c0 = _mm_loadu_ps(m.v[0].v);
+	__m128 c1 = _mm_loadu_ps(m.v[1].v);
+	__m128 c2 = _mm_loadu_ps(m.v[2].v);
+	__m128 t = _mm_loadu_ps(m.v[3].v);
+
+	// rows of the inverse of the upper 3x3 are the cross products of its columns, divided by its determinant
+	#define YZX(a) _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1))
+	#define ZXY(a) _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2))
+	__m128 r0 = _mm_sub_ps(_mm_mul_ps(YZX(c1), ZXY(c2)), _mm_mul_ps(ZXY(c1), YZX(c2)));
+	__m128 r1 = _mm_sub_ps(_mm_mul_ps(YZX(c2), ZXY(c0)), _mm_mul_ps(ZXY(c2), YZX(c0)));
+	__m128 r2 = _mm_sub_ps(_mm_mul_ps(YZX(c0), ZXY(c1)), _mm_mul_ps(ZXY(c0), YZX(c1)));
+	#undef YZX
+	#undef ZXY
+
+	__m128 d = _mm_mul_ps(c0, r0);
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1)));
+	d = _mm_add_ps(d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 0, 3, 2)));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), d);
+	r0 = _mm_mul_ps(r0, invDet);
+	r1 = _mm_mul_ps(r1, invDet);
+	r2 = _mm_mul_ps(r2, invDet);
+	__m128 r3 = _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+	// translation is -(M^-1 * t)
+	__m128 x = _mm_mul_ps(r0, _mm_shuffle_ps(t, t, _MM_SHUFFLE(0, 0, 0, 0)));
+	__m128 y = _mm_mul_ps(r1, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 1, 1, 1)));
+	__m128 z = _mm_mul_ps(r2, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 2, 2, 2)));
+	r3 = _mm_sub_ps(_mm_set_ps(1.f, 0.f, 0.f, 0.f), _mm_add_ps(_mm_add_ps(x, y), z));
+
+	_mm_storeu_ps(r.v[0].v, r0);
+	_mm_storeu_ps(r.v[1].v, r1);
+	_mm_storeu_ps(r.v[2].v, r2);
+	_mm_storeu_ps(r.v[3].v, r3);
+#else
+	r = inverse(m);
+#endif
+}
+
+TransformHierarchy::TransformHierarchy(::Scene* scene) : mScene(scene), mFreeCount(0), mLayoutDirty(false) {}
+TransformHierarchy::~TransformHierarchy() {
+	for (Object* o : mObjects)
+		if (o) Erase(o);
+}
+
+uint32_t TransformHierarchy::Insert(Object* object) {
+	uint32_t index = (uint32_t)mObjects.size();
+	Object* parent = object->mParent;
+
+	mObjects.push_back(object);
+	mLocalPosition.push_back(object->mLocalPosition);
+	mLocalRotation.push_back(object->mLocalRotation);
+	mLocalScale.push_back(object->mLocalScale);
+	mObjectToParent.push_back(float4x4(1));
+	mObjectToWorld.push_back(float4x4(1));
+	mWorldToObject.push_back(float4x4(1));
+	mWorldRotation.push_back(quaternion(0, 0, 0, 1));
+	mWorldScale.push_back(float3(1));
+	if (parent && parent->mHierarchy == this)
+		mParent.push_back(parent->mTransform);
+	else
+		mParent.push_back(INVALID_INDEX);
+	mFirstChild.push_back(0);
+	mChildCount.push_back(0);
+	mVersion.push_back(object->mTransformVersion);
+	mFlags.push_back(TRANSFORM_DIRTY | (parent && parent->mHierarchy != this ? TRANSFORM_EXTERNAL_PARENT : 0));
+
+	object->mHierarchy = this;
+	object->mTransform = index;
+	mLayoutDirty = true;
+	return index;
+}
+void TransformHierarchy::Erase(Object* object) {
+	uint32_t index = object->mTransform;
+	object->mLocalPosition = mLocalPosition[index];
+	object->mLocalRotation = mLocalRotation[index];
+	object->mLocalScale = mLocalScale[index];
+	object->mTransformDirty = true;
+	object->mHierarchy = nullptr;
+
+	mObjects[index] = nullptr;
+	mFlags[index] = 0;
+	mFreeCount++;
+	mLayoutDirty = true;
+}
+
+void TransformHierarchy::Add(Object* object) {
+	if (object->mHierarchy) return;
+
+	// children that are already in the hierarchy had an external parent, which is now in it
+	vector<Object*> linked;
+	vector<Object*> todo;
+	todo.push_back(object);
+	while (todo.size()) {
+		Object* o = todo.back();
+		todo.pop_back();
+		Insert(o);
+		for (Object* c : o->mChildren)
+			if (!c->mHierarchy)
+				todo.push_back(c);
+			else if (c->mHierarchy == this) {
+				mParent[c->mTransform] = o->mTransform;
+				mFlags[c->mTransform] &= ~TRANSFORM_EXTERNAL_PARENT;
+				linked.push_back(c);
+			}
+	}
+	for (Object* c : linked) Dirty(c);
+}
+void TransformHierarchy::Remove(Object* object) {
+	if (object->mHierarchy != this) return;
+
+	// descendants that are in the scene stay, with an external parent
+	vector<Object*> unlinked;
+	vector<Object*> todo;
+	todo.push_back(object);
+	while (todo.size()) {
+		Object* o = todo.back();
+		todo.pop_back();
+		for (Object* c : o->mChildren) {
+			if (c->mHierarchy != this) continue;
+			if (c->mScene == mScene) {
+				mParent[c->mTransform] = INVALID_INDEX;
+				mFlags[c->mTransform] |= TRANSFORM_EXTERNAL_PARENT;
+				unlinked.push_back(c);
+			} else
+				todo.push_back(c);
+		}
+		Erase(o);
+	}
+	for (Object* c : unlinked) Dirty(c);
+}
+void TransformHierarchy::Reparent(Object* object) {
+	Object* parent = object->mParent;
+	if (object->mHierarchy != this) {
+		// joining the parent's hierarchy
+		if (!object->mHierarchy) Add(object);
+		return;
+	}
+
+	uint32_t index = object->mTransform;
+	if (parent && parent->mHierarchy == this) {
+		mParent[index] = parent->mTransform;
+		mFlags[index] &= ~TRANSFORM_EXTERNAL_PARENT;
+	} else if (object->mScene != mScene) {
+		// leaving with the parent
+		Remove(object);
+		return;
+	} else {
+		mParent[index] = INVALID_INDEX;
+		if (parent) mFlags[index] |= TRANSFORM_EXTERNAL_PARENT;
+		else mFlags[index] &= ~TRANSFORM_EXTERNAL_PARENT;
+	}
+	mLayoutDirty = true;
+}
+
+template<typename T>
+inline void Permute(vector<T>& v, const vector<uint32_t>& order) {
+	vector<T> p(order.size());
+	for (uint32_t i = 0; i < order.size(); i++)
+		p[i] = v[order[i]];
+	v.swap(p);
+}
+
+void TransformHierarchy::BuildLayout() {
+	PROFILER_BEGIN("Build Transform Layout");
+	vector<uint32_t> order;
+	vector<uint32_t> newIndex(mObjects.size(), INVALID_INDEX);
+	vector<uint32_t> firstChild;
+	vector<uint32_t> childCount;
+	uint32_t count = (uint32_t)mObjects.size() - mFreeCount;
+
+	while (true) {
+		order.clear();
+		mLevels.clear();
+		for (uint32_t i = 0; i < mObjects.size(); i++)
+			if (mObjects[i] && mParent[i] == INVALID_INDEX)
+				order.push_back(i);
+
+		// breadth-first, so each level's children are appended in the order of their parents
+		firstChild.resize(count);
+		childCount.resize(count);
+		uint32_t levelEnd = 0;
+		for (uint32_t i = 0; i < order.size(); i++) {
+			if (i == levelEnd) {
+				mLevels.push_back(i);
+				levelEnd = (uint32_t)order.size();
+			}
+			uint32_t index = order[i];
+			newIndex[index] = i;
+			firstChild[i] = (uint32_t)order.size();
+			for (Object* c : mObjects[index]->mChildren)
+				if (c->mHierarchy == this && mParent[c->mTransform] == index)
+					order.push_back(c->mTransform);
+			childCount[i] = (uint32_t)order.size() - firstChild[i];
+		}
+		mLevels.push_back((uint32_t)order.size());
+		if (order.size() == count) break;
+
+		// the transforms that weren't reached are in a loop, which is broken by making them roots
+		for (uint32_t i = 0; i < mObjects.size(); i++)
+			if (mObjects[i] && newIndex[i] == INVALID_INDEX) {
+				fprintf_color(COLOR_RED, stderr, "Loop in heirarchy! %s\n", mObjects[i]->mName.c_str());
+				mParent[i] = INVALID_INDEX;
+				mFlags[i] &= ~TRANSFORM_EXTERNAL_PARENT;
+			}
+	}
+
+	for (uint32_t i = 0; i < order.size(); i++)
+		if (mParent[order[i]] != INVALID_INDEX)
+			mParent[order[i]] = newIndex[mParent[order[i]]];
+
+	Permute(mObjects, order);
+	Permute(mLocalPosition, order);
+	Permute(mLocalRotation, order);
+	Permute(mLocalScale, order);
+	Permute(mObjectToParent, order);
+	Permute(mObjectToWorld, order);
+	Permute(mWorldToObject, order);
+	Permute(mWorldRotation, order);
+	Permute(mWorldScale, order);
+	Permute(mParent, order);
+	Permute(mVersion, order);
+	Permute(mFlags, order);
+	mFirstChild.swap(firstChild);
+	mChildCount.swap(childCount);
+
+	for (uint32_t i = 0; i < mObjects.size(); i++)
+		mObjects[i]->mTransform = i;
+
+	mFreeCount = 0;
+	mLayoutDirty = false;
+	PROFILER_END;
+}
+
+void TransformHierarchy::Dirty(Object* object) {
+	uint32_t index = object->mTransform;
+	// the descendants of a dirty transform are already dirty
+	if (mFlags[index] & TRANSFORM_DIRTY) return;
+	if (mLayoutDirty && object->mChildren.size()) {
+		BuildLayout();
+		index = object->mTransform;
+	}
+
+	// the descendants in each level are one contiguous range
+	uint32_t start = index;
+	uint32_t end = index + 1;
+	while (start < end) {
+		for (uint32_t i = start; i < end; i++) {
+			if (mFlags[i] & TRANSFORM_DIRTY) continue;
+			mFlags[i] |= TRANSFORM_DIRTY;
+			if (mObjects[i]->LayerMask()) mScene->BvhDirty(mObjects[i]);
+		}
+		if (mLayoutDirty) break;
+		uint32_t childStart = mFirstChild[start];
+		end = mFirstChild[end - 1] + mChildCount[end - 1];
+		start = childStart;
+	}
+}
+
+void TransformHierarchy::Compute(uint32_t start, uint32_t end) {
+	for (uint32_t i = start; i < end; i++) {
+		if (!(mFlags[i] & TRANSFORM_DIRTY)) continue;
+
+		float4x4 objectToParent = float4x4::TRS(mLocalPosition[i], mLocalRotation[i], mLocalScale[i]);
+		mObjectToParent[i] = objectToParent;
+
+		uint32_t parent = mParent[i];
+		if (parent != INVALID_INDEX) {
+			MultiplyTransforms(mObjectToWorld[parent], objectToParent, mObjectToWorld[i]);
+			mWorldRotation[i] = mWorldRotation[parent] * mLocalRotation[i];
+		} else if (mFlags[i] & TRANSFORM_EXTERNAL_PARENT) {
+			Object* o = mObjects[i]->mParent;
+			MultiplyTransforms(o->ObjectToWorld(), objectToParent, mObjectToWorld[i]);
+			mWorldRotation[i] = o->WorldRotation() * mLocalRotation[i];
+		} else {
+			mObjectToWorld[i] = objectToParent;
+			mWorldRotation[i] = mLocalRotation[i];
+		}
+
+		const float4x4& objectToWorld = mObjectToWorld[i];
+		InvertTransform(objectToWorld, mWorldToObject[i]);
+		mWorldScale[i] = float3(length(objectToWorld[0].xyz), length(objectToWorld[1].xyz), length(objectToWorld[2].xyz));
+
+		mVersion[i]++;
+		mFlags[i] &= ~TRANSFORM_DIRTY;
+	}
+}
+
+uint32_t TransformHierarchy::UpdateTransform(uint32_t index) {
+	if (!(mFlags[index] & TRANSFORM_DIRTY)) return mVersion[index];
+
+	// the parents of a clean transform are clean, so the dirty ancestors are the ones right above it
+	static thread_local vector<uint32_t> dirty;
+	dirty.clear();
+	for (uint32_t i = index; i != INVALID_INDEX && (mFlags[i] & TRANSFORM_DIRTY); i = mParent[i])
+		dirty.push_back(i);
+	for (auto it = dirty.rbegin(); it != dirty.rend(); it++)
+		Compute(*it, *it + 1);
+
+	return mVersion[index];
+}
+
+void TransformHierarchy::Update(uint32_t threadCount) {
+	if (mLayoutDirty) BuildLayout();
+	if (mObjects.empty()) return;
+
+	// external parents might be computed on demand, which isn't safe on worker threads
+	for (uint32_t i = mLevels[0]; i < mLevels[1]; i++)
+		if ((mFlags[i] & (TRANSFORM_DIRTY | TRANSFORM_EXTERNAL_PARENT)) == (TRANSFORM_DIRTY | TRANSFORM_EXTERNAL_PARENT))
+			Compute(i, i + 1);
+
+	if (threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+
+	for (uint32_t l = 0; l + 1 < mLevels.size(); l++) {
+		uint32_t start = mLevels[l];
+		uint32_t end = mLevels[l + 1];
+		uint32_t levelThreads = min(threadCount, (end - start) / MIN_THREAD_TRANSFORMS);
+		if (levelThreads <= 1) {
+			Compute(start, end);
+			continue;
+		}
+
+		atomic<uint32_t> next(start);
+		auto worker = [&]() {
+			uint32_t s;
+			while ((s = next.fetch_add(TRANSFORMS_PER_TASK)) < end)
+				Compute(s, min(s + TRANSFORMS_PER_TASK, end));
+		};
+		vector<thread> threads;
+		for (uint32_t j = 1; j < levelThreads; j++)
+			threads.push_back(thread(worker));
+		worker();
+		for (thread& t : threads) t.join();
+	}
+}
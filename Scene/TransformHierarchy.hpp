@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Util/Util.hpp>
+
+class Object;
+class Scene;
+
+// Stores the transforms of a scene's objects in structure-of-arrays layout, sorted by depth in the hierarchy.
+// Objects in each level are grouped by parent, so the children of any range of objects are one contiguous range in the next level,
+// which lets Dirty() mark a whole subtree without visiting the objects, and Update() compute each level in one pass, on several threads if it is large enough.
+// Objects join the hierarchy when they are added to the scene or parented to an object that is in it. Objects outside of any hierarchy keep their transform themselves.
+// Parents outside of the hierarchy are supported, but their children are computed one at a time.
+class TransformHierarchy {
+public:
+	static const uint32_t INVALID_INDEX = 0xFFFFFFFF;
+
+	ENGINE_EXPORT TransformHierarchy(::Scene* scene);
+	ENGINE_EXPORT ~TransformHierarchy();
+
+	// Adds an object and its descendants that aren't in a hierarchy yet
+	ENGINE_EXPORT void Add(Object* object);
+	// Removes an object and its descendants that aren't in the scene. Their transforms are copied back into the objects.
+	ENGINE_EXPORT void Remove(Object* object);
+	// Updates the hierarchy after an object's parent changes. Objects that aren't in the scene leave the hierarchy with their parent.
+	ENGINE_EXPORT void Reparent(Object* object);
+
+	// Marks an object and its descendants as needing their transforms computed
+	ENGINE_EXPORT void Dirty(Object* object);
+	// Computes an object's transform and the transforms of its dirty ancestors, and returns its version, which changes every time it is computed
+	ENGINE_EXPORT uint32_t UpdateTransform(uint32_t index);
+	// Computes every dirty transform, one level at a time, using threadCount threads, or one per hardware thread if threadCount is 0
+	ENGINE_EXPORT void Update(uint32_t threadCount = 0);
+
+	inline uint32_t Count() const { return (uint32_t)mObjects.size() - mFreeCount; }
+	inline uint32_t LevelCount() const { return mLayoutDirty ? 0 : (uint32_t)mLevels.size() - 1; }
+
+	std::vector<float3> mLocalPosition;
+	std::vector<quaternion> mLocalRotation;
+	std::vector<float3> mLocalScale;
+
+	std::vector<float4x4> mObjectToParent;
+	std::vector<float4x4> mObjectToWorld;
+	std::vector<float4x4> mWorldToObject;
+	std::vector<quaternion> mWorldRotation;
+	std::vector<float3> mWorldScale;
+
+private:
+	enum TransformFlags : uint8_t {
+		TRANSFORM_DIRTY = 1,
+		// the object has a parent that isn't in this hierarchy
+		TRANSFORM_EXTERNAL_PARENT = 2,
+	};
+
+	// Index of an object's transform, which stays valid until the layout is rebuilt
+	ENGINE_EXPORT uint32_t Insert(Object* object);
+	ENGINE_EXPORT void Erase(Object* object);
+	// Sorts the transforms by depth and grouped by parent, and tells the objects their new indices
+	ENGINE_EXPORT void BuildLayout();
+	// Computes the transforms in [start, end) that are dirty, which must not have dirty parents
+	ENGINE_EXPORT void Compute(uint32_t start, uint32_t end);
+
+	::Scene* mScene;
+
+	std::vector<Object*> mObjects;
+	std::vector<uint32_t> mParent;
+	std::vector<uint32_t> mFirstChild;
+	std::vector<uint32_t> mChildCount;
+	std::vector<uint32_t> mVersion;
+	std::vector<uint8_t> mFlags;
+	// first index of each level, followed by the end of the last level
+	std::vector<uint32_t> mLevels;
+	// removed transforms, which are left in place until the layout is rebuilt
+	uint32_t mFreeCount;
+	// true when transforms have been added, removed or reparented since the layout was built
+	bool mLayoutDirty;
+};
@@ -2,184 +2,817 @@
 
 #include <Scene/Scene.hpp>
 
+#include <atomic>
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SAH_BIN_COUNT 16
+// Binning of nodes with at least this many triangles is spread across threads
+#define PARALLEL_BIN_THRESHOLD 65536
+// Smallest number of triangles handed to a worker thread as an independent subtree
+#define MIN_SUBTREE_SIZE 4096
+// Number of packets a thread takes from a batch at a time
+#define PACKETS_PER_TASK 16
+// Smallest number of rays traced by each thread in a batch
+#define MIN_THREAD_RAYS 1024
+// Traversal stacks up to this size live on the call stack, deeper trees use a vector
+#define TRAVERSAL_STACK_SIZE 256
+// Bumped whenever the layout of cache files or of the cached structures changes
+#define BVH_CACHE_VERSION 1
+#define BVH_CACHE_MAGIC 0x48564253 // "SBVH"
+
 using namespace std;
 
-void TriangleBvh2::Build(const void* vertices, uint32_t baseVertex, uint32_t vertexCount, size_t vertexStride, const void* indices, uint32_t indexCount, VkIndexType indexType) {
+struct BuildPrimitive {
+	AABB mBounds;
+	float3 mCentroid;
+	uint3 mTriangle;
+	uint32_t mIndex;
+};
+struct BuildParameters {
+	uint32_t mMaxLeafSize;
+	float mTraversalCost;
+	float mIntersectionCost;
+};
+struct SahBins {
+	AABB mBounds[3][SAH_BIN_COUNT];
+	uint32_t mCount[3][SAH_BIN_COUNT];
+
+	inline void Clear() {
+		for (uint32_t axis = 0; axis < 3; axis++)
+			for (uint32_t b = 0; b < SAH_BIN_COUNT; b++) {
+				mBounds[axis][b] = AABB(1e30f, -1e30f);
+				mCount[axis][b] = 0;
+			}
+	}
+	inline void Merge(const SahBins& bins) {
+		for (uint32_t axis = 0; axis < 3; axis++)
+			for (uint32_t b = 0; b < SAH_BIN_COUNT; b++) {
+				mBounds[axis][b].Encapsulate(bins.mBounds[axis][b]);
+				mCount[axis][b] += bins.mCount[axis][b];
+			}
+	}
+};
+
+// Runs func(chunk, start, end) on threadCount contiguous chunks of [start, end), each on its own thread
+template<typename F>
+static void ForEachChunk(uint32_t start, uint32_t end, uint32_t threadCount, F func) {
+	uint32_t chunkSize = (end - start + threadCount - 1) / threadCount;
+	vector<thread> threads;
+	for (uint32_t j = 1; j < threadCount; j++) {
+		uint32_t s = min(start + j * chunkSize, end);
+		threads.push_back(thread(func, j, s, min(s + chunkSize, end)));
+	}
+	func(0, start, min(start + chunkSize, end));
+	for (thread& t : threads) t.join();
+}
+
+static void ComputeBounds(const BuildPrimitive* primitives, uint32_t start, uint32_t end, AABB& bounds, AABB& centroidBounds) {
+	bounds = primitives[start].mBounds;
+	centroidBounds = AABB(primitives[start].mCentroid, primitives[start].mCentroid);
+	for (uint32_t p = start + 1; p < end; ++p) {
+		bounds.Encapsulate(primitives[p].mBounds);
+		centroidBounds.Encapsulate(primitives[p].mCentroid);
+	}
+}
+
+static float3 BinScale(const AABB& centroidBounds) {
+	float3 extent = centroidBounds.mMax - centroidBounds.mMin;
+	float3 binScale;
+	for (uint32_t axis = 0; axis < 3; axis++)
+		binScale[axis] = extent[axis] > 1e-12f ? SAH_BIN_COUNT * (1.f - 1e-5f) / extent[axis] : 0.f;
+	return binScale;
+}
+
+static void BinPrimitives(const BuildPrimitive* primitives, uint32_t start, uint32_t end, const AABB& centroidBounds, const float3& binScale, SahBins& bins) {
+	bins.Clear();
+	for (uint32_t i = start; i < end; i++) {
+		uint3 b = min(uint3((primitives[i].mCentroid - centroidBounds.mMin) * binScale), uint3(SAH_BIN_COUNT - 1));
+		for (uint32_t axis = 0; axis < 3; axis++) {
+			bins.mBounds[axis][b[axis]].Encapsulate(primitives[i].mBounds);
+			bins.mCount[axis][b[axis]]++;
+		}
+	}
+}
+
+// Finds the best split of primitives [start, end) from their SAH bins and partitions them around it
+// Returns the index of the first primitive in the right child, or end if the node should become a leaf
+static uint32_t PartitionSAH(BuildPrimitive* primitives, uint32_t start, uint32_t end, const AABB& bounds, const AABB& centroidBounds,
+	const SahBins& bins, const float3& binScale, const BuildParameters& params) {
+	uint32_t nPrims = end - start;
+	if (nPrims <= 1) return end;
+
+	float bestCost = 1e30f;
+	uint32_t bestAxis = 0xFFFFFFFF;
+	uint32_t bestBin = 0;
+
+	float invArea = 1.f / fmaxf(bounds.SurfaceArea(), 1e-20f);
+
+	for (uint32_t axis = 0; axis < 3; axis++) {
+		if (binScale[axis] == 0) continue;
+
+		// sweep from the right to accumulate the cost of the right side of each split
+		float rightCost[SAH_BIN_COUNT];
+		AABB acc(1e30f, -1e30f);
+		uint32_t count = 0;
+		for (uint32_t b = SAH_BIN_COUNT - 1; b > 0; b--) {
+			acc.Encapsulate(bins.mBounds[axis][b]);
+			count += bins.mCount[axis][b];
+			rightCost[b - 1] = count ? count * acc.SurfaceArea() : -1.f;
+		}
+
+		// sweep from the left, evaluating the split between bin b and b+1
+		acc = AABB(1e30f, -1e30f);
+		count = 0;
+		for (uint32_t b = 0; b < SAH_BIN_COUNT - 1; b++) {
+			acc.Encapsulate(bins.mBounds[axis][b]);
+			count += bins.mCount[axis][b];
+			if (count == 0 || rightCost[b] < 0) continue;
+			float cost = params.mTraversalCost + params.mIntersectionCost * (count * acc.SurfaceArea() + rightCost[b]) * invArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	// Terminate when intersecting every primitive is cheaper than the best split
+	if (nPrims <= params.mMaxLeafSize && (bestAxis == 0xFFFFFFFF || params.mIntersectionCost * nPrims <= bestCost))
+		return end;
+
+	// All centroids are coincident, split in the middle of the list
+	if (bestAxis == 0xFFFFFFFF)
+		return start + nPrims / 2;
+
+	float scale = binScale[bestAxis];
+	float binMin = centroidBounds.mMin[bestAxis];
+	BuildPrimitive* mid = partition(primitives + start, primitives + end, [&](const BuildPrimitive& p) {
+		return min((uint32_t)((p.mCentroid[bestAxis] - binMin) * scale), (uint32_t)SAH_BIN_COUNT - 1) <= bestBin;
+	});
+	return (uint32_t)(mid - primitives);
+}
+
+// Builds the subtree over primitives [start, end) into nodes, depth-first.
+// The left child always directly follows its parent, and right children patch their parent's mRightOffset once they are written.
+static void BuildSubtree(vector<TriangleBvh2::Node>& nodes, BuildPrimitive* primitives, uint32_t start, uint32_t end, const BuildParameters& params) {
+	struct BuildTask {
+		uint32_t mParentOffset;
+		uint32_t mStart;
+		uint32_t mEnd;
+	};
+
+	const uint32_t noParent = 0xFFFFFFFF;
+	vector<BuildTask> todo;
+	todo.push_back({ noParent, start, end });
+
+	SahBins bins;
+
+	while (todo.size()) {
+		// Pop the next item off of the stack
+		BuildTask bnode = todo.back();
+		todo.pop_back();
+
+		uint32_t nodeIndex = (uint32_t)nodes.size();
+		if (bnode.mParentOffset != noParent)
+			nodes[bnode.mParentOffset].mRightOffset = nodeIndex - bnode.mParentOffset;
+
+		// Calculate the bounding box for this node
+		AABB bb, bc;
+		ComputeBounds(primitives, bnode.mStart, bnode.mEnd, bb, bc);
+
+		TriangleBvh2::Node node;
+		node.mBounds = bb;
+		node.mStartIndex = bnode.mStart;
+		node.mCount = bnode.mEnd - bnode.mStart;
+		node.mRightOffset = 0; // leaf until its right child is written
+		nodes.push_back(node);
+
+		if (node.mCount <= 1) continue;
+
+		float3 binScale = BinScale(bc);
+		BinPrimitives(primitives, bnode.mStart, bnode.mEnd, bc, binScale, bins);
+		uint32_t mid = PartitionSAH(primitives, bnode.mStart, bnode.mEnd, bb, bc, bins, binScale, params);
+		if (mid == bnode.mEnd) continue;
+
+		todo.push_back({ nodeIndex, mid, bnode.mEnd });
+		todo.push_back({ noParent, bnode.mStart, mid });
+	}
+}
+
+void TriangleBvh2::Build(const void* vertices, uint32_t baseVertex, uint32_t vertexCount, size_t vertexStride, const void* indices, uint32_t indexCount, VkIndexType indexType, uint32_t threadCount) {
 	mTriangles.clear();
+	mTriangleIndices.clear();
 	mNodes.clear();
+	mWideNodes.clear();
+	mStats = {};
 
 	mVertices.resize(vertexCount);
 
-	vector<AABB> aabbs;
-
 	for (uint32_t i = 0; i < vertexCount; i++)
 		mVertices[i] = *(float3*)((uint8_t*)vertices + vertexStride * (i + baseVertex));
 
 	uint16_t* indices16 = (uint16_t*)indices;
 	uint32_t* indices32 = (uint32_t*)indices;
 
-	for (uint32_t i = 0; i < indexCount; i += 3) {
+	vector<BuildPrimitive> primitives(indexCount / 3);
+	for (uint32_t i = 0; i < primitives.size(); i++) {
 		uint3 tri = indexType == VK_INDEX_TYPE_UINT16 ?
-			uint3(indices16[i], indices16[i+1], indices16[i+2]) :
-			uint3(indices32[i], indices32[i+1], indices32[i+2]);
-		mTriangles.push_back(tri);
+			uint3(indices16[3*i], indices16[3*i+1], indices16[3*i+2]) :
+			uint3(indices32[3*i], indices32[3*i+1], indices32[3*i+2]);
 		float3 v0 = mVertices[tri.x - baseVertex];
 		float3 v1 = mVertices[tri.y - baseVertex];
 		float3 v2 = mVertices[tri.z - baseVertex];
-		aabbs.push_back(AABB(min(min(v0, v1), v2) - 1e-3f, max(max(v0, v1), v2) + 1e-3f));
+		primitives[i].mBounds = AABB(min(min(v0, v1), v2) - 1e-3f, max(max(v0, v1), v2) + 1e-3f);
+		primitives[i].mCentroid = primitives[i].mBounds.Center();
+		primitives[i].mTriangle = tri;
+		primitives[i].mIndex = i;
 	}
+	if (primitives.empty()) return;
+
+	BuildParameters params = { mMaxLeafSize, mTraversalCost, mIntersectionCost };
+	uint32_t primitiveCount = (uint32_t)primitives.size();
+
+	if (threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+	threadCount = min(threadCount, primitiveCount / MIN_SUBTREE_SIZE);
+
+	if (threadCount <= 1) {
+		BuildSubtree(mNodes, primitives.data(), 0, primitiveCount, params);
+	} else {
+		// Split the top of the tree serially, binning large nodes across threads, until the remaining ranges
+		// are small enough to be built as independent subtrees. Since every split only depends on the primitives
+		// in a node, the resulting tree is the same for any thread count.
+		struct TopNode {
+			Node mNode;
+			uint32_t mLeft;
+			uint32_t mRight;
+			uint32_t mSubtree;
+		};
+		struct TopTask {
+			uint32_t mTopNode;
+			uint32_t mStart;
+			uint32_t mEnd;
+		};
+		const uint32_t noSubtree = 0xFFFFFFFF;
+		uint32_t subtreeSize = max((uint32_t)MIN_SUBTREE_SIZE, primitiveCount / (threadCount * 8));
+
+		vector<TopNode> top;
+		vector<uint2> subtrees;
+		vector<TopTask> todo;
+		vector<SahBins> chunkBins(threadCount);
+		vector<AABB> chunkBounds(threadCount * 2);
+
+		top.push_back({});
+		todo.push_back({ 0, 0, primitiveCount });
+		while (todo.size()) {
+			TopTask task = todo.back();
+			todo.pop_back();
+			uint32_t nPrims = task.mEnd - task.mStart;
+
+			uint32_t mid = task.mEnd;
+			AABB bb, bc;
+			if (nPrims > subtreeSize) {
+				if (nPrims >= PARALLEL_BIN_THRESHOLD) {
+					ForEachChunk(task.mStart, task.mEnd, threadCount, [&](uint32_t j, uint32_t s, uint32_t e) {
+						if (s < e)
+							ComputeBounds(primitives.data(), s, e, chunkBounds[2*j], chunkBounds[2*j+1]);
+						else
+							chunkBounds[2*j] = chunkBounds[2*j+1] = AABB(1e30f, -1e30f);
+					});
+					bb = chunkBounds[0];
+					bc = chunkBounds[1];
+					for (uint32_t j = 1; j < threadCount; j++) {
+						bb.Encapsulate(chunkBounds[2*j]);
+						bc.Encapsulate(chunkBounds[2*j+1]);
+					}
 
-	struct BuildTask {
-		uint32_t mParentOffset;
-		uint32_t mStart;
-		uint32_t mEnd;
-	};
+					float3 binScale = BinScale(bc);
+					ForEachChunk(task.mStart, task.mEnd, threadCount, [&](uint32_t j, uint32_t s, uint32_t e) {
+						BinPrimitives(primitives.data(), s, e, bc, binScale, chunkBins[j]);
+					});
+					for (uint32_t j = 1; j < threadCount; j++)
+						chunkBins[0].Merge(chunkBins[j]);
+					mid = PartitionSAH(primitives.data(), task.mStart, task.mEnd, bb, bc, chunkBins[0], binScale, params);
+				} else {
+					ComputeBounds(primitives.data(), task.mStart, task.mEnd, bb, bc);
+					float3 binScale = BinScale(bc);
+					BinPrimitives(primitives.data(), task.mStart, task.mEnd, bc, binScale, chunkBins[0]);
+					mid = PartitionSAH(primitives.data(), task.mStart, task.mEnd, bb, bc, chunkBins[0], binScale, params);
+				}
+			}
 
-	BuildTask todo[1024];
-	uint32_t stackptr = 0;
-	const uint32_t untouched = 0xffffffff;
-	const uint32_t touchedTwice = 0xfffffffd;
+			if (mid == task.mEnd) {
+				top[task.mTopNode].mSubtree = (uint32_t)subtrees.size();
+				subtrees.push_back(uint2(task.mStart, task.mEnd));
+				continue;
+			}
 
-	uint32_t nNodes = 0;
-	uint32_t nLeafs = 0;
+			TopNode& node = top[task.mTopNode];
+			node.mNode.mBounds = bb;
+			node.mNode.mStartIndex = task.mStart;
+			node.mNode.mCount = nPrims;
+			node.mNode.mRightOffset = 0;
+			node.mSubtree = noSubtree;
+			node.mLeft = (uint32_t)top.size();
+			node.mRight = node.mLeft + 1;
+			todo.push_back({ node.mRight, mid, task.mEnd });
+			todo.push_back({ node.mLeft, task.mStart, mid });
+			top.push_back({});
+			top.push_back({});
+		}
 
-	Node node;
+		// Build the subtrees on worker threads
+		vector<vector<Node>> subtreeNodes(subtrees.size());
+		atomic<uint32_t> nextSubtree(0);
+		auto worker = [&]() {
+			uint32_t i;
+			while ((i = nextSubtree++) < subtrees.size())
+				BuildSubtree(subtreeNodes[i], primitives.data(), subtrees[i].x, subtrees[i].y, params);
+		};
+		vector<thread> threads;
+		for (uint32_t j = 1; j < threadCount; j++)
+			threads.push_back(thread(worker));
+		worker();
+		for (thread& t : threads) t.join();
+
+		// Stitch the top nodes and subtrees together, depth-first
+		struct StitchTask {
+			uint32_t mParentOffset;
+			uint32_t mTopNode;
+		};
+		const uint32_t noParent = 0xFFFFFFFF;
+		vector<StitchTask> stitch;
+		stitch.push_back({ noParent, 0 });
+		while (stitch.size()) {
+			StitchTask task = stitch.back();
+			stitch.pop_back();
+
+			uint32_t nodeIndex = (uint32_t)mNodes.size();
+			if (task.mParentOffset != noParent)
+				mNodes[task.mParentOffset].mRightOffset = nodeIndex - task.mParentOffset;
+
+			const TopNode& node = top[task.mTopNode];
+			if (node.mSubtree != noSubtree) {
+				mNodes.insert(mNodes.end(), subtreeNodes[node.mSubtree].begin(), subtreeNodes[node.mSubtree].end());
+				continue;
+			}
+			mNodes.push_back(node.mNode);
+			stitch.push_back({ nodeIndex, node.mRight });
+			stitch.push_back({ noParent, node.mLeft });
+		}
+	}
 
-	todo[stackptr].mStart = 0;
-	todo[stackptr].mEnd = mTriangles.size();
-	todo[stackptr].mParentOffset = 0xfffffffc;
-	stackptr++;
+	mTriangles.resize(primitives.size());
+	mTriangleIndices.resize(primitives.size());
+	for (uint32_t i = 0; i < primitives.size(); i++) {
+		mTriangles[i] = primitives[i].mTriangle;
+		mTriangleIndices[i] = primitives[i].mIndex;
+	}
 
-	while (stackptr > 0) {
-		// Pop the next item off of the stack
-		BuildTask& bnode(todo[--stackptr]);
-		uint32_t start = bnode.mStart;
-		uint32_t end = bnode.mEnd;
-		uint32_t nPrims = end - start;
+	ComputeStats();
 
-		nNodes++;
-		node.mStartIndex = start;
-		node.mCount = nPrims;
-		node.mRightOffset = untouched;
+	CollapseBvh4(mNodes, 0, [&](uint32_t n, uint32_t& l, uint32_t& r) {
+		l = n + 1;
+		r = n + mNodes[n].mRightOffset;
+		return mNodes[n].mRightOffset != 0;
+	}, mWideNodes, nullptr);
+}
 
-		// Calculate the bounding box for this node
-		AABB bb(aabbs[start]);
-		AABB bc(aabbs[start].Center(), aabbs[start].Center());
-		for (uint32_t p = start + 1; p < end; ++p) {
-			bb.Encapsulate(aabbs[p]);
-			bc.Encapsulate(aabbs[p].Center());
-		}
-		node.mBounds = bb;
+void TriangleBvh2::ComputeStats() {
+	mStats = {};
+	if (mNodes.size() == 0) return;
 
-		// If the number of primitives at this point is less than the leaf
-		// size, then this will become a leaf. (Signified by rightOffset == 0)
-		if (nPrims <= mLeafSize) {
-			node.mRightOffset = 0;
-			nLeafs++;
-		}
+	float invRootArea = 1.f / fmaxf(mNodes[0].mBounds.SurfaceArea(), 1e-20f);
 
-		mNodes.push_back(node);
+	// the depth isn't known yet, so the stack grows as needed
+	vector<uint2> todo;
+	todo.push_back(uint2(0, 1));
 
-		// Child touches parent...
-		// Special case: Don't do this for the root.
-		if (bnode.mParentOffset != 0xfffffffc) {
-			mNodes[bnode.mParentOffset].mRightOffset--;
+	while (todo.size()) {
+		uint32_t ni = todo.back().x;
+		uint32_t depth = todo.back().y;
+		todo.pop_back();
+		const Node& node = mNodes[ni];
 
-			// When this is the second touch, this is the right child.
-			// The right child sets up the offset for the flat tree.
-			if (mNodes[bnode.mParentOffset].mRightOffset == touchedTwice) {
-				mNodes[bnode.mParentOffset].mRightOffset = nNodes - 1 - bnode.mParentOffset;
-			}
+		mStats.mNodeCount++;
+		mStats.mMaxDepth = max(mStats.mMaxDepth, depth);
+		float area = node.mBounds.SurfaceArea() * invRootArea;
+
+		if (node.mRightOffset == 0) {
+			mStats.mLeafCount++;
+			mStats.mMaxLeafSize = max(mStats.mMaxLeafSize, node.mCount);
+			mStats.mSahCost += mIntersectionCost * node.mCount * area;
+		} else {
+			mStats.mSahCost += mTraversalCost * area;
+			todo.push_back(uint2(ni + 1, depth + 1));
+			todo.push_back(uint2(ni + node.mRightOffset, depth + 1));
 		}
+	}
+
+	mStats.mAverageLeafSize = (float)mTriangles.size() / (float)mStats.mLeafCount;
+}
 
-		// If this is a leaf, no need to subdivide.
-		if (node.mRightOffset == 0) continue;
-
-		// Set the split dimensions
-		uint32_t split_dim = 0;
-		float3 ext = bc.Extents();
-		if (ext.y > ext.x) {
-			split_dim = 1;
-			if (ext.z > ext.y) split_dim = 2;
-		} else
-			if (ext.z > ext.x) split_dim = 2;
-
-		// Split on the center of the longest axis
-		float split_coord = bc.Center()[split_dim];
-
-		// Partition the list of objects on this split
-		uint32_t mid = start;
-		for (uint32_t i = start; i < end; ++i)
-			if (aabbs[i].Center()[split_dim] < split_coord) {
-				swap(mTriangles[i], mTriangles[mid]);
-				swap(aabbs[i], aabbs[mid]);
-				mid++;
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	inline MappedFile(const string& filename) : mData(nullptr), mSize(0) {
+		#ifdef WINDOWS
+		mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		mMapping = NULL;
+		if (mFile == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0) return;
+		mMapping = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mMapping == NULL) return;
+		mData = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+		if (mData) mSize = (size_t)size.QuadPart;
+		#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				mData = (const uint8_t*)data;
+				mSize = (size_t)st.st_size;
 			}
+		}
+		close(fd);
+		#endif
+	}
+	inline ~MappedFile() {
+		#ifdef WINDOWS
+		if (mData) UnmapViewOfFile(mData);
+		if (mMapping != NULL) CloseHandle(mMapping);
+		if (mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+		#else
+		if (mData) munmap((void*)mData, mSize);
+		#endif
+	}
+
+	inline const uint8_t* Data() const { return mData; }
+	inline size_t Size() const { return mSize; }
+
+private:
+	const uint8_t* mData;
+	size_t mSize;
+	#ifdef WINDOWS
+	HANDLE mFile;
+	HANDLE mMapping;
+	#endif
+};
+
+struct BvhCacheHeader {
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint64_t mKey;
+	uint32_t mTreeCount;
+};
+struct BvhCacheTree {
+	uint32_t mMaxLeafSize;
+	float mTraversalCost;
+	float mIntersectionCost;
+	uint32_t mNodeCount;
+	uint32_t mWideNodeCount;
+	uint32_t mTriangleCount;
+	uint32_t mVertexCount;
+	TriangleBvh2::BuildStats mStats;
+};
+
+// 64-bit FNV-1a over whole words, with the tail mixed in bytewise
+static uint64_t HashBytes(const uint8_t* data, size_t size, uint64_t seed) {
+	const uint64_t prime = 0x100000001B3ull;
+	uint64_t h = seed ^ 0xCBF29CE484222325ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(uint64_t));
+		h = (h ^ w) * prime;
+	}
+	for (; i < size; i++)
+		h = (h ^ data[i]) * prime;
+	return h ^ (h >> 32);
+}
+
+uint64_t TriangleBvh2::HashFile(const string& filename, uint64_t extra) {
+	MappedFile file(filename);
+	if (!file.Data()) return 0;
+	uint64_t h = HashBytes(file.Data(), file.Size(), extra);
+	return h ? h : 1;
+}
 
-		// If we get a bad split, just choose the center...
-		if (mid == start || mid == end)
-			mid = start + (end - start) / 2;
+template<typename T>
+static void WriteArray(ofstream& file, const vector<T>& v) {
+	file.write((const char*)v.data(), sizeof(T) * v.size());
+}
+template<typename T>
+static bool ReadArray(const uint8_t*& cur, const uint8_t* end, vector<T>& v, uint32_t count) {
+	if ((size_t)(end - cur) < sizeof(T) * count) return false;
+	v.resize(count);
+	memcpy(v.data(), cur, sizeof(T) * count);
+	cur += sizeof(T) * count;
+	return true;
+}
+
+bool TriangleBvh2::WriteCache(const string& filename, uint64_t key, TriangleBvh2* const* bvhs, uint32_t count) {
+	if (key == 0) return false;
+	// Write to a temporary file first, so a crash never leaves a partial cache behind
+	string tmp = filename + ".tmp";
+	ofstream file(tmp, ios::binary | ios::trunc);
+	if (!file.is_open()) return false;
+
+	BvhCacheHeader header = { BVH_CACHE_MAGIC, BVH_CACHE_VERSION, key, count };
+	file.write((const char*)&header, sizeof(BvhCacheHeader));
+	for (uint32_t i = 0; i < count; i++) {
+		const TriangleBvh2* b = bvhs[i];
+		BvhCacheTree tree = { b->mMaxLeafSize, b->mTraversalCost, b->mIntersectionCost,
+			(uint32_t)b->mNodes.size(), (uint32_t)b->mWideNodes.size(), (uint32_t)b->mTriangles.size(), (uint32_t)b->mVertices.size(), b->mStats };
+		file.write((const char*)&tree, sizeof(BvhCacheTree));
+		WriteArray(file, b->mNodes);
+		WriteArray(file, b->mWideNodes);
+		WriteArray(file, b->mTriangles);
+		WriteArray(file, b->mTriangleIndices);
+		WriteArray(file, b->mVertices);
+	}
+	bool good = file.good();
+	file.close();
+
+	error_code ec;
+	if (good) fs::rename(tmp, filename, ec);
+	if (!good || ec) {
+		fs::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
 
-		todo[stackptr].mStart = mid;
-		todo[stackptr].mEnd = end;
-		todo[stackptr].mParentOffset = nNodes - 1;
-		stackptr++;
-		todo[stackptr].mStart = start;
-		todo[stackptr].mEnd = mid;
-		todo[stackptr].mParentOffset = nNodes - 1;
-		stackptr++;
+bool TriangleBvh2::ReadCache(const string& filename, uint64_t key, TriangleBvh2* const* bvhs, uint32_t count) {
+	if (key == 0) return false;
+	MappedFile file(filename);
+	if (!file.Data() || file.Size() < sizeof(BvhCacheHeader)) return false;
+
+	const uint8_t* cur = file.Data();
+	const uint8_t* end = file.Data() + file.Size();
+
+	BvhCacheHeader header;
+	memcpy(&header, cur, sizeof(BvhCacheHeader));
+	cur += sizeof(BvhCacheHeader);
+	if (header.mMagic != BVH_CACHE_MAGIC || header.mVersion != BVH_CACHE_VERSION || header.mKey != key || header.mTreeCount != count) return false;
+
+	for (uint32_t i = 0; i < count; i++) {
+		TriangleBvh2* b = bvhs[i];
+		if ((size_t)(end - cur) < sizeof(BvhCacheTree)) return false;
+		BvhCacheTree tree;
+		memcpy(&tree, cur, sizeof(BvhCacheTree));
+		cur += sizeof(BvhCacheTree);
+
+		// Trees built with different parameters are stale
+		if (tree.mMaxLeafSize != b->mMaxLeafSize || tree.mTraversalCost != b->mTraversalCost || tree.mIntersectionCost != b->mIntersectionCost) return false;
+
+		if (!ReadArray(cur, end, b->mNodes, tree.mNodeCount) ||
+			!ReadArray(cur, end, b->mWideNodes, tree.mWideNodeCount) ||
+			!ReadArray(cur, end, b->mTriangles, tree.mTriangleCount) ||
+			!ReadArray(cur, end, b->mTriangleIndices, tree.mTriangleCount) ||
+			!ReadArray(cur, end, b->mVertices, tree.mVertexCount)) return false;
+		b->mStats = tree.mStats;
 	}
+	return true;
 }
 
 bool TriangleBvh2::Intersect(const Ray& ray, float* t, bool any) {
-	if (mNodes.size() == 0) return false;
+	TriangleHit hit;
+	bool h = Intersect(ray, &hit, any);
+	if (t) *t = hit.mT;
+	return h;
+}
+
+void TriangleBvh2::WriteHit(TriangleHit* hit, float t, uint32_t index, const float2& bary) const {
+	hit->mT = t;
+	if (index == INVALID_TRIANGLE) {
+		hit->mTriangle = INVALID_TRIANGLE;
+		hit->mVertices = 0;
+		hit->mBarycentrics = 0;
+		return;
+	}
+	hit->mTriangle = mTriangleIndices[index];
+	hit->mVertices = mTriangles[index];
+	// the intersection test returns the weights of the first two vertices
+	hit->mBarycentrics = float2(bary.y, 1.f - bary.x - bary.y);
+}
 
+bool TriangleBvh2::Intersect(const Ray& ray, TriangleHit* hit, bool any) {
 	float ht = 1.e20f;
 	float2 bary = 0;
-	int hitIndex = -1;
-
-	uint32_t todo[256];
-	int stackptr = 0;
+	uint32_t hitIndex = INVALID_TRIANGLE;
+	float3 invDirection = InverseDirection(ray.mDirection);
+
+	uint32_t todoArray[TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (StackSize() > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(StackSize());
+		todo = todoVector.data();
+	}
+	int stackptr = mWideNodes.size() ? 0 : -1;
 
-	todo[stackptr] = 0;
+	todo[0] = 0;
 
 	while (stackptr >= 0) {
-		uint32_t ni = todo[stackptr];
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
 		stackptr--;
-		const Node& node = mNodes[ni];
 
-		if (node.mRightOffset == 0) {
-			for (uint32_t o = 0; o < node.mCount; ++o) {
-				uint3 tri = mTriangles[node.mStartIndex + o];
+		float ct[4];
+		uint32_t mask = IntersectBvh4(node, ray.mOrigin, invDirection, ht, ct);
+
+		// Test leaves right away, and push the hit nodes so that the closest one is visited first
+		uint32_t order[4];
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < 4; i++) {
+			if ((mask & (1 << i)) == 0) continue;
+			if (node.mCount[i] == 0) {
+				uint32_t j = count++;
+				for (; j > 0 && ct[order[j - 1]] < ct[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+				continue;
+			}
+			if (ct[i] > ht) continue;
+
+			for (uint32_t o = 0; o < node.mCount[i]; ++o) {
+				uint32_t index = node.mChild[i] + o;
+				uint3 tri = mTriangles[index];
 
 				float3 tuv;
 				bool h = ray.Intersect(mVertices[tri.x], mVertices[tri.y], mVertices[tri.z], &tuv);
 
-				if (h && tuv.x > 0 && tuv.x < ht) {
+				// Ties go to the lowest index, so the result does not depend on the traversal order
+				if (h && tuv.x > 0 && (tuv.x < ht || (tuv.x == ht && index < hitIndex))) {
 					ht = tuv.x;
 					bary.x = tuv.y;
 					bary.y = tuv.z;
-					hitIndex = node.mStartIndex + o;
+					hitIndex = index;
 					if (any) {
-						if (t) *t = ht;
-						return hitIndex;
+						if (hit) WriteHit(hit, ht, hitIndex, bary);
+						return true;
 					}
 				}
 			}
-		} else {
-			uint32_t n0 = ni + 1;
-			uint32_t n1 = ni + node.mRightOffset;
+		}
+		for (uint32_t i = 0; i < count; i++)
+			if (ct[order[i]] <= ht) todo[++stackptr] = node.mChild[order[i]];
+	}
+
+	if (hit) WriteHit(hit, ht, hitIndex, bary);
+	return hitIndex != INVALID_TRIANGLE;
+}
+
+void TriangleBvh2::IntersectPacket(const Ray* rays, uint32_t rayCount, TriangleHit* hits, bool any) {
+	// Single rays stop at their first hit, which beats waiting for the whole packet in any-hit queries
+	if (any || !CoherentPacket(rays, rayCount)) {
+		for (uint32_t r = 0; r < rayCount; r++)
+			Intersect(rays[r], &hits[r], any);
+		return;
+	}
 
-			float2 t0;
-			float2 t1;
-			bool h0 = ray.Intersect(mNodes[n0].mBounds, t0);
-			bool h1 = ray.Intersect(mNodes[n1].mBounds, t1);
+	float3 invDirection[RAY_PACKET_SIZE];
+	float ht[RAY_PACKET_SIZE];
+	float2 bary[RAY_PACKET_SIZE];
+	uint32_t hitIndex[RAY_PACKET_SIZE];
+
+	uint32_t active = 0;
+	for (uint32_t r = 0; r < rayCount; r++) {
+		invDirection[r] = InverseDirection(rays[r].mDirection);
+		ht[r] = 1.e20f;
+		bary[r] = 0;
+		hitIndex[r] = INVALID_TRIANGLE;
+		active |= 1 << r;
+	}
 
-			if (h0 && t0.y < ht) todo[++stackptr] = n0;
-			if (h1 && t1.y < ht) todo[++stackptr] = n1;
+	// Bounds of the whole packet. They stay valid for any subset of its rays, so they're only computed once.
+	RayPacketBounds packet(rays, invDirection, active);
+
+	// Each node on the stack keeps the mask of the rays that entered it, in the second half of the stack
+	uint32_t stackSize = max(StackSize(), (uint32_t)TRAVERSAL_STACK_SIZE);
+	uint32_t todoArray[2 * TRAVERSAL_STACK_SIZE];
+	vector<uint32_t> todoVector;
+	uint32_t* todo = todoArray;
+	if (stackSize > TRAVERSAL_STACK_SIZE) {
+		todoVector.resize(2 * stackSize);
+		todo = todoVector.data();
+	}
+	uint32_t* todoMask = todo + stackSize;
+	int stackptr = mWideNodes.size() ? 0 : -1;
+
+	todo[0] = 0;
+	todoMask[0] = active;
+
+	// The whole packet walks the tree together. Each node is first tested against the whole packet at once,
+	// then against single rays only until every child that survived is known to be entered by one of them.
+	// Rays that entered a node aren't always tested against its children, so they are tested again further down.
+	while (stackptr >= 0 && active) {
+		const Bvh4Node& node = mWideNodes[todo[stackptr]];
+		uint32_t nodeMask = todoMask[stackptr] & active;
+		stackptr--;
+		if (nodeMask == 0) continue;
+
+		float tmax = 0;
+		for (uint32_t r = 0; r < rayCount; r++)
+			if ((nodeMask & (1 << r)) && ht[r] > tmax) tmax = ht[r];
+		uint32_t children = IntersectBvh4(node, packet, tmax);
+		if (children == 0) continue;
+
+		uint32_t leaves = 0;
+		for (uint32_t i = 0; i < 4; i++)
+			if (node.mCount[i]) leaves |= 1 << i;
+
+		// Leaves need exact results for every ray, since each ray only tests the triangles it reaches
+		uint32_t rayMask[4] = { 0, 0, 0, 0 };
+		float tnear[4] = { 1e30f, 1e30f, 1e30f, 1e30f };
+		uint32_t entered = 0;
+		for (uint32_t r = 0; r < rayCount; r++) {
+			if ((nodeMask & (1 << r)) == 0) continue;
+			if ((children & leaves) == 0 && entered == children) {
+				for (uint32_t i = 0; i < 4; i++)
+					if (children & (1 << i)) rayMask[i] |= nodeMask & ~((1 << r) - 1);
+				break;
+			}
+			float ct[4];
+			uint32_t mask = IntersectBvh4(node, rays[r].mOrigin, invDirection[r], ht[r], ct) & children;
+			entered |= mask;
+			for (uint32_t i = 0; i < 4; i++)
+				if (mask & (1 << i)) {
+					rayMask[i] |= 1 << r;
+					if (ct[i] < tnear[i]) tnear[i] = ct[i];
+				}
+		}
+
+		uint32_t order[4];
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < 4; i++) {
+			if (rayMask[i] == 0) continue;
+			if (node.mCount[i] == 0) {
+				uint32_t j = count++;
+				for (; j > 0 && tnear[order[j - 1]] < tnear[i]; j--)
+					order[j] = order[j - 1];
+				order[j] = i;
+				continue;
+			}
+
+			for (uint32_t r = 0; r < rayCount; r++) {
+				if ((rayMask[i] & active & (1 << r)) == 0) continue;
+				for (uint32_t o = 0; o < node.mCount[i]; ++o) {
+					uint32_t index = node.mChild[i] + o;
+					uint3 tri = mTriangles[index];
+
+					float3 tuv;
+					bool h = rays[r].Intersect(mVertices[tri.x], mVertices[tri.y], mVertices[tri.z], &tuv);
+
+					if (h && tuv.x > 0 && (tuv.x < ht[r] || (tuv.x == ht[r] && index < hitIndex[r]))) {
+						ht[r] = tuv.x;
+						bary[r] = float2(tuv.y, tuv.z);
+						hitIndex[r] = index;
+						if (any) {
+							active &= ~(1 << r);
+							break;
+						}
+					}
+				}
+			}
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			todo[++stackptr] = node.mChild[order[i]];
+			todoMask[stackptr] = rayMask[order[i]];
 		}
 	}
 
-	if (t) *t = ht;
-	return hitIndex != -1;
-}
\ No newline at end of file
+	for (uint32_t r = 0; r < rayCount; r++)
+		WriteHit(&hits[r], ht[r], hitIndex[r], bary[r]);
+}
+
+void TriangleBvh2::Intersect(const Ray* rays, uint32_t rayCount, TriangleHit* hits, bool any, uint32_t threadCount) {
+	uint32_t packetCount = (rayCount + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+
+	if (threadCount == 0) threadCount = max(thread::hardware_concurrency(), 1u);
+	threadCount = max(min(threadCount, rayCount / MIN_THREAD_RAYS), 1u);
+
+	// Threads take a few packets at a time, so rays that are next to each other in the array stay together
+	atomic<uint32_t> nextPacket(0);
+	auto worker = [&]() {
+		uint32_t p;
+		while ((p = nextPacket.fetch_add(PACKETS_PER_TASK)) < packetCount)
+			for (uint32_t i = p; i < min(p + PACKETS_PER_TASK, packetCount); i++) {
+				uint32_t first = i * RAY_PACKET_SIZE;
+				IntersectPacket(rays + first, min(rayCount - first, (uint32_t)RAY_PACKET_SIZE), hits + first, any);
+			}
+	};
+	vector<thread> threads;
+	for (uint32_t j = 1; j < threadCount; j++)
+		threads.push_back(thread(worker));
+	worker();
+	for (thread& t : threads) t.join();
+}
@@ -1,7 +1,21 @@
 #pragma once
 
+#include <Scene/Bvh4.hpp>
 #include <Util/Util.hpp>
 
+// A ray's closest (or any) intersection with the triangles in a TriangleBvh2
+struct TriangleHit {
+	float mT;
+	// index of the triangle in the index buffer the bvh was built from, 0xFFFFFFFF if the ray missed
+	uint32_t mTriangle;
+	// indices of the triangle's vertices, as they appear in the index buffer
+	uint3 mVertices;
+	// weights of the triangle's second and third vertex, the first vertex has weight 1 - x - y
+	float2 mBarycentrics;
+};
+
+// Stores a binary bvh of triangles, built using a binned surface area heuristic
+// Rays traverse a four-wide copy of the tree, collapsed from the binary tree after each build
 class TriangleBvh2 {
 public:
 	struct Primitive {
@@ -15,11 +29,25 @@ public:
 		uint32_t mCount;
 		uint32_t mRightOffset; // 1st child is at node[index + 1], 2nd child is at node[index + mRightOffset]
 	};
+	// Quality statistics of the last build, used to compare trees
+	struct BuildStats {
+		uint32_t mNodeCount;
+		uint32_t mLeafCount;
+		uint32_t mMaxDepth;
+		uint32_t mMaxLeafSize;
+		float mAverageLeafSize;
+		// Expected cost of a ray query, relative to the surface area of the root node
+		float mSahCost;
+	};
 
-	inline TriangleBvh2(uint32_t leafSize = 4) : mLeafSize(leafSize) {};
+	// Leaves are created when the SAH predicts intersecting the triangles is cheaper than splitting, and nodes with more than maxLeafSize triangles are always split
+	inline TriangleBvh2(uint32_t maxLeafSize = 8, float traversalCost = 1.f, float intersectionCost = 1.f)
+		: mMaxLeafSize(maxLeafSize), mTraversalCost(traversalCost), mIntersectionCost(intersectionCost), mStats({}) {};
 	inline ~TriangleBvh2() {}
 
 	const std::vector<Node>& Nodes() const { return mNodes; }
+	inline const std::vector<Bvh4Node>& WideNodes() const { return mWideNodes; }
+	inline const BuildStats& Stats() const { return mStats; }
 
 	float3 GetVertex(uint32_t index) const { return mVertices[index]; }
 	uint3 GetTriangle(uint32_t index) const { return mTriangles[index]; }
@@ -27,15 +55,44 @@ public:
 
 	inline AABB Bounds() { return mNodes.size() ? mNodes[0].mBounds : AABB(); }
 
-	ENGINE_EXPORT void Build(const void* vertices, uint32_t baseVertex, uint32_t vertexCount, size_t vertexStride, const void* indices, uint32_t indexCount, VkIndexType indexType);
+	// Builds the bvh using threadCount threads, or one per hardware thread if threadCount is 0. The tree is the same for any thread count.
+	ENGINE_EXPORT void Build(const void* vertices, uint32_t baseVertex, uint32_t vertexCount, size_t vertexStride, const void* indices, uint32_t indexCount, VkIndexType indexType, uint32_t threadCount = 0);
+
+	// Hashes the contents of a file together with extra (e.g. import settings), to key cached trees built from it. Returns 0 if the file can't be read.
+	ENGINE_EXPORT static uint64_t HashFile(const std::string& filename, uint64_t extra = 0);
+	// Saves built trees to a versioned binary cache file. Returns false if the file can't be written.
+	ENGINE_EXPORT static bool WriteCache(const std::string& filename, uint64_t key, TriangleBvh2* const* bvhs, uint32_t count);
+	// Memory-maps a cache file written by WriteCache() and loads the trees from it.
+	// Returns false if the file is missing or stale: written by another version, with a different key, or by trees with different builder parameters.
+	ENGINE_EXPORT static bool ReadCache(const std::string& filename, uint64_t key, TriangleBvh2* const* bvhs, uint32_t count);
 
 	ENGINE_EXPORT bool Intersect(const Ray& ray, float* t, bool any);
+	ENGINE_EXPORT bool Intersect(const Ray& ray, TriangleHit* hit, bool any);
+	// Intersects a batch of rays, tracing them in packets of neighboring rays and spreading large batches across threadCount threads (one per hardware thread if 0)
+	// Closest hits match the single ray queries exactly. hits must hold rayCount elements.
+	ENGINE_EXPORT void Intersect(const Ray* rays, uint32_t rayCount, TriangleHit* hits, bool any, uint32_t threadCount = 0);
+	// Traces up to RAY_PACKET_SIZE closest-hit rays through the tree together on the calling thread, or one at a time for any-hit queries, small packets, or directions that differ too much
+	ENGINE_EXPORT void IntersectPacket(const Ray* rays, uint32_t rayCount, TriangleHit* hits, bool any);
 
 private:
 	std::vector<Node> mNodes;
+	std::vector<Bvh4Node> mWideNodes;
 
 	std::vector<uint3> mTriangles;
+	// index of each triangle in the index buffer the bvh was built from
+	std::vector<uint32_t> mTriangleIndices;
 	std::vector<float3> mVertices;
 
-	uint32_t mLeafSize;
-};
\ No newline at end of file
+	uint32_t mMaxLeafSize;
+	float mTraversalCost;
+	float mIntersectionCost;
+	BuildStats mStats;
+
+	static const uint32_t INVALID_TRIANGLE = 0xFFFFFFFF;
+
+	ENGINE_EXPORT void ComputeStats();
+	// Entries needed by a depth-first traversal of the four-wide tree, which holds at most three siblings of each node on the path to the current node.
+	// The wide tree is never deeper than the binary tree it was collapsed from
+	inline uint32_t StackSize() const { return 3 * mStats.mMaxDepth + 1; }
+	ENGINE_EXPORT void WriteHit(TriangleHit* hit, float t, uint32_t index, const float2& bary) const;
+};
@@ -17,6 +17,9 @@
 
 using namespace std;
 
+// Number of frames averaged by each line that --stats prints
+#define STATS_FRAMES 256
+
 class Stratum {
 private:
 	Instance* mInstance;
@@ -25,6 +28,28 @@ private:
 	AssetManager* mAssetManager;
 	Scene* mScene;
 
+	// --stats prints the average frame, record and sort times and the last frame's render stats every STATS_FRAMES frames, for comparing settings such as --record-threads
+	bool mPrintStats;
+	uint32_t mStatsFrames;
+	float mStatsFrameTime;
+	float mStatsRecordTime;
+	float mStatsSortTime;
+
+	void PrintStats(float frameTime) {
+		const RenderStats& stats = mScene->LastRenderStats();
+		mStatsFrames++;
+		mStatsFrameTime += frameTime;
+		mStatsRecordTime += stats.mRecordTime;
+		mStatsSortTime += stats.mSortTime;
+		if (mStatsFrames < STATS_FRAMES) return;
+		printf("%u record threads: frame %.3f ms, record %.3f ms, sort %.3f ms, %u draws, %u pipeline binds, %u descriptor set binds\n", mScene->RecordThreadCount(),
+			mStatsFrameTime / mStatsFrames, mStatsRecordTime / mStatsFrames, mStatsSortTime / mStatsFrames, stats.mDrawCount, stats.mPipelineBindCount, stats.mDescriptorSetBindCount);
+		mStatsFrames = 0;
+		mStatsFrameTime = 0;
+		mStatsRecordTime = 0;
+		mStatsSortTime = 0;
+	}
+
 	void Render(CommandBuffer* commandBuffer) {
 		PROFILER_BEGIN("Scene PreFrame");
 		mScene->PreFrame(commandBuffer);
@@ -74,7 +99,7 @@ private:
 	}
 
 public:
-	Stratum(int argc, char** argv) : mScene(nullptr), mInstance(nullptr), mInputManager(nullptr) {
+	Stratum(int argc, char** argv) : mScene(nullptr), mInstance(nullptr), mInputManager(nullptr), mPrintStats(false), mStatsFrames(0), mStatsFrameTime(0), mStatsRecordTime(0), mStatsSortTime(0) {
 		printf("Initializing...\n");
 		mPluginManager = new PluginManager();
 		mPluginManager->LoadPlugins();
@@ -85,6 +110,13 @@ public:
 		printf("Initialized.\n");
 
 		mScene = new Scene(mInstance, mAssetManager, mInputManager, mPluginManager);
+		for (int i = 0; i < argc; i++) {
+			if (strcmp(argv[i], "--record-threads") == 0) {
+				// 0 uses every hardware thread
+				if (++i < argc) mScene->RecordThreadCount(atoi(argv[i]));
+			} else if (strcmp(argv[i], "--stats") == 0)
+				mPrintStats = true;
+		}
 		Gizmos::Initialize(mInstance->Device(), mAssetManager, mInputManager);
 		GUI::Initialize(mInstance->Device(), mAssetManager, mInputManager);
 		mInputManager->RegisterInputDevice(mInstance->Window()->mInput);
@@ -98,6 +130,7 @@ public:
 			#ifdef PROFILER_ENABLE
 			Profiler::FrameStart();
 			#endif
+			auto frameStart = chrono::high_resolution_clock::now();
 
 			PROFILER_BEGIN("Poll Events");
 			for (InputDevice* d : mInputManager->mInputDevices)
@@ -132,6 +165,7 @@ public:
 			if (mInstance->mXRRuntime) mInstance->mXRRuntime->EndFrame();
 			PROFILER_END;
 			mInstance->AdvanceFrame();
+			if (mPrintStats) PrintStats(chrono::duration<float, milli>(chrono::high_resolution_clock::now() - frameStart).count());
 
 			#ifdef PROFILER_ENABLE
 			Profiler::FrameEnd();
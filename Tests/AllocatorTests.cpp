@@ -0,0 +1,230 @@
+#include <Util/LinearAllocator.hpp>
+#include <Util/TlsfAllocator.hpp>
+#include <Tests/Tests.hpp>
+
+#include <list>
+#include <map>
+#include <random>
+
+using namespace std;
+
+// One step of an allocation trace: an allocation of 'size' bytes, or a free of allocation 'id'
+struct AllocatorOp {
+	bool mAllocate;
+	uint64_t mSize;
+	uint64_t mAlignment;
+	uint32_t mId;
+};
+
+// Random trace that keeps between liveCount / 2 and liveCount allocations alive, mixing small buffers with large images.
+// Returns the number of allocations, and the ids of the ones still alive at the end.
+static uint32_t RandomTrace(uint32_t liveCount, uint32_t opCount, uint64_t seed, vector<AllocatorOp>& trace, vector<uint32_t>& live) {
+	mt19937_64 rng(seed);
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < opCount; i++) {
+		if (live.size() < liveCount / 2 || (live.size() < liveCount && rng() % 2)) {
+			uint64_t size = rng() % 4 == 0 ? 1 + rng() % (1 << 20) : 16 + rng() % 16384;
+			uint64_t alignment = 1ull << (rng() % 2 ? 8 : 4 + rng() % 13);
+			trace.push_back({ true, size, alignment, count });
+			live.push_back(count++);
+		} else {
+			uint32_t k = (uint32_t)(rng() % live.size());
+			trace.push_back({ false, 0, 0, live[k] });
+			live[k] = live.back();
+			live.pop_back();
+		}
+	}
+	return count;
+}
+
+// The best-fit free list that Device used before TlsfAllocator, kept as a baseline for the benchmark
+class ListAllocator {
+public:
+	inline ListAllocator(uint64_t size) : mAvailable({ { 0, size } }) {}
+
+	inline bool Allocate(uint64_t size, uint64_t alignment, uint64_t* offset, uint64_t* allocatedSize) {
+		auto block = mAvailable.end();
+		uint64_t blockSize = 0;
+		for (auto it = mAvailable.begin(); it != mAvailable.end(); it++) {
+			uint64_t start = AlignUp(it->first, alignment);
+			uint64_t end = AlignUp(start + size, TlsfAllocator::MIN_BLOCK_SIZE);
+			if (end > it->first + it->second) continue;
+			if (block == mAvailable.end() || it->second < block->second) {
+				*offset = start;
+				*allocatedSize = end - start;
+				blockSize = end - it->first;
+				block = it;
+			}
+		}
+		if (block == mAvailable.end()) return false;
+		if (block->second > blockSize) {
+			block->first += blockSize;
+			block->second -= blockSize;
+		} else
+			mAvailable.erase(block);
+		return true;
+	}
+	inline void Free(uint64_t offset, uint64_t size) {
+		uint64_t end = offset + size;
+		auto after = mAvailable.end(), startBlock = mAvailable.end(), endBlock = mAvailable.end();
+		for (auto it = mAvailable.begin(); it != mAvailable.end(); it++) {
+			if (it->first > offset && (after == mAvailable.end() || it->first < after->first)) after = it;
+			if (it->first == end) endBlock = it;
+			if (it->first + it->second == offset) startBlock = it;
+		}
+		if (startBlock == mAvailable.end() && endBlock == mAvailable.end())
+			mAvailable.insert(after, { offset, size });
+		else if (startBlock == mAvailable.end()) {
+			endBlock->first = offset;
+			endBlock->second += size;
+		} else if (endBlock == mAvailable.end())
+			startBlock->second += size;
+		else {
+			startBlock->second += size + endBlock->second;
+			mAvailable.erase(endBlock);
+		}
+	}
+
+private:
+	// offset and size of each free range
+	list<pair<uint64_t, uint64_t>> mAvailable;
+};
+
+TEST(TlsfAllocatorTrace) {
+	vector<AllocatorOp> trace;
+	vector<uint32_t> live;
+	uint32_t count = RandomTrace(4000, 100000, 7, trace, live);
+
+	TlsfAllocator allocator(4ull << 30);
+	vector<uint32_t> blocks(count);
+	vector<uint64_t> offsets(count);
+	// end of each live allocation, by offset
+	map<uint64_t, uint64_t> used;
+	for (const AllocatorOp& op : trace) {
+		if (!op.mAllocate) {
+			allocator.Free(blocks[op.mId]);
+			used.erase(offsets[op.mId]);
+			continue;
+		}
+		uint64_t offset;
+		uint32_t block = allocator.Allocate(op.mSize, op.mAlignment, &offset);
+		CHECK(block != TlsfAllocator::INVALID_BLOCK);
+		if (block == TlsfAllocator::INVALID_BLOCK) return;
+		CHECK(offset % op.mAlignment == 0);
+		CHECK(allocator.Offset(block) == offset);
+		CHECK(allocator.BlockSize(block) >= op.mSize);
+		CHECK(offset + op.mSize <= allocator.Size());
+		// must not overlap the allocations before or after it
+		auto it = used.lower_bound(offset);
+		if (it != used.end()) CHECK(it->first >= offset + op.mSize);
+		if (it != used.begin()) CHECK(prev(it)->second <= offset);
+		used[offset] = offset + op.mSize;
+		blocks[op.mId] = block;
+		offsets[op.mId] = offset;
+	}
+	CHECK(allocator.AllocationCount() == live.size());
+
+	for (uint32_t id : live) allocator.Free(blocks[id]);
+	CHECK(allocator.Empty());
+	CHECK(allocator.Available() == allocator.Size());
+	// every free block merged back into one
+	uint64_t offset;
+	CHECK(allocator.Allocate(allocator.Size(), 1, &offset) != TlsfAllocator::INVALID_BLOCK);
+	CHECK(offset == 0);
+}
+
+TEST(TlsfAllocatorMinimumSize) {
+	mt19937_64 rng(3);
+	for (uint32_t i = 0; i < 10000; i++) {
+		uint64_t size = 1 + rng() % (1ull << (rng() % 30));
+		uint64_t alignment = 1ull << (rng() % 17);
+		TlsfAllocator allocator(TlsfAllocator::MinimumSize(size, alignment));
+		uint64_t offset;
+		CHECK(allocator.Allocate(size, alignment, &offset) != TlsfAllocator::INVALID_BLOCK);
+	}
+}
+
+TEST(TlsfAllocatorFull) {
+	const uint64_t blockSize = 64 * 1024;
+	TlsfAllocator allocator(256 * blockSize);
+	vector<uint32_t> blocks;
+	uint64_t offset;
+	for (uint32_t block; (block = allocator.Allocate(blockSize, 256, &offset)) != TlsfAllocator::INVALID_BLOCK;)
+		blocks.push_back(block);
+	CHECK(blocks.size() == 256);
+	CHECK(allocator.Available() == 0);
+
+	// freeing every other block leaves holes that can't fit two blocks
+	for (uint32_t i = 0; i < blocks.size(); i += 2) allocator.Free(blocks[i]);
+	CHECK(allocator.Allocate(2 * blockSize, 256, &offset) == TlsfAllocator::INVALID_BLOCK);
+	for (uint32_t i = 1; i < blocks.size(); i += 2) allocator.Free(blocks[i]);
+	CHECK(allocator.Empty());
+	CHECK(allocator.Allocate(256 * blockSize, 256, &offset) != TlsfAllocator::INVALID_BLOCK);
+}
+
+TEST(LinearAllocatorReset) {
+	LinearAllocator allocator(1024);
+	uint64_t offset;
+	CHECK(allocator.Allocate(10, 16, &offset) && offset == 0);
+	CHECK(allocator.Allocate(10, 256, &offset) && offset == 256);
+	CHECK(allocator.Allocate(500, 16, &offset) && offset == 272);
+	CHECK(allocator.Used() == 772);
+
+	// allocations that don't fit fail, but still count towards Required()
+	CHECK(!allocator.Allocate(300, 64, &offset));
+	CHECK(allocator.OverflowCount() == 1);
+	CHECK(allocator.Required() == 832 + 300);
+	CHECK(allocator.Used() == 1024);
+
+	allocator.Reset(2048);
+	CHECK(allocator.HighWaterMark() == 1132);
+	CHECK(allocator.Capacity() == 2048);
+	CHECK(allocator.Required() == 0);
+	CHECK(allocator.OverflowCount() == 0);
+	CHECK(allocator.Allocate(1100, 1, &offset) && offset == 0);
+}
+
+BENCHMARK(TlsfAllocatorBenchmark) {
+	for (uint32_t liveCount : { 100u, 1000u, 4000u }) {
+		const uint32_t opCount = 200000;
+		vector<AllocatorOp> trace;
+		vector<uint32_t> live;
+		uint32_t count = RandomTrace(liveCount, opCount, 7, trace, live);
+
+		// replay each trace once for the total time, and once more timing each op for the worst case
+		auto replayTlsf = [&](double* worst) {
+			TlsfAllocator allocator(4ull << 30);
+			vector<uint32_t> blocks(count);
+			uint64_t offset;
+			for (const AllocatorOp& op : trace) {
+				chrono::high_resolution_clock::time_point t0;
+				if (worst) t0 = chrono::high_resolution_clock::now();
+				if (op.mAllocate)
+					blocks[op.mId] = allocator.Allocate(op.mSize, op.mAlignment, &offset);
+				else
+					allocator.Free(blocks[op.mId]);
+				if (worst) *worst = max(*worst, chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count());
+			}
+		};
+		auto replayList = [&](double* worst) {
+			ListAllocator allocator(4ull << 30);
+			vector<pair<uint64_t, uint64_t>> ranges(count);
+			for (const AllocatorOp& op : trace) {
+				chrono::high_resolution_clock::time_point t0;
+				if (worst) t0 = chrono::high_resolution_clock::now();
+				if (op.mAllocate)
+					allocator.Allocate(op.mSize, op.mAlignment, &ranges[op.mId].first, &ranges[op.mId].second);
+				else
+					allocator.Free(ranges[op.mId].first, ranges[op.mId].second);
+				if (worst) *worst = max(*worst, chrono::duration<double, milli>(chrono::high_resolution_clock::now() - t0).count());
+			}
+		};
+		double tlsfWorst = 0, listWorst = 0;
+		double tlsf = TimeMilliseconds([&]() { replayTlsf(nullptr); });
+		double list = TimeMilliseconds([&]() { replayList(nullptr); });
+		replayTlsf(&tlsfWorst);
+		replayList(&listWorst);
+		printf("%5u live allocations: tlsf %.1f ns/op (worst %.2f us) | list %.1f ns/op (worst %.2f us)\n",
+			liveCount, tlsf * 1e6 / opCount, tlsfWorst * 1e3, list * 1e6 / opCount, listWorst * 1e3);
+	}
+}
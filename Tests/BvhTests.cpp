@@ -0,0 +1,261 @@
+#include <Scene/ObjectBvh2.hpp>
+#include <Scene/TriangleBvh2.hpp>
+#include <Tests/Tests.hpp>
+
+#include <random>
+
+using namespace std;
+
+// An object with fixed bounds, which rays hit where they enter its box
+class BoxObject final : public Object {
+public:
+	AABB mBox;
+
+	inline BoxObject(const AABB& box, uint32_t layerMask) : Object("Box"), mBox(box) { LayerMask(layerMask); }
+
+	inline AABB Bounds() override { return mBox; }
+	using Object::Intersect;
+	inline bool Intersect(const Ray& ray, float* t, bool any) override {
+		float2 st;
+		if (!ray.Intersect(mBox, st) || st.y < 0) return false;
+		if (t) *t = st.x > 0 ? st.x : st.y;
+		return true;
+	}
+};
+
+// Random boxes in a cube, with every 5th box on layer 2 and every 17th box disabled
+static vector<BoxObject*> RandomBoxes(uint32_t count, mt19937& rng) {
+	uniform_real_distribution<float> u(0, 1);
+	float side = cbrtf((float)count) * 4;
+	vector<BoxObject*> boxes(count);
+	for (uint32_t i = 0; i < count; i++) {
+		float3 p = float3(u(rng), u(rng), u(rng)) * side;
+		float3 e = float3(u(rng), u(rng), u(rng)) + .2f;
+		boxes[i] = new BoxObject(AABB(p - e, p + e), i % 5 == 0 ? 2 : 1);
+		boxes[i]->Enabled(i % 17 != 0);
+	}
+	return boxes;
+}
+
+// Random triangles in a flat slab
+static void RandomTriangles(uint32_t count, mt19937& rng, vector<float3>& vertices, vector<uint32_t>& indices) {
+	uniform_real_distribution<float> u(-10, 10), s(-.3f, .3f);
+	for (uint32_t i = 0; i < count; i++) {
+		float3 c(u(rng), u(rng) * .2f, u(rng));
+		for (uint32_t j = 0; j < 3; j++) {
+			indices.push_back((uint32_t)vertices.size());
+			vertices.push_back(c + float3(s(rng), s(rng), s(rng)));
+		}
+	}
+}
+
+// Rays pointing down into the slab from RandomTriangles
+static vector<Ray> RandomRays(uint32_t count, mt19937& rng) {
+	uniform_real_distribution<float> u(-10, 10), s(-.3f, .3f);
+	vector<Ray> rays(count);
+	for (uint32_t i = 0; i < count; i++)
+		rays[i] = Ray(float3(u(rng), 5, u(rng)), normalize(float3(s(rng), -1, s(rng))));
+	return rays;
+}
+
+// Closest hit, found by testing every triangle. Ties go to the lowest triangle, like TriangleBvh2.
+static TriangleHit BruteForceIntersect(const Ray& ray, const vector<float3>& vertices, const vector<uint32_t>& indices) {
+	TriangleHit hit = {};
+	hit.mT = 1e20f;
+	hit.mTriangle = 0xFFFFFFFF;
+	for (uint32_t i = 0; i < indices.size(); i += 3) {
+		float3 tuv;
+		if (ray.Intersect(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]], &tuv) && tuv.x > 0 && tuv.x < hit.mT) {
+			hit.mT = tuv.x;
+			hit.mTriangle = i / 3;
+		}
+	}
+	return hit;
+}
+
+static bool Visible(BoxObject* box, uint32_t mask) {
+	return box->EnabledHierarchy() && (box->LayerMask() & mask);
+}
+
+// Checks every query on bvh against testing each box
+static void CheckObjectQueries(ObjectBvh2& bvh, const vector<BoxObject*>& boxes, mt19937& rng) {
+	uniform_real_distribution<float> u(0, 1);
+	float side = cbrtf((float)boxes.size()) * 4;
+	vector<Object*> result(boxes.size());
+	for (uint32_t q = 0; q < 200; q++) {
+		float3 center = float3(u(rng), u(rng), u(rng)) * side;
+		float radius = 1 + u(rng) * 6;
+		uint32_t mask = q % 3 == 0 ? 2 : ~0u;
+
+		AABB box(center - radius, center + radius);
+		uint32_t count = bvh.Overlap(box, result.data(), (uint32_t)result.size(), mask);
+		set<Object*> found(result.begin(), result.begin() + count), expected;
+		for (BoxObject* b : boxes)
+			if (Visible(b, mask) && b->Bounds().Intersects(box)) expected.insert(b);
+		CHECK(count == found.size());
+		CHECK(found == expected);
+		// results past the capacity are still counted
+		CHECK(bvh.Overlap(box, result.data(), 1, mask) == count);
+
+		Sphere sphere(center, radius);
+		count = bvh.Overlap(sphere, result.data(), (uint32_t)result.size(), mask);
+		found = set<Object*>(result.begin(), result.begin() + count);
+		expected.clear();
+		for (BoxObject* b : boxes)
+			if (Visible(b, mask) && b->Bounds().Intersects(sphere)) expected.insert(b);
+		CHECK(found == expected);
+
+		uint32_t k = 1 + q % 16;
+		float maxDistance = q % 4 == 0 ? 3.f : 1e20f;
+		Object* nearest[16];
+		float distances[16];
+		count = bvh.Nearest(center, k, nearest, distances, mask, maxDistance);
+		vector<float> expectedDistances;
+		for (BoxObject* b : boxes)
+			if (Visible(b, mask)) {
+				float d = sqrtf(b->Bounds().DistanceSquared(center));
+				if (d <= maxDistance) expectedDistances.push_back(d);
+			}
+		sort(expectedDistances.begin(), expectedDistances.end());
+		CHECK(count == min<size_t>(k, expectedDistances.size()));
+		for (uint32_t i = 0; i < count && i < expectedDistances.size(); i++) {
+			CHECK(fabsf(distances[i] - expectedDistances[i]) <= 1e-4f * (1 + expectedDistances[i]));
+			CHECK(fabsf(sqrtf(nearest[i]->Bounds().DistanceSquared(center)) - distances[i]) <= 1e-4f * (1 + distances[i]));
+		}
+
+		Ray ray(center, normalize(float3(u(rng), u(rng), u(rng)) - .5f));
+		float t;
+		Object* hit = bvh.Intersect(ray, &t, false, mask);
+		float expectedT = 1e20f;
+		for (BoxObject* b : boxes) {
+			float bt;
+			if (Visible(b, mask) && b->Intersect(ray, &bt, false) && bt < expectedT) expectedT = bt;
+		}
+		CHECK((hit != nullptr) == (expectedT < 1e20f));
+		if (hit) CHECK(fabsf(t - expectedT) <= 1e-4f * (1 + expectedT));
+	}
+}
+
+TEST(ObjectBvh2Queries) {
+	mt19937 rng(3);
+	vector<BoxObject*> boxes = RandomBoxes(5000, rng);
+	for (BvhBuilder builder : { BVH_BUILDER_MEDIAN_SPLIT, BVH_BUILDER_LBVH }) {
+		ObjectBvh2 bvh;
+		bvh.Builder(builder);
+		bvh.Build((Object**)boxes.data(), (uint32_t)boxes.size(), 1);
+		CheckObjectQueries(bvh, boxes, rng);
+	}
+	for (BoxObject* b : boxes) delete b;
+}
+
+TEST(ObjectBvh2Dynamic) {
+	mt19937 rng(5);
+	uniform_real_distribution<float> u(0, 1);
+	vector<BoxObject*> boxes = RandomBoxes(3000, rng);
+	ObjectBvh2 bvh(true);
+	for (BoxObject* b : boxes) bvh.Insert(b);
+
+	// remove every 7th box, and move every 3rd box
+	vector<BoxObject*> remaining;
+	for (uint32_t i = 0; i < boxes.size(); i++) {
+		if (i % 7 == 0) {
+			bvh.Remove(boxes[i]);
+			delete boxes[i];
+			continue;
+		}
+		if (i % 3 == 0) {
+			boxes[i]->mBox.mMin += float3(u(rng), u(rng), u(rng)) * 4 - 2;
+			boxes[i]->mBox.mMax = max(boxes[i]->mBox.mMax, boxes[i]->mBox.mMin + .1f);
+			bvh.Dirty(boxes[i]);
+		}
+		remaining.push_back(boxes[i]);
+	}
+	bvh.Refit();
+	CheckObjectQueries(bvh, remaining, rng);
+	for (BoxObject* b : remaining) delete b;
+}
+
+TEST(TriangleBvh2Intersect) {
+	mt19937 rng(1);
+	vector<float3> vertices;
+	vector<uint32_t> indices;
+	RandomTriangles(20000, rng, vertices, indices);
+	TriangleBvh2 bvh;
+	bvh.Build(vertices.data(), 0, (uint32_t)vertices.size(), sizeof(float3), indices.data(), (uint32_t)indices.size(), VK_INDEX_TYPE_UINT32, 1);
+
+	vector<Ray> rays = RandomRays(1024, rng);
+	vector<TriangleHit> batch(rays.size());
+	bvh.Intersect(rays.data(), (uint32_t)rays.size(), batch.data(), false, 1);
+	for (uint32_t i = 0; i < rays.size(); i++) {
+		TriangleHit expected = BruteForceIntersect(rays[i], vertices, indices);
+		TriangleHit hit;
+		bool h = bvh.Intersect(rays[i], &hit, false);
+		CHECK(h == (expected.mTriangle != 0xFFFFFFFF));
+		CHECK(hit.mTriangle == expected.mTriangle);
+		if (h) CHECK(hit.mT == expected.mT);
+		// batched rays are traced as packets, which must find the same hits
+		CHECK(batch[i].mTriangle == expected.mTriangle);
+		float t;
+		CHECK(bvh.Intersect(rays[i], &t, true) == h);
+	}
+}
+
+BENCHMARK(ObjectBvh2QueryBenchmark) {
+	for (uint32_t count : { 1000u, 10000u, 100000u }) {
+		mt19937 rng(3);
+		uniform_real_distribution<float> u(0, 1);
+		vector<BoxObject*> boxes = RandomBoxes(count, rng);
+		float side = cbrtf((float)count) * 4;
+		vector<Object*> result(count);
+		for (BvhBuilder builder : { BVH_BUILDER_MEDIAN_SPLIT, BVH_BUILDER_LBVH }) {
+			ObjectBvh2 bvh;
+			bvh.Builder(builder);
+			double build = TimeMilliseconds([&]() { bvh.Build((Object**)boxes.data(), count, 1); });
+
+			const uint32_t queryCount = 2000;
+			double box = 0, sphere = 0, nearest = 0, bruteForce = 0;
+			uint64_t found = 0;
+			for (uint32_t q = 0; q < queryCount; q++) {
+				float3 center = float3(u(rng), u(rng), u(rng)) * side;
+				float radius = 1 + u(rng) * 6;
+				box += TimeMilliseconds([&]() { found += bvh.Overlap(AABB(center - radius, center + radius), result.data(), count, ~0u); });
+				sphere += TimeMilliseconds([&]() { bvh.Overlap(Sphere(center, radius), result.data(), count, ~0u); });
+				Object* objects[16];
+				float distances[16];
+				nearest += TimeMilliseconds([&]() { bvh.Nearest(center, 16, objects, distances, ~0u); });
+				bruteForce += TimeMilliseconds([&]() {
+					AABB aabb(center - radius, center + radius);
+					uint32_t n = 0;
+					for (BoxObject* b : boxes)
+						if (Visible(b, ~0u) && b->Bounds().Intersects(aabb)) result[n++] = b;
+				});
+			}
+			printf("%6u objects, %-6s build %.2f ms | box %.2f us, sphere %.2f us, 16-nearest %.2f us, brute force box %.2f us | %.1f found per box\n",
+				count, builder == BVH_BUILDER_LBVH ? "lbvh" : "median", build,
+				box * 1e3 / queryCount, sphere * 1e3 / queryCount, nearest * 1e3 / queryCount, bruteForce * 1e3 / queryCount, found / (double)queryCount);
+		}
+		for (BoxObject* b : boxes) delete b;
+	}
+}
+
+BENCHMARK(TriangleBvh2Benchmark) {
+	for (uint32_t count : { 10000u, 100000u }) {
+		mt19937 rng(1);
+		vector<float3> vertices;
+		vector<uint32_t> indices;
+		RandomTriangles(count, rng, vertices, indices);
+		TriangleBvh2 bvh;
+		double build = TimeMilliseconds([&]() {
+			bvh.Build(vertices.data(), 0, (uint32_t)vertices.size(), sizeof(float3), indices.data(), (uint32_t)indices.size(), VK_INDEX_TYPE_UINT32);
+		});
+
+		vector<Ray> rays = RandomRays(100000, rng);
+		vector<TriangleHit> hits(rays.size());
+		double single = TimeMilliseconds([&]() { for (uint32_t i = 0; i < rays.size(); i++) bvh.Intersect(rays[i], &hits[i], false); });
+		double packets = TimeMilliseconds([&]() { bvh.Intersect(rays.data(), (uint32_t)rays.size(), hits.data(), false, 1); });
+
+		const TriangleBvh2::BuildStats& stats = bvh.Stats();
+		printf("%7u triangles: build %.1f ms, %u nodes, depth %u, sah %.2f | single rays %.2f Mrays/s, packets %.2f Mrays/s\n",
+			count, build, stats.mNodeCount, stats.mMaxDepth, stats.mSahCost, rays.size() / single * 1e-3, rays.size() / packets * 1e-3);
+	}
+}
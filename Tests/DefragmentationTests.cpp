@@ -0,0 +1,151 @@
+#include <Util/DefragmentationPlanner.hpp>
+#include <Tests/Tests.hpp>
+
+#include <random>
+
+using namespace std;
+
+// Memory blocks filled by a random trace, with every allocation still alive at the end
+struct FragmentedBlocks {
+	vector<TlsfAllocator> mBlocks;
+	vector<DefragmentationPlanner::Allocation> mAllocations;
+	// TlsfAllocator handle of each allocation
+	vector<uint32_t> mHandles;
+};
+
+// Fills blockCount blocks first-fit, then frees most allocations, so that blocks are left sparsely used
+static FragmentedBlocks RandomFragmentedBlocks(uint32_t blockCount, uint64_t blockSize, uint64_t seed) {
+	mt19937_64 rng(seed);
+	FragmentedBlocks f;
+	f.mBlocks.resize(blockCount, TlsfAllocator(blockSize));
+	while (true) {
+		DefragmentationPlanner::Allocation a = {};
+		a.mSize = rng() % 4 == 0 ? 1 + rng() % (blockSize / 8) : 16 + rng() % 16384;
+		a.mAlignment = 1ull << (4 + rng() % 9);
+		uint32_t handle = TlsfAllocator::INVALID_BLOCK;
+		uint64_t offset;
+		for (a.mBlock = 0; a.mBlock < blockCount; a.mBlock++)
+			if ((handle = f.mBlocks[a.mBlock].Allocate(a.mSize, a.mAlignment, &offset)) != TlsfAllocator::INVALID_BLOCK) break;
+		if (handle == TlsfAllocator::INVALID_BLOCK) break;
+		f.mAllocations.push_back(a);
+		f.mHandles.push_back(handle);
+	}
+
+	// free most of the allocations, more of them in later blocks
+	for (uint32_t i = 0; i < f.mAllocations.size();) {
+		if (rng() % blockCount <= f.mAllocations[i].mBlock) {
+			f.mBlocks[f.mAllocations[i].mBlock].Free(f.mHandles[i]);
+			f.mAllocations[i] = f.mAllocations.back();
+			f.mHandles[i] = f.mHandles.back();
+			f.mAllocations.pop_back();
+			f.mHandles.pop_back();
+		} else
+			i++;
+	}
+	return f;
+}
+
+static vector<const TlsfAllocator*> BlockPointers(const FragmentedBlocks& f) {
+	vector<const TlsfAllocator*> blocks;
+	for (const TlsfAllocator& b : f.mBlocks) blocks.push_back(&b);
+	return blocks;
+}
+
+// Applies the moves to the real allocators, like Device does, and checks that they land where they were planned.
+// Returns the blocks that were emptied.
+static set<uint32_t> ApplyMoves(FragmentedBlocks& f, const vector<DefragmentationPlanner::Move>& moves) {
+	set<uint32_t> sources, destinations;
+	set<uint32_t> moved;
+	for (const DefragmentationPlanner::Move& m : moves) {
+		CHECK(moved.insert(m.mAllocation).second);
+		const DefragmentationPlanner::Allocation& a = f.mAllocations[m.mAllocation];
+		CHECK(m.mDstBlock != a.mBlock);
+		sources.insert(a.mBlock);
+		destinations.insert(m.mDstBlock);
+
+		uint64_t offset;
+		uint32_t handle = f.mBlocks[m.mDstBlock].Allocate(a.mSize, a.mAlignment, &offset);
+		CHECK(handle != TlsfAllocator::INVALID_BLOCK);
+		CHECK(offset == m.mDstOffset);
+		CHECK(offset % a.mAlignment == 0);
+	}
+	for (uint32_t i : moved)
+		f.mBlocks[f.mAllocations[i].mBlock].Free(f.mHandles[i]);
+
+	// allocations are only moved out of blocks that end up empty, and never into them
+	for (uint32_t src : sources) {
+		CHECK(f.mBlocks[src].Empty());
+		CHECK(destinations.count(src) == 0);
+	}
+	return sources;
+}
+
+TEST(DefragmentationPlan) {
+	for (uint64_t seed = 0; seed < 8; seed++) {
+		FragmentedBlocks f = RandomFragmentedBlocks(16, 16 * 1024 * 1024, seed);
+		uint64_t used = 0;
+		for (const TlsfAllocator& b : f.mBlocks) used += b.Used();
+
+		vector<DefragmentationPlanner::Move> moves = DefragmentationPlanner::Plan(BlockPointers(f), f.mAllocations, ~0ull, .5f);
+		set<uint32_t> emptied = ApplyMoves(f, moves);
+		CHECK(!emptied.empty());
+
+		uint64_t usedAfter = 0;
+		for (const TlsfAllocator& b : f.mBlocks) usedAfter += b.Used();
+		CHECK(usedAfter == used);
+	}
+}
+
+TEST(DefragmentationBudget) {
+	FragmentedBlocks f = RandomFragmentedBlocks(16, 16 * 1024 * 1024, 1);
+	vector<uint64_t> used;
+	for (const TlsfAllocator& b : f.mBlocks) used.push_back(b.Used());
+
+	const uint64_t maxBytes = 4 * 1024 * 1024;
+	vector<DefragmentationPlanner::Move> moves = DefragmentationPlanner::Plan(BlockPointers(f), f.mAllocations, maxBytes, .5f);
+	CHECK(!moves.empty());
+	// the budget counts everything used in the blocks that are emptied
+	uint64_t bytes = 0;
+	for (uint32_t src : ApplyMoves(f, moves)) bytes += used[src];
+	CHECK(bytes <= maxBytes);
+}
+
+TEST(DefragmentationPinned) {
+	FragmentedBlocks f = RandomFragmentedBlocks(16, 16 * 1024 * 1024, 2);
+	// blocks with allocations that can't be moved are never emptied
+	set<uint32_t> pinned;
+	vector<DefragmentationPlanner::Allocation> movable;
+	vector<uint32_t> handles;
+	for (uint32_t i = 0; i < f.mAllocations.size(); i++) {
+		if (i % 10 == 0) {
+			pinned.insert(f.mAllocations[i].mBlock);
+			continue;
+		}
+		movable.push_back(f.mAllocations[i]);
+		handles.push_back(f.mHandles[i]);
+	}
+	f.mAllocations = movable;
+	f.mHandles = handles;
+
+	vector<DefragmentationPlanner::Move> moves = DefragmentationPlanner::Plan(BlockPointers(f), f.mAllocations, ~0ull, 1.f);
+	CHECK(!moves.empty());
+	for (uint32_t src : ApplyMoves(f, moves))
+		CHECK(pinned.count(src) == 0);
+}
+
+BENCHMARK(DefragmentationBenchmark) {
+	for (uint32_t blockCount : { 16u, 64u, 256u }) {
+		FragmentedBlocks f = RandomFragmentedBlocks(blockCount, 16 * 1024 * 1024, 7);
+		uint32_t blocksUsed = 0;
+		for (const TlsfAllocator& b : f.mBlocks) if (!b.Empty()) blocksUsed++;
+
+		vector<DefragmentationPlanner::Move> moves;
+		double plan = TimeMilliseconds([&]() { moves = DefragmentationPlanner::Plan(BlockPointers(f), f.mAllocations, ~0ull, .5f); });
+		uint64_t bytes = 0;
+		for (const DefragmentationPlanner::Move& m : moves) bytes += f.mAllocations[m.mAllocation].mSize;
+		uint32_t emptied = (uint32_t)ApplyMoves(f, moves).size();
+
+		printf("%3u blocks, %6zu allocations: plan %.2f ms | %zu moves, %.1f MiB moved | %u of %u used blocks emptied\n",
+			blockCount, f.mAllocations.size(), plan, moves.size(), bytes / (1024.0 * 1024.0), emptied, blocksUsed);
+	}
+}
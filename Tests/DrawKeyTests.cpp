@@ -0,0 +1,152 @@
+#include <Scene/Renderer.hpp>
+#include <Util/RadixSort.hpp>
+#include <Tests/Tests.hpp>
+
+#include <random>
+
+using namespace std;
+
+// The state of a draw, as the scene sees it
+struct DrawState {
+	uint32_t mRenderQueue;
+	uint32_t mShader;
+	uint32_t mMaterial;
+	uint32_t mMesh;
+	uint32_t mDepth;
+};
+
+// Random draws of meshes with materials, which each use one of a few shaders.
+// Material and mesh addresses are shuffled relative to their ids, like heap pointers.
+static vector<DrawState> RandomDraws(uint32_t count, mt19937& rng, vector<uint32_t>& materialAddress, vector<uint32_t>& meshAddress) {
+	const uint32_t shaderCount = 16, materialCount = 256, meshCount = 1024;
+	vector<uint32_t> materialShader(materialCount);
+	for (uint32_t& s : materialShader) s = rng() % shaderCount;
+	materialAddress.resize(materialCount);
+	meshAddress.resize(meshCount);
+	iota(materialAddress.begin(), materialAddress.end(), 0);
+	iota(meshAddress.begin(), meshAddress.end(), 0);
+	shuffle(materialAddress.begin(), materialAddress.end(), rng);
+	shuffle(meshAddress.begin(), meshAddress.end(), rng);
+
+	vector<DrawState> draws(count);
+	for (DrawState& d : draws) {
+		d.mRenderQueue = rng() % 8 == 0 ? 3000 : 1000;
+		d.mMaterial = rng() % materialCount;
+		d.mShader = materialShader[d.mMaterial];
+		d.mMesh = rng() % meshCount;
+		d.mDepth = rng() % (1 << DRAW_KEY_DEPTH_BITS);
+	}
+	return draws;
+}
+
+static uint64_t DrawKey(const DrawState& d) {
+	return PackDrawKey(d.mRenderQueue, d.mShader, d.mMaterial, d.mMesh) | d.mDepth;
+}
+
+// Number of times the pipeline and the material's descriptor set change between consecutive draws
+static void CountBinds(const vector<const DrawState*>& draws, uint32_t& pipelineBinds, uint32_t& descriptorSetBinds) {
+	pipelineBinds = 0;
+	descriptorSetBinds = 0;
+	for (uint32_t i = 0; i < draws.size(); i++) {
+		if (i == 0 || draws[i]->mShader != draws[i - 1]->mShader) pipelineBinds++;
+		if (i == 0 || draws[i]->mMaterial != draws[i - 1]->mMaterial) descriptorSetBinds++;
+	}
+}
+
+TEST(RadixSortMatchesStableSort) {
+	mt19937_64 rng(1);
+	for (uint32_t count : { 0u, 1u, 2u, 100u, 10000u }) {
+		// keys that share their high and low digits, like draw keys
+		vector<pair<uint64_t, uint32_t>> values(count), scratch;
+		for (uint32_t i = 0; i < count; i++)
+			values[i] = make_pair((0x3E8ull << 51) | ((rng() % 4096) << 12) | (rng() % 2 ? 0xFF : 0), i);
+		vector<pair<uint64_t, uint32_t>> expected = values;
+		stable_sort(expected.begin(), expected.end(), [](const pair<uint64_t, uint32_t>& a, const pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+		RadixSort(values, scratch);
+		CHECK(values == expected);
+	}
+
+	vector<pair<uint64_t, uint32_t>> values(10000), scratch;
+	for (uint32_t i = 0; i < values.size(); i++) values[i] = make_pair(rng(), i);
+	vector<pair<uint64_t, uint32_t>> expected = values;
+	sort(expected.begin(), expected.end());
+	RadixSort(values, scratch);
+	CHECK(values == expected);
+}
+
+TEST(DrawKeyOrder) {
+	// render queue comes first, then shader, material, mesh and depth
+	CHECK(PackDrawKey(1000, 9, 9, 9) < PackDrawKey(1001, 0, 0, 0));
+	CHECK(PackDrawKey(1000, 1, 9, 9) < PackDrawKey(1000, 2, 0, 0));
+	CHECK(PackDrawKey(1000, 1, 1, 9) < PackDrawKey(1000, 1, 2, 0));
+	CHECK(PackDrawKey(1000, 1, 1, 1) < PackDrawKey(1000, 1, 1, 2));
+	CHECK((PackDrawKey(1000, 1, 1, 1) | ((1 << DRAW_KEY_DEPTH_BITS) - 1)) < PackDrawKey(1000, 1, 1, 2));
+	// ids that don't fit are truncated instead of spilling into the next field
+	CHECK(PackDrawKey(1000, 1u << DRAW_KEY_SHADER_BITS, 0, 0) == PackDrawKey(1000, 0, 0, 0));
+	CHECK(PackDrawKey(1000, 0, 0, 1u << DRAW_KEY_MESH_BITS) == PackDrawKey(1000, 0, 0, 0));
+	// and so is the render queue, which is clamped so large queues still sort last
+	CHECK(PackDrawKey(0xFFFFFFFF, 0, 0, 0) > PackDrawKey(5000, 9, 9, 9));
+
+	// sorted draws have each shader and material together within a render queue
+	mt19937 rng(4);
+	vector<uint32_t> materialAddress, meshAddress;
+	vector<DrawState> draws = RandomDraws(20000, rng, materialAddress, meshAddress);
+	vector<pair<uint64_t, const DrawState*>> keys, scratch;
+	for (const DrawState& d : draws) keys.push_back(make_pair(DrawKey(d), &d));
+	RadixSort(keys, scratch);
+	set<pair<uint32_t, uint32_t>> shaders, materials;
+	for (uint32_t i = 0; i < keys.size(); i++) {
+		const DrawState& d = *keys[i].second;
+		if (i > 0) {
+			const DrawState& p = *keys[i - 1].second;
+			CHECK(p.mRenderQueue <= d.mRenderQueue);
+			if (p.mShader != d.mShader || p.mRenderQueue != d.mRenderQueue) CHECK(shaders.insert(make_pair(d.mRenderQueue, d.mShader)).second);
+			if (p.mMaterial != d.mMaterial || p.mRenderQueue != d.mRenderQueue) CHECK(materials.insert(make_pair(d.mRenderQueue, d.mMaterial)).second);
+			// front to back within the same state
+			if (p.mRenderQueue == d.mRenderQueue && p.mShader == d.mShader && p.mMaterial == d.mMaterial && p.mMesh == d.mMesh) CHECK(p.mDepth <= d.mDepth);
+		} else {
+			shaders.insert(make_pair(d.mRenderQueue, d.mShader));
+			materials.insert(make_pair(d.mRenderQueue, d.mMaterial));
+		}
+	}
+}
+
+BENCHMARK(DrawKeyBenchmark) {
+	for (uint32_t count : { 1000u, 10000u, 100000u }) {
+		mt19937 rng(2);
+		vector<uint32_t> materialAddress, meshAddress;
+		vector<DrawState> draws = RandomDraws(count, rng, materialAddress, meshAddress);
+		const uint32_t repeatCount = 20;
+
+		// before: std::sort comparing render queue, then material and mesh addresses
+		vector<const DrawState*> compared(count);
+		double compareTime = 0;
+		for (uint32_t r = 0; r < repeatCount; r++) {
+			for (uint32_t i = 0; i < count; i++) compared[i] = &draws[i];
+			compareTime += TimeMilliseconds([&]() {
+				sort(compared.begin(), compared.end(), [&](const DrawState* a, const DrawState* b) {
+					if (a->mRenderQueue != b->mRenderQueue) return a->mRenderQueue < b->mRenderQueue;
+					if (a->mMaterial != b->mMaterial) return materialAddress[a->mMaterial] < materialAddress[b->mMaterial];
+					return meshAddress[a->mMesh] < meshAddress[b->mMesh];
+				});
+			});
+		}
+
+		// after: pack a key per draw, and radix sort the keys
+		vector<pair<uint64_t, const DrawState*>> keys(count), scratch;
+		double radixTime = 0;
+		for (uint32_t r = 0; r < repeatCount; r++)
+			radixTime += TimeMilliseconds([&]() {
+				for (uint32_t i = 0; i < count; i++) keys[i] = make_pair(DrawKey(draws[i]), &draws[i]);
+				RadixSort(keys, scratch);
+			});
+		vector<const DrawState*> sorted(count);
+		for (uint32_t i = 0; i < count; i++) sorted[i] = keys[i].second;
+
+		uint32_t comparePipelines, compareSets, radixPipelines, radixSets;
+		CountBinds(compared, comparePipelines, compareSets);
+		CountBinds(sorted, radixPipelines, radixSets);
+		printf("%6u draws: compare sort %.3f ms, %u pipeline / %u descriptor set binds | radix sort %.3f ms, %u pipeline / %u descriptor set binds\n",
+			count, compareTime / repeatCount, comparePipelines, compareSets, radixTime / repeatCount, radixPipelines, radixSets);
+	}
+}
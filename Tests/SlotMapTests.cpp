@@ -0,0 +1,104 @@
+#include <Util/SlotMap.hpp>
+#include <Tests/Tests.hpp>
+
+#include <map>
+#include <random>
+
+using namespace std;
+
+// Checks that every live handle finds its value, and that every value's handle finds it
+static void CheckSlotMap(SlotMap<uint32_t>& values, const map<SlotHandle, uint32_t>& expected) {
+	CHECK(values.Size() == expected.size());
+	for (auto& kp : expected) {
+		CHECK(values.Contains(kp.first));
+		uint32_t* value = values.Get(kp.first);
+		CHECK(value && *value == kp.second);
+	}
+	for (uint32_t i = 0; i < values.Size(); i++)
+		CHECK(values.Get(values.Handle(i)) == &values[i]);
+}
+
+TEST(SlotMapRandom) {
+	mt19937 rng(11);
+	SlotMap<uint32_t> values;
+	map<SlotHandle, uint32_t> expected;
+	vector<SlotHandle> erased;
+	for (uint32_t i = 0; i < 20000; i++) {
+		if (expected.empty() || rng() % 3) {
+			SlotHandle h = values.Insert(i);
+			CHECK(expected.count(h) == 0);
+			expected[h] = i;
+		} else {
+			auto it = expected.begin();
+			advance(it, rng() % expected.size());
+			CHECK(values.Erase(it->first));
+			erased.push_back(it->first);
+			expected.erase(it);
+		}
+		if (i % 1000 == 0) CheckSlotMap(values, expected);
+	}
+	CheckSlotMap(values, expected);
+
+	// handles of erased values stay stale, even after their slots are reused
+	for (SlotHandle h : erased) {
+		CHECK(!values.Contains(h));
+		CHECK(values.Get(h) == nullptr);
+		CHECK(!values.Erase(h));
+	}
+	CHECK(!values.Contains(INVALID_SLOT_HANDLE));
+
+	values.Sort([](uint32_t a, uint32_t b) { return a < b; });
+	CHECK(is_sorted(values.begin(), values.end()));
+	CheckSlotMap(values, expected);
+
+	values.Clear();
+	CHECK(values.Empty());
+	for (auto& kp : expected) CHECK(!values.Contains(kp.first));
+}
+
+TEST(SlotMapDestroysValues) {
+	SlotMap<shared_ptr<uint32_t>> values;
+	weak_ptr<uint32_t> a, b;
+	SlotHandle ha = values.Insert(make_shared<uint32_t>(1));
+	SlotHandle hb = values.Insert(make_shared<uint32_t>(2));
+	a = *values.Get(ha);
+	b = *values.Get(hb);
+	CHECK(values.Erase(ha));
+	CHECK(a.expired());
+	CHECK(!b.expired());
+	CHECK(**values.Get(hb) == 2);
+	values.Clear();
+	CHECK(b.expired());
+}
+
+BENCHMARK(SlotMapBenchmark) {
+	for (uint32_t count : { 1000u, 10000u, 100000u }) {
+		mt19937 rng(5);
+		vector<shared_ptr<uint32_t>> objects(count);
+		for (uint32_t i = 0; i < count; i++) objects[i] = make_shared<uint32_t>(i);
+		vector<uint32_t> order(count);
+		iota(order.begin(), order.end(), 0);
+		shuffle(order.begin(), order.end(), rng);
+
+		// spawn everything, then despawn in random order
+		SlotMap<shared_ptr<uint32_t>> values;
+		vector<SlotHandle> handles(count);
+		double insert = TimeMilliseconds([&]() { for (uint32_t i = 0; i < count; i++) handles[i] = values.Insert(objects[i]); });
+		double erase = TimeMilliseconds([&]() { for (uint32_t i : order) values.Erase(handles[i]); });
+
+		// what Scene did before: push into a vector, and find and erase the object on removal
+		vector<shared_ptr<uint32_t>> list;
+		double listInsert = TimeMilliseconds([&]() { for (uint32_t i = 0; i < count; i++) list.push_back(objects[i]); });
+		double listErase = TimeMilliseconds([&]() {
+			for (uint32_t i : order)
+				for (auto it = list.begin(); it != list.end(); it++)
+					if (*it == objects[i]) {
+						list.erase(it);
+						break;
+					}
+		});
+
+		printf("%6u objects: slot map insert %.1f ns, erase %.1f ns | vector insert %.1f ns, erase %.1f ns\n", count,
+			insert * 1e6 / count, erase * 1e6 / count, listInsert * 1e6 / count, listErase * 1e6 / count);
+	}
+}
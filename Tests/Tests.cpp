@@ -0,0 +1,38 @@
+#include <Tests/Tests.hpp>
+
+using namespace std;
+
+// Usage: Tests [--benchmark] [filter]
+// Runs every test (or benchmark) whose name contains the filter, and returns nonzero if any check failed
+int main(int argc, char** argv) {
+	bool benchmark = false;
+	const char* filter = nullptr;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--benchmark") == 0)
+			benchmark = true;
+		else
+			filter = argv[i];
+	}
+
+	uint32_t count = 0;
+	uint32_t failed = 0;
+	for (const TestCase& test : TestCases()) {
+		if (test.mBenchmark != benchmark) continue;
+		if (filter && !strstr(test.mName, filter)) continue;
+
+		printf("%s\n", test.mName);
+		uint32_t failures = TestFailures();
+		test.mFunction();
+		count++;
+		if (TestFailures() != failures) {
+			fprintf_color(COLOR_RED, stderr, "%s failed\n", test.mName);
+			failed++;
+		}
+	}
+
+	if (failed)
+		fprintf_color(COLOR_RED, stderr, "%u of %u failed\n", failed, count);
+	else
+		printf_color(COLOR_GREEN, "%u passed\n", count);
+	return TestFailures() ? 1 : 0;
+}
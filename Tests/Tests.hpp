@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Util/Util.hpp>
+
+// Tests for the parts of the engine that run without a device (bvhs, allocators, containers)
+// TEST cases run by default and fail through CHECK. BENCHMARK cases only run with --benchmark, and print their timings.
+
+struct TestCase {
+	const char* mName;
+	void (*mFunction)();
+	bool mBenchmark;
+};
+
+inline std::vector<TestCase>& TestCases() {
+	static std::vector<TestCase> cases;
+	return cases;
+}
+inline uint32_t& TestFailures() {
+	static uint32_t failures = 0;
+	return failures;
+}
+
+struct TestRegistrar {
+	inline TestRegistrar(const char* name, void (*function)(), bool benchmark) { TestCases().push_back({ name, function, benchmark }); }
+};
+
+#define TEST(name) static void name(); static TestRegistrar name##Registrar(#name, name, false); static void name()
+#define BENCHMARK(name) static void name(); static TestRegistrar name##Registrar(#name, name, true); static void name()
+
+#define CHECK(x) do { if (!(x)) { fprintf_color(COLOR_RED, stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); TestFailures()++; } } while (0)
+
+// Time it takes to run f, in milliseconds
+template<typename F>
+inline double TimeMilliseconds(F f) {
+	auto t0 = std::chrono::high_resolution_clock::now();
+	f();
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+}
@@ -0,0 +1,190 @@
+#include <Scene/Object.hpp>
+#include <Scene/TransformHierarchy.hpp>
+#include <Tests/Tests.hpp>
+
+#include <deque>
+#include <random>
+
+using namespace std;
+
+// Parent of each object, which comes before it, or INVALID_INDEX for roots
+static vector<uint32_t> WideHierarchy(uint32_t rootCount, uint32_t childCount) {
+	vector<uint32_t> parents;
+	for (uint32_t r = 0; r < rootCount; r++) {
+		uint32_t root = (uint32_t)parents.size();
+		parents.push_back(TransformHierarchy::INVALID_INDEX);
+		for (uint32_t c = 0; c < childCount; c++) parents.push_back(root);
+	}
+	return parents;
+}
+static vector<uint32_t> DeepHierarchy(uint32_t chainCount, uint32_t depth) {
+	vector<uint32_t> parents;
+	for (uint32_t c = 0; c < chainCount; c++) {
+		parents.push_back(TransformHierarchy::INVALID_INDEX);
+		for (uint32_t d = 1; d < depth; d++) parents.push_back((uint32_t)parents.size() - 1);
+	}
+	return parents;
+}
+static vector<uint32_t> RandomHierarchy(uint32_t count, mt19937& rng) {
+	vector<uint32_t> parents(count);
+	for (uint32_t i = 0; i < count; i++)
+		parents[i] = i == 0 || rng() % 16 == 0 ? TransformHierarchy::INVALID_INDEX : (uint32_t)(rng() % i);
+	return parents;
+}
+
+// Objects live in a deque, which never moves them, and are destroyed with it
+static vector<Object*> CreateObjects(const vector<uint32_t>& parents, deque<Object>& storage) {
+	vector<Object*> objects(parents.size());
+	for (uint32_t i = 0; i < parents.size(); i++) {
+		storage.emplace_back("Object");
+		objects[i] = &storage.back();
+		if (parents[i] != TransformHierarchy::INVALID_INDEX) objects[parents[i]]->AddChild(objects[i]);
+	}
+	return objects;
+}
+
+static void RandomTransform(Object* object, Object* copy, mt19937& rng) {
+	uniform_real_distribution<float> u(-1, 1);
+	float3 position(u(rng), u(rng), u(rng));
+	quaternion rotation(u(rng) * 3.14159f, normalize(float3(u(rng), u(rng), u(rng)) + float3(0, 2, 0)));
+	float3 scale = float3(u(rng), u(rng), u(rng)) * .25f + 1;
+	object->LocalPosition(position);
+	object->LocalRotation(rotation);
+	object->LocalScale(scale);
+	copy->LocalPosition(position);
+	copy->LocalRotation(rotation);
+	copy->LocalScale(scale);
+}
+
+static bool Equal(const float4x4& a, const float4x4& b) {
+	for (uint32_t i = 0; i < 4; i++)
+		for (uint32_t j = 0; j < 4; j++)
+			if (fabsf(a[i][j] - b[i][j]) > 1e-3f * (1 + fabsf(b[i][j]))) return false;
+	return true;
+}
+
+// Objects in a hierarchy must have the same transforms as the objects that compute their own
+static void CheckTransforms(const vector<Object*>& objects, const vector<Object*>& copies) {
+	for (uint32_t i = 0; i < objects.size(); i++) {
+		CHECK(Equal(objects[i]->ObjectToWorld(), copies[i]->ObjectToWorld()));
+		CHECK(Equal(objects[i]->WorldToObject(), copies[i]->WorldToObject()));
+		CHECK(length(objects[i]->WorldPosition() - copies[i]->WorldPosition()) < 1e-3f * (1 + length(copies[i]->WorldPosition())));
+	}
+}
+
+TEST(TransformHierarchyMatchesObjects) {
+	mt19937 rng(9);
+	vector<uint32_t> parents = RandomHierarchy(5000, rng);
+	deque<Object> storage;
+	vector<Object*> objects = CreateObjects(parents, storage);
+	vector<Object*> copies = CreateObjects(parents, storage);
+	for (uint32_t i = 0; i < objects.size(); i++) RandomTransform(objects[i], copies[i], rng);
+
+	TransformHierarchy hierarchy(nullptr);
+	for (uint32_t i = 0; i < objects.size(); i++)
+		if (parents[i] == TransformHierarchy::INVALID_INDEX) hierarchy.Add(objects[i]);
+	CHECK(hierarchy.Count() == objects.size());
+	hierarchy.Update(1);
+	CheckTransforms(objects, copies);
+
+	// move some objects, and read transforms without updating the hierarchy
+	for (uint32_t i = 0; i < objects.size(); i += 7) RandomTransform(objects[i], copies[i], rng);
+	CheckTransforms(objects, copies);
+
+	// reparent some objects, then update on several threads
+	for (uint32_t i = 1; i < objects.size(); i += 13) {
+		uint32_t p = (uint32_t)(rng() % i);
+		objects[p]->AddChild(objects[i]);
+		copies[p]->AddChild(copies[i]);
+	}
+	for (uint32_t i = 0; i < objects.size(); i += 5) RandomTransform(objects[i], copies[i], rng);
+	hierarchy.Update(4);
+	CHECK(hierarchy.Count() == objects.size());
+	CheckTransforms(objects, copies);
+
+	// objects that leave the hierarchy keep their transforms, and their children stay with an external parent
+	Object* removed = objects[objects.size() / 2];
+	float4x4 objectToWorld = removed->ObjectToWorld();
+	hierarchy.Remove(removed);
+	CHECK(hierarchy.Count() == objects.size() - 1);
+	CHECK(Equal(removed->ObjectToWorld(), objectToWorld));
+	RandomTransform(removed, copies[objects.size() / 2], rng);
+	hierarchy.Update(1);
+	CheckTransforms(objects, copies);
+}
+
+// Enabling, disabling and reparenting objects must only change the cached state of their subtrees, and always match walking up the hierarchy
+TEST(EnabledHierarchyMatchesAncestors) {
+	mt19937 rng(4);
+	vector<uint32_t> parents = RandomHierarchy(2000, rng);
+	deque<Object> storage;
+	vector<Object*> objects = CreateObjects(parents, storage);
+	auto Expected = [](Object* o) {
+		for (; o; o = o->Parent())
+			if (!o->Enabled()) return false;
+		return true;
+	};
+	for (uint32_t i = 0; i < 2000; i++) {
+		uint32_t index = (uint32_t)(rng() % objects.size());
+		Object* o = objects[index];
+		if (rng() % 4) o->Enabled(!o->Enabled());
+		// parents come before their children, so this can't make a loop
+		else if (index) objects[rng() % index]->AddChild(o);
+		for (uint32_t j = 0; j < 16; j++) {
+			Object* q = objects[rng() % objects.size()];
+			CHECK(q->EnabledHierarchy() == Expected(q));
+		}
+	}
+	for (Object* o : objects) CHECK(o->EnabledHierarchy() == Expected(o));
+}
+
+BENCHMARK(TransformHierarchyBenchmark) {
+	mt19937 rng(3);
+	struct Shape {
+		const char* mName;
+		vector<uint32_t> mParents;
+	};
+	Shape shapes[] = {
+		{ "wide (1000 x 100)", WideHierarchy(1000, 99) },
+		{ "deep (100 x 1000)", DeepHierarchy(100, 1000) },
+		{ "random (100k)", RandomHierarchy(100000, rng) },
+	};
+	for (Shape& shape : shapes) {
+		deque<Object> storage;
+		vector<Object*> objects = CreateObjects(shape.mParents, storage);
+		vector<Object*> copies = CreateObjects(shape.mParents, storage);
+		for (uint32_t i = 0; i < objects.size(); i++) RandomTransform(objects[i], copies[i], rng);
+		TransformHierarchy hierarchy(nullptr);
+		for (uint32_t i = 0; i < objects.size(); i++)
+			if (shape.mParents[i] == TransformHierarchy::INVALID_INDEX) hierarchy.Add(objects[i]);
+		hierarchy.Update(1);
+
+		vector<Object*> roots, rootCopies;
+		for (uint32_t i = 0; i < objects.size(); i++)
+			if (shape.mParents[i] == TransformHierarchy::INVALID_INDEX) {
+				roots.push_back(objects[i]);
+				rootCopies.push_back(copies[i]);
+			}
+
+		// every frame, move each root, which dirties every transform, and then compute them all
+		const uint32_t frameCount = 10;
+		double lazy = 0, single = 0, threaded = 0;
+		for (uint32_t f = 0; f < frameCount; f++) {
+			lazy += TimeMilliseconds([&]() {
+				for (Object* r : rootCopies) r->LocalPosition(float3((float)f, 0, 0));
+				for (Object* o : copies) o->ObjectToWorld();
+			});
+			single += TimeMilliseconds([&]() {
+				for (Object* r : roots) r->LocalPosition(float3((float)f, 0, 0));
+				hierarchy.Update(1);
+			});
+			threaded += TimeMilliseconds([&]() {
+				for (Object* r : roots) r->LocalPosition(float3((float)f, 1, 0));
+				hierarchy.Update();
+			});
+		}
+
+		printf("%-18s %6zu objects, %3u levels: per object %.2f ms | hierarchy %.2f ms, %u threads %.2f ms\n", shape.mName, objects.size(), hierarchy.LevelCount(),
+			lazy / frameCount, single / frameCount, max(thread::hardware_concurrency(), 1u), threaded / frameCount);
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <Util/TlsfAllocator.hpp>
+
+// Plans which sub-allocations to move so that sparsely used memory blocks become empty and can be freed
+// Like TlsfAllocator, this only deals with offsets and sizes, so it can be run against recorded allocation traces without a device.
+// Blocks are emptied least used first, and their allocations are placed in the most used blocks that fit them, which are simulated with copies of their allocators.
+// A block is only emptied if every allocation in it can be moved, and all of them fit elsewhere. Moves are returned in the order they have to be allocated in,
+// so applying them to the real allocators in that order gives the same offsets.
+class DefragmentationPlanner {
+public:
+	// A sub-allocation that can be moved
+	struct Allocation {
+		// index of the block it is in
+		uint32_t mBlock;
+		uint64_t mSize;
+		uint64_t mAlignment;
+	};
+	struct Move {
+		// index of the allocation in the list passed to Plan()
+		uint32_t mAllocation;
+		uint32_t mDstBlock;
+		uint64_t mDstOffset;
+	};
+
+	// 'blocks' are the allocators of each block, and 'allocations' are the allocations in them that can be moved.
+	// Only blocks less than 'maxOccupancy' full are emptied, and at most 'maxBytes' are moved
+	inline static std::vector<Move> Plan(const std::vector<const TlsfAllocator*>& blocks, const std::vector<Allocation>& allocations, uint64_t maxBytes, float maxOccupancy) {
+		std::vector<Move> moves;
+		if (blocks.size() < 2) return moves;
+
+		std::vector<std::vector<uint32_t>> movable(blocks.size());
+		for (uint32_t i = 0; i < allocations.size(); i++)
+			movable[allocations[i].mBlock].push_back(i);
+
+		std::vector<uint32_t> sources;
+		std::vector<uint32_t> destinations;
+		for (uint32_t i = 0; i < blocks.size(); i++) {
+			if (blocks[i]->Empty()) continue;
+			destinations.push_back(i);
+			if (movable[i].size() == blocks[i]->AllocationCount() && blocks[i]->Used() < blocks[i]->Size() * maxOccupancy)
+				sources.push_back(i);
+		}
+		std::sort(sources.begin(), sources.end(), [&](uint32_t a, uint32_t b) { return blocks[a]->Used() < blocks[b]->Used(); });
+		std::sort(destinations.begin(), destinations.end(), [&](uint32_t a, uint32_t b) { return blocks[a]->Used() > blocks[b]->Used(); });
+
+		// simulated blocks, copied from 'blocks' the first time something is placed in them
+		std::unordered_map<uint32_t, TlsfAllocator> simulated;
+		std::vector<bool> emptied(blocks.size(), false);
+		// blocks that allocations were moved into, which can't be emptied anymore
+		std::vector<bool> filled(blocks.size(), false);
+		uint64_t bytes = 0;
+
+		for (uint32_t src : sources) {
+			if (filled[src]) continue;
+			if (bytes + blocks[src]->Used() > maxBytes) break;
+
+			// largest first, so the small ones fill in the gaps
+			std::vector<uint32_t> order = movable[src];
+			std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return allocations[a].mSize > allocations[b].mSize; });
+
+			// the simulated blocks before this source was tried, to undo its placements if they don't all fit
+			std::unordered_map<uint32_t, TlsfAllocator> undo;
+			size_t moveCount = moves.size();
+			bool fits = true;
+			for (uint32_t a : order) {
+				bool placed = false;
+				for (uint32_t dst : destinations) {
+					if (dst == src || emptied[dst]) continue;
+					auto it = simulated.find(dst);
+					if (it == simulated.end()) it = simulated.emplace(dst, *blocks[dst]).first;
+					if (it->second.Available() < allocations[a].mSize) continue;
+					if (!undo.count(dst)) undo.emplace(dst, it->second);
+
+					uint64_t offset;
+					if (it->second.Allocate(allocations[a].mSize, allocations[a].mAlignment, &offset) == TlsfAllocator::INVALID_BLOCK) continue;
+					Move m = {};
+					m.mAllocation = a;
+					m.mDstBlock = dst;
+					m.mDstOffset = offset;
+					moves.push_back(m);
+					placed = true;
+					break;
+				}
+				if (!placed) {
+					fits = false;
+					break;
+				}
+			}
+
+			if (fits) {
+				emptied[src] = true;
+				bytes += blocks[src]->Used();
+				for (size_t i = moveCount; i < moves.size(); i++)
+					filled[moves[i].mDstBlock] = true;
+			} else {
+				moves.resize(moveCount);
+				for (auto& kp : undo)
+					simulated[kp.first] = kp.second;
+			}
+		}
+
+		return moves;
+	}
+};
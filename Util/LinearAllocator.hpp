@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+// Hands out aligned ranges of a fixed-size buffer by bumping an offset, and frees them all at once with Reset()
+// Used for per-frame data: each frame context owns one, and resets it once the GPU is done with that frame.
+// Allocations past the end fail, but are still counted, so Required() is the capacity that would have fit the whole frame.
+// Has no dependencies on Vulkan, so it can be tested and benchmarked without a device
+class LinearAllocator {
+public:
+	inline LinearAllocator(uint64_t capacity = 0) : mCapacity(capacity), mHead(0), mHighWaterMark(0), mOverflowCount(0) {}
+
+	// Returns false if the range doesn't fit in the buffer
+	inline bool Allocate(uint64_t size, uint64_t alignment, uint64_t* offset) {
+		uint64_t start = alignment > 1 ? (mHead + alignment - 1) & ~(alignment - 1) : mHead;
+		// keep bumping the head past the end, so that Required() includes every allocation
+		mHead = start + size;
+		if (mHead > mCapacity) {
+			mOverflowCount++;
+			return false;
+		}
+		*offset = start;
+		return true;
+	}
+
+	// Frees every allocation, and optionally changes the capacity
+	inline void Reset() { Reset(mCapacity); }
+	inline void Reset(uint64_t capacity) {
+		if (mHead > mHighWaterMark) mHighWaterMark = mHead;
+		mCapacity = capacity;
+		mHead = 0;
+		mOverflowCount = 0;
+	}
+
+	inline uint64_t Capacity() const { return mCapacity; }
+	// Bytes used since the last reset, including alignment padding
+	inline uint64_t Used() const { return mHead < mCapacity ? mHead : mCapacity; }
+	// Capacity needed to fit everything allocated since the last reset
+	inline uint64_t Required() const { return mHead; }
+	// Largest Required() seen at any reset
+	inline uint64_t HighWaterMark() const { return mHighWaterMark; }
+	// Number of allocations that didn't fit since the last reset
+	inline uint32_t OverflowCount() const { return mOverflowCount; }
+
+private:
+	uint64_t mCapacity;
+	uint64_t mHead;
+	uint64_t mHighWaterMark;
+	uint32_t mOverflowCount;
+};
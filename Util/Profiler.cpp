@@ -6,10 +6,13 @@ using namespace std;
 
 ProfilerSample  Profiler::mFrames[PROFILER_FRAME_COUNT];
 ProfilerSample* Profiler::mCurrentSample = nullptr;
+thread::id Profiler::mThread;
 uint64_t Profiler::mCurrentFrame = 0;
 const std::chrono::high_resolution_clock Profiler::mTimer;
 
 void Profiler::BeginSample(const string& label) {
+	// samples form one tree per frame, so only the thread that started the frame records them
+	if (this_thread::get_id() != mThread) return;
 	mCurrentSample->mChildren.push_back({});
 	ProfilerSample* s = &mCurrentSample->mChildren.back();
 	memset(s, 0, sizeof(ProfilerSample));
@@ -22,6 +25,7 @@ void Profiler::BeginSample(const string& label) {
 	mCurrentSample =  s;
 }
 void Profiler::EndSample() {
+	if (this_thread::get_id() != mThread) return;
 	if (!mCurrentSample->mParent) {
 		fprintf_color(COLOR_RED, stderr, "%s\n", "Error: Attempt to end nonexistant Profiler sample!");
 		throw;
@@ -38,6 +42,7 @@ void Profiler::FrameStart() {
 	mFrames[i].mDuration = chrono::nanoseconds::zero();
 	mFrames[i].mChildren.clear();
 	mCurrentSample = &mFrames[i];
+	mThread = this_thread::get_id();
 }
 void Profiler::FrameEnd() {
 	int i = mCurrentFrame % PROFILER_FRAME_COUNT;
@@ -42,4 +42,6 @@ private:
 	ENGINE_EXPORT static ProfilerSample mFrames[PROFILER_FRAME_COUNT];
 	ENGINE_EXPORT static ProfilerSample* mCurrentSample;
 	ENGINE_EXPORT static uint64_t mCurrentFrame;
+	// thread that called FrameStart. Samples begun on other threads are ignored.
+	ENGINE_EXPORT static std::thread::id mThread;
 };
\ No newline at end of file
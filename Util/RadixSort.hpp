@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Number of key bits sorted in each pass
+#define RADIX_SORT_BITS 8
+
+// Sorts values by their 64-bit keys with an LSD radix sort, skipping the digits that every key shares.
+// The sort is stable. 'scratch' is used as the second buffer, so keeping it around avoids allocating every sort.
+// Has no dependencies on the engine, so it can be tested and benchmarked on its own
+template<typename T>
+inline void RadixSort(std::vector<std::pair<uint64_t, T>>& values, std::vector<std::pair<uint64_t, T>>& scratch) {
+	uint32_t count = (uint32_t)values.size();
+	if (count < 2) return;
+	scratch.resize(count);
+
+	const uint32_t bucketCount = 1 << RADIX_SORT_BITS;
+	uint32_t offsets[bucketCount];
+	for (uint32_t shift = 0; shift < 64; shift += RADIX_SORT_BITS) {
+		memset(offsets, 0, sizeof(uint32_t) * bucketCount);
+		for (uint32_t i = 0; i < count; i++)
+			offsets[(values[i].first >> shift) & (bucketCount - 1)]++;
+		if (offsets[(values[0].first >> shift) & (bucketCount - 1)] == count) continue;
+		uint32_t sum = 0;
+		for (uint32_t b = 0; b < bucketCount; b++) {
+			uint32_t c = offsets[b];
+			offsets[b] = sum;
+			sum += c;
+		}
+		for (uint32_t i = 0; i < count; i++)
+			scratch[offsets[(values[i].first >> shift) & (bucketCount - 1)]++] = values[i];
+		values.swap(scratch);
+	}
+}
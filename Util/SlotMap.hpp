@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+// Refers to a value in a SlotMap: the index of its slot in the low 32 bits, and the slot's generation in the high 32 bits.
+// Handles stay valid until their value is erased, after which the slot's generation changes, so stale handles are detected instead of aliasing a new value.
+typedef uint64_t SlotHandle;
+static const SlotHandle INVALID_SLOT_HANDLE = 0xFFFFFFFFFFFFFFFFull;
+
+// Stores values densely in a vector, so they can be iterated like one, and hands out stable handles to them through an indirection table of slots.
+// Insert and Erase are O(1): erasing moves the last value into the hole, so the order of the values is not preserved.
+// Has no dependencies on the engine, so it can be tested and benchmarked on its own
+template<typename T>
+class SlotMap {
+public:
+	inline SlotMap() : mFreeSlot(INVALID_INDEX) {}
+
+	inline SlotHandle Insert(const T& value) {
+		mValues.push_back(value);
+		return Link();
+	}
+	inline SlotHandle Insert(T&& value) {
+		mValues.push_back(std::move(value));
+		return Link();
+	}
+
+	// Returns false if the handle is stale
+	inline bool Erase(SlotHandle handle) {
+		if (!Contains(handle)) return false;
+		uint32_t slot = (uint32_t)handle;
+		uint32_t index = mSlots[slot].mIndex;
+		uint32_t last = (uint32_t)mValues.size() - 1;
+		if (index != last) {
+			std::swap(mValues[index], mValues[last]);
+			mValueSlots[index] = mValueSlots[last];
+			mSlots[mValueSlots[index]].mIndex = index;
+		}
+		mValueSlots.pop_back();
+
+		mSlots[slot].mGeneration++;
+		mSlots[slot].mIndex = mFreeSlot;
+		mFreeSlot = slot;
+		// destroy the value last, once the map is consistent again, in case its destructor uses the map
+		mValues.pop_back();
+		return true;
+	}
+
+	inline bool Contains(SlotHandle handle) const {
+		uint32_t slot = (uint32_t)handle;
+		return slot < mSlots.size() && mSlots[slot].mGeneration == (uint32_t)(handle >> 32);
+	}
+	// Returns nullptr if the handle is stale. The pointer is invalidated by Insert, Erase and Sort.
+	inline T* Get(SlotHandle handle) { return Contains(handle) ? &mValues[mSlots[(uint32_t)handle].mIndex] : nullptr; }
+	inline const T* Get(SlotHandle handle) const { return Contains(handle) ? &mValues[mSlots[(uint32_t)handle].mIndex] : nullptr; }
+	// Handle of the value at index in Values()
+	inline SlotHandle Handle(uint32_t index) const {
+		uint32_t slot = mValueSlots[index];
+		return ((SlotHandle)mSlots[slot].mGeneration << 32) | slot;
+	}
+
+	// Sorts the values, keeping their handles valid
+	template<typename Compare>
+	inline void Sort(Compare compare) {
+		std::vector<uint32_t> order(mValues.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return compare(mValues[a], mValues[b]); });
+
+		std::vector<T> values;
+		std::vector<uint32_t> valueSlots(order.size());
+		values.reserve(order.size());
+		for (uint32_t i = 0; i < order.size(); i++) {
+			values.push_back(std::move(mValues[order[i]]));
+			valueSlots[i] = mValueSlots[order[i]];
+			mSlots[valueSlots[i]].mIndex = i;
+		}
+		mValues.swap(values);
+		mValueSlots.swap(valueSlots);
+	}
+
+	// Erases every value. Existing handles become stale.
+	inline void Clear() {
+		while (mValues.size()) Erase(Handle((uint32_t)mValues.size() - 1));
+	}
+
+	inline uint32_t Size() const { return (uint32_t)mValues.size(); }
+	inline bool Empty() const { return mValues.empty(); }
+	inline const std::vector<T>& Values() const { return mValues; }
+
+	inline T& operator[](uint32_t index) { return mValues[index]; }
+	inline const T& operator[](uint32_t index) const { return mValues[index]; }
+	inline typename std::vector<T>::iterator begin() { return mValues.begin(); }
+	inline typename std::vector<T>::iterator end() { return mValues.end(); }
+	inline typename std::vector<T>::const_iterator begin() const { return mValues.begin(); }
+	inline typename std::vector<T>::const_iterator end() const { return mValues.end(); }
+
+private:
+	static const uint32_t INVALID_INDEX = 0xFFFFFFFF;
+
+	struct Slot {
+		// index of the value while the slot is in use, otherwise the next free slot
+		uint32_t mIndex;
+		uint32_t mGeneration;
+	};
+
+	// Gives the value that was just pushed a slot, reusing a free one if there is one
+	inline SlotHandle Link() {
+		uint32_t slot = mFreeSlot;
+		if (slot == INVALID_INDEX) {
+			slot = (uint32_t)mSlots.size();
+			mSlots.push_back({ 0, 0 });
+		} else
+			mFreeSlot = mSlots[slot].mIndex;
+		mSlots[slot].mIndex = (uint32_t)mValues.size() - 1;
+		mValueSlots.push_back(slot);
+		return ((SlotHandle)mSlots[slot].mGeneration << 32) | slot;
+	}
+
+	std::vector<T> mValues;
+	// slot of each value
+	std::vector<uint32_t> mValueSlots;
+	std::vector<Slot> mSlots;
+	// head of the list of free slots, threaded through Slot::mIndex
+	uint32_t mFreeSlot;
+};
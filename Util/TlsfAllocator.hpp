@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#ifdef WINDOWS
+#include <intrin.h>
+#endif
+
+// Two-level segregated fit allocator, used to sub-allocate ranges of a larger allocation (i.e. device memory)
+// Only tracks offsets and sizes, and has no dependencies on Vulkan, so it can be tested and benchmarked without a device
+// Free blocks are binned by size into power-of-two first levels, each split linearly into TLSF_SL_COUNT second levels.
+// Two levels of bitmaps find the first non-empty bin large enough for a request, so Allocate and Free are O(1)
+class TlsfAllocator {
+public:
+	static const uint32_t INVALID_BLOCK = 0xFFFFFFFF;
+	// All offsets and sizes are multiples of this
+	static const uint64_t MIN_BLOCK_SIZE = 256;
+
+	inline TlsfAllocator() : TlsfAllocator(0) {}
+	inline TlsfAllocator(uint64_t size) : mSize(size & ~(MIN_BLOCK_SIZE - 1)), mUsed(0), mAllocationCount(0), mFirstLevelBitmap(0) {
+		for (uint32_t i = 0; i < TLSF_FL_COUNT; i++) {
+			mSecondLevelBitmaps[i] = 0;
+			for (uint32_t j = 0; j < TLSF_SL_COUNT; j++)
+				mFreeLists[i][j] = INVALID_BLOCK;
+		}
+		if (mSize == 0) return;
+		Block b = {};
+		b.mOffset = 0;
+		b.mSize = mSize;
+		b.mPrevPhysical = INVALID_BLOCK;
+		b.mNextPhysical = INVALID_BLOCK;
+		InsertFree(NewBlock(b));
+	}
+
+	// Size of the smallest allocator that can fit an allocation with the given size and alignment
+	inline static uint64_t MinimumSize(uint64_t size, uint64_t alignment) {
+		uint64_t s = SearchSize(size, alignment);
+		if (s >= (1ull << TLSF_FL_SHIFT)) {
+			uint64_t mask = (1ull << (BitScanReverse(s) - TLSF_SL_BITS)) - 1;
+			s = (s + mask) & ~mask;
+		}
+		return s;
+	}
+
+	// Allocates a block of at least 'size' bytes, with an offset that is a multiple of 'alignment' (which must be a power of two)
+	// Returns a handle to the block, or INVALID_BLOCK if no free block is large enough
+	inline uint32_t Allocate(uint64_t size, uint64_t alignment, uint64_t* offset) {
+		if (alignment < MIN_BLOCK_SIZE) alignment = MIN_BLOCK_SIZE;
+		size = AlignSize(size);
+
+		uint32_t index = FindFree(SearchSize(size, alignment));
+		if (index == INVALID_BLOCK) return INVALID_BLOCK;
+		RemoveFree(index);
+
+		// split off padding in front of the aligned offset
+		uint64_t padding = ((mBlocks[index].mOffset + alignment - 1) & ~(alignment - 1)) - mBlocks[index].mOffset;
+		if (padding) {
+			Block front = {};
+			front.mOffset = mBlocks[index].mOffset;
+			front.mSize = padding;
+			front.mPrevPhysical = mBlocks[index].mPrevPhysical;
+			front.mNextPhysical = index;
+			uint32_t f = NewBlock(front);
+			if (front.mPrevPhysical != INVALID_BLOCK) mBlocks[front.mPrevPhysical].mNextPhysical = f;
+			mBlocks[index].mPrevPhysical = f;
+			mBlocks[index].mOffset += padding;
+			mBlocks[index].mSize -= padding;
+			InsertFree(f);
+		}
+
+		// return the rest of the block to the free lists
+		if (mBlocks[index].mSize > size) {
+			Block back = {};
+			back.mOffset = mBlocks[index].mOffset + size;
+			back.mSize = mBlocks[index].mSize - size;
+			back.mPrevPhysical = index;
+			back.mNextPhysical = mBlocks[index].mNextPhysical;
+			uint32_t b = NewBlock(back);
+			if (back.mNextPhysical != INVALID_BLOCK) mBlocks[back.mNextPhysical].mPrevPhysical = b;
+			mBlocks[index].mNextPhysical = b;
+			mBlocks[index].mSize = size;
+			InsertFree(b);
+		}
+
+		mUsed += size;
+		mAllocationCount++;
+		*offset = mBlocks[index].mOffset;
+		return index;
+	}
+
+	// Frees a block returned by Allocate(), merging it with its free neighbors
+	inline void Free(uint32_t index) {
+		mUsed -= mBlocks[index].mSize;
+		mAllocationCount--;
+
+		uint32_t prev = mBlocks[index].mPrevPhysical;
+		if (prev != INVALID_BLOCK && mBlocks[prev].mFree) {
+			//  |---- prev ----|---- index ----|
+			RemoveFree(prev);
+			mBlocks[index].mOffset = mBlocks[prev].mOffset;
+			mBlocks[index].mSize += mBlocks[prev].mSize;
+			mBlocks[index].mPrevPhysical = mBlocks[prev].mPrevPhysical;
+			if (mBlocks[index].mPrevPhysical != INVALID_BLOCK) mBlocks[mBlocks[index].mPrevPhysical].mNextPhysical = index;
+			DeleteBlock(prev);
+		}
+		uint32_t next = mBlocks[index].mNextPhysical;
+		if (next != INVALID_BLOCK && mBlocks[next].mFree) {
+			//  |---- index ----|---- next ----|
+			RemoveFree(next);
+			mBlocks[index].mSize += mBlocks[next].mSize;
+			mBlocks[index].mNextPhysical = mBlocks[next].mNextPhysical;
+			if (mBlocks[index].mNextPhysical != INVALID_BLOCK) mBlocks[mBlocks[index].mNextPhysical].mPrevPhysical = index;
+			DeleteBlock(next);
+		}
+
+		InsertFree(index);
+	}
+
+	inline uint64_t Offset(uint32_t index) const { return mBlocks[index].mOffset; }
+	inline uint64_t BlockSize(uint32_t index) const { return mBlocks[index].mSize; }
+
+	inline uint64_t Size() const { return mSize; }
+	inline uint64_t Used() const { return mUsed; }
+	inline uint64_t Available() const { return mSize - mUsed; }
+	inline uint32_t AllocationCount() const { return mAllocationCount; }
+	inline bool Empty() const { return mAllocationCount == 0; }
+
+private:
+	static const uint32_t TLSF_SL_BITS = 5;
+	static const uint32_t TLSF_SL_COUNT = 1 << TLSF_SL_BITS;
+	// sizes below 1 << TLSF_FL_SHIFT are binned linearly in the first first-level
+	static const uint32_t TLSF_FL_SHIFT = TLSF_SL_BITS + 8;
+	static const uint32_t TLSF_FL_COUNT = 64 - TLSF_FL_SHIFT + 1;
+
+	struct Block {
+		uint64_t mOffset;
+		uint64_t mSize;
+		// neighboring blocks in memory
+		uint32_t mPrevPhysical;
+		uint32_t mNextPhysical;
+		// neighboring blocks in the free list, if this block is free
+		uint32_t mPrevFree;
+		uint32_t mNextFree;
+		bool mFree;
+	};
+
+	std::vector<Block> mBlocks;
+	// indices in mBlocks that can be re-used
+	std::vector<uint32_t> mUnusedBlocks;
+
+	uint64_t mSize;
+	uint64_t mUsed;
+	uint32_t mAllocationCount;
+
+	uint64_t mFirstLevelBitmap;
+	uint32_t mSecondLevelBitmaps[TLSF_FL_COUNT];
+	uint32_t mFreeLists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+	inline static uint32_t BitScanReverse(uint64_t x) {
+		#ifdef WINDOWS
+		unsigned long i;
+		_BitScanReverse64(&i, x);
+		return (uint32_t)i;
+		#else
+		return 63 - __builtin_clzll(x);
+		#endif
+	}
+	inline static uint32_t BitScanForward(uint64_t x) {
+		#ifdef WINDOWS
+		unsigned long i;
+		_BitScanForward64(&i, x);
+		return (uint32_t)i;
+		#else
+		return __builtin_ctzll(x);
+		#endif
+	}
+
+	inline static uint64_t AlignSize(uint64_t size) {
+		return size ? (size + MIN_BLOCK_SIZE - 1) & ~(MIN_BLOCK_SIZE - 1) : MIN_BLOCK_SIZE;
+	}
+	// Any free block at least this large can hold the allocation after aligning its offset
+	inline static uint64_t SearchSize(uint64_t size, uint64_t alignment) {
+		if (alignment < MIN_BLOCK_SIZE) alignment = MIN_BLOCK_SIZE;
+		return AlignSize(size) + alignment - MIN_BLOCK_SIZE;
+	}
+
+	inline static void Mapping(uint64_t size, uint32_t& fl, uint32_t& sl) {
+		if (size < (1ull << TLSF_FL_SHIFT)) {
+			fl = 0;
+			sl = (uint32_t)(size / MIN_BLOCK_SIZE);
+		} else {
+			uint32_t b = BitScanReverse(size);
+			sl = (uint32_t)(size >> (b - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+			fl = b - TLSF_FL_SHIFT + 1;
+		}
+	}
+
+	// Finds a free block of at least 'size' bytes, in the first non-empty bin whose smallest block is at least 'size'
+	inline uint32_t FindFree(uint64_t size) const {
+		if (size >= (1ull << TLSF_FL_SHIFT)) {
+			size += (1ull << (BitScanReverse(size) - TLSF_SL_BITS)) - 1;
+			if (size >> 63) return INVALID_BLOCK;
+		}
+		uint32_t fl, sl;
+		Mapping(size, fl, sl);
+
+		uint32_t slMap = mSecondLevelBitmaps[fl] & (~0u << sl);
+		if (!slMap) {
+			uint64_t flMap = mFirstLevelBitmap & (~0ull << (fl + 1));
+			if (!flMap) return INVALID_BLOCK;
+			fl = BitScanForward(flMap);
+			slMap = mSecondLevelBitmaps[fl];
+		}
+		return mFreeLists[fl][BitScanForward(slMap)];
+	}
+
+	inline void InsertFree(uint32_t index) {
+		uint32_t fl, sl;
+		Mapping(mBlocks[index].mSize, fl, sl);
+		mBlocks[index].mFree = true;
+		mBlocks[index].mPrevFree = INVALID_BLOCK;
+		mBlocks[index].mNextFree = mFreeLists[fl][sl];
+		if (mFreeLists[fl][sl] != INVALID_BLOCK) mBlocks[mFreeLists[fl][sl]].mPrevFree = index;
+		mFreeLists[fl][sl] = index;
+		mFirstLevelBitmap |= 1ull << fl;
+		mSecondLevelBitmaps[fl] |= 1u << sl;
+	}
+	inline void RemoveFree(uint32_t index) {
+		uint32_t fl, sl;
+		Mapping(mBlocks[index].mSize, fl, sl);
+		Block& b = mBlocks[index];
+		b.mFree = false;
+		if (b.mPrevFree != INVALID_BLOCK) mBlocks[b.mPrevFree].mNextFree = b.mNextFree;
+		if (b.mNextFree != INVALID_BLOCK) mBlocks[b.mNextFree].mPrevFree = b.mPrevFree;
+		if (mFreeLists[fl][sl] == index) {
+			mFreeLists[fl][sl] = b.mNextFree;
+			if (b.mNextFree == INVALID_BLOCK) {
+				mSecondLevelBitmaps[fl] &= ~(1u << sl);
+				if (!mSecondLevelBitmaps[fl]) mFirstLevelBitmap &= ~(1ull << fl);
+			}
+		}
+	}
+
+	inline uint32_t NewBlock(const Block& block) {
+		if (mUnusedBlocks.empty()) {
+			mBlocks.push_back(block);
+			return (uint32_t)mBlocks.size() - 1;
+		}
+		uint32_t index = mUnusedBlocks.back();
+		mUnusedBlocks.pop_back();
+		mBlocks[index] = block;
+		return index;
+	}
+	inline void DeleteBlock(uint32_t index) {
+		mUnusedBlocks.push_back(index);
+	}
+};
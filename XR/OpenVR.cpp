@@ -497,7 +497,7 @@ void OpenVR::PostRender(CommandBuffer* commandBuffer) {
         else {
             // only enable the scene object if its pose is valid
             if (mTrackedObjects[i])
-                mTrackedObjects[i]->mEnabled = renderPoses[i].bPoseIsValid;
+                mTrackedObjects[i]->Enabled(renderPoses[i].bPoseIsValid);
             else if (renderPoses[i].bPoseIsValid) {
                 // Create an object for tracked devices with a valid pose
                 auto o = make_shared<Object>("TrackedDevice" + to_string(i));
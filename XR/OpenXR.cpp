@@ -659,6 +659,8 @@ void OpenXR::PostRender(CommandBuffer* commandBuffer) {
 }
 
 void OpenXR::EndFrame() {
+	// the runtime expects the rendering to be submitted before the images are released
+	if (mScene) mScene->Instance()->Device()->SubmitPending();
 	for (uint32_t i = 0; i < mViewCount; i++) {
 		XrSwapchainImageReleaseInfo swapchainImageReleaseInfo = {};
 		swapchainImageReleaseInfo.type = XR_TYPE_SWAPCHAIN_IMAGE_RELEASE_INFO;